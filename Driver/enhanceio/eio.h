@@ -42,6 +42,7 @@
 #include <linux/slab.h>
 #include <linux/hash.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/workqueue.h>
 #include <linux/pagemap.h>
 #include <linux/random.h>
@@ -55,10 +56,12 @@
 #include <linux/device-mapper.h>
 #include <linux/dm-kcopyd.h>
 #include <linux/sort.h>         /* required for eio_subr.c */
+#include <linux/list_sort.h>
 #include <linux/kthread.h>
 #include <linux/jiffies.h>
 #include <linux/vmalloc.h>      /* for sysinfo (mem) variables */
 #include <linux/mm.h>
+#include <linux/percpu.h>
 #include <scsi/scsi_device.h>   /* required for SSD failure handling */
 /* resolve conflict with scsi/scsi_device.h */
 #ifdef QUEUED
@@ -147,6 +150,9 @@ extern struct work_struct _kcached_wq;
 extern int eio_force_warm_boot;
 extern atomic_t nr_cache_jobs;
 extern mempool_t *_job_pool;
+extern mempool_t *_bc_pool;
+extern mempool_t *_ebio_pool;
+extern mempool_t *_seq_pool;
 
 /*
  * This file has three sections as follows:
@@ -242,8 +248,10 @@ extern mempool_t *_job_pool;
 #define EIO_BAD_MAGIC           0xBADCAC6E
 
 /* EIO version */
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          5       /* kernel superblock version */
 #define EIO_SB_MAGIC_VERSION    3       /* version in which magic number was introduced */
+#define EIO_SB_SET_HASH_VERSION 4       /* version in which set_hash was introduced */
+#define EIO_SB_JOURNAL_VERSION  5       /* version in which the metadata journal was introduced */
 
 union eio_superblock {
 	struct superblock_fields {
@@ -271,6 +279,11 @@ union eio_superblock {
 		__le32 dirty_set_low_threshold;
 		__le32 time_based_clean_interval;
 		__le32 autoclean_threshold;
+		__le32 set_hash;                /* set index function */
+		__le32 journal_id;              /* tags the journal sectors of this cache */
+		__le64 journal_start_sect;      /* metadata journal start (8K aligned) */
+		__le64 journal_sectors;         /* metadata journal size, 0 if none */
+		__le64 journal_ckpt_seq;        /* journal sectors up to it are in the metadata */
 	} sbf;
 	u_int8_t padding[EIO_SUPERBLOCK_SIZE];
 };
@@ -282,11 +295,15 @@ union eio_superblock {
  * data sectors, we allocate extra sectors so that we can
  * align the data sectors on a 4K boundary.
  *
- *    64K    4K  variable variable  8K variable  variable
- * +--------+--+--------+---------+---+--------+---------+
- * | unused |SB| align1 |metadata | Z | align2 | data... |
- * +--------+--+--------+---------+---+--------+---------+
- * <------------- dmc->md_sectors ------------>
+ *    64K    4K  variable variable variable  8K variable  variable
+ * +--------+--+--------+-------+---------+---+--------+---------+
+ * | unused |SB| align1 |journal|metadata | Z | align2 | data... |
+ * +--------+--+--------+-------+---------+---+--------+---------+
+ * <----------------- dmc->md_sectors ---------------->
+ *
+ * The metadata journal of a write-back cache (see eio_journal.c) is
+ * a multiple of 8K, it is empty unless the cache was created with the
+ * "md_journal" module parameter set.
  */
 #define EIO_UNUSED_SECTORS              128
 #define EIO_SUPERBLOCK_SECTORS          8
@@ -317,6 +334,30 @@ struct flash_cacheblock {
 	__le64 cache_state;
 };
 
+/*
+ * A metadata journal sector. The records are dirty (VALID | DIRTY) or
+ * clean (INVALID) transitions of cache blocks, in the same format as
+ * the state written to the metadata. "crc" is the crc32 of the sector
+ * with "crc" zeroed.
+ */
+#define EIO_JOURNAL_MAGIC               0xE10C10A1
+#define EIO_JOURNAL_RECORDS             30
+
+struct eio_journal_record {
+	__le64 index_state;     /* cache block index << 8 | state */
+	__le64 dbn;             /* Sector number of the cached block */
+};
+
+struct eio_journal_sector {
+	__le32 magic;
+	__le32 journal_id;
+	__le64 seq;                     /* ring position is seq % journal_sectors */
+	__le32 nr_records;
+	__le32 crc;
+	__le64 reserved;
+	struct eio_journal_record records[EIO_JOURNAL_RECORDS];
+};
+
 /* blksize in terms of no. of sectors */
 #define BLKSIZE_2K      4
 #define BLKSIZE_4K      8
@@ -389,6 +430,14 @@ static const struct eio_policy_and_name eio_policy_names[] = {
 	{ CACHE_REPL_RANDOM, "rand" },
 };
 
+/*
+ * Set index function, see eio_mem.c.
+ */
+#define EIO_SET_HASH_LINEAR     0
+#define EIO_SET_HASH_XOR        1
+#define EIO_SET_HASH_MULT       2
+#define EIO_SET_HASH_LAST       EIO_SET_HASH_MULT
+
 
 /*
  * Default cache parameters.
@@ -458,7 +507,7 @@ enum dev_notifier {
  * Subsection 3.1: Definitions.
  */
 
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          5       /* kernel superblock version */
 
 /* kcached/pending job states */
 #define READCACHE               1
@@ -474,8 +523,24 @@ enum dev_notifier {
 #define CACHE_FORCECREATE       3
 
 /* Sysctl defined */
-#define MAX_CLEAN_IOS_SET       2
-#define MAX_CLEAN_IOS_TOTAL     4
+#define CLEAN_THREADS_DEF       4       /* Set cleaner threads per cache */
+#define CLEAN_THREADS_MAX       32
+#define CLEAN_PIPELINE_DEPTH    2       /* Set cleans in flight per cleaner */
+#define MAX_CLEAN_IOS_DEF       256     /* Clean I/Os in flight per cache */
+#define MAX_CLEAN_IOS_MAX       65536
+#define WB_PERCENT_DEF          0       /* Writeback rate control off */
+#define WB_LATENCY_MS_DEF       50      /* Hdd latency of clean writes aimed at */
+#define WB_LATENCY_MS_MAX       10000
+#define WRITE_THROTTLE_MS_DEF   0       /* Writes to full sets go uncached */
+#define WRITE_THROTTLE_MS_MAX   1000
+#define READFILL_ADMIT_ALL      0       /* Every read miss fills the cache */
+#define READFILL_ADMIT_SECOND   1       /* Only a second miss in a while does */
+#define READFILL_ADMIT_DEF      READFILL_ADMIT_ALL
+#define SEQ_CUTOFF_KB_DEF       0       /* Sequential I/O is cached */
+#define SEQ_CUTOFF_KB_MAX       4194304
+#define READAHEAD_BLOCKS_DEF    0       /* No read-ahead */
+#define READAHEAD_BLOCKS_MAX    64
+#define EXPAND_PARTIAL_READS_DEF        0       /* Partial misses are not cached */
 
 /*
  * TBD
@@ -530,6 +595,8 @@ struct cacheblock {
 #define EIO_MD4_DBN_BITS                (32 - 8)        /* 8 bits for state */
 #define EIO_MD4_DBN_MASK                ((1 << EIO_MD4_DBN_BITS) - 1)
 #define EIO_MD4_INVALID                 (INVALID << EIO_MD4_DBN_BITS)
+#define EIO_MD4_VALID                   (VALID << EIO_MD4_DBN_BITS)
+#define EIO_MD4_DBN_VALID_MASK          (EIO_MD4_DBN_MASK | EIO_MD4_VALID)
 
 /*
  * 8-byte metadata support.
@@ -555,9 +622,14 @@ struct cacheblock_md8 {
 #define EIO_MD8_DBN_BITS                (64 - 8)        /* 8 bits for state */
 #define EIO_MD8_DBN_MASK                ((((u_int64_t)1) << EIO_MD8_DBN_BITS) - 1)
 #define EIO_MD8_INVALID                 (((u_int64_t)INVALID) << EIO_MD8_DBN_BITS)
+#define EIO_MD8_VALID                   (((u_int64_t)VALID) << EIO_MD8_DBN_BITS)
+#define EIO_MD8_DBN_VALID_MASK          (EIO_MD8_DBN_MASK | EIO_MD8_VALID)
 #define EIO_MD8(dmc)                    CACHE_MD8_IS_SET(dmc)
 
 /* Structure used for metadata update on-disk and in-core for writeback cache */
+/* Runs of changed md sectors in an update: every other sector of 2 pages */
+#define MDREQ_MAX_RUNS  SECTORS_PER_PAGE
+
 struct mdupdate_request {
 	struct list_head list;          /* to build mdrequest chain */
 	struct work_struct work;        /* work structure */
@@ -566,24 +638,33 @@ struct mdupdate_request {
 	unsigned md_size;               /* metadata size */
 	unsigned mdbvec_count;          /* count of bvecs allocated. */
 	struct bio_vec *mdblk_bvecs;    /* bvecs for updating md_blocks */
+	struct bio_vec md_run_bvecs[MDREQ_MAX_RUNS];    /* bvecs of the md sectors written */
 	atomic_t holdcount;             /* I/O hold count */
 	struct eio_bio *pending_mdlist; /* ebios pending for md update */
 	struct eio_bio *inprog_mdlist;  /* ebios processed for md update */
 	int error;                      /* error during md update */
+	int pooled;                     /* belongs to the cache's mdreq pool */
 	struct mdupdate_request *next;  /* next mdreq in the mdreq list .TBD. Deprecate */
 };
 
 #define SETFLAG_CLEAN_INPROG    0x00000001      /* clean in progress on a set */
 #define SETFLAG_CLEAN_WHOLE     0x00000002      /* clean the set fully */
+#define SETFLAG_CLEAN_URGENT    0x00000004      /* writers wait for the clean */
+#define SETFLAG_CLEANING        0x00000008      /* blocks of the set are CLEAN_INPROG */
 
 /* Structure used for doing operations and storing cache set level info */
 struct cache_set {
 	struct list_head list;
+	struct mdupdate_request *mdreq; /* metadata update request pointer */
 	u_int32_t nr_dirty;             /* number of dirty blocks */
+	unsigned int flags;             /* misc cache set specific flags */
+};
+
+/* Locks of a set, see eio_set_lock() */
+struct eio_set_lock {
 	spinlock_t cs_lock;             /* spin lock to protect struct fields */
 	struct rw_semaphore rw_lock;    /* reader-writer lock used for clean */
-	unsigned int flags;             /* misc cache set specific flags */
-	struct mdupdate_request *mdreq; /* metadata update request pointer */
+	seqcount_t dbn_seq;             /* bumped as blocks change dbn, under cs_lock */
 };
 
 struct eio_errors {
@@ -597,55 +678,116 @@ struct eio_errors {
 };
 
 /*
- * Stats. Note that everything should be "atomic64_t" as
- * code relies on it.
+ * Stats. Every field is an "int64_t" counter, kept per CPU and
+ * only summed up by eio_stats_sum().
  */
-#define SECTOR_STATS(statval, io_size)	\
-	atomic64_add(eio_to_sector(io_size), &statval);
+#define EIO_STATS_ADD(dmc, stat, val)	\
+	this_cpu_add((dmc)->pcpu_stats->stats.stat, (val))
+#define EIO_STATS_INC(dmc, stat)	EIO_STATS_ADD(dmc, stat, 1)
+#define EIO_STATS_DEC(dmc, stat)	EIO_STATS_ADD(dmc, stat, -1)
+#define SECTOR_STATS(dmc, stat, io_size)	\
+	EIO_STATS_ADD(dmc, stat, eio_to_sector(io_size))
+
+#define MD_COMMIT_HIST                          5
+#define WRITE_THROTTLE_HIST                     6
+#define READFILL_BATCH_HIST                     6
 
 struct eio_stats {
-	atomic64_t reads;               /* Number of reads */
-	atomic64_t writes;              /* Number of writes */
-	atomic64_t read_hits;           /* Number of cache hits */
-	atomic64_t write_hits;          /* Number of write hits (includes dirty write hits) */
-	atomic64_t dirty_write_hits;    /* Number of "dirty" write hits */
-	atomic64_t cached_blocks;       /* Number of cached blocks */
-	atomic64_t rd_replace;          /* Number of read cache replacements. TBD modify def doc */
-	atomic64_t wr_replace;          /* Number of write cache replacements. TBD modify def doc */
-	atomic64_t noroom;              /* No room in set */
-	atomic64_t cleanings;           /* blocks cleaned TBD modify def doc */
-	atomic64_t md_write_dirty;      /* Metadata sector writes dirtying block */
-	atomic64_t md_write_clean;      /* Metadata sector writes cleaning block */
-	atomic64_t md_ssd_writes;       /* How many md ssd writes did we do ? */
-	atomic64_t uncached_reads;
-	atomic64_t uncached_writes;
-	atomic64_t uncached_map_size;
-	atomic64_t uncached_map_uncacheable;
-	atomic64_t disk_reads;
-	atomic64_t disk_writes;
-	atomic64_t ssd_reads;
-	atomic64_t ssd_writes;
-	atomic64_t ssd_readfills;
-	atomic64_t ssd_readfill_unplugs;
-	atomic64_t readdisk;
-	atomic64_t writedisk;
-	atomic64_t readcache;
-	atomic64_t readfill;
-	atomic64_t writecache;
-	atomic64_t wrtime_ms;   /* total write time in ms */
-	atomic64_t rdtime_ms;   /* total read time in ms */
-	atomic64_t readcount;   /* total reads received so far */
-	atomic64_t writecount;  /* total writes received so far */
+	int64_t reads;                  /* Number of reads */
+	int64_t writes;                 /* Number of writes */
+	int64_t read_hits;              /* Number of cache hits */
+	int64_t lockless_read_hits;     /* Of them, found without cs_lock */
+	int64_t lockless_read_misses;   /* Read misses found without cs_lock */
+	int64_t partial_reads;          /* Sectors read of part of a block */
+	int64_t partial_read_hits;      /* Of them, read from the cache */
+	int64_t expanded_reads;         /* Partial misses read as whole blocks */
+	int64_t write_hits;             /* Number of write hits (includes dirty write hits) */
+	int64_t dirty_write_hits;       /* Number of "dirty" write hits */
+	int64_t cached_blocks;          /* Number of cached blocks */
+	int64_t rd_replace;             /* Number of read cache replacements. TBD modify def doc */
+	int64_t wr_replace;             /* Number of write cache replacements. TBD modify def doc */
+	int64_t noroom;                 /* No room in set */
+	int64_t write_throttles;        /* Writes which waited for room in a set */
+	int64_t write_throttle_timeouts;        /* Of them, waited "write_throttle_ms" */
+	int64_t write_throttle_uncached;        /* Of them, went to the source anyway */
+	int64_t write_throttle_hist[WRITE_THROTTLE_HIST];       /* Waits of 0, 1-3, 4-15, 16-63, 64-255, 256+ ms */
+	int64_t cleanings;              /* blocks cleaned TBD modify def doc */
+	int64_t clean_waits;            /* I/Os which waited for a block clean */
+	int64_t md_write_dirty;         /* Metadata sector writes dirtying block */
+	int64_t md_write_clean;         /* Metadata sector writes cleaning block */
+	int64_t md_ssd_writes;          /* How many md ssd writes did we do ? */
+	int64_t mdreq_waits;            /* Writes which waited for the mdreq pool */
+	int64_t md_commits;             /* Metadata updates (group commits) */
+	int64_t md_commit_blocks;       /* Blocks marked dirty by them */
+	int64_t md_commit_sectors;      /* Metadata sectors written by them */
+	int64_t md_commit_hist[MD_COMMIT_HIST]; /* Commits of 1, 2-3, 4-7, 8-15, 16+ blocks */
+	int64_t journal_commits;        /* Metadata journal writes */
+	int64_t journal_records;        /* Block transitions written to the journal */
+	int64_t journal_sectors;        /* Journal sectors written */
+	int64_t journal_checkpoints;    /* Journal checkpoints */
+	int64_t journal_ckpt_sectors;   /* Metadata sectors written by them */
+	int64_t uncached_reads;
+	int64_t uncached_writes;
+	int64_t uncached_map_size;
+	int64_t uncached_map_uncacheable;
+	int64_t disk_reads;
+	int64_t disk_writes;
+	int64_t ssd_reads;
+	int64_t ssd_writes;
+	int64_t ssd_readfills;
+	int64_t ssd_readfill_unplugs;
+	int64_t readfill_ssd_writes;    /* SSD writes of the readfills, merged */
+	int64_t readfill_batches;       /* Passes of the readfill workers */
+	int64_t readfill_batch_hist[READFILL_BATCH_HIST];       /* Passes of 1, 2-3, 4-7, 8-15, 16-31, 32+ reads */
+	int64_t readfill_admitted;      /* Read misses let in by "readfill_admit" */
+	int64_t readfill_rejected;      /* Read misses kept out by it */
+	int64_t seq_hits;               /* Bios which extended a stream */
+	int64_t seq_streams;            /* Bios which started a new one */
+	int64_t seq_bypass_reads;       /* Reads past "sequential_cutoff_kb" */
+	int64_t seq_bypass_writes;      /* Writes past it, sent to the source */
+	int64_t readahead_ios;          /* Read-aheads which filled blocks */
+	int64_t readahead_blocks;       /* Blocks filled by them */
+	int64_t readahead_hits;         /* Read-ahead blocks read afterwards */
+	int64_t readahead_wasted;       /* Read-ahead blocks reused unread */
+	int64_t readdisk;
+	int64_t writedisk;
+	int64_t readcache;
+	int64_t readfill;
+	int64_t writecache;
+	int64_t wrtime_ms;      /* total write time in ms */
+	int64_t rdtime_ms;      /* total read time in ms */
+	int64_t readcount;      /* total reads received so far */
+	int64_t writecount;     /* total writes received so far */
+};
+
+#define SIZE_HIST                               (128 + 1)
+
+/* Per CPU counters of a cache */
+struct eio_pcpu_stats {
+	struct eio_stats stats;
+	int64_t nr_ios;                 /* I/Os in flight, may be negative */
+	int64_t size_hist[SIZE_HIST];
 };
 
 #define PENDING_JOB_HASH_SIZE                   32
 #define PENDING_JOB_HASH(index)                 ((index) % PENDING_JOB_HASH_SIZE)
-#define SIZE_HIST                               (128 + 1)
 #define EIO_COPY_PAGES                          1024    /* Number of pages for I/O */
 #define MIN_JOBS                                1024
 #define MIN_EIO_IO                              4096
+#define MIN_EIO_BC                              1024
+#define MIN_EIO_EBIO                            1024
+#define MIN_EIO_SEQ                             256
 #define MIN_DMC_BIO_PAIR                        8192
 
+/*
+ * Writers waiting for room in a set, and I/Os waiting for the clean of
+ * their blocks, sleep on one of EIO_SET_WQS wait queues, shared by the
+ * sets with the same hash, rather than on one of their own in each
+ * struct cache_set.
+ */
+#define EIO_SET_WQS                             64
+#define EIO_SET_WQ(dmc, set)                    (&(dmc)->set_wq[(set) % EIO_SET_WQS])
+
 /* Structure representing a sequence of sets(first to last set index) */
 struct set_seq {
 	index_t first_set;
@@ -671,11 +813,135 @@ struct eio_sysctl {
 	int32_t mem_limit_pct;
 	int32_t control;
 	u_int64_t invalidate;
+	uint32_t clean_threads;
+	uint32_t max_clean_ios;
+	uint32_t writeback_percent;
+	uint32_t writeback_latency_ms;
+	uint32_t write_throttle_ms;
+	int32_t readfill_admit;
+	uint32_t sequential_cutoff_kb;
+	uint32_t readahead_blocks;
+	int32_t expand_partial_reads;
 };
 
 /* forward declaration */
 struct lru_ls;
 
+/* A set cleaner thread, see eio_clean_thread_proc() */
+struct eio_cleaner {
+	struct cache_c *dmc;
+	void *thread;
+	int running;
+	int id;                         /* cleaner 0 also enforces the dirty thresholds */
+};
+
+/* A clean of a set, waiting for its journal records to be committed */
+struct eio_journal_clean {
+	struct list_head list;
+	index_t set;
+	unsigned nr_records;
+	int error;
+	eio_notify_fn notify;
+	void *context;
+};
+
+/* Stages of a set clean, see eio_clean_pipe_run() */
+#define CLEAN_STAGE_READ        1       /* reading the blocks from ssd */
+#define CLEAN_STAGE_WRITE       2       /* writing them to hdd */
+#define CLEAN_STAGE_COMMIT      3       /* updating on-disk metadata */
+
+/*
+ * Set cleans of one cleaner, each in a stage of its own, so that the
+ * ssd reads of a set overlap the hdd writes of another.
+ */
+struct eio_clean_pipe {
+	struct cache_c *dmc;
+	spinlock_t lock;
+	struct list_head done;          /* cleans at the end of a stage, under lock */
+	struct list_head commit;        /* cleans waiting for their commit */
+	wait_queue_head_t wait;
+	int nr_cleans;                  /* set cleans in the pipe */
+	int nr_locked;                  /* of them, with their set locked */
+};
+
+/* A block of a set clean, see eio_clean_write() */
+struct eio_clean_blk {
+	sector_t dbn;
+	unsigned index;                 /* in the set */
+};
+
+/* Buffers of one set clean, and its state while in a pipe */
+struct eio_clean_buf {
+	struct list_head list;
+	struct bio_vec *dbvecs;         /* Data bvecs for clean set */
+	struct page **mdpages;          /* Metadata pages for clean set */
+	int dbvec_count;
+	int mdpage_count;
+	struct eio_clean_blk *blks;     /* blocks to write, in dbn order */
+	struct bio_vec *wbvecs;         /* dbvecs in the order of blks */
+
+	struct eio_clean_pipe *pipe;
+	index_t set;
+	int force;
+	int stage;
+	int error;
+	int locked;                     /* set locked for write, see eio_clean_commit() */
+	atomic_t nr_ios;                /* I/Os of the stage in flight, plus one */
+	ktime_t stage_start;
+	struct eio_journal_clean jclean;
+};
+
+/*
+ * Writeback rate controller of a write-back cache, see eio_wbrate.c.
+ * The terms and the rate are in blocks and blocks per second.
+ */
+struct eio_wb_rate {
+	struct delayed_work work;
+	atomic64_t lat_sum_us;          /* hdd latency of the clean writes */
+	atomic64_t lat_count;           /*   ended in the current period */
+	int64_t last_dirty;
+	int64_t integral;               /* dirty block seconds over target */
+	int64_t budget;                 /* blocks left to queue for clean */
+	int64_t target;
+	int64_t proportional;
+	int64_t integral_term;
+	int64_t derivative;
+	int64_t rate;
+	u_int64_t latency_us;           /* mean of the last period with cleans */
+	u_int64_t queued;               /* dirty blocks of the sets queued */
+};
+
+/*
+ * A readfill worker of a cache, see eio_enqueue_readfill(). The reads
+ * whose blocks fall in the same EIO_READFILL_STRIPE of the cache device
+ * are staged on the same worker.
+ */
+struct eio_readfill_worker {
+	spinlock_t lock;                /* protects jobs */
+	struct list_head jobs;          /* uncached reads to fill the cache */
+	struct work_struct work;
+	struct cache_c *dmc;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Sequential stream detector of a cache, see eio_seq.c. A stream is
+ * known by the sector following its last bio.
+ */
+#define EIO_SEQ_STREAMS         32
+
+struct eio_seq_stream {
+	sector_t next;
+	u_int64_t sectors;              /* length of the stream so far */
+	u_int64_t used;                 /* "clock" of its last bio */
+	sector_t ra_next;               /* end of its last read-ahead */
+};
+
+struct eio_seq_detect {
+	spinlock_t lock;
+	u_int64_t clock;
+	struct eio_seq_stream streams[EIO_SEQ_STREAMS];
+};
+
 /* Replacement for 'struct dm_dev' */
 struct eio_bdev {
 	struct block_device *bdev;
@@ -701,29 +967,46 @@ struct cache_c {
 	sector_t dev_start_sect;
 	sector_t dev_end_sect;
 	int cache_rdonly;               /* protected by ttc_write lock */
+	atomic_t ttc_block;             /* application I/O held off, see eio_ttc.c */
 	struct eio_bdev *disk_dev;      /* Source device */
 	struct eio_bdev *cache_dev;     /* Cache device */
 	struct cacheblock *cache;       /* Hash table for cache blocks */
 	struct cache_set *cache_sets;
 	struct cache_c *next_cache;
-	struct kcached_job *readfill_queue;
-	struct work_struct readfill_wq;
+	struct workqueue_struct *readfill_q;
+	struct workqueue_struct *readahead_q;
+	struct eio_readfill_worker *readfill_workers;
+	unsigned nr_readfill_workers;
+	atomic_t readfill_depth;        /* reads staged on the workers */
+	int readfill_max_depth;
 
 	struct list_head cleanq;        /* queue of sets to awaiting clean */
-	struct eio_event clean_event;   /* event to wait for, when cleanq is empty */
+	wait_queue_head_t clean_wq;     /* cleaners wait here, when cleanq is empty */
 	spinlock_t clean_sl;            /* spinlock to protect cleanq etc */
-	void *clean_thread;             /* OS specific thread object to handle cleanq */
-	int clean_thread_running;       /* to indicate that clean thread is running */
+	struct mutex cleaners_mutex;    /* serializes starting and stopping cleaners */
+	struct eio_cleaner cleaners[CLEAN_THREADS_MAX];
+	int nr_cleaners;                /* cleaner threads started */
 	atomic64_t clean_pendings;      /* Number of sets pending to be cleaned */
-	struct bio_vec *clean_dbvecs;   /* Data bvecs for clean set */
-	struct page **clean_mdpages;    /* Metadata pages for clean set */
-	int dbvec_count;
-	int mdpage_count;
+	struct list_head clean_bufs;    /* free struct eio_clean_buf, under clean_sl */
+	wait_queue_head_t clean_buf_wq;
+	int nr_clean_bufs;              /* clean buffers allocated */
+	atomic_t clean_ios;             /* clean I/Os in flight */
+	wait_queue_head_t clean_io_wq;  /* waiting for clean_ios < max_clean_ios */
 	int clean_excess_dirty;         /* Clean in progress to bring cache dirty blocks in limits */
-	atomic_t clean_index;           /* set being cleaned, in case of force clean */
+	atomic_t clean_index;           /* next set to clean, in case of force clean */
+	atomic_t clean_sweepers;        /* cleaners helping a force clean */
+	index_t clean_sweep;            /* next set for a cache-wide clean */
+	wait_queue_head_t set_wq[EIO_SET_WQS];  /* waiters on sets, see EIO_SET_WQ() */
+	struct eio_wb_rate wb_rate;
+	struct eio_seq_detect seq_detect;
 
 	u_int64_t md_start_sect;        /* Sector no. at which Metadata starts */
 	u_int64_t md_sectors;           /* Numbers of metadata sectors, including header */
+	u_int64_t journal_start_sect;   /* Sector no. at which the metadata journal starts */
+	u_int64_t journal_sectors;      /* Size of the metadata journal, 0 if none */
+	u_int64_t journal_head_seq;     /* seq of the next journal sector */
+	u_int64_t journal_ckpt_seq;     /* journal sectors up to it are in the metadata */
+	u_int32_t journal_id;           /* tags the journal sectors of this cache */
 	u_int64_t disk_size;            /* Source size */
 	u_int64_t size;                 /* Cache size */
 	u_int32_t assoc;                /* Cache associativity */
@@ -744,15 +1027,12 @@ struct cache_c {
 	u_int32_t sb_state;     /* Superblock state */
 	u_int32_t sb_version;   /* Superblock version */
 
-	int readfill_in_prog;
-	struct eio_stats eio_stats;     /* Run time stats */
+	struct eio_pcpu_stats __percpu *pcpu_stats;     /* Run time stats */
 	struct eio_errors eio_errors;   /* Error stats */
-	int max_clean_ios_set;          /* Max cleaning IOs per set */
-	int max_clean_ios_total;        /* Total max cleaning IOs */
 	int clean_inprog;
 	atomic64_t nr_dirty;
-	atomic64_t nr_ios;
-	atomic64_t size_hist[SIZE_HIST];
+	int64_t nr_ios_est;             /* "nr_ios" as of "nr_ios_stamp" */
+	unsigned long nr_ios_stamp;
 
 	void *sysctl_handle_common;
 	void *sysctl_handle_writeback;
@@ -775,6 +1055,18 @@ struct cache_c {
 	u_int32_t num_sets;                             /* number of cache sets */
 	u_int32_t num_sets_bits;                        /* number of bits to encode "num_sets" */
 	u_int64_t num_sets_mask;                        /* mask value for bits in "num_sets" */
+	u_int32_t set_hash;                             /* EIO_SET_HASH_* */
+	u_int16_t *dbn_index;                           /* per-set dbn to block index, NULL if disabled */
+	u_int32_t dbn_index_bits;                       /* log2 of dbn index entries per set */
+	u_int16_t *ghost;                               /* readfill admission tags, NULL until used */
+	u_int32_t ghost_bits;                           /* log2 of ghost tags per set */
+	unsigned long *readahead_map;                   /* blocks read ahead and not read yet, NULL until used */
+	void *set_locks;                                /* lock table, see eio_set_lock() */
+	u_int32_t nr_set_locks;                         /* entries in "set_locks" */
+	u_int32_t set_locks_shift;                      /* log2 of sets per entry */
+	u_int32_t set_lock_size;                        /* bytes per entry */
+	unsigned long *set_bitmaps;                     /* per-set free and dirty block bitmaps */
+	u_int32_t set_bitmap_longs;                     /* longs in one set bitmap */
 
 	struct eio_policy *policy_ops;                  /* Cache block Replacement policy */
 	u_int32_t req_policy;                           /* Policy requested by the user */
@@ -786,6 +1078,12 @@ struct cache_c {
 	struct delayed_work clean_aged_sets_work;       /* work item for clean_aged_sets */
 	int is_clean_aged_sets_sched;                   /* to know whether clean aged sets is scheduled */
 	struct workqueue_struct *mdupdate_q;            /* Workqueue to handle md updates */
+	spinlock_t mdreq_pool_lock;                     /* protects the mdreq pool */
+	struct mdupdate_request *mdreq_pool;            /* free mdreqs, for write-back */
+	unsigned mdreq_pool_free;                       /* mdreqs in mdreq_pool */
+	unsigned mdreq_pool_size;                       /* mdreqs owned by the pool */
+	wait_queue_head_t mdreq_pool_wait;              /* writes waiting for mdreqs */
+	struct eio_journal *journal;                    /* metadata journal, for write-back */
 	struct workqueue_struct *callback_q;            /* Workqueue to handle io callbacks */
 };
 
@@ -810,7 +1108,7 @@ struct cache_c {
 #define CACHE_SRC_IS_ABSENT(dmc)                (((dmc)->eio_errors.no_source_dev == 1) ? 1 : 0)
 
 #define AUTOCLEAN_THRESHOLD_CROSSED(dmc)	\
-	((atomic64_read(&(dmc)->nr_ios) > (int64_t)(dmc)->sysctl_active.autoclean_threshold) ||	\
+	((eio_nr_ios_est(dmc) > (int64_t)(dmc)->sysctl_active.autoclean_threshold) ||	\
 	 ((dmc)->sysctl_active.autoclean_threshold == 0))
 
 #define DIRTY_CACHE_THRESHOLD_CROSSED(dmc)	\
@@ -834,6 +1132,14 @@ struct job_io_regions {
 #define EB_MAIN_IO 1
 #define EB_SUBORDINATE_IO 2
 #define EB_INVAL 4
+
+/* Where an eio_bio was allocated from (eb_alloc) */
+#define EB_ALLOC_BC 0           /* embedded in its bio_container */
+#define EB_ALLOC_POOL 1         /* _ebio_pool */
+#define EB_ALLOC_KMALLOC 2      /* too many bio_vecs for the pool */
+
+/* bio_vecs available in an embedded or pooled eio_bio */
+#define EB_INLINE_BVECS 4
 #define GET_BIO_FLAGS(ebio)             ((ebio)->eb_bc->bc_bio->bi_rw)
 #define VERIFY_BIO_FLAGS(ebio)          EIO_ASSERT((ebio) && (ebio)->eb_bc && (ebio)->eb_bc->bc_bio)
 
@@ -851,6 +1157,7 @@ struct eio_bio {
 	struct eio_bio *eb_next;        /*used for splitting reads*/
 	index_t eb_index;               /*for read bios*/
 	atomic_t eb_holdcount;          /* ebio hold count, currently used only for dirty block I/O */
+	int eb_alloc;                   /* EB_ALLOC_* */
 	struct bio_vec eb_rbv[0];
 };
 
@@ -880,6 +1187,13 @@ struct bio_container {
 	int bc_error;                           /* error encountered during processing bc */
 	unsigned long bc_iotime;                /* maintains i/o time in jiffies */
 	struct bio_container *bc_next;          /* next bc in the chain */
+	int bc_ebio_used;                       /* bc_ebio handed out */
+	int bc_throttled;                       /* waited for room in a set */
+	int bc_seq_bypass;                      /* sequential read, no readfill */
+	int bc_bio_private;                     /* bc_bio is no application bio */
+	struct bio *bc_fill_bio;                /* whole block read of a partial miss */
+	struct eio_bio bc_ebio;                 /* first ebio, saves an allocation */
+	struct bio_vec bc_ebio_bvecs[EB_INLINE_BVECS];  /* bc_ebio.eb_rbv */
 };
 
 /* structure used as callback context during synchronous I/O */
@@ -937,7 +1251,6 @@ void eio_md_write_done(struct kcached_job *job);
 void eio_ssderror_diskread(struct kcached_job *job);
 void eio_md_write(struct kcached_job *job);
 void eio_md_write_kickoff(struct kcached_job *job);
-void eio_do_readfill(struct work_struct *work);
 void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set);
 void eio_clean_all(struct cache_c *dmc);
 void eio_clean_for_reboot(struct cache_c *dmc);
@@ -981,6 +1294,7 @@ extern void eio_dtr(struct dm_target *ti);
 extern int eio_md_destroy(struct dm_target *tip, char *namep, char *srcp,
 			  char *cachep, int force);
 extern int eio_ctr_ssd_add(struct cache_c *dmc, char *dev);
+extern int eio_set_clean_threads(struct cache_c *dmc, u_int32_t nr);
 
 /* thread related functions */
 void *eio_create_thread(int (*func)(void *), void *context, char *name);
@@ -993,11 +1307,20 @@ extern void eio_md_write_done(struct kcached_job *job);
 extern void eio_ssderror_diskread(struct kcached_job *job);
 extern void eio_md_write(struct kcached_job *job);
 extern void eio_md_write_kickoff(struct kcached_job *job);
-extern void eio_do_readfill(struct work_struct *work);
+extern int eio_readfill_init(struct cache_c *dmc);
+extern void eio_readfill_exit(struct cache_c *dmc);
 extern void eio_check_dirty_thresholds(struct cache_c *dmc, index_t set);
 extern void eio_clean_all(struct cache_c *dmc);
 extern int eio_clean_thread_proc(void *context);
+extern struct eio_clean_buf *eio_get_clean_buf(struct cache_c *dmc);
+extern void eio_put_clean_buf(struct cache_c *dmc, struct eio_clean_buf *buf);
+extern int64_t eio_queue_dirty_sets(struct cache_c *dmc,
+				    int64_t required_cleans);
 extern void eio_touch_set_lru(struct cache_c *dmc, index_t set);
+extern int eio_mdreq_pool_init(struct cache_c *dmc);
+extern void eio_mdreq_pool_exit(struct cache_c *dmc);
+extern void eio_mdupdate_done(struct cache_c *dmc, struct eio_bio *ebio,
+			      int error);
 extern void eio_inval_range(struct cache_c *dmc, sector_t iosector,
 			    unsigned iosize);
 extern int eio_invalidate_sanity_check(struct cache_c *dmc, u_int64_t iosector,
@@ -1008,15 +1331,62 @@ extern int eio_invalidate_sanity_check(struct cache_c *dmc, u_int64_t iosector,
  */
 extern int eio_invalidate_cache(struct cache_c *dmc);
 
+/* eio_wbrate.c */
+extern void eio_wb_rate_init(struct cache_c *dmc);
+extern void eio_wb_rate_start(struct cache_c *dmc);
+extern void eio_wb_rate_stop(struct cache_c *dmc);
+
+/* eio_seq.c */
+extern void eio_seq_init(struct cache_c *dmc);
+extern int eio_seq_detect(struct cache_c *dmc, sector_t sector,
+			  sector_t sectors, struct eio_io_region *ra);
+
+/* eio_journal.c */
+extern u_int64_t eio_journal_size(struct cache_c *dmc);
+extern int eio_journal_init(struct cache_c *dmc);
+extern void eio_journal_exit(struct cache_c *dmc);
+extern void eio_journal_enq(struct cache_c *dmc, struct eio_bio *ebio);
+extern void eio_journal_clean(struct cache_c *dmc, struct eio_journal_clean *req);
+extern void eio_journal_sync(struct cache_c *dmc);
+extern int eio_journal_replay(struct cache_c *dmc, int *num_valid,
+			      int *num_dirty);
+
 /* eio_mem.c */
 extern int eio_mem_init(struct cache_c *dmc);
 extern u_int32_t eio_hash_block(struct cache_c *dmc, sector_t dbn);
+extern u_int32_t eio_set_hash_default(void);
 extern unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn);
 extern sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index);
 extern void eio_invalidate_md(struct cache_c *dmc, u_int64_t index);
 extern void eio_md4_dbn_set(struct cache_c *dmc, u_int64_t index,
 			    u_int32_t dbn_24);
 extern void eio_md8_dbn_set(struct cache_c *dmc, u_int64_t index, sector_t dbn);
+extern index_t eio_scan_valid_dbn(struct cache_c *dmc, index_t start_index,
+				  sector_t dbn);
+extern index_t eio_dbn_index_find(struct cache_c *dmc, index_t start_index,
+				  sector_t dbn);
+extern size_t eio_dbn_index_size(struct cache_c *dmc);
+extern void eio_dbn_index_build(struct cache_c *dmc);
+extern int eio_dbn_index_alloc(struct cache_c *dmc);
+extern void eio_dbn_index_free(struct cache_c *dmc);
+extern int eio_ghost_alloc(struct cache_c *dmc);
+extern void eio_ghost_free(struct cache_c *dmc);
+extern int eio_ghost_admit(struct cache_c *dmc, index_t set, sector_t dbn);
+extern int eio_readahead_map_alloc(struct cache_c *dmc);
+extern void eio_readahead_map_free(struct cache_c *dmc);
+extern size_t eio_set_locks_size(struct cache_c *dmc);
+extern int eio_set_locks_alloc(struct cache_c *dmc);
+extern void eio_set_locks_free(struct cache_c *dmc);
+extern size_t eio_mem_size(struct cache_c *dmc);
+
+/* eio_scan.c */
+extern void eio_scan_init(void);
+extern const char *eio_scan_name(void);
+extern index_t eio_scan_md(struct cache_c *dmc, index_t index, u_int32_t count,
+			   u_int32_t mask4, u_int32_t want4, u_int64_t mask8,
+			   u_int64_t want8);
+extern index_t eio_scan_state(struct cache_c *dmc, index_t index,
+			      u_int32_t count, u_int8_t cache_state);
 
 /* eio_procfs.c */
 extern void eio_module_procfs_init(void);
@@ -1041,6 +1411,12 @@ extern void eio_unplug_cache_device(struct cache_c *dmc);
 extern void eio_put_cache_device(struct cache_c *dmc);
 extern void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note);
 extern void eio_resume_caching(struct cache_c *dmc, char *dev);
+extern void eio_stats_sum(struct cache_c *dmc, struct eio_stats *stats);
+extern void eio_stats_zero(struct cache_c *dmc, int keep_cached);
+extern void eio_stats_clear_cached(struct cache_c *dmc);
+extern int64_t eio_size_hist_sum(struct cache_c *dmc, int i);
+extern int64_t eio_nr_ios(struct cache_c *dmc);
+extern int64_t eio_nr_ios_est(struct cache_c *dmc);
 
 static inline void
 EIO_DBN_SET(struct cache_c *dmc, u_int64_t index, sector_t dbn)
@@ -1061,6 +1437,64 @@ static inline u_int64_t EIO_DBN_GET(struct cache_c *dmc, u_int64_t index)
 	return eio_expand_dbn(dmc, index);
 }
 
+/*
+ * Each set has two bitmaps of "assoc" bits, one with the blocks in
+ * INVALID state (free slots) followed by one with the blocks having
+ * DIRTY set. Blocks of a set change state under different locks, so
+ * the bits are flipped atomically.
+ */
+#define EIO_SET_FREE_MAP(dmc, set)	\
+	((dmc)->set_bitmaps + (set) * 2 * (dmc)->set_bitmap_longs)
+#define EIO_SET_DIRTY_MAP(dmc, set)	\
+	(EIO_SET_FREE_MAP(dmc, set) + (dmc)->set_bitmap_longs)
+
+/*
+ * The locks of a set. By default, each set has an entry of its own in
+ * the lock table. A cache set up with the "set_locks" module parameter
+ * set has that many entries instead, each padded to a cacheline and
+ * shared by a run of consecutive sets, so that the memory of the locks
+ * does not grow with the cache. Sets sharing an entry are consecutive
+ * so that the set locks of an I/O are still taken in order, each entry
+ * once, see eio_lock_setspan(). No code holds the spin locks of two
+ * sets at once.
+ */
+static inline struct eio_set_lock *eio_set_lock(struct cache_c *dmc,
+						index_t set)
+{
+
+	return (struct eio_set_lock *)((char *)dmc->set_locks +
+				       (size_t)(set >> dmc->set_locks_shift) *
+				       dmc->set_lock_size);
+}
+
+#define EIO_SET_CS_LOCK(dmc, set)       (&eio_set_lock(dmc, set)->cs_lock)
+#define EIO_SET_RW_LOCK(dmc, set)       (&eio_set_lock(dmc, set)->rw_lock)
+#define EIO_SET_DBN_SEQ(dmc, set)       (&eio_set_lock(dmc, set)->dbn_seq)
+
+static inline void
+eio_set_bitmaps_update(struct cache_c *dmc, u_int64_t index,
+		       u_int8_t cache_state)
+{
+	unsigned long *free_map;
+	unsigned long *dirty_map;
+	unsigned int bit = index & (dmc->assoc - 1);
+
+	free_map = EIO_SET_FREE_MAP(dmc, index >> dmc->consecutive_shift);
+	dirty_map = free_map + dmc->set_bitmap_longs;
+
+	if (cache_state == INVALID) {
+		if (!test_bit(bit, free_map))
+			set_bit(bit, free_map);
+	} else if (test_bit(bit, free_map))
+		clear_bit(bit, free_map);
+
+	if (cache_state & DIRTY) {
+		if (!test_bit(bit, dirty_map))
+			set_bit(bit, dirty_map);
+	} else if (test_bit(bit, dirty_map))
+		clear_bit(bit, dirty_map);
+}
+
 static inline void
 EIO_CACHE_STATE_SET(struct cache_c *dmc, u_int64_t index, u_int8_t cache_state)
 {
@@ -1068,6 +1502,8 @@ EIO_CACHE_STATE_SET(struct cache_c *dmc, u_int64_t index, u_int8_t cache_state)
 		dmc->cache_md8[index].md8_u.u_s_md8.cache_state = cache_state;
 	else
 		dmc->cache[index].md4_u.u_s_md4.cache_state = cache_state;
+	if (dmc->set_bitmaps)
+		eio_set_bitmaps_update(dmc, index, cache_state);
 }
 
 static inline u_int8_t
@@ -1100,6 +1536,58 @@ EIO_CACHE_STATE_ON(struct cache_c *dmc, index_t index, u_int8_t bitmask)
 	EIO_CACHE_STATE_SET(dmc, index, cache_state);
 }
 
+/*
+ * Read hits flip CACHEREADINPROG on and off a VALID block with a cmpxchg
+ * of its metadata word rather than under cs_lock, see eio_read_peek_fast().
+ * Code under cs_lock which moves a block out of VALID, or marks one with
+ * a read hit in progress QUEUED, does it with eio_cache_state_cmpxchg()
+ * too: it fails if the state is no longer "old".
+ */
+#define EIO_MD_STATE_SHIFT(dmc)	\
+	(EIO_MD8(dmc) ? EIO_MD8_DBN_BITS : EIO_MD4_DBN_BITS)
+
+static inline u_int64_t eio_md_word(struct cache_c *dmc, index_t index)
+{
+	if (EIO_MD8(dmc))
+		return ACCESS_ONCE(dmc->cache_md8[index].md8_u.u_i_md8);
+	return ACCESS_ONCE(dmc->cache[index].md4_u.u_i_md4);
+}
+
+/* Returns the word found, "old" if it has been replaced by "new" */
+static inline u_int64_t
+eio_md_word_cmpxchg(struct cache_c *dmc, index_t index, u_int64_t old,
+		    u_int64_t new)
+{
+	if (EIO_MD8(dmc))
+		return cmpxchg64(&dmc->cache_md8[index].md8_u.u_i_md8, old,
+				 new);
+	return cmpxchg(&dmc->cache[index].md4_u.u_i_md4, (u_int32_t)old,
+		       (u_int32_t)new);
+}
+
+static inline int
+eio_cache_state_cmpxchg(struct cache_c *dmc, index_t index, u_int8_t old,
+			u_int8_t cache_state)
+{
+	u_int32_t shift = EIO_MD_STATE_SHIFT(dmc);
+	u_int64_t dbn_mask = ((u_int64_t)1 << shift) - 1;
+	u_int64_t word = eio_md_word(dmc, index);
+	u_int64_t prev;
+
+	for (;;) {
+		if ((u_int8_t)(word >> shift) != old)
+			return 0;
+		prev = eio_md_word_cmpxchg(dmc, index, word, (word & dbn_mask) |
+					   ((u_int64_t)cache_state << shift));
+		if (prev == word)
+			break;
+		word = prev;
+	}
+	if (dmc->set_bitmaps)
+		eio_set_bitmaps_update(dmc, index, cache_state);
+	return 1;
+}
+
 void eio_set_warm_boot(void);
 #endif                          /* defined(__KERNEL__) */
 
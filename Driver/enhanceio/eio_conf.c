@@ -41,6 +41,9 @@
 
 #define KMEM_CACHE_JOB          "eio-kcached-jobs"
 #define KMEM_EIO_IO             "eio-io-context"
+#define KMEM_EIO_BC             "eio-bio-container"
+#define KMEM_EIO_EBIO           "eio-bio"
+#define KMEM_EIO_SEQ            "eio-set-seq"
 #define KMEM_DMC_BIO_PAIR       "eio-dmc-bio-pair"
 /* #define KMEM_CACHE_PENDING_JOB	"eio-pending-jobs" */
 
@@ -51,6 +54,12 @@ static struct kmem_cache *_job_cache;
 struct kmem_cache *_io_cache;   /* cache of eio_context objects */
 mempool_t *_job_pool;
 mempool_t *_io_pool;            /* pool of eio_context object */
+static struct kmem_cache *_bc_cache;
+mempool_t *_bc_pool;            /* pool of bio_container objects */
+static struct kmem_cache *_ebio_cache;
+mempool_t *_ebio_pool;          /* pool of eio_bio objects */
+static struct kmem_cache *_seq_cache;
+mempool_t *_seq_pool;           /* pool of set_seq objects */
 
 atomic_t nr_cache_jobs;
 
@@ -65,6 +74,7 @@ int eio_force_warm_boot;
 static int eio_notify_reboot(struct notifier_block *nb, unsigned long action,
 			     void *x);
 void eio_stop_async_tasks(struct cache_c *dmc);
+static void eio_stop_clean_threads(struct cache_c *dmc, int nr);
 static int eio_notify_ssd_rm(struct notifier_block *nb, unsigned long action,
 			     void *x);
 
@@ -182,6 +192,13 @@ static int eio_jobs_init(void)
 
 	_job_cache = _io_cache = NULL;
 	_job_pool = _io_pool = NULL;
+	_bc_cache = _ebio_cache = _seq_cache = NULL;
+	_bc_pool = _ebio_pool = _seq_pool = NULL;
+
+	/* bc_ebio_bvecs must be where bc_ebio.eb_rbv points */
+	BUILD_BUG_ON(offsetof(struct bio_container, bc_ebio_bvecs) !=
+		     offsetof(struct bio_container, bc_ebio) +
+		     offsetof(struct eio_bio, eb_rbv));
 
 	_job_cache = kmem_cache_create(KMEM_CACHE_JOB,
 				       sizeof(struct kcached_job),
@@ -206,9 +223,55 @@ static int eio_jobs_init(void)
 	if (!_io_pool)
 		goto out;
 
+	_bc_cache = kmem_cache_create(KMEM_EIO_BC,
+				      sizeof(struct bio_container),
+				      __alignof__(struct bio_container), 0,
+				      NULL);
+	if (!_bc_cache)
+		goto out;
+
+	_bc_pool = mempool_create(MIN_EIO_BC, mempool_alloc_slab,
+				  mempool_free_slab, _bc_cache);
+	if (!_bc_pool)
+		goto out;
+
+	_ebio_cache = kmem_cache_create(KMEM_EIO_EBIO,
+					sizeof(struct eio_bio) +
+					EB_INLINE_BVECS * sizeof(struct bio_vec),
+					__alignof__(struct eio_bio), 0, NULL);
+	if (!_ebio_cache)
+		goto out;
+
+	_ebio_pool = mempool_create(MIN_EIO_EBIO, mempool_alloc_slab,
+				    mempool_free_slab, _ebio_cache);
+	if (!_ebio_pool)
+		goto out;
+
+	_seq_cache = kmem_cache_create(KMEM_EIO_SEQ, sizeof(struct set_seq),
+				       __alignof__(struct set_seq), 0, NULL);
+	if (!_seq_cache)
+		goto out;
+
+	_seq_pool = mempool_create(MIN_EIO_SEQ, mempool_alloc_slab,
+				   mempool_free_slab, _seq_cache);
+	if (!_seq_pool)
+		goto out;
+
 	return 0;
 
 out:
+	if (_seq_pool)
+		mempool_destroy(_seq_pool);
+	if (_seq_cache)
+		kmem_cache_destroy(_seq_cache);
+	if (_ebio_pool)
+		mempool_destroy(_ebio_pool);
+	if (_ebio_cache)
+		kmem_cache_destroy(_ebio_cache);
+	if (_bc_pool)
+		mempool_destroy(_bc_pool);
+	if (_bc_cache)
+		kmem_cache_destroy(_bc_cache);
 	if (_io_pool)
 		mempool_destroy(_io_pool);
 	if (_io_cache)
@@ -220,19 +283,29 @@ out:
 
 	_job_pool = _io_pool = NULL;
 	_job_cache = _io_cache = NULL;
+	_bc_cache = _ebio_cache = _seq_cache = NULL;
+	_bc_pool = _ebio_pool = _seq_pool = NULL;
 	return -ENOMEM;
 }
 
 static void eio_jobs_exit(void)
 {
 
+	mempool_destroy(_seq_pool);
+	mempool_destroy(_ebio_pool);
+	mempool_destroy(_bc_pool);
 	mempool_destroy(_io_pool);
 	mempool_destroy(_job_pool);
+	kmem_cache_destroy(_seq_cache);
+	kmem_cache_destroy(_ebio_cache);
+	kmem_cache_destroy(_bc_cache);
 	kmem_cache_destroy(_io_cache);
 	kmem_cache_destroy(_job_cache);
 
 	_job_pool = _io_pool = NULL;
 	_job_cache = _io_cache = NULL;
+	_bc_cache = _ebio_cache = _seq_cache = NULL;
+	_bc_pool = _ebio_pool = _seq_pool = NULL;
 }
 
 static int eio_kcached_init(struct cache_c *dmc)
@@ -240,7 +313,7 @@ static int eio_kcached_init(struct cache_c *dmc)
 
 	/* init_waitqueue_head(&dmc->destroyq); */
 	atomic_set(&dmc->nr_jobs, 0);
-	return 0;
+	return eio_readfill_init(dmc);
 }
 
 static void eio_kcached_client_destroy(struct cache_c *dmc)
@@ -248,6 +321,7 @@ static void eio_kcached_client_destroy(struct cache_c *dmc)
 
 	/* Wait for all IOs
 	   /wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));*/
+	eio_readfill_exit(dmc);
 }
 
 /* Store the cache superblock on ssd */
@@ -324,6 +398,11 @@ int eio_sb_store(struct cache_c *dmc)
 	sb->sbf.time_based_clean_interval =
 		cpu_to_le32(dmc->sysctl_active.time_based_clean_interval);
 	sb->sbf.autoclean_threshold = cpu_to_le32(dmc->sysctl_active.autoclean_threshold);
+	sb->sbf.set_hash = cpu_to_le32(dmc->set_hash);
+	sb->sbf.journal_id = cpu_to_le32(dmc->journal_id);
+	sb->sbf.journal_start_sect = cpu_to_le64(dmc->journal_start_sect);
+	sb->sbf.journal_sectors = cpu_to_le64(dmc->journal_sectors);
+	sb->sbf.journal_ckpt_seq = cpu_to_le64(dmc->journal_ckpt_seq);
 
 	/* write out to ssd */
 	where.bdev = dmc->cache_dev->bdev;
@@ -392,6 +471,9 @@ int eio_md_store(struct cache_c *dmc)
 		return 0;
 	}
 
+	/* The metadata written below covers the whole journal */
+	eio_journal_sync(dmc);
+
 	if (!eio_mem_available(dmc, METADATA_IO_BLOCKSIZE_SECT)) {
 		pr_err
 			("md_store: System memory too low for allocating metadata IO buffers");
@@ -656,12 +738,27 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	 * on SSD is aligned at 8K boundary.
 	 *
 	 * Note dmc->size is in raw sectors
+	 *
+	 * An SSD being re-added keeps the set index and the journal of
+	 * its cache. The journal, if any, sits between the superblock
+	 * and the metadata, and is a multiple of 8K.
 	 */
-	dmc->md_start_sect = EIO_METADATA_START(dmc->cache_dev_start_sect);
+	if (!CACHE_SSD_ADD_INPROG_IS_SET(dmc)) {
+		dmc->set_hash = eio_set_hash_default();
+		dmc->journal_sectors = eio_journal_size(dmc);
+		get_random_bytes(&dmc->journal_id, sizeof(dmc->journal_id));
+		dmc->journal_head_seq = 1;
+	}
+	/* Nothing in the journal is newer than the metadata written here */
+	if (cold)
+		dmc->journal_ckpt_seq = dmc->journal_head_seq - 1;
+	dmc->journal_start_sect = EIO_METADATA_START(dmc->cache_dev_start_sect);
+	dmc->md_start_sect = dmc->journal_start_sect + dmc->journal_sectors;
 	dmc->md_sectors =
 		INDEX_TO_MD_SECTOR(EIO_DIV(dmc->size, (sector_t)dmc->block_size));
 	dmc->md_sectors +=
 		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
+	dmc->md_sectors += dmc->journal_sectors;
 	dmc->size -= dmc->md_sectors;   /* total sectors available for cache */
 	do_div(dmc->size, dmc->block_size);
 	dmc->size = EIO_DIV(dmc->size, dmc->assoc) * (sector_t)dmc->assoc;
@@ -669,6 +766,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size);
 	dmc->md_sectors +=
 		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
+	dmc->md_sectors += dmc->journal_sectors;
 
 	error = eio_mem_init(dmc);
 	if (error == -1) {
@@ -1011,8 +1109,13 @@ static int eio_md_load(struct cache_c *dmc)
 		goto free_header;
 	}
 
-	/* check ondisk superblock version */
-	if (le32_to_cpu(header->sbf.cache_version) != EIO_SB_VERSION) {
+	/*
+	 * check ondisk superblock version, a version 3 superblock only
+	 * lacks "set_hash" and is loaded with a linear set index, a
+	 * version 4 one lacks the journal and is loaded without one
+	 */
+	if (le32_to_cpu(header->sbf.cache_version) > EIO_SB_VERSION ||
+	    le32_to_cpu(header->sbf.cache_version) < EIO_SB_SET_HASH_VERSION - 1) {
 		pr_info("md_load: Cache superblock mismatch detected." \
 			" (current: %u, ondisk: %u)", EIO_SB_VERSION,
 			header->sbf.cache_version);
@@ -1155,6 +1258,29 @@ static int eio_md_load(struct cache_c *dmc)
 		le32_to_cpu(header->sbf.time_based_clean_interval);
 	dmc->sysctl_active.autoclean_threshold =
 		le32_to_cpu(header->sbf.autoclean_threshold);
+	if (le32_to_cpu(header->sbf.cache_version) >= EIO_SB_SET_HASH_VERSION)
+		dmc->set_hash = le32_to_cpu(header->sbf.set_hash);
+	else
+		dmc->set_hash = EIO_SET_HASH_LINEAR;
+	if (dmc->set_hash > EIO_SET_HASH_LAST) {
+		pr_err("eio_md_load: Unknown set index function %u.",
+		       dmc->set_hash);
+		ret = -EINVAL;
+		goto free_header;
+	}
+	if (le32_to_cpu(header->sbf.cache_version) >= EIO_SB_JOURNAL_VERSION) {
+		dmc->journal_id = le32_to_cpu(header->sbf.journal_id);
+		dmc->journal_start_sect =
+			le64_to_cpu(header->sbf.journal_start_sect);
+		dmc->journal_sectors = le64_to_cpu(header->sbf.journal_sectors);
+		dmc->journal_ckpt_seq =
+			le64_to_cpu(header->sbf.journal_ckpt_seq);
+	} else {
+		dmc->journal_id = 0;
+		dmc->journal_start_sect = 0;
+		dmc->journal_sectors = 0;
+		dmc->journal_ckpt_seq = 0;
+	}
 
 	i = eio_mem_init(dmc);
 	if (i == -1) {
@@ -1299,6 +1425,14 @@ static int eio_md_load(struct cache_c *dmc)
 		size -= slots_read;
 	}
 
+	/* Apply the metadata updates still in the journal */
+	error = eio_journal_replay(dmc, &num_valid, &dirty_loaded);
+	if (error) {
+		vfree((void *)EIO_CACHE(dmc));
+		ret = -EIO;
+		goto free_md;
+	}
+
 	/*
 	 * If the cache contains dirty data, the only valid mode is write back.
 	 */
@@ -1383,9 +1517,10 @@ void eio_policy_free(struct cache_c *dmc)
 static int eio_clean_thread_init(struct cache_c *dmc)
 {
 	INIT_LIST_HEAD(&dmc->cleanq);
-	spin_lock_init(&dmc->clean_sl);
-	EIO_INIT_EVENT(&dmc->clean_event);
-	return eio_start_clean_thread(dmc);
+	init_waitqueue_head(&dmc->clean_wq);
+	atomic_set(&dmc->clean_ios, 0);
+	init_waitqueue_head(&dmc->clean_io_wq);
+	return eio_start_clean_threads(dmc);
 }
 
 int
@@ -1487,6 +1622,13 @@ int eio_cache_create(struct cache_rec_short *cache)
 		goto bad;
 	}
 
+	dmc->pcpu_stats = alloc_percpu(struct eio_pcpu_stats);
+	if (dmc->pcpu_stats == NULL) {
+		strerr = "Failed to allocate memory for cache stats";
+		error = -ENOMEM;
+		goto bad1;
+	}
+
 	/*
 	 * Source device.
 	 */
@@ -1809,14 +1951,39 @@ init:
 
 	for (i = 0; i < (dmc->size >> dmc->consecutive_shift); i++) {
 		dmc->cache_sets[i].nr_dirty = 0;
-		spin_lock_init(&dmc->cache_sets[i].cs_lock);
-		init_rwsem(&dmc->cache_sets[i].rw_lock);
 		dmc->cache_sets[i].mdreq = NULL;
 		dmc->cache_sets[i].flags = 0;
 	}
+
+	order = eio_set_locks_size(dmc);
+	if (!eio_mem_available(dmc, order) || eio_set_locks_alloc(dmc)) {
+		strerr = "Failed to allocate memory for set locks";
+		error = -ENOMEM;
+		vfree((void *)dmc->cache_sets);
+		vfree((void *)EIO_CACHE(dmc));
+		goto bad5;
+	}
+
+	/* Free and dirty block bitmaps, filled in from the metadata below */
+	dmc->set_bitmap_longs = BITS_TO_LONGS(dmc->assoc);
+	order = (dmc->size >> dmc->consecutive_shift) * 2 *
+		dmc->set_bitmap_longs * sizeof(unsigned long);
+	dmc->set_bitmaps = vmalloc((size_t)order);
+	if (!dmc->set_bitmaps) {
+		strerr = "Failed to allocate memory";
+		error = -ENOMEM;
+		eio_set_locks_free(dmc);
+		vfree((void *)dmc->cache_sets);
+		vfree((void *)EIO_CACHE(dmc));
+		goto bad5;
+	}
+	memset(dmc->set_bitmaps, 0, (size_t)order);
+
 	error = eio_repl_sets_init(dmc->policy_ops);
 	if (error < 0) {
 		strerr = "Failed to allocate memory for cache policy";
+		vfree((void *)dmc->set_bitmaps);
+		eio_set_locks_free(dmc);
 		vfree((void *)dmc->cache_sets);
 		vfree((void *)EIO_CACHE(dmc));
 		goto bad5;
@@ -1826,20 +1993,42 @@ init:
 	if (dmc->mode == CACHE_MODE_WB) {
 		error = eio_allocate_wb_resources(dmc);
 		if (error) {
+			vfree((void *)dmc->set_bitmaps);
+			eio_set_locks_free(dmc);
 			vfree((void *)dmc->cache_sets);
 			vfree((void *)EIO_CACHE(dmc));
 			goto bad5;
 		}
 	}
 
+	/* The dbn index is only an accelerator, go on without it if need be */
+	order = eio_dbn_index_size(dmc);
+	if (order) {
+		if (!eio_mem_available(dmc, order) ||
+		    eio_dbn_index_alloc(dmc))
+			pr_info("Not enough memory for dbn index, " \
+				"cache \"%s\" will use set scans",
+				dmc->cache_name);
+	}
+
 	dmc->sysctl_active.error_inject = 0;
 	dmc->sysctl_active.fast_remove = 0;
 	dmc->sysctl_active.zerostats = 0;
 	dmc->sysctl_active.do_clean = 0;
+	dmc->sysctl_active.clean_threads = CLEAN_THREADS_DEF;
+	dmc->sysctl_active.max_clean_ios = MAX_CLEAN_IOS_DEF;
+	dmc->sysctl_active.writeback_percent = WB_PERCENT_DEF;
+	dmc->sysctl_active.writeback_latency_ms = WB_LATENCY_MS_DEF;
+	dmc->sysctl_active.write_throttle_ms = WRITE_THROTTLE_MS_DEF;
+	dmc->sysctl_active.readfill_admit = READFILL_ADMIT_DEF;
+	dmc->sysctl_active.sequential_cutoff_kb = SEQ_CUTOFF_KB_DEF;
+	dmc->sysctl_active.readahead_blocks = READAHEAD_BLOCKS_DEF;
+	dmc->sysctl_active.expand_partial_reads = EXPAND_PARTIAL_READS_DEF;
+	eio_seq_init(dmc);
 
 	atomic_set(&dmc->clean_index, 0);
-
-	atomic64_set(&dmc->nr_ios, 0);
+	atomic_set(&dmc->clean_sweepers, 0);
+	dmc->clean_sweep = 0;
 
 	/*
 	 * sysctl_mem_limit_pct [0 - 100]. Before doing a vmalloc()
@@ -1862,8 +2051,9 @@ init:
 
 	prev_set = -1;
 	for (i = 0; i < dmc->size; i++) {
+		eio_set_bitmaps_update(dmc, i, EIO_CACHE_STATE_GET(dmc, i));
 		if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_INC(dmc, cached_blocks);
 		if (EIO_CACHE_STATE_GET(dmc, i) & DIRTY) {
 			dmc->cache_sets[EIO_DIV(i, dmc->assoc)].nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
@@ -1876,8 +2066,6 @@ init:
 		}
 	}
 
-	INIT_WORK(&dmc->readfill_wq, eio_do_readfill);
-
 	/*
 	 * invalid index, but signifies cache successfully built
 	 */
@@ -1907,6 +2095,11 @@ bad6:
 		eio_stop_async_tasks(dmc);
 		eio_free_wb_resources(dmc);
 	}
+	eio_dbn_index_free(dmc);
+	eio_ghost_free(dmc);
+	eio_readahead_map_free(dmc);
+	vfree((void *)dmc->set_bitmaps);
+	eio_set_locks_free(dmc);
 	vfree((void *)dmc->cache_sets);
 	vfree((void *)EIO_CACHE(dmc));
 
@@ -1933,6 +2126,7 @@ bad2:
 	eio_ttc_put_device(&dmc->disk_dev);
 bad1:
 	eio_policy_free(dmc);
+	free_percpu(dmc->pcpu_stats);
 	kfree(dmc);
 bad:
 	if (strerr)
@@ -2060,7 +2254,13 @@ force_delete:
 	}
 
 	eio_free_wb_resources(dmc);
+	eio_kcached_client_destroy(dmc);
+	eio_dbn_index_free(dmc);
+	eio_ghost_free(dmc);
+	eio_readahead_map_free(dmc);
 	vfree((void *)EIO_CACHE(dmc));
+	vfree((void *)dmc->set_bitmaps);
+	eio_set_locks_free(dmc);
 	vfree((void *)dmc->cache_sets);
 	eio_ttc_put_device(&dmc->disk_dev);
 	eio_put_cache_device(dmc);
@@ -2081,8 +2281,8 @@ force_delete:
 
 out:
 	if (restart_async_task) {
-		EIO_ASSERT(dmc->clean_thread == NULL);
-		error = eio_start_clean_thread(dmc);
+		EIO_ASSERT(dmc->nr_cleaners == 0);
+		error = eio_start_clean_threads(dmc);
 		if (error)
 			pr_err
 				("cache_delete: Failed to restart async tasks. error=%d\n",
@@ -2103,8 +2303,10 @@ out:
 		 * no more accessible via lookup.
 		 */
 
-		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG))
+		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG)) {
+			free_percpu(dmc->pcpu_stats);
 			kfree(dmc);
+		}
 	}
 
 	return ret;
@@ -2194,9 +2396,10 @@ int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 		goto out;
 	}
 	eio_policy_lru_pushblks(dmc->policy_ops);
+	eio_dbn_index_build(dmc);
 	if (dmc->mode != CACHE_MODE_WB)
 		/* Cold cache will reset the stats */
-		memset(&dmc->eio_stats, 0, sizeof(dmc->eio_stats));
+		eio_stats_zero(dmc, 0);
 
 	return 0;
 out:
@@ -2211,17 +2414,11 @@ out:
  */
 void eio_stop_async_tasks(struct cache_c *dmc)
 {
-	unsigned long flags = 0;
-
-	if (dmc->clean_thread) {
+	if (dmc->nr_cleaners) {
 		dmc->sysctl_active.fast_remove = 1;
-		spin_lock_irqsave(&dmc->clean_sl, flags);
-		EIO_SET_EVENT_AND_UNLOCK(&dmc->clean_event, &dmc->clean_sl,
-					 flags);
-		eio_wait_thread_exit(dmc->clean_thread,
-				     &dmc->clean_thread_running);
-		EIO_CLEAR_EVENT(&dmc->clean_event);
-		dmc->clean_thread = NULL;
+		mutex_lock(&dmc->cleaners_mutex);
+		eio_stop_clean_threads(dmc, 0);
+		mutex_unlock(&dmc->cleaners_mutex);
 	}
 
 	dmc->sysctl_active.fast_remove = CACHE_FAST_REMOVE_IS_SET(dmc) ? 1 : 0;
@@ -2233,77 +2430,220 @@ void eio_stop_async_tasks(struct cache_c *dmc)
 		 */
 		dmc->sysctl_active.time_based_clean_interval = 0;
 		cancel_delayed_work_sync(&dmc->clean_aged_sets_work);
+		eio_wb_rate_stop(dmc);
 	}
 }
 
-int eio_start_clean_thread(struct cache_c *dmc)
+static struct eio_clean_buf *eio_alloc_clean_buf(struct cache_c *dmc)
 {
-	EIO_ASSERT(dmc->clean_thread == NULL);
-	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
-	EIO_ASSERT(dmc->clean_thread_running == 0);
-	EIO_ASSERT(!(dmc->sysctl_active.do_clean & EIO_CLEAN_START));
-
-	dmc->clean_thread = eio_create_thread(eio_clean_thread_proc,
-					      (void *)dmc, "eio_clean_thread");
-	if (!dmc->clean_thread)
-		return -EFAULT;
-	return 0;
-}
-
-int eio_allocate_wb_resources(struct cache_c *dmc)
-{
-	int nr_bvecs, nr_pages;
+	struct eio_clean_buf *buf;
 	unsigned iosize;
-	int ret;
+	int nr_bvecs, nr_pages;
 
-	EIO_ASSERT(dmc->clean_dbvecs == NULL);
-	EIO_ASSERT(dmc->clean_mdpages == NULL);
-	EIO_ASSERT(dmc->dbvec_count == 0);
-	EIO_ASSERT(dmc->mdpage_count == 0);
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		goto nomem;
 
 	/* Data page allocations are done in terms of "bio_vec" structures */
 	iosize = (dmc->block_size * dmc->assoc) << SECTOR_SHIFT;
 	nr_bvecs = IO_BVEC_COUNT(iosize, dmc->block_size);
-	dmc->clean_dbvecs = kmalloc(sizeof(struct bio_vec) * nr_bvecs,
-				GFP_KERNEL);
-	if (dmc->clean_dbvecs == NULL) {
-		pr_err("cache_create: Failed to allocated memory.\n");
-		ret = -ENOMEM;
-		goto errout;
-	}
+	buf->dbvecs = kmalloc(sizeof(struct bio_vec) * nr_bvecs, GFP_KERNEL);
+	if (buf->dbvecs == NULL)
+		goto nomem;
 	/* Allocate pages for each bio_vec */
-	ret = eio_alloc_wb_bvecs(dmc->clean_dbvecs, nr_bvecs, dmc->block_size);
-	if (ret)
-		goto errout;
-	EIO_ASSERT(dmc->clean_dbvecs != NULL);
-	dmc->dbvec_count = nr_bvecs;
+	if (eio_alloc_wb_bvecs(buf->dbvecs, nr_bvecs, dmc->block_size))
+		goto nomem;
+	buf->dbvec_count = nr_bvecs;
+	buf->wbvecs = kmalloc(sizeof(struct bio_vec) * nr_bvecs, GFP_KERNEL);
+	if (buf->wbvecs == NULL)
+		goto nomem;
+	buf->blks = kmalloc(sizeof(struct eio_clean_blk) * dmc->assoc,
+			    GFP_KERNEL);
+	if (buf->blks == NULL)
+		goto nomem;
 
 	/* Metadata page allocations are done in terms of pages only */
 	iosize = dmc->assoc * sizeof(struct flash_cacheblock);
 	nr_pages = IO_PAGE_COUNT(iosize);
-	dmc->clean_mdpages = kmalloc(sizeof(struct page *) * nr_pages,
-				GFP_KERNEL);
-	if (dmc->clean_mdpages == NULL) {
-		pr_err("cache_create: Failed to allocated memory.\n");
-		ret = -ENOMEM;
-		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
-				  dmc->block_size);
-		goto errout;
+	buf->mdpages = kmalloc(sizeof(struct page *) * nr_pages, GFP_KERNEL);
+	if (buf->mdpages == NULL)
+		goto nomem;
+	if (eio_alloc_wb_pages(buf->mdpages, nr_pages))
+		goto nomem;
+	buf->mdpage_count = nr_pages;
+	return buf;
+
+nomem:
+	pr_err("alloc_clean_buf: Failed to allocate memory.\n");
+	if (buf) {
+		if (buf->dbvec_count)
+			eio_free_wb_bvecs(buf->dbvecs, buf->dbvec_count,
+					  dmc->block_size);
+		kfree(buf->dbvecs);
+		kfree(buf->wbvecs);
+		kfree(buf->blks);
+		kfree(buf->mdpages);
+		kfree(buf);
 	}
-	ret = eio_alloc_wb_pages(dmc->clean_mdpages, nr_pages);
-	if (ret) {
-		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
-				  dmc->block_size);
-		goto errout;
+	return NULL;
+}
+
+static void eio_free_clean_buf(struct cache_c *dmc, struct eio_clean_buf *buf)
+{
+	eio_free_wb_pages(buf->mdpages, buf->mdpage_count);
+	kfree(buf->mdpages);
+	eio_free_wb_bvecs(buf->dbvecs, buf->dbvec_count, dmc->block_size);
+	kfree(buf->dbvecs);
+	kfree(buf->wbvecs);
+	kfree(buf->blks);
+	kfree(buf);
+}
+
+/*
+ * Grow or shrink the clean buffers to those of "nr" cleaner threads,
+ * one per set clean in their pipes. Shrinking waits for the buffers
+ * in use to come back.
+ */
+static int eio_resize_clean_bufs(struct cache_c *dmc, int nr)
+{
+	struct eio_clean_buf *buf;
+
+	nr *= CLEAN_PIPELINE_DEPTH;
+	while (dmc->nr_clean_bufs < nr) {
+		buf = eio_alloc_clean_buf(dmc);
+		if (buf == NULL)
+			return -ENOMEM;
+		dmc->nr_clean_bufs++;
+		eio_put_clean_buf(dmc, buf);
+	}
+	while (dmc->nr_clean_bufs > nr) {
+		buf = eio_get_clean_buf(dmc);
+		dmc->nr_clean_bufs--;
+		eio_free_clean_buf(dmc, buf);
 	}
-	EIO_ASSERT(dmc->clean_mdpages != NULL);
-	dmc->mdpage_count = nr_pages;
+	return 0;
+}
+
+/*
+ * Stop the cleaner threads from "nr" on. Called with cleaners_mutex
+ * held, once fast_remove or the "clean_threads" sysctl tells them to.
+ */
+static void eio_stop_clean_threads(struct cache_c *dmc, int nr)
+{
+	struct eio_cleaner *cl;
+
+	wake_up_all(&dmc->clean_wq);
+	while (dmc->nr_cleaners > nr) {
+		cl = &dmc->cleaners[dmc->nr_cleaners - 1];
+		eio_wait_thread_exit(cl->thread, &cl->running);
+		cl->thread = NULL;
+		dmc->nr_cleaners--;
+	}
+}
+
+/* Start the cleaner threads up to the "clean_threads" sysctl */
+static int __eio_start_clean_threads(struct cache_c *dmc)
+{
+	struct eio_cleaner *cl;
+	int nr = dmc->sysctl_active.clean_threads;
+	int ret;
+
+	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
+	EIO_ASSERT(nr > 0 && nr <= CLEAN_THREADS_MAX);
+
+	ret = eio_resize_clean_bufs(dmc, nr);
+	if (ret)
+		return ret;
+
+	while (dmc->nr_cleaners < nr) {
+		cl = &dmc->cleaners[dmc->nr_cleaners];
+		cl->dmc = dmc;
+		cl->id = dmc->nr_cleaners;
+		/* Set before the thread runs, so a stop can't miss it */
+		cl->running = 1;
+		cl->thread = eio_create_thread(eio_clean_thread_proc,
+					       (void *)cl, "eio_clean_thread");
+		if (IS_ERR_OR_NULL(cl->thread)) {
+			cl->running = 0;
+			cl->thread = NULL;
+			return -EFAULT;
+		}
+		dmc->nr_cleaners++;
+	}
+	return 0;
+}
+
+int eio_start_clean_threads(struct cache_c *dmc)
+{
+	int ret;
+
+	EIO_ASSERT(dmc->nr_cleaners == 0);
+	EIO_ASSERT(!(dmc->sysctl_active.do_clean & EIO_CLEAN_START));
+
+	mutex_lock(&dmc->cleaners_mutex);
+	ret = __eio_start_clean_threads(dmc);
+	mutex_unlock(&dmc->cleaners_mutex);
+	return ret;
+}
+
+/*
+ * eio_set_clean_threads
+ *
+ * Apply a new value of the "clean_threads" sysctl. With the threads
+ * stopped, it takes effect when they are restarted.
+ */
+int eio_set_clean_threads(struct cache_c *dmc, u_int32_t nr)
+{
+	u_int32_t old_nr;
+	int ret = 0;
+
+	mutex_lock(&dmc->cleaners_mutex);
+	old_nr = dmc->sysctl_active.clean_threads;
+	dmc->sysctl_active.clean_threads = nr;
+	if (dmc->nr_cleaners == 0)
+		goto out;
+
+	if (nr > old_nr) {
+		ret = __eio_start_clean_threads(dmc);
+		if (ret) {
+			/* Keep the threads which did start */
+			dmc->sysctl_active.clean_threads = dmc->nr_cleaners;
+			eio_resize_clean_bufs(dmc, dmc->nr_cleaners);
+		}
+	} else {
+		eio_stop_clean_threads(dmc, nr);
+		eio_resize_clean_bufs(dmc, nr);
+	}
+
+out:
+	mutex_unlock(&dmc->cleaners_mutex);
+	return ret;
+}
+
+int eio_allocate_wb_resources(struct cache_c *dmc)
+{
+	int ret;
+	int i;
+
+	EIO_ASSERT(dmc->nr_clean_bufs == 0);
+	EIO_ASSERT(dmc->nr_cleaners == 0);
+
+	/*
+	 * The clean buffers, CLEAN_PIPELINE_DEPTH per cleaner thread, are
+	 * allocated as the threads are started.
+	 */
+	spin_lock_init(&dmc->clean_sl);
+	mutex_init(&dmc->cleaners_mutex);
+	INIT_LIST_HEAD(&dmc->clean_bufs);
+	init_waitqueue_head(&dmc->clean_buf_wq);
+	for (i = 0; i < EIO_SET_WQS; i++)
+		init_waitqueue_head(&dmc->set_wq[i]);
 
 	/*
 	 * For writeback cache:
 	 * 1. Initialize the time based clean work queue
 	 * 2. Initialize the dirty set lru
-	 * 3. Initialize clean thread
+	 * 3. Initialize clean threads
 	 */
 
 	/*
@@ -2324,67 +2664,66 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 		ret = eio_clean_thread_init(dmc);
 	}
 	EIO_ASSERT(dmc->mdupdate_q == NULL);
-	dmc->mdupdate_q = create_singlethread_workqueue("eio_mdupdate");
-	if (!dmc->mdupdate_q)
-		ret = -ENOMEM;
+	/*
+	 * An mdreq is queued by one set at a time, so the metadata updates
+	 * of different sets may run concurrently.
+	 */
+	if (ret == 0) {
+		dmc->mdupdate_q = alloc_workqueue("eio_mdupdate",
+						  WQ_MEM_RECLAIM, 0);
+		if (!dmc->mdupdate_q)
+			ret = -ENOMEM;
+	}
+	if (ret == 0)
+		ret = eio_mdreq_pool_init(dmc);
+	if (ret == 0)
+		ret = eio_journal_init(dmc);
+	if (ret == 0) {
+		eio_wb_rate_init(dmc);
+		eio_wb_rate_start(dmc);
+	}
 
 	if (ret < 0) {
 		pr_err("cache_create: Failed to initialize dirty lru set or" \
 		       "clean/mdupdate thread for wb cache.\n");
+		if (dmc->nr_cleaners) {
+			dmc->sysctl_active.fast_remove = 1;
+			mutex_lock(&dmc->cleaners_mutex);
+			eio_stop_clean_threads(dmc, 0);
+			mutex_unlock(&dmc->cleaners_mutex);
+			dmc->sysctl_active.fast_remove = 0;
+		}
 		if (dmc->dirty_set_lru) {
 			lru_uninit(dmc->dirty_set_lru);
 			dmc->dirty_set_lru = NULL;
 		}
-
-		eio_free_wb_pages(dmc->clean_mdpages, dmc->mdpage_count);
-		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
-				  dmc->block_size);
-		goto errout;
-	}
-
-	goto out;
-
-errout:
-	if (dmc->clean_mdpages) {
-		kfree(dmc->clean_mdpages);
-		dmc->clean_mdpages = NULL;
-		dmc->mdpage_count = 0;
-	}
-	if (dmc->clean_dbvecs) {
-		kfree(dmc->clean_dbvecs);
-		dmc->clean_dbvecs = NULL;
-		dmc->dbvec_count = 0;
+		if (dmc->mdupdate_q) {
+			destroy_workqueue(dmc->mdupdate_q);
+			dmc->mdupdate_q = NULL;
+		}
+		eio_mdreq_pool_exit(dmc);
+		eio_resize_clean_bufs(dmc, 0);
 	}
 
-out:
 	return ret;
 }
 
 void eio_free_wb_resources(struct cache_c *dmc)
 {
+	EIO_ASSERT(dmc->nr_cleaners == 0);
 
+	eio_journal_exit(dmc);
 	if (dmc->mdupdate_q) {
 		flush_workqueue(dmc->mdupdate_q);
 		destroy_workqueue(dmc->mdupdate_q);
 		dmc->mdupdate_q = NULL;
 	}
+	eio_mdreq_pool_exit(dmc);
 	if (dmc->dirty_set_lru) {
 		lru_uninit(dmc->dirty_set_lru);
 		dmc->dirty_set_lru = NULL;
 	}
-	if (dmc->clean_mdpages) {
-		eio_free_wb_pages(dmc->clean_mdpages, dmc->mdpage_count);
-		kfree(dmc->clean_mdpages);
-		dmc->clean_mdpages = NULL;
-	}
-	if (dmc->clean_dbvecs) {
-		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
-				  dmc->block_size);
-		kfree(dmc->clean_dbvecs);
-		dmc->clean_dbvecs = NULL;
-	}
-
-	dmc->dbvec_count = dmc->mdpage_count = 0;
+	eio_resize_clean_bufs(dmc, 0);
 	return;
 }
 
@@ -2555,14 +2894,20 @@ static int __init eio_init(void)
 	int r;
 	extern struct bus_type scsi_bus_type;
 
-	eio_ttc_init();
-	r = eio_create_misc_device();
+	r = eio_ttc_init();
 	if (r)
 		return r;
+	eio_scan_init();
+	r = eio_create_misc_device();
+	if (r) {
+		eio_ttc_exit();
+		return r;
+	}
 
 	r = eio_jobs_init();
 	if (r) {
 		(void)eio_delete_misc_device();
+		eio_ttc_exit();
 		return r;
 	}
 	atomic_set(&nr_cache_jobs, 0);
@@ -2573,6 +2918,7 @@ static int __init eio_init(void)
 	if (eio_control == NULL) {
 		pr_err("init: Cannot allocate memory for eio_control");
 		(void)eio_delete_misc_device();
+		eio_ttc_exit();
 		return -ENOMEM;
 	}
 	eio_control->synch_flags = 0;
@@ -2582,6 +2928,7 @@ static int __init eio_init(void)
 	if (r) {
 		pr_err("init: bus register notifier failed %d", r);
 		(void)eio_delete_misc_device();
+		eio_ttc_exit();
 	}
 	return r;
 }
@@ -2607,6 +2954,7 @@ static void eio_exit(void)
 		eio_control = NULL;
 	}
 	(void)eio_delete_misc_device();
+	eio_ttc_exit();
 }
 
 /*
@@ -80,6 +80,7 @@ int eio_fifo_cache_sets_init(struct eio_policy *p_ops)
 	dmc->sp_cache_set = vmalloc((size_t)order);
 	if (dmc->sp_cache_set == NULL)
 		return -ENOMEM;
+	p_ops->sp_mem_size += order;
 
 	cache_sets = (struct eio_fifo_cache_set *)dmc->sp_cache_set;
 
@@ -99,8 +100,8 @@ eio_fifo_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 			  index_t *index)
 {
 	index_t end_index;
-	int slots_searched = 0;
 	index_t i;
+	index_t found;
 	index_t set;
 	struct eio_fifo_cache_set *cache_sets;
 	struct cache_c *dmc = p_ops->sp_dmc;
@@ -110,17 +111,16 @@ eio_fifo_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 	cache_sets = (struct eio_fifo_cache_set *)dmc->sp_cache_set;
 
 	i = cache_sets[set].set_fifo_next;
-	while (slots_searched < (int)dmc->assoc) {
-		EIO_ASSERT(i >= start_index);
-		EIO_ASSERT(i < end_index);
-		if (EIO_CACHE_STATE_GET(dmc, i) == VALID) {
-			*index = i;
-			break;
-		}
-		slots_searched++;
-		i++;
-		if (i == end_index)
-			i = start_index;
+	EIO_ASSERT(i >= start_index);
+	EIO_ASSERT(i < end_index);
+
+	/* Look for a VALID block from set_fifo_next on, wrapping around */
+	found = eio_scan_state(dmc, i, end_index - i, VALID);
+	if (found == -1 && i > start_index)
+		found = eio_scan_state(dmc, start_index, i - start_index, VALID);
+	if (found != -1) {
+		*index = found;
+		i = found;
 	}
 	i++;
 	if (i == end_index)
@@ -134,29 +134,44 @@ eio_fifo_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 int eio_fifo_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 {
 	index_t i;
-	int scanned = 0, nr_writes = 0;
+	int nr_writes = 0;
 	index_t start_index;
-	index_t end_index;
+	unsigned long *dirty_map;
+	unsigned long bit, from, to;
 	struct eio_fifo_cache_set *cache_sets;
 	struct cache_c *dmc;
 
 	dmc = p_ops->sp_dmc;
 	cache_sets = (struct eio_fifo_cache_set *)dmc->sp_cache_set;
 	start_index = set * dmc->assoc;
-	end_index = start_index + dmc->assoc;
+	dirty_map = EIO_SET_DIRTY_MAP(dmc, set);
 	i = cache_sets[set].set_clean_next;
 
-	while ((scanned < (int)dmc->assoc) && (nr_writes < to_clean)) {
-		if ((EIO_CACHE_STATE_GET(dmc, i) & (DIRTY | BLOCK_IO_INPROG)) ==
-		    DIRTY) {
-			EIO_CACHE_STATE_ON(dmc, i, DISKWRITEINPROG);
-			nr_writes++;
+	/*
+	 * Walk the dirty blocks from set_clean_next to the end of
+	 * the set, then wrap around to the start of the set.
+	 */
+	from = i - start_index;
+	to = dmc->assoc;
+	while (nr_writes < to_clean) {
+		for (bit = find_next_bit(dirty_map, to, from);
+		     bit < to && nr_writes < to_clean;
+		     bit = find_next_bit(dirty_map, to, bit + 1)) {
+			if ((EIO_CACHE_STATE_GET(dmc, start_index + bit) &
+			     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+				EIO_CACHE_STATE_ON(dmc, start_index + bit,
+						   DISKWRITEINPROG);
+				nr_writes++;
+				i = start_index + bit + 1;
+			}
 		}
-		scanned++;
-		i++;
-		if (i == end_index)
-			i = start_index;
+		if (to != dmc->assoc || from == 0)
+			break;
+		to = from;
+		from = 0;
 	}
+	if (i == start_index + dmc->assoc)
+		i = start_index;
 	cache_sets[set].set_clean_next = i;
 
 	return nr_writes;
@@ -193,6 +208,7 @@ struct eio_policy *eio_fifo_instance_init(void)
 	new_instance->sp_find_reclaim_dbn = eio_fifo_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_fifo_clean_set;
 	new_instance->sp_dmc = NULL;
+	new_instance->sp_mem_size = 0;
 
 	try_module_get(THIS_MODULE);
 
@@ -0,0 +1,927 @@
+/*
+ *  eio_journal.c
+ *
+ *  Metadata journal of a write-back cache. Without it, every block made
+ *  dirty is followed by an in-place write of the metadata sectors of
+ *  its set, and every clean of a set by a write of the set's metadata:
+ *  small random writes which double the SSD writes of a write-back
+ *  cache.
+ *
+ *  With it, the dirty (VALID | DIRTY) and clean (INVALID) transitions
+ *  of all the sets are appended as 16 byte records to a circular
+ *  journal next to the superblock. Commits are serialized: while one
+ *  is on the SSD the next group builds up, so a commit of many blocks
+ *  costs one journal write. The in-core metadata is updated when the
+ *  commit completes, as eio_post_mdupdate() does for an in-place update.
+ *
+ *  Once half the journal is in use, a checkpoint writes the metadata of
+ *  the sets with records in the journal in place and advances the
+ *  "journal_ckpt_seq" of the superblock. eio_md_load() replays the
+ *  journal sectors past it, in order, on top of the metadata.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/crc32.h>
+#include "eio.h"
+#include "eio_ttc.h"
+
+/*
+ * Size in MB of the metadata journal of new caches. 0 keeps the
+ * in-place metadata updates. It is recorded in the superblock and
+ * can't change over the life of a cache.
+ */
+static unsigned int md_journal;
+module_param(md_journal, uint, 0644);
+MODULE_PARM_DESC(md_journal,
+		 "Metadata journal size in MB of new write-back caches, 0 for none");
+
+#define EIO_JOURNAL_MAX_MB      1024
+#define EIO_JOURNAL_BATCH       64      /* sectors in a commit */
+
+struct eio_journal {
+	struct cache_c *dmc;
+	spinlock_t lock;                /* protects the fields down to idle_wait */
+	struct eio_bio *pending;        /* ebios to be marked dirty */
+	struct eio_bio **pending_tail;
+	struct list_head clean_pending; /* struct eio_journal_clean */
+	u_int64_t head_seq;             /* seq of the next sector */
+	u_int64_t durable_seq;          /* last sector written */
+	u_int64_t ckpt_seq;             /* last sector in the metadata */
+	unsigned long *touched;         /* sets with records past ckpt_seq */
+	int commit_busy;                /* a commit is queued or in flight */
+	int ckpt_busy;                  /* a checkpoint is queued or running */
+	int need_space;                 /* the next commit waits for a checkpoint */
+	int failed;                     /* a journal write failed */
+	wait_queue_head_t idle_wait;
+
+	/* The commit in flight */
+	struct work_struct commit_work;
+	struct work_struct done_work;
+	struct eio_bio *commit_ebios;
+	struct list_head commit_cleans;
+	u_int64_t commit_seq;
+	unsigned commit_sectors;
+	unsigned commit_records;
+	u_int32_t *commit_sets;         /* sets of the records */
+	unsigned commit_nr_sets;
+	atomic_t commit_ios;
+	int commit_error;
+	unsigned max_sectors;
+	unsigned nr_pages;
+	struct page **pages;
+	struct bio_vec *bvecs;          /* two runs of nr_pages + 1 */
+
+	/* The checkpoint */
+	struct work_struct ckpt_work;
+	unsigned long *ckpt_sets;
+	unsigned ckpt_nr_pages;
+	struct page **ckpt_pages;
+};
+
+static void eio_journal_commit(struct work_struct *work);
+static void eio_journal_commit_done(struct work_struct *work);
+static void eio_journal_checkpoint(struct work_struct *work);
+
+/* A commit holds at least the records of a whole set */
+static unsigned eio_journal_max_sectors(struct cache_c *dmc)
+{
+	return max_t(unsigned, EIO_JOURNAL_BATCH,
+		     DIV_ROUND_UP(dmc->assoc, EIO_JOURNAL_RECORDS));
+}
+
+/*
+ * eio_journal_size
+ *
+ * Journal sectors of a cache being created, a multiple of 8K.
+ */
+u_int64_t eio_journal_size(struct cache_c *dmc)
+{
+	u_int64_t sectors;
+
+	if (!md_journal)
+		return 0;
+	sectors = (u_int64_t)min_t(unsigned, md_journal, EIO_JOURNAL_MAX_MB)
+		  << (20 - SECTOR_SHIFT);
+	return max_t(u_int64_t, sectors,
+		     roundup(4 * eio_journal_max_sectors(dmc), 16));
+}
+
+static struct eio_journal_sector *eio_journal_sector(struct eio_journal *j,
+						     unsigned k)
+{
+	return page_address(j->pages[k / SECTORS_PER_PAGE]) +
+	       ((k % SECTORS_PER_PAGE) << SECTOR_SHIFT);
+}
+
+static int eio_journal_sector_ok(struct cache_c *dmc,
+				 struct eio_journal_sector *js, u_int64_t seq)
+{
+	u_int32_t crc;
+
+	if (le32_to_cpu(js->magic) != EIO_JOURNAL_MAGIC ||
+	    le32_to_cpu(js->journal_id) != dmc->journal_id ||
+	    le64_to_cpu(js->seq) != seq ||
+	    le32_to_cpu(js->nr_records) > EIO_JOURNAL_RECORDS)
+		return 0;
+	crc = le32_to_cpu(js->crc);
+	js->crc = 0;
+	return crc32_le(~0, (unsigned char *)js, sizeof(*js)) == crc;
+}
+
+/*
+ * Write the metadata of a set in place. A block being dirtied has no
+ * record in the journal yet and a block being cleaned is still dirty
+ * until its record is, as in eio_clean_commit().
+ */
+static int eio_journal_write_set(struct cache_c *dmc, index_t set,
+				 struct page **pages, int nr_pages)
+{
+	struct flash_cacheblock *md_blocks = NULL;
+	struct eio_io_region where;
+	unsigned long flags = 0;
+	index_t start_index = set * dmc->assoc;
+	index_t i;
+	u_int8_t cache_state;
+	unsigned k;
+
+	/* The set locks are not there yet when the journal is replayed */
+	if (dmc->set_locks)
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+	for (k = 0; k < dmc->assoc; k++) {
+		if (k % MD_BLOCKS_PER_PAGE == 0)
+			md_blocks = page_address(pages[k / MD_BLOCKS_PER_PAGE]);
+		i = start_index + k;
+		cache_state = EIO_CACHE_STATE_GET(dmc, i);
+		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+		if (cache_state == ALREADY_DIRTY || cache_state == CLEAN_INPROG)
+			md_blocks->cache_state = cpu_to_le64(VALID | DIRTY);
+		else
+			md_blocks->cache_state = cpu_to_le64(INVALID);
+		md_blocks++;
+	}
+	if (dmc->set_locks)
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index);
+	where.count = eio_to_sector(dmc->assoc * sizeof(struct flash_cacheblock));
+	EIO_STATS_INC(dmc, md_ssd_writes);
+	EIO_STATS_ADD(dmc, journal_ckpt_sectors, where.count);
+	return eio_io_sync_pages(dmc, &where, WRITE, pages, nr_pages);
+}
+
+/* Called with the journal lock held */
+static void eio_journal_kick(struct eio_journal *j)
+{
+	if (j->commit_busy || j->need_space)
+		return;
+	if (!j->pending && list_empty(&j->clean_pending))
+		return;
+	j->commit_busy = 1;
+	queue_work(j->dmc->mdupdate_q, &j->commit_work);
+}
+
+/* Called with the journal lock held */
+static void eio_journal_kick_ckpt(struct eio_journal *j)
+{
+	if (j->ckpt_busy)
+		return;
+	j->ckpt_busy = 1;
+	queue_work(j->dmc->mdupdate_q, &j->ckpt_work);
+}
+
+static int eio_journal_idle(struct eio_journal *j)
+{
+	unsigned long flags;
+	int idle;
+
+	spin_lock_irqsave(&j->lock, flags);
+	idle = !j->commit_busy && !j->ckpt_busy && !j->pending &&
+	       list_empty(&j->clean_pending);
+	spin_unlock_irqrestore(&j->lock, flags);
+	return idle;
+}
+
+/* Fail everything waiting for a commit, once the journal has failed */
+static void eio_journal_fail(struct eio_journal *j)
+{
+	struct eio_journal_clean *req, *nreq;
+	struct eio_bio *ebio;
+	unsigned long flags;
+	LIST_HEAD(cleans);
+
+	spin_lock_irqsave(&j->lock, flags);
+	ebio = j->pending;
+	j->pending = NULL;
+	j->pending_tail = &j->pending;
+	list_splice_init(&j->clean_pending, &cleans);
+	j->commit_busy = 0;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	eio_mdupdate_done(j->dmc, ebio, -EIO);
+	list_for_each_entry_safe(req, nreq, &cleans, list) {
+		list_del(&req->list);
+		req->error = -EIO;
+		req->notify(req->error, req->context);
+	}
+	wake_up(&j->idle_wait);
+}
+
+static void eio_journal_add(struct eio_journal *j, index_t index,
+			    u_int8_t cache_state, u_int32_t set)
+{
+	struct eio_journal_sector *js;
+	struct eio_journal_record *rec;
+
+	js = eio_journal_sector(j, j->commit_records / EIO_JOURNAL_RECORDS);
+	rec = &js->records[j->commit_records % EIO_JOURNAL_RECORDS];
+	rec->index_state = cpu_to_le64(((u_int64_t)index << 8) | cache_state);
+	rec->dbn = cpu_to_le64(EIO_DBN_GET(j->dmc, index));
+	j->commit_records++;
+	if (!j->commit_nr_sets || j->commit_sets[j->commit_nr_sets - 1] != set)
+		j->commit_sets[j->commit_nr_sets++] = set;
+}
+
+/*
+ * Build the sectors of a commit. The blocks of the cleans and of the
+ * ebios are all in progress, their state can't change under us.
+ */
+static void eio_journal_build(struct eio_journal *j)
+{
+	struct cache_c *dmc = j->dmc;
+	struct eio_journal_clean *req;
+	struct eio_journal_sector *js;
+	struct eio_bio *ebio;
+	unsigned long bit;
+	unsigned k, nr_records;
+	index_t i;
+
+	for (k = 0; k < j->commit_sectors; k++)
+		memset(eio_journal_sector(j, k), 0, sizeof(*js));
+
+	j->commit_records = 0;
+	j->commit_nr_sets = 0;
+	list_for_each_entry(req, &j->commit_cleans, list) {
+		for_each_set_bit(bit, EIO_SET_DIRTY_MAP(dmc, req->set),
+				 dmc->assoc) {
+			i = req->set * dmc->assoc + bit;
+			if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
+				eio_journal_add(j, i, INVALID, req->set);
+		}
+	}
+	for (ebio = j->commit_ebios; ebio; ebio = ebio->eb_next)
+		eio_journal_add(j, ebio->eb_index, VALID | DIRTY,
+				ebio->eb_cacheset);
+	EIO_ASSERT(DIV_ROUND_UP(j->commit_records, EIO_JOURNAL_RECORDS) ==
+		   j->commit_sectors);
+
+	nr_records = j->commit_records;
+	for (k = 0; k < j->commit_sectors; k++) {
+		js = eio_journal_sector(j, k);
+		js->magic = cpu_to_le32(EIO_JOURNAL_MAGIC);
+		js->journal_id = cpu_to_le32(dmc->journal_id);
+		js->seq = cpu_to_le64(j->commit_seq + k);
+		js->nr_records = cpu_to_le32(min_t(unsigned, nr_records,
+						   EIO_JOURNAL_RECORDS));
+		nr_records -= le32_to_cpu(js->nr_records);
+		js->crc = cpu_to_le32(crc32_le(~0, (unsigned char *)js,
+					       sizeof(*js)));
+	}
+}
+
+/* bvecs for sectors [k, k + count) of the commit */
+static unsigned eio_journal_bvecs(struct eio_journal *j, struct bio_vec *bvecs,
+				  unsigned k, unsigned count)
+{
+	unsigned nr_bvecs = 0;
+	unsigned len;
+
+	while (count) {
+		len = min_t(unsigned, count,
+			    SECTORS_PER_PAGE - k % SECTORS_PER_PAGE);
+		bvecs[nr_bvecs].bv_page = j->pages[k / SECTORS_PER_PAGE];
+		bvecs[nr_bvecs].bv_offset = (k % SECTORS_PER_PAGE) << SECTOR_SHIFT;
+		bvecs[nr_bvecs].bv_len = len << SECTOR_SHIFT;
+		nr_bvecs++;
+		k += len;
+		count -= len;
+	}
+	return nr_bvecs;
+}
+
+static void eio_journal_io_done(int error, void *context)
+{
+	struct eio_journal *j = (struct eio_journal *)context;
+
+	if (error && !j->commit_error)
+		j->commit_error = error;
+	if (!atomic_dec_and_test(&j->commit_ios))
+		return;
+	queue_work(j->dmc->mdupdate_q, &j->done_work);
+}
+
+/* Write a commit, in two I/Os if it wraps around the end of the journal */
+static void eio_journal_write(struct eio_journal *j)
+{
+	struct cache_c *dmc = j->dmc;
+	struct eio_io_region where;
+	struct eio_io_request req;
+	struct bio_vec *bvecs;
+	u_int32_t pos, count;
+	unsigned k, run, nr_runs;
+	int error;
+
+	pos = EIO_REM(j->commit_seq, dmc->journal_sectors);
+	count = min_t(u_int32_t, j->commit_sectors, dmc->journal_sectors - pos);
+	nr_runs = (count < j->commit_sectors) ? 2 : 1;
+
+	EIO_STATS_INC(dmc, journal_commits);
+	EIO_STATS_ADD(dmc, journal_records, j->commit_records);
+	EIO_STATS_ADD(dmc, journal_sectors, j->commit_sectors);
+	EIO_STATS_ADD(dmc, md_ssd_writes, nr_runs);
+
+	j->commit_error = 0;
+	atomic_set(&j->commit_ios, nr_runs);
+	k = 0;
+	for (run = 0; run < nr_runs; run++) {
+		bvecs = j->bvecs + run * (j->nr_pages + 1);
+		memset((char *)&req, 0, sizeof(req));
+		req.mtype = EIO_BVECS;
+		req.dptr.pages = bvecs;
+		req.num_bvecs = eio_journal_bvecs(j, bvecs, k, count);
+		req.notify = eio_journal_io_done;
+		req.context = j;
+		req.hddio = 0;
+
+		where.bdev = dmc->cache_dev->bdev;
+		where.sector = dmc->journal_start_sect + pos;
+		where.count = count;
+		k += count;
+		pos = 0;
+		count = j->commit_sectors - k;
+
+		if (unlikely(CACHE_DEGRADED_IS_SET(dmc)))
+			error = -ENODEV;
+		else
+			error = eio_do_io(dmc, &where, WRITE, &req);
+		if (error)
+			eio_journal_io_done(error, j);
+	}
+	eio_unplug_cache_device(dmc);
+}
+
+/*
+ * eio_journal_commit
+ *
+ * Take the cleans and the ebios waiting, as many as fit in a commit
+ * and in the free part of the journal, and write their records.
+ */
+static void eio_journal_commit(struct work_struct *work)
+{
+	struct eio_journal *j;
+	struct cache_c *dmc;
+	struct eio_journal_clean *req;
+	struct eio_bio *ebio;
+	struct eio_bio **tail;
+	unsigned long flags;
+	u_int64_t space;
+	unsigned max_records;
+	unsigned nr_records = 0;
+
+	j = container_of(work, struct eio_journal, commit_work);
+	dmc = j->dmc;
+
+	spin_lock_irqsave(&j->lock, flags);
+	EIO_ASSERT(j->commit_busy);
+	if (unlikely(j->failed)) {
+		spin_unlock_irqrestore(&j->lock, flags);
+		eio_journal_fail(j);
+		return;
+	}
+
+	/* Sectors up to ckpt_seq + journal_sectors may be written */
+	space = j->ckpt_seq + dmc->journal_sectors - (j->head_seq - 1);
+	max_records = (unsigned)min_t(u_int64_t, space, j->max_sectors) *
+		      EIO_JOURNAL_RECORDS;
+
+	while (!list_empty(&j->clean_pending)) {
+		req = list_first_entry(&j->clean_pending,
+				       struct eio_journal_clean, list);
+		if (nr_records + req->nr_records > max_records)
+			break;
+		list_move_tail(&req->list, &j->commit_cleans);
+		nr_records += req->nr_records;
+	}
+	tail = &j->commit_ebios;
+	while (j->pending && nr_records < max_records) {
+		ebio = j->pending;
+		j->pending = ebio->eb_next;
+		ebio->eb_next = NULL;
+		*tail = ebio;
+		tail = &ebio->eb_next;
+		nr_records++;
+	}
+	if (!j->pending)
+		j->pending_tail = &j->pending;
+
+	if (!nr_records) {
+		/* Out of space, the checkpoint restarts us */
+		j->commit_busy = 0;
+		j->need_space = 1;
+		eio_journal_kick_ckpt(j);
+		spin_unlock_irqrestore(&j->lock, flags);
+		return;
+	}
+
+	j->commit_seq = j->head_seq;
+	j->commit_sectors = DIV_ROUND_UP(nr_records, EIO_JOURNAL_RECORDS);
+	j->head_seq += j->commit_sectors;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	eio_journal_build(j);
+	eio_journal_write(j);
+}
+
+/*
+ * eio_journal_commit_done
+ *
+ * Update the in-core metadata of a commit before it counts as durable,
+ * so that a checkpoint covering it sees the new states. Then end the
+ * cleans and the I/Os and start the next commit.
+ */
+static void eio_journal_commit_done(struct work_struct *work)
+{
+	struct eio_journal *j;
+	struct cache_c *dmc;
+	struct eio_journal_clean *req, *nreq;
+	struct cache_set *set;
+	unsigned long flags;
+	unsigned long bit;
+	index_t i;
+	unsigned k;
+	int error;
+
+	j = container_of(work, struct eio_journal, done_work);
+	dmc = j->dmc;
+	error = j->commit_error;
+
+	list_for_each_entry(req, &j->commit_cleans, list) {
+		req->error = error;
+		if (error)
+			continue;
+		set = &dmc->cache_sets[req->set];
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, req->set), flags);
+		for_each_set_bit(bit, EIO_SET_DIRTY_MAP(dmc, req->set),
+				 dmc->assoc) {
+			i = req->set * dmc->assoc + bit;
+			if (EIO_CACHE_STATE_GET(dmc, i) != CLEAN_INPROG)
+				continue;
+			EIO_CACHE_STATE_SET(dmc, i, VALID);
+			EIO_ASSERT(set->nr_dirty > 0);
+			set->nr_dirty--;
+			atomic64_dec(&dmc->nr_dirty);
+		}
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, req->set), flags);
+	}
+	eio_mdupdate_done(dmc, j->commit_ebios, error);
+	j->commit_ebios = NULL;
+
+	spin_lock_irqsave(&j->lock, flags);
+	if (unlikely(error)) {
+		/*
+		 * The sectors may or may not be on the SSD. Writing more
+		 * after them could make stale records replayable.
+		 */
+		if (!j->failed)
+			pr_err("journal: Metadata journal write failed (error %d) for cache \"%s\"",
+			       error, dmc->cache_name);
+		j->failed = 1;
+	} else {
+		for (k = 0; k < j->commit_nr_sets; k++)
+			__set_bit(j->commit_sets[k], j->touched);
+		j->durable_seq = j->commit_seq + j->commit_sectors - 1;
+		if (j->durable_seq - j->ckpt_seq >= dmc->journal_sectors / 2)
+			eio_journal_kick_ckpt(j);
+	}
+	j->commit_busy = 0;
+	eio_journal_kick(j);
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	list_for_each_entry_safe(req, nreq, &j->commit_cleans, list) {
+		list_del(&req->list);
+		req->notify(req->error, req->context);
+	}
+	wake_up(&j->idle_wait);
+}
+
+/*
+ * eio_journal_checkpoint
+ *
+ * Write in place the metadata of the sets with records up to the
+ * last durable sector, then record it as the checkpoint. Commits go on
+ * meanwhile: a set changed again is written with its newer state,
+ * whose records are replayed after the checkpoint anyway.
+ */
+static void eio_journal_checkpoint(struct work_struct *work)
+{
+	struct eio_journal *j;
+	struct cache_c *dmc;
+	unsigned long *sets;
+	unsigned long flags;
+	unsigned long set;
+	u_int64_t end_seq;
+	int error = 0;
+
+	j = container_of(work, struct eio_journal, ckpt_work);
+	dmc = j->dmc;
+
+	spin_lock_irqsave(&j->lock, flags);
+	sets = j->touched;
+	j->touched = j->ckpt_sets;
+	j->ckpt_sets = sets;
+	end_seq = j->durable_seq;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	for_each_set_bit(set, sets, dmc->num_sets) {
+		error = eio_journal_write_set(dmc, set, j->ckpt_pages,
+					      j->ckpt_nr_pages);
+		if (error)
+			break;
+		clear_bit(set, sets);
+	}
+
+	/*
+	 * The journal sectors past the old checkpoint may be overwritten
+	 * only once the superblock has the new one.
+	 */
+	if (!error && end_seq != dmc->journal_ckpt_seq) {
+		dmc->journal_ckpt_seq = end_seq;
+		error = eio_sb_store(dmc);
+	}
+	EIO_STATS_INC(dmc, journal_checkpoints);
+
+	spin_lock_irqsave(&j->lock, flags);
+	if (unlikely(error)) {
+		bitmap_or(j->touched, j->touched, sets, dmc->num_sets);
+		bitmap_zero(sets, dmc->num_sets);
+		if (!j->failed)
+			pr_err("journal: Metadata checkpoint failed (error %d) for cache \"%s\"",
+			       error, dmc->cache_name);
+		j->failed = 1;
+	} else
+		j->ckpt_seq = end_seq;
+	j->ckpt_busy = 0;
+	if (j->need_space) {
+		j->need_space = 0;
+		eio_journal_kick(j);
+	}
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	wake_up(&j->idle_wait);
+}
+
+/*
+ * eio_journal_enq
+ *
+ * Queue a list of ebios, linked by eb_next, to mark their blocks
+ * dirty. Replaces the mdreqs of eio_enq_mdupdate().
+ */
+void eio_journal_enq(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	struct eio_journal *j = dmc->journal;
+	struct eio_bio *last;
+	unsigned long flags;
+
+	if (!ebio)
+		return;
+	for (last = ebio; last->eb_next; last = last->eb_next)
+		;
+
+	spin_lock_irqsave(&j->lock, flags);
+	*j->pending_tail = ebio;
+	j->pending_tail = &last->eb_next;
+	eio_journal_kick(j);
+	spin_unlock_irqrestore(&j->lock, flags);
+}
+
+/*
+ * eio_journal_clean
+ *
+ * Queue the clean of the CLEAN_INPROG blocks of req->set. App writes to
+ * the other blocks of the set may go on, their records are of blocks
+ * of their own. Cleans queued meanwhile go in the same commit. req->notify is called once it is durable, with the
+ * blocks VALID, or has failed.
+ */
+void eio_journal_clean(struct cache_c *dmc, struct eio_journal_clean *req)
+{
+	struct eio_journal *j = dmc->journal;
+	unsigned long flags;
+	unsigned long bit;
+
+	req->nr_records = 0;
+	req->error = 0;
+	for_each_set_bit(bit, EIO_SET_DIRTY_MAP(dmc, req->set), dmc->assoc)
+		if (EIO_CACHE_STATE_GET(dmc, req->set * dmc->assoc + bit) ==
+		    CLEAN_INPROG)
+			req->nr_records++;
+	if (!req->nr_records) {
+		req->notify(0, req->context);
+		return;
+	}
+
+	spin_lock_irqsave(&j->lock, flags);
+	list_add_tail(&req->list, &j->clean_pending);
+	eio_journal_kick(j);
+	spin_unlock_irqrestore(&j->lock, flags);
+}
+
+/*
+ * eio_journal_sync
+ *
+ * Called by eio_md_store() before it writes all the metadata, which
+ * then covers every journal sector.
+ */
+void eio_journal_sync(struct cache_c *dmc)
+{
+	struct eio_journal *j = dmc->journal;
+	unsigned long flags;
+
+	if (j) {
+		wait_event(j->idle_wait, eio_journal_idle(j));
+		spin_lock_irqsave(&j->lock, flags);
+		j->ckpt_seq = j->durable_seq = j->head_seq - 1;
+		bitmap_zero(j->touched, dmc->num_sets);
+		dmc->journal_head_seq = j->head_seq;
+		spin_unlock_irqrestore(&j->lock, flags);
+	}
+	dmc->journal_ckpt_seq = dmc->journal_head_seq - 1;
+}
+
+static void eio_journal_free(struct eio_journal *j)
+{
+	if (j->ckpt_pages) {
+		if (j->ckpt_pages[0])
+			eio_free_wb_pages(j->ckpt_pages, j->ckpt_nr_pages);
+		kfree(j->ckpt_pages);
+	}
+	if (j->pages) {
+		if (j->pages[0])
+			eio_free_wb_pages(j->pages, j->nr_pages);
+		kfree(j->pages);
+	}
+	kfree(j->bvecs);
+	if (j->commit_sets)
+		vfree(j->commit_sets);
+	if (j->touched)
+		vfree(j->touched);
+	if (j->ckpt_sets)
+		vfree(j->ckpt_sets);
+	kfree(j);
+}
+
+/*
+ * eio_journal_init
+ *
+ * Start the journal of a write-back cache, if it has one. Called
+ * once mdupdate_q exists.
+ */
+int eio_journal_init(struct cache_c *dmc)
+{
+	struct eio_journal *j;
+	size_t bitmap_size;
+
+	EIO_ASSERT(dmc->journal == NULL);
+	if (!dmc->journal_sectors)
+		return 0;
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (j == NULL)
+		goto nomem;
+	j->dmc = dmc;
+	spin_lock_init(&j->lock);
+	j->pending_tail = &j->pending;
+	INIT_LIST_HEAD(&j->clean_pending);
+	INIT_LIST_HEAD(&j->commit_cleans);
+	init_waitqueue_head(&j->idle_wait);
+	INIT_WORK(&j->commit_work, eio_journal_commit);
+	INIT_WORK(&j->done_work, eio_journal_commit_done);
+	INIT_WORK(&j->ckpt_work, eio_journal_checkpoint);
+	j->head_seq = dmc->journal_head_seq;
+	j->durable_seq = j->head_seq - 1;
+	j->ckpt_seq = dmc->journal_ckpt_seq;
+
+	j->max_sectors = eio_journal_max_sectors(dmc);
+	j->nr_pages = DIV_ROUND_UP(j->max_sectors, SECTORS_PER_PAGE);
+	j->pages = kcalloc(j->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	j->bvecs = kcalloc(2 * (j->nr_pages + 1), sizeof(struct bio_vec),
+			   GFP_KERNEL);
+	j->commit_sets = vmalloc(j->max_sectors * EIO_JOURNAL_RECORDS *
+				 sizeof(u_int32_t));
+	j->ckpt_nr_pages =
+		IO_PAGE_COUNT(dmc->assoc * sizeof(struct flash_cacheblock));
+	j->ckpt_pages = kcalloc(j->ckpt_nr_pages, sizeof(struct page *),
+				GFP_KERNEL);
+	bitmap_size = BITS_TO_LONGS(dmc->num_sets) * sizeof(unsigned long);
+	j->touched = vmalloc(bitmap_size);
+	j->ckpt_sets = vmalloc(bitmap_size);
+	if (!j->pages || !j->bvecs || !j->commit_sets || !j->ckpt_pages ||
+	    !j->touched || !j->ckpt_sets)
+		goto nomem;
+	memset(j->ckpt_sets, 0, bitmap_size);
+	/*
+	 * A journal stopped after a failure may have records past its
+	 * checkpoint, of sets we don't know. Checkpoint them all.
+	 */
+	if (j->ckpt_seq != j->durable_seq)
+		bitmap_fill(j->touched, dmc->num_sets);
+	else
+		memset(j->touched, 0, bitmap_size);
+
+	if (eio_alloc_wb_pages(j->pages, j->nr_pages)) {
+		j->pages[0] = NULL;
+		goto nomem;
+	}
+	if (eio_alloc_wb_pages(j->ckpt_pages, j->ckpt_nr_pages)) {
+		j->ckpt_pages[0] = NULL;
+		goto nomem;
+	}
+
+	dmc->journal = j;
+	pr_info("journal: Cache \"%s\" has a %lluKB metadata journal",
+		dmc->cache_name,
+		(unsigned long long)dmc->journal_sectors >> 1);
+	return 0;
+
+nomem:
+	pr_err("journal: Failed to allocate the metadata journal of cache \"%s\"",
+	       dmc->cache_name);
+	if (j)
+		eio_journal_free(j);
+	return -ENOMEM;
+}
+
+/*
+ * eio_journal_exit
+ *
+ * Stop the journal, once no writes are coming in. The records still
+ * in it are checkpointed so that a restarted journal only needs to
+ * know about its own.
+ */
+void eio_journal_exit(struct cache_c *dmc)
+{
+	struct eio_journal *j = dmc->journal;
+
+	if (j == NULL)
+		return;
+
+	wait_event(j->idle_wait, eio_journal_idle(j));
+	if (j->durable_seq != j->ckpt_seq && !j->failed) {
+		j->ckpt_busy = 1;
+		eio_journal_checkpoint(&j->ckpt_work);
+	}
+	dmc->journal_head_seq = j->head_seq;
+	dmc->journal = NULL;
+	eio_journal_free(j);
+}
+
+/*
+ * eio_journal_replay
+ *
+ * Apply the journal sectors past the checkpoint to the metadata loaded
+ * by eio_md_load(), from the first one on and as long as they follow
+ * each other. The sets they touch are written back in place right
+ * away and the checkpoint moved past them, so that the records never
+ * have to be replayed again.
+ */
+int eio_journal_replay(struct cache_c *dmc, int *num_valid, int *num_dirty)
+{
+	struct eio_journal_sector *js;
+	struct eio_journal_record *rec;
+	struct eio_io_region where;
+	struct page *page = NULL;
+	struct page **md_pages = NULL;
+	unsigned long *sets = NULL;
+	unsigned long set;
+	unsigned md_nr_pages = 0;
+	u_int64_t seq, end_seq, replayed = 0;
+	u_int64_t index_state;
+	u_int32_t pos, count, k, r;
+	u_int8_t cache_state;
+	index_t index;
+	size_t bitmap_size;
+	int error = 0;
+
+	seq = dmc->journal_ckpt_seq + 1;
+	if (!dmc->journal_sectors) {
+		dmc->journal_head_seq = seq;
+		return 0;
+	}
+	end_seq = dmc->journal_ckpt_seq + dmc->journal_sectors;
+
+	md_nr_pages = IO_PAGE_COUNT(dmc->assoc * sizeof(struct flash_cacheblock));
+	md_pages = kcalloc(md_nr_pages, sizeof(struct page *), GFP_KERNEL);
+	bitmap_size = BITS_TO_LONGS(dmc->num_sets) * sizeof(unsigned long);
+	sets = vmalloc(bitmap_size);
+	page = alloc_page(GFP_KERNEL);
+	if (!md_pages || !sets || !page ||
+	    eio_alloc_wb_pages(md_pages, md_nr_pages)) {
+		pr_err("journal_replay: System memory too low.");
+		if (md_pages)
+			md_pages[0] = NULL;
+		error = -ENOMEM;
+		goto out;
+	}
+	memset(sets, 0, bitmap_size);
+
+	where.bdev = dmc->cache_dev->bdev;
+	while (seq <= end_seq) {
+		pos = EIO_REM(seq, dmc->journal_sectors);
+		count = min_t(u_int32_t, SECTORS_PER_PAGE,
+			      dmc->journal_sectors - pos);
+		where.sector = dmc->journal_start_sect + pos;
+		where.count = count;
+		error = eio_io_sync_pages(dmc, &where, READ, &page, 1);
+		if (error) {
+			pr_err("journal_replay: Could not read journal sector %llu error %d",
+			       (unsigned long long)where.sector, error);
+			goto out;
+		}
+
+		for (k = 0; k < count && seq <= end_seq; k++, seq++) {
+			js = page_address(page) + (k << SECTOR_SHIFT);
+			if (!eio_journal_sector_ok(dmc, js, seq))
+				goto replayed;
+			for (r = 0; r < le32_to_cpu(js->nr_records); r++) {
+				rec = &js->records[r];
+				index_state = le64_to_cpu(rec->index_state);
+				index = index_state >> 8;
+				cache_state = index_state & 0xff;
+				if (index >= (index_t)dmc->size) {
+					pr_err("journal_replay: Bad block %llu in journal sector %llu",
+					       (unsigned long long)index,
+					       (unsigned long long)seq);
+					error = -EINVAL;
+					goto out;
+				}
+				if (EIO_CACHE_STATE_GET(dmc, index) & VALID)
+					(*num_valid)--;
+				if (EIO_CACHE_STATE_GET(dmc, index) & DIRTY)
+					(*num_dirty)--;
+				if (cache_state == (VALID | DIRTY)) {
+					EIO_CACHE_STATE_SET(dmc, index,
+							    ALREADY_DIRTY);
+					EIO_DBN_SET(dmc, index,
+						    le64_to_cpu(rec->dbn));
+					(*num_valid)++;
+					(*num_dirty)++;
+				} else
+					eio_invalidate_md(dmc, index);
+				__set_bit(EIO_DIV(index, dmc->assoc), sets);
+			}
+			replayed++;
+		}
+	}
+
+replayed:
+	for_each_set_bit(set, sets, dmc->num_sets) {
+		error = eio_journal_write_set(dmc, set, md_pages, md_nr_pages);
+		if (error) {
+			pr_err("journal_replay: Could not write metadata of set %lu error %d",
+			       set, error);
+			goto out;
+		}
+	}
+
+	/*
+	 * A commit cut short by a crash may have left sectors past the
+	 * last good one, skip them. A commit is at most max_sectors.
+	 */
+	dmc->journal_head_seq = seq + eio_journal_max_sectors(dmc);
+	dmc->journal_ckpt_seq = dmc->journal_head_seq - 1;
+	if (replayed)
+		pr_info("journal_replay: Replayed %llu metadata journal sectors",
+			(unsigned long long)replayed);
+
+out:
+	if (page)
+		__free_page(page);
+	if (md_pages) {
+		if (md_pages[0])
+			eio_free_wb_pages(md_pages, md_nr_pages);
+		kfree(md_pages);
+	}
+	if (sets)
+		vfree(sets);
+	return error;
+}
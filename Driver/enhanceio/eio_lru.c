@@ -93,6 +93,7 @@ int eio_lru_cache_sets_init(struct eio_policy *p_ops)
 	dmc->sp_cache_set = vmalloc((size_t)order);
 	if (dmc->sp_cache_set == NULL)
 		return -ENOMEM;
+	p_ops->sp_mem_size += order;
 
 	cache_sets = (struct eio_lru_cache_set *)dmc->sp_cache_set;
 
@@ -118,6 +119,7 @@ int eio_lru_cache_blk_init(struct eio_policy *p_ops)
 	dmc->sp_cache_blk = vmalloc((size_t)order);
 	if (dmc->sp_cache_blk == NULL)
 		return -ENOMEM;
+	p_ops->sp_mem_size += order;
 
 	return 0;
 }
@@ -145,6 +147,7 @@ struct eio_policy *eio_lru_instance_init(void)
 	new_instance->sp_find_reclaim_dbn = eio_lru_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_lru_clean_set;
 	new_instance->sp_dmc = NULL;
+	new_instance->sp_mem_size = 0;
 
 	try_module_get(THIS_MODULE);
 
@@ -56,6 +56,11 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio);
 static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio);
 static void eio_read(struct cache_c *dmc, struct bio_container *bc,
 		     struct eio_bio *ebegin);
+static void eio_readahead(struct cache_c *dmc, struct eio_io_region *where);
+static int eio_read_expand(struct cache_c *dmc, struct bio_container *bc,
+			   struct eio_bio *ebio);
+static void eio_read_expand_done(struct cache_c *dmc,
+				 struct bio_container *bc);
 static void eio_write(struct cache_c *dmc, struct bio_container *bc,
 		      struct eio_bio *ebegin);
 static int eio_inval_block(struct cache_c *dmc, sector_t iosector);
@@ -63,14 +68,20 @@ static void eio_enqueue_readfill(struct cache_c *dmc, struct kcached_job *job);
 static int eio_acquire_set_locks(struct cache_c *dmc, struct bio_container *bc);
 static int eio_release_io_resources(struct cache_c *dmc,
 				    struct bio_container *bc);
-static void eio_clean_set(struct cache_c *dmc, index_t set, int whole,
-			  int force);
+static void eio_clean_pipe_init(struct eio_clean_pipe *pipe,
+				struct cache_c *dmc);
+static void eio_clean_pipe_add(struct eio_clean_pipe *pipe, index_t set,
+			       int whole, int force);
+static void eio_clean_pipe_run(struct eio_clean_pipe *pipe, int wait);
+static void eio_clean_pipe_drain(struct eio_clean_pipe *pipe);
+static void eio_clean_sweep(struct cache_c *dmc, struct eio_clean_pipe *pipe);
 static void eio_do_mdupdate(struct work_struct *work);
 static void eio_mdupdate_callback(int error, void *context);
 static void eio_enq_mdupdate(struct bio_container *bc);
 static void eio_uncached_read_done(struct kcached_job *job);
 static void eio_addto_cleanq(struct cache_c *dmc, index_t set, int whole);
 static int eio_alloc_mdreqs(struct cache_c *, struct bio_container *);
+static void eio_put_mdreq(struct cache_c *, struct mdupdate_request *);
 static void eio_check_dirty_set_thresholds(struct cache_c *dmc, index_t set);
 static void eio_check_dirty_cache_thresholds(struct cache_c *dmc);
 static void eio_post_mdupdate(struct work_struct *work);
@@ -100,35 +111,86 @@ static void bc_put(struct bio_container *bc, unsigned int doneio)
 #endif 
 		dmc = bc->bc_dmc;
 
-		/* update iotime for latency */
+		/* update iotime for latency, of application I/O only */
 		data_dir = bio_data_dir(bc->bc_bio);
 		elapsed = (long)jiffies_to_msecs(jiffies - bc->bc_iotime);
 
-		if (data_dir == READ)
-			atomic64_add(elapsed, &dmc->eio_stats.rdtime_ms);
-		else
-			atomic64_add(elapsed, &dmc->eio_stats.wrtime_ms);
+		if (!bc->bc_bio_private) {
+			if (data_dir == READ)
+				EIO_STATS_ADD(dmc, rdtime_ms, elapsed);
+			else
+				EIO_STATS_ADD(dmc, wrtime_ms, elapsed);
+		}
 
 		bio_endio(bc->bc_bio, bc->bc_error);
-		atomic64_dec(&bc->bc_dmc->nr_ios);
-		kfree(bc);
+		/* The whole block read of a partial miss failed */
+		if (bc->bc_fill_bio)
+			bio_endio(bc->bc_fill_bio, 0);
+		this_cpu_dec(bc->bc_dmc->pcpu_stats->nr_ios);
+		mempool_free(bc, _bc_pool);
+	}
+}
+
+/*
+ * eio_alloc_ebio
+ *
+ * The first ebio of a bio_container is the one embedded in it, the
+ * others come from _ebio_pool. Only an ebio which needs more than
+ * EB_INLINE_BVECS bio_vecs of its own is kmalloc'ed.
+ */
+static struct eio_bio *eio_alloc_ebio(struct bio_container *bc, int nbvecs)
+{
+	struct eio_bio *ebio;
+
+	if (nbvecs > EB_INLINE_BVECS) {
+		ebio = kmalloc(sizeof(struct eio_bio) +
+			       nbvecs * sizeof(struct bio_vec), GFP_NOWAIT);
+		if (ebio)
+			ebio->eb_alloc = EB_ALLOC_KMALLOC;
+		return ebio;
+	}
+
+	if (!bc->bc_ebio_used) {
+		bc->bc_ebio_used = 1;
+		ebio = &bc->bc_ebio;
+		ebio->eb_alloc = EB_ALLOC_BC;
+		return ebio;
 	}
+
+	ebio = mempool_alloc(_ebio_pool, GFP_NOWAIT);
+	if (ebio)
+		ebio->eb_alloc = EB_ALLOC_POOL;
+	return ebio;
+}
+
+static void eio_free_ebio(struct eio_bio *ebio)
+{
+
+	/* An embedded ebio goes away with its bio_container */
+	if (ebio->eb_alloc == EB_ALLOC_POOL)
+		mempool_free(ebio, _ebio_pool);
+	else if (ebio->eb_alloc == EB_ALLOC_KMALLOC)
+		kfree(ebio);
 }
 
 static void eb_endio(struct eio_bio *ebio, int error)
 {
+	struct bio_container *bc = ebio->eb_bc;
+	unsigned int doneio = 0;
 
-	EIO_ASSERT(ebio->eb_bc);
+	EIO_ASSERT(bc);
 
 	/*Propagate only main io errors and sizes*/
 	if (ebio->eb_iotype == EB_MAIN_IO) {
 		if (error)
-			ebio->eb_bc->bc_error = error;
-		bc_put(ebio->eb_bc, ebio->eb_size);
-	} else
-		bc_put(ebio->eb_bc, 0);
+			bc->bc_error = error;
+		doneio = ebio->eb_size;
+	}
 	ebio->eb_bc = NULL;
-	kfree(ebio);
+
+	/* Free the ebio first, it may be embedded in bc */
+	eio_free_ebio(ebio);
+	bc_put(bc, doneio);
 }
 
 static int
@@ -179,7 +241,7 @@ eio_flag_abios(struct cache_c *dmc, struct eio_bio *abio, int invalidated)
 		EIO_ASSERT(!(abio->eb_iotype & EB_INVAL) || abio->eb_index == -1);
 		invalidate = !invalidated && (abio->eb_iotype & EB_INVAL);
 
-		spin_lock_irqsave(&dmc->cache_sets[abio->eb_cacheset].cs_lock,
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, abio->eb_cacheset),
 				  flags);
 
 		if (abio->eb_index != -1) {
@@ -215,9 +277,7 @@ eio_flag_abios(struct cache_c *dmc, struct eio_bio *abio, int invalidated)
 				else {
 					EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 							    INVALID);
-					atomic64_dec_if_positive(&dmc->
-								 eio_stats.
-								 cached_blocks);
+					EIO_STATS_DEC(dmc, cached_blocks);
 				}
 			} else {
 				if (cwip_on)
@@ -230,9 +290,7 @@ eio_flag_abios(struct cache_c *dmc, struct eio_bio *abio, int invalidated)
 								    abio->
 								    eb_index,
 								    INVALID);
-						atomic64_dec_if_positive(&dmc->
-									 eio_stats.
-									 cached_blocks);
+						EIO_STATS_DEC(dmc, cached_blocks);
 					} else {
 						EIO_CACHE_STATE_SET(dmc,
 								    abio->
@@ -246,8 +304,8 @@ eio_flag_abios(struct cache_c *dmc, struct eio_bio *abio, int invalidated)
 			if (invalidate)
 				eio_inval_block(dmc, abio->eb_sector);
 		}
-		spin_unlock_irqrestore(&dmc->cache_sets[abio->eb_cacheset].
-				       cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, abio->eb_cacheset),
+				       flags);
 		if (!cwip_on && (!dirty_on || callendio))
 			eb_endio(abio, 0);
 		abio = nbio;
@@ -273,11 +331,11 @@ static void eio_disk_io_callback(int error, void *context)
 	if (unlikely(error))
 		dmc->eio_errors.disk_read_errors++;
 
-	spin_lock_irqsave(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, eb_cacheset), flags);
 	/* Invalidate the cache block */
 	EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
-	spin_unlock_irqrestore(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
+	EIO_STATS_DEC(dmc, cached_blocks);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, eb_cacheset), flags);
 
 	if (unlikely(error))
 		pr_err("disk_io_callback: io error %d block %llu action %d",
@@ -306,19 +364,15 @@ static void eio_uncached_read_done(struct kcached_job *job)
 		while (iebio != NULL) {
 			nebio = iebio->eb_next;
 			if (iebio->eb_index != -1) {
-				spin_lock_irqsave(&dmc->
-						  cache_sets[iebio->
-							     eb_cacheset].
-						  cs_lock, flags);
+				spin_lock_irqsave(EIO_SET_CS_LOCK(dmc,
+						  iebio->eb_cacheset), flags);
 				if (unlikely
 					    (EIO_CACHE_STATE_GET(dmc, iebio->eb_index) &
 					    QUEUED)) {
 					EIO_CACHE_STATE_SET(dmc,
 							    iebio->eb_index,
 							    INVALID);
-					atomic64_dec_if_positive(&dmc->
-								 eio_stats.
-								 cached_blocks);
+					EIO_STATS_DEC(dmc, cached_blocks);
 				} else
 				if (EIO_CACHE_STATE_GET
 					    (dmc,
@@ -330,10 +384,9 @@ static void eio_uncached_read_done(struct kcached_job *job)
 				} else
 					/*Should never reach here*/
 					EIO_ASSERT(0);
-				spin_unlock_irqrestore(&dmc->
-						       cache_sets[iebio->
-								  eb_cacheset].
-						       cs_lock, flags);
+				spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc,
+						       iebio->eb_cacheset),
+						       flags);
 			}
 			eb_endio(iebio, 0);
 			iebio = nebio;
@@ -396,7 +449,7 @@ static void eio_post_io_callback(struct work_struct *work)
 	switch (job->action) {
 	case WRITEDISK:
 
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		EIO_STATS_INC(dmc, writedisk);
 		if (unlikely(error))
 			dmc->eio_errors.disk_write_errors++;
 		if (unlikely(error) || (ebio->eb_iotype & EB_INVAL))
@@ -411,6 +464,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case READDISK:
 
+		if (ebio->eb_bc->bc_fill_bio && !error)
+			eio_read_expand_done(dmc, ebio->eb_bc);
 		if (unlikely(error) || unlikely(ebio->eb_iotype & EB_INVAL)
 		    || CACHE_DEGRADED_IS_SET(dmc)) {
 			if (error)
@@ -428,8 +483,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case READCACHE:
 
-		/*atomic64_inc(&dmc->eio_stats.readcache);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc, readcache);*/
+		/*SECTOR_STATS(dmc, ssd_reads, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
@@ -439,15 +494,14 @@ static void eio_post_io_callback(struct work_struct *work)
 			dmc->eio_errors.ssd_read_errors++;
 			/* Retry read from HDD for non-DIRTY blocks. */
 			if (cstate != ALREADY_DIRTY) {
-				spin_lock_irqsave(&dmc->cache_sets[eb_cacheset].
-						  cs_lock, flags);
+				spin_lock_irqsave(EIO_SET_CS_LOCK(dmc,
+						  eb_cacheset), flags);
 				EIO_CACHE_STATE_OFF(dmc, ebio->eb_index,
 						    CACHEREADINPROG);
 				EIO_CACHE_STATE_ON(dmc, ebio->eb_index,
 						   DISKREADINPROG);
-				spin_unlock_irqrestore(&dmc->
-						       cache_sets[eb_cacheset].
-						       cs_lock, flags);
+				spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc,
+						       eb_cacheset), flags);
 
 				eio_push_ssdread_failures(job);
 				schedule_work(&_kcached_wq);
@@ -455,13 +509,23 @@ static void eio_post_io_callback(struct work_struct *work)
 				return;
 			}
 		}
+
+		/* A read hit ends without cs_lock, see eio_read_peek_fast() */
+		if (likely(!error) &&
+		    (cstate == ALREADY_DIRTY ||
+		     eio_cache_state_cmpxchg(dmc, index,
+					     VALID | CACHEREADINPROG, VALID))) {
+			eb_endio(ebio, 0);
+			eio_free_cache_job(job);
+			return;
+		}
 		callendio = 1;
 		break;
 
 	case READFILL:
 
-		/*atomic64_inc(&dmc->eio_stats.readfill);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc, readfill);*/
+		/*SECTOR_STATS(dmc, ssd_writes, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) == ebio->eb_sector);
 		if (unlikely(error))
 			dmc->eio_errors.ssd_write_errors++;
@@ -476,8 +540,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case WRITECACHE:
 
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
-		/*atomic64_inc(&dmc->eio_stats.writecache);*/
+		/*SECTOR_STATS(dmc, ssd_writes, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc, writecache);*/
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
@@ -503,7 +567,7 @@ static void eio_post_io_callback(struct work_struct *work)
 		return;
 	}
 
-	spin_lock_irqsave(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, eb_cacheset), flags);
 
 	cstate = EIO_CACHE_STATE_GET(dmc, index);
 	EIO_ASSERT(!(cstate & INVALID));
@@ -536,7 +600,7 @@ static void eio_post_io_callback(struct work_struct *work)
 		/* Error or QUEUED is set: mark block as INVALID for non-DIRTY blocks */
 		if (cstate != ALREADY_DIRTY) {
 			EIO_CACHE_STATE_SET(dmc, index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_DEC(dmc, cached_blocks);
 		}
 	} else if (cstate & VALID) {
 		EIO_CACHE_STATE_OFF(dmc, index, BLOCK_IO_INPROG);
@@ -558,7 +622,7 @@ static void eio_post_io_callback(struct work_struct *work)
 			EIO_CACHE_STATE_OFF(dmc, index, VALID);
 	}
 
-	spin_unlock_irqrestore(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, eb_cacheset), flags);
 
 	if (callendio)
 		eb_endio(ebio, error);
@@ -595,15 +659,15 @@ void eio_ssderror_diskread(struct kcached_job *job)
 
 	EIO_ASSERT(index != -1);
 
-	spin_lock_irqsave(&dmc->cache_sets[index / dmc->assoc].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, index / dmc->assoc), flags);
 	EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, index) & DISKREADINPROG);
-	spin_unlock_irqrestore(&dmc->cache_sets[index / dmc->assoc].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, index / dmc->assoc),
 			       flags);
 
 	EIO_ASSERT(ebio->eb_dir == READ);
 
-	atomic64_inc(&dmc->eio_stats.readdisk);
-	SECTOR_STATS(dmc->eio_stats.disk_reads, ebio->eb_size);
+	EIO_STATS_INC(dmc, readdisk);
+	SECTOR_STATS(dmc, disk_reads, ebio->eb_size);
 	job->action = READDISK;
 
 	error = eio_io_async_bvec(dmc, &job->job_io_regions.disk, ebio->eb_dir,
@@ -624,12 +688,12 @@ out:
 	 * block should be marked as INVALID by turning off already set
 	 * flags.
 	 */
-	spin_lock_irqsave(&dmc->cache_sets[index / dmc->assoc].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, index / dmc->assoc), flags);
 	EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-	spin_unlock_irqrestore(&dmc->cache_sets[index / dmc->assoc].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, index / dmc->assoc),
 			       flags);
 
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+	EIO_STATS_DEC(dmc, cached_blocks);
 
 	eb_endio(ebio, error);
 	ebio = NULL;
@@ -642,11 +706,11 @@ static void eio_addto_cleanq(struct cache_c *dmc, index_t set, int whole)
 {
 	unsigned long flags = 0;
 
-	spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
 
 	if (dmc->cache_sets[set].flags & SETFLAG_CLEAN_INPROG) {
 		/* Clean already in progress, just add to clean pendings */
-		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
 		return;
 	}
 
@@ -654,46 +718,139 @@ static void eio_addto_cleanq(struct cache_c *dmc, index_t set, int whole)
 	if (whole)
 		dmc->cache_sets[set].flags |= SETFLAG_CLEAN_WHOLE;
 
-	spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
 
 	spin_lock_irqsave(&dmc->clean_sl, flags);
 	list_add_tail(&dmc->cache_sets[set].list, &dmc->cleanq);
 	atomic64_inc(&dmc->clean_pendings);
-	EIO_SET_EVENT_AND_UNLOCK(&dmc->clean_event, &dmc->clean_sl, flags);
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+	wake_up(&dmc->clean_wq);
 	return;
 }
 
 /*
- * Clean thread loops forever in this, waiting for
- * new clean set requests in the clean queue.
+ * Queue a set full of dirty blocks for clean ahead of the other sets,
+ * for the writers waiting for room in it. It is cleaned whole, and
+ * regardless of "autoclean_threshold".
+ */
+static void eio_addto_cleanq_urgent(struct cache_c *dmc, index_t set)
+{
+	unsigned long flags = 0;
+
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+
+	if (dmc->cache_sets[set].flags & SETFLAG_CLEAN_INPROG) {
+		/* Queued or being cleaned, do not let it be postponed */
+		dmc->cache_sets[set].flags |= SETFLAG_CLEAN_URGENT;
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+		return;
+	}
+
+	dmc->cache_sets[set].flags |= SETFLAG_CLEAN_INPROG |
+				      SETFLAG_CLEAN_WHOLE | SETFLAG_CLEAN_URGENT;
+
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+
+	spin_lock_irqsave(&dmc->clean_sl, flags);
+	list_add(&dmc->cache_sets[set].list, &dmc->cleanq);
+	atomic64_inc(&dmc->clean_pendings);
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+	wake_up(&dmc->clean_wq);
+}
+
+static struct eio_clean_buf *eio_tryget_clean_buf(struct cache_c *dmc)
+{
+	struct eio_clean_buf *buf = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->clean_sl, flags);
+	if (!list_empty(&dmc->clean_bufs)) {
+		buf = list_first_entry(&dmc->clean_bufs, struct eio_clean_buf,
+				       list);
+		list_del(&buf->list);
+	}
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+	return buf;
+}
+
+/* Take the buffers of a set clean, waiting for one to be free */
+struct eio_clean_buf *eio_get_clean_buf(struct cache_c *dmc)
+{
+	struct eio_clean_buf *buf;
+
+	while ((buf = eio_tryget_clean_buf(dmc)) == NULL)
+		wait_event(dmc->clean_buf_wq, !list_empty(&dmc->clean_bufs));
+	return buf;
+}
+
+void eio_put_clean_buf(struct cache_c *dmc, struct eio_clean_buf *buf)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->clean_sl, flags);
+	list_add(&buf->list, &dmc->clean_bufs);
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+	wake_up(&dmc->clean_buf_wq);
+}
+
+/* A force clean has sets left for the other cleaners to sweep */
+static int eio_clean_sweep_pending(struct cache_c *dmc)
+{
+	return (dmc->sysctl_active.do_clean & EIO_CLEAN_START) &&
+	       atomic_read(&dmc->clean_index) < (s32)dmc->num_sets;
+}
+
+/* A cleaner has work, or has to go */
+static int eio_cleaner_wakeup(struct eio_cleaner *cl)
+{
+	struct cache_c *dmc = cl->dmc;
+
+	return !list_empty(&dmc->cleanq) || dmc->sysctl_active.fast_remove ||
+	       cl->id >= (int)dmc->sysctl_active.clean_threads ||
+	       (cl->id == 0 && dmc->sysctl_active.do_clean) ||
+	       (cl->id != 0 && eio_clean_sweep_pending(dmc));
+}
+
+/*
+ * Cleaner threads loop forever in this, waiting for new clean set
+ * requests in the clean queue. Each takes one set at a time into a
+ * pipe of CLEAN_PIPELINE_DEPTH set cleans, so that up to that many
+ * times "clean_threads" sets are cleaned concurrently. Cleaner 0
+ * also enforces the dirty thresholds and runs the "do_clean" sysctl.
  */
 int eio_clean_thread_proc(void *context)
 {
-	struct cache_c *dmc = (struct cache_c *)context;
+	struct eio_cleaner *cl = (struct eio_cleaner *)context;
+	struct cache_c *dmc = cl->dmc;
+	struct eio_clean_pipe pipe;
 	unsigned long flags = 0;
 	u_int64_t systime;
 	index_t index;
+	struct cache_set *set;
 
 	/* Sync makes sense only for writeback cache */
 	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
+	EIO_ASSERT(cl->running);
 
-	dmc->clean_thread_running = 1;
+	eio_clean_pipe_init(&pipe, dmc);
 
 	/*
-	 * Using sysctl_fast_remove to stop the clean thread
+	 * Using sysctl_fast_remove to stop the clean threads
 	 * works for now. Should have another flag specifically
 	 * for such notification.
 	 */
-	for (; !dmc->sysctl_active.fast_remove; ) {
-		LIST_HEAD(setlist);
-		struct cache_set *set;
-
-		eio_comply_dirty_thresholds(dmc, -1);
+	while (!dmc->sysctl_active.fast_remove &&
+	       cl->id < (int)dmc->sysctl_active.clean_threads) {
+		if (cl->id == 0)
+			eio_comply_dirty_thresholds(dmc, -1);
 
-		if (dmc->sysctl_active.do_clean) {
+		if (cl->id == 0 && dmc->sysctl_active.do_clean) {
 			/* pause the periodic clean */
 			cancel_delayed_work_sync(&dmc->clean_aged_sets_work);
 
+			/* eio_clean_all() may need the buffers of our pipe */
+			eio_clean_pipe_drain(&pipe);
+
 			/* clean all the sets */
 			eio_clean_all(dmc);
 
@@ -716,68 +873,74 @@ int eio_clean_thread_proc(void *context)
 			spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
 		}
 
+		/* help cleaner 0 with a force clean */
+		if (cl->id != 0 && eio_clean_sweep_pending(dmc)) {
+			atomic_inc(&dmc->clean_sweepers);
+			eio_clean_sweep(dmc, &pipe);
+			eio_clean_pipe_drain(&pipe);
+			if (atomic_dec_and_test(&dmc->clean_sweepers))
+				wake_up_all(&dmc->clean_wq);
+		}
+
 		if (dmc->sysctl_active.fast_remove)
 			break;
 
-		spin_lock_irqsave(&dmc->clean_sl, flags);
-
-		while (!
-		       ((!list_empty(&dmc->cleanq))
-			|| dmc->sysctl_active.fast_remove
-			|| dmc->sysctl_active.do_clean))
-			EIO_WAIT_EVENT(&dmc->clean_event, &dmc->clean_sl,
-				       flags);
-
 		/*
-		 * Move cleanq elements to a private list for processing.
+		 * With set cleans in the pipe, move them on rather than
+		 * wait for more sets to clean.
 		 */
+		if (!pipe.nr_cleans)
+			wait_event_interruptible_timeout(dmc->clean_wq,
+							 eio_cleaner_wakeup(cl),
+							 10 * HZ);
+		else
+			eio_clean_pipe_run(&pipe, list_empty(&dmc->cleanq));
 
-		list_add(&setlist, &dmc->cleanq);
-		list_del(&dmc->cleanq);
-		INIT_LIST_HEAD(&dmc->cleanq);
-
+		/* Take the next set off the clean queue */
+		spin_lock_irqsave(&dmc->clean_sl, flags);
+		if (list_empty(&dmc->cleanq)) {
+			spin_unlock_irqrestore(&dmc->clean_sl, flags);
+			continue;
+		}
+		set = list_first_entry(&dmc->cleanq, struct cache_set, list);
+		list_del(&set->list);
 		spin_unlock_irqrestore(&dmc->clean_sl, flags);
 
 		systime = jiffies;
-		while (!list_empty(&setlist)) {
-			set =
-				list_entry((&setlist)->next, struct cache_set,
-					   list);
-			list_del(&set->list);
-			index = set - dmc->cache_sets;
-			if (!(dmc->sysctl_active.fast_remove)) {
-				eio_clean_set(dmc, index,
-					      set->flags & SETFLAG_CLEAN_WHOLE,
-					      0);
-			} else {
+		index = set - dmc->cache_sets;
+		if (!(dmc->sysctl_active.fast_remove)) {
+			eio_clean_pipe_add(&pipe, index,
+					   set->flags & SETFLAG_CLEAN_WHOLE, 0);
+		} else {
 
-				/*
-				 * Since we are not cleaning the set, we should
-				 * put the set back in the lru list so that
-				 * it is picked up at a later point.
-				 * We also need to clear the clean inprog flag
-				 * otherwise this set would never be cleaned.
-				 */
+			/*
+			 * Since we are not cleaning the set, we should
+			 * put the set back in the lru list so that
+			 * it is picked up at a later point.
+			 * We also need to clear the clean inprog flag
+			 * otherwise this set would never be cleaned.
+			 */
 
-				spin_lock_irqsave(&dmc->cache_sets[index].
-						  cs_lock, flags);
-				dmc->cache_sets[index].flags &=
-					~(SETFLAG_CLEAN_INPROG |
-					  SETFLAG_CLEAN_WHOLE);
-				spin_unlock_irqrestore(&dmc->cache_sets[index].
-						       cs_lock, flags);
-				spin_lock_irqsave(&dmc->dirty_set_lru_lock,
-						  flags);
-				lru_touch(dmc->dirty_set_lru, index, systime);
-				spin_unlock_irqrestore(&dmc->dirty_set_lru_lock,
-						       flags);
-			}
-			atomic64_dec(&dmc->clean_pendings);
+			spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, index),
+					  flags);
+			dmc->cache_sets[index].flags &=
+				~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE |
+				  SETFLAG_CLEAN_URGENT);
+			spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, index),
+					       flags);
+			wake_up_all(EIO_SET_WQ(dmc, index));
+			spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
+			lru_touch(dmc->dirty_set_lru, index, systime);
+			spin_unlock_irqrestore(&dmc->dirty_set_lru_lock,
+					       flags);
 		}
+		atomic64_dec(&dmc->clean_pendings);
 	}
 
-	/* notifier for cache delete that the clean thread has stopped running */
-	dmc->clean_thread_running = 0;
+	eio_clean_pipe_drain(&pipe);
+
+	/* notifier for eio_stop_clean_threads() that this thread has stopped */
+	cl->running = 0;
 
 	eio_thread_exit(0);
 
@@ -787,282 +950,385 @@ int eio_clean_thread_proc(void *context)
 
 /*
  * Cache miss support. We read the data from disk, write it to the ssd.
- * To avoid doing 1 IO at a time to the ssd, when the IO is kicked off,
- * we enqueue it to a "readfill" queue in the cache in cache sector order.
- * The worker thread can then issue all of these IOs and do 1 unplug to
- * start them all.
- *
+ * To avoid doing 1 IO at a time to the ssd, when the disk read is done
+ * the job is staged on one of the "readfill_workers" of the cache, picked
+ * by the cache set of its blocks. A worker takes all the jobs staged on
+ * it at once, sorts the blocks to fill in cache sector order, merges the
+ * runs of adjacent blocks into one ssd write of up to
+ * EIO_READFILL_MERGE_SECTORS and does 1 unplug to start them all.
  */
+static unsigned int readfill_workers = 4;
+module_param(readfill_workers, uint, 0444);
+MODULE_PARM_DESC(readfill_workers,
+		 "Workers writing the blocks read on a miss to each cache");
+
+#define EIO_READFILL_MERGE_SECTORS      256
+
+/* A merged readfill write, see eio_readfill_write() */
+struct eio_readfill_io {
+	struct list_head jobs;
+	struct bio_vec bvecs[0];
+};
+
 static void eio_enqueue_readfill(struct cache_c *dmc, struct kcached_job *job)
 {
-	unsigned long flags = 0;
-	struct kcached_job **j1, *next;
-	int do_schedule = 0;
+	struct eio_readfill_worker *w;
+	unsigned long flags;
+	int depth;
+
+	EIO_ASSERT(job->ebio->eb_next);
+	w = &dmc->readfill_workers[job->ebio->eb_next->eb_cacheset %
+				   dmc->nr_readfill_workers];
+	depth = atomic_inc_return(&dmc->readfill_depth);
+	if (depth > dmc->readfill_max_depth)
+		dmc->readfill_max_depth = depth;
+
+	spin_lock_irqsave(&w->lock, flags);
+	list_add_tail(&job->list, &w->jobs);
+	spin_unlock_irqrestore(&w->lock, flags);
+	queue_work(dmc->readfill_q, &w->work);
+}
 
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	/* Insert job in sorted order of cache sector */
-	j1 = &dmc->readfill_queue;
-	while (*j1 != NULL && (*j1)->job_io_regions.cache.sector <
-	       job->job_io_regions.cache.sector)
-		j1 = &(*j1)->next;
-	next = *j1;
-	*j1 = job;
-	job->next = next;
-	do_schedule = (dmc->readfill_in_prog == 0);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-	if (do_schedule)
-		schedule_work(&dmc->readfill_wq);
+/* Give up the fill of a block whose disk read is done */
+static void eio_readfill_abort(struct cache_c *dmc, struct eio_bio *iebio,
+			       int err)
+{
+	unsigned long flags;
+
+	pr_err("eio_do_readfill: IO submission failed, block %llu",
+	       EIO_DBN_GET(dmc, iebio->eb_index));
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, iebio->eb_cacheset), flags);
+	EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, iebio->eb_cacheset),
+			       flags);
+	EIO_STATS_DEC(dmc, cached_blocks);
+	eb_endio(iebio, err);
 }
 
-void eio_do_readfill(struct work_struct *work)
+/*
+ * Take the blocks of an uncached read whose disk read is done. The
+ * blocks to fill are added to "fills" as READFILL jobs, the dirty ones
+ * are read from the ssd over the data read from the disk.
+ */
+static void eio_readfill_blocks(struct cache_c *dmc, struct kcached_job *job,
+				struct list_head *fills)
 {
-	struct kcached_job *job, *joblist;
-	struct eio_bio *ebio;
-	unsigned long flags = 0;
-	struct kcached_job *nextjob = NULL;
-	struct cache_c *dmc = container_of(work, struct cache_c, readfill_wq);
+	struct eio_bio *ebio, *iebio, *next;
+	struct kcached_job *fjob;
+	spinlock_t *cs_lock;
+	unsigned long flags;
+	index_t index;
+	u_int8_t cstate;
+	int err;
 
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	if (dmc->readfill_in_prog)
-		goto out;
-	dmc->readfill_in_prog = 1;
-	while (dmc->readfill_queue != NULL) {
-		joblist = dmc->readfill_queue;
-		dmc->readfill_queue = NULL;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-		for (job = joblist; job != NULL; job = nextjob) {
-			struct eio_bio *iebio;
-			struct eio_bio *next;
-
-			nextjob = job->next;    /* save for later because 'job' will be freed */
-			EIO_ASSERT(job->action == READFILL);
-			/* Write to cache device */
-			ebio = job->ebio;
-			iebio = ebio->eb_next;
-			EIO_ASSERT(iebio);
-			/* other iebios are anchored on this bio. Create
-			 * jobs for them and then issue ios
+	EIO_ASSERT(job->action == READFILL);
+	ebio = job->ebio;
+	iebio = ebio->eb_next;
+	EIO_ASSERT(iebio);
+	/* other iebios are anchored on this bio */
+	for (; iebio; iebio = next) {
+		next = iebio->eb_next;
+		index = iebio->eb_index;
+		if (index == -1) {
+			CTRACE("eio_do_readfill:1\n");
+			/* Any INPROG(including DIRTY_INPROG) case would fall here */
+			eb_endio(iebio, 0);
+			continue;
+		}
+
+		cs_lock = EIO_SET_CS_LOCK(dmc, iebio->eb_cacheset);
+		spin_lock_irqsave(cs_lock, flags);
+		cstate = EIO_CACHE_STATE_GET(dmc, index);
+		if (unlikely(cstate & QUEUED)) {
+			/*An invalidation request is queued. Can't do anything*/
+			CTRACE("eio_do_readfill:2\n");
+			EIO_CACHE_STATE_SET(dmc, index, INVALID);
+			spin_unlock_irqrestore(cs_lock, flags);
+			EIO_STATS_DEC(dmc, cached_blocks);
+			eb_endio(iebio, 0);
+		} else if ((cstate & (VALID | DISKREADINPROG)) ==
+			   (VALID | DISKREADINPROG)) {
+			/* Do readfill. */
+			EIO_CACHE_STATE_SET(dmc, index,
+					    VALID | CACHEWRITEINPROG);
+			EIO_ASSERT(EIO_DBN_GET(dmc, index) == iebio->eb_sector);
+			spin_unlock_irqrestore(cs_lock, flags);
+			fjob = eio_new_job(dmc, iebio, index);
+			if (unlikely(fjob == NULL)) {
+				eio_readfill_abort(dmc, iebio, -ENOMEM);
+				continue;
+			}
+			fjob->action = READFILL;
+			atomic_inc(&dmc->nr_jobs);
+			list_add_tail(&fjob->list, fills);
+		} else if (cstate == ALREADY_DIRTY) {
+			spin_unlock_irqrestore(cs_lock, flags);
+
+			/*
+			 * DIRTY block handling:
+			 * Read the dirty data from the cache block to update
+			 * the data buffer already read from the disk
 			 */
-			do {
-				struct kcached_job *job;
-				int err;
-				unsigned long flags;
-				index_t index;
-				next = iebio->eb_next;
-				index = iebio->eb_index;
-				if (index == -1) {
-					CTRACE("eio_do_readfill:1\n");
-					/* Any INPROG(including DIRTY_INPROG) case would fall here */
-					eb_endio(iebio, 0);
-					iebio = NULL;
-				} else {
-					spin_lock_irqsave(&dmc->
-							  cache_sets[iebio->
-								     eb_cacheset].
-							  cs_lock, flags);
-					/* If this block was already  valid, we don't need to write it */
-					if (unlikely
-						    (EIO_CACHE_STATE_GET(dmc, index) &
-						    QUEUED)) {
-						/*An invalidation request is queued. Can't do anything*/
-						CTRACE("eio_do_readfill:2\n");
-						EIO_CACHE_STATE_SET(dmc, index,
-								    INVALID);
-						spin_unlock_irqrestore(&dmc->
-								       cache_sets
-								       [iebio->
-									eb_cacheset].
-								       cs_lock,
-								       flags);
-						atomic64_dec_if_positive(&dmc->
-									 eio_stats.
-									 cached_blocks);
-						eb_endio(iebio, 0);
-						iebio = NULL;
-					} else
-					if ((EIO_CACHE_STATE_GET(dmc, index)
-					     & (VALID | DISKREADINPROG))
-					    == (VALID | DISKREADINPROG)) {
-						/* Do readfill. */
-						EIO_CACHE_STATE_SET(dmc, index,
-								    VALID |
-								    CACHEWRITEINPROG);
-						EIO_ASSERT(EIO_DBN_GET(dmc, index)
-							   == iebio->eb_sector);
-						spin_unlock_irqrestore(&dmc->
-								       cache_sets
-								       [iebio->
-									eb_cacheset].
-								       cs_lock,
-								       flags);
-						job =
-							eio_new_job(dmc, iebio,
-								    iebio->
-								    eb_index);
-						if (unlikely(job == NULL))
-							err = -ENOMEM;
-						else {
-							err = 0;
-							job->action = READFILL;
-							atomic_inc(&dmc->
-								   nr_jobs);
-							SECTOR_STATS(dmc->
-								     eio_stats.
-								     ssd_readfills,
-								     iebio->
-								     eb_size);
-							SECTOR_STATS(dmc->
-								     eio_stats.
-								     ssd_writes,
-								     iebio->
-								     eb_size);
-							atomic64_inc(&dmc->
-								     eio_stats.
-								     readfill);
-							atomic64_inc(&dmc->
-								     eio_stats.
-								     writecache);
-							err =
-								eio_io_async_bvec
-									(dmc,
-									&job->
-									job_io_regions.
-									cache, WRITE,
-									iebio->eb_bv,
-									iebio->eb_nbvec,
-									eio_io_callback,
-									job, 0);
-						}
-						if (err) {
-							pr_err
-								("eio_do_readfill: IO submission failed, block %llu",
-								EIO_DBN_GET(dmc,
-									    index));
-							spin_lock_irqsave(&dmc->
-									  cache_sets
-									  [iebio->
-									   eb_cacheset].
-									  cs_lock,
-									  flags);
-							EIO_CACHE_STATE_SET(dmc,
-									    iebio->
-									    eb_index,
-									    INVALID);
-							spin_unlock_irqrestore
-								(&dmc->
-								cache_sets[iebio->
-									   eb_cacheset].
-								cs_lock, flags);
-							atomic64_dec_if_positive
-								(&dmc->eio_stats.
-								cached_blocks);
-							eb_endio(iebio, err);
-
-							if (job) {
-								eio_free_cache_job
-									(job);
-								job = NULL;
-							}
-						}
-					} else
-					if (EIO_CACHE_STATE_GET(dmc, index)
-					    == ALREADY_DIRTY) {
-
-						spin_unlock_irqrestore(&dmc->
-								       cache_sets
-								       [iebio->
-									eb_cacheset].
-								       cs_lock,
-								       flags);
-
-						/*
-						 * DIRTY block handling:
-						 * Read the dirty data from the cache block to update
-						 * the data buffer already read from the disk
-						 */
-						job =
-							eio_new_job(dmc, iebio,
-								    iebio->
-								    eb_index);
-						if (unlikely(job == NULL))
-							err = -ENOMEM;
-						else {
-							job->action = READCACHE;
-							SECTOR_STATS(dmc->
-								     eio_stats.
-								     ssd_reads,
-								     iebio->
-								     eb_size);
-							atomic64_inc(&dmc->
-								     eio_stats.
-								     readcache);
-							err =
-								eio_io_async_bvec
-									(dmc,
-									&job->
-									job_io_regions.
-									cache, READ,
-									iebio->eb_bv,
-									iebio->eb_nbvec,
-									eio_io_callback,
-									job, 0);
-						}
-
-						if (err) {
-							pr_err
-								("eio_do_readfill: dirty block read IO submission failed, block %llu",
-								EIO_DBN_GET(dmc,
-									    index));
-							/* can't invalidate the DIRTY block, just return error */
-							eb_endio(iebio, err);
-							if (job) {
-								eio_free_cache_job
-									(job);
-								job = NULL;
-							}
-						}
-					} else
-					if ((EIO_CACHE_STATE_GET(dmc, index)
-					     & (VALID | CACHEREADINPROG))
-					    == (VALID | CACHEREADINPROG)) {
-						/*turn off the cache read in prog flag
-						   don't need to write the cache block*/
-						CTRACE("eio_do_readfill:3\n");
-						EIO_CACHE_STATE_OFF(dmc, index,
-								    BLOCK_IO_INPROG);
-						spin_unlock_irqrestore(&dmc->
-								       cache_sets
-								       [iebio->
-									eb_cacheset].
-								       cs_lock,
-								       flags);
-						eb_endio(iebio, 0);
-						iebio = NULL;
-					} else {
-						panic("Unknown condition");
-						spin_unlock_irqrestore(&dmc->
-								       cache_sets
-								       [iebio->
-									eb_cacheset].
-								       cs_lock,
-								       flags);
-					}
-				}
-				iebio = next;
-			} while (iebio);
-			eb_endio(ebio, 0);
-			ebio = NULL;
+			fjob = eio_new_job(dmc, iebio, index);
+			if (unlikely(fjob == NULL))
+				err = -ENOMEM;
+			else {
+				fjob->action = READCACHE;
+				SECTOR_STATS(dmc, ssd_reads, iebio->eb_size);
+				EIO_STATS_INC(dmc, readcache);
+				err = eio_io_async_bvec(dmc,
+						&fjob->job_io_regions.cache,
+						READ, iebio->eb_bv,
+						iebio->eb_nbvec,
+						eio_io_callback, fjob, 0);
+			}
+			if (err) {
+				pr_err
+					("eio_do_readfill: dirty block read IO submission failed, block %llu",
+					EIO_DBN_GET(dmc, index));
+				/* can't invalidate the DIRTY block, just return error */
+				eb_endio(iebio, err);
+				if (fjob)
+					eio_free_cache_job(fjob);
+			}
+		} else if ((cstate & (VALID | CACHEREADINPROG)) ==
+			   (VALID | CACHEREADINPROG)) {
+			/*turn off the cache read in prog flag
+			   don't need to write the cache block*/
+			CTRACE("eio_do_readfill:3\n");
+			EIO_CACHE_STATE_OFF(dmc, index, BLOCK_IO_INPROG);
+			spin_unlock_irqrestore(cs_lock, flags);
+			eb_endio(iebio, 0);
+		} else {
+			panic("Unknown condition");
+			spin_unlock_irqrestore(cs_lock, flags);
+		}
+	}
+	eb_endio(ebio, 0);
+	eio_free_cache_job(job);
+}
+
+static int eio_readfill_cmp(void *priv, struct list_head *a,
+			    struct list_head *b)
+{
+	struct kcached_job *ja = list_entry(a, struct kcached_job, list);
+	struct kcached_job *jb = list_entry(b, struct kcached_job, list);
+	sector_t sa = ja->job_io_regions.cache.sector;
+	sector_t sb = jb->job_io_regions.cache.sector;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+static void eio_readfill_io_callback(int error, void *context)
+{
+	struct eio_readfill_io *rio = (struct eio_readfill_io *)context;
+	struct kcached_job *job, *next;
+
+	list_for_each_entry_safe(job, next, &rio->jobs, list)
+		eio_io_callback(error, job);
+	kfree(rio);
+}
+
+/*
+ * Write a run of adjacent blocks to fill, "where" spanning them all. The
+ * bvecs of a block may go past its end, so they are cut to its size in
+ * the merged write.
+ */
+static void eio_readfill_write(struct cache_c *dmc, struct list_head *run,
+			       struct eio_io_region *where, unsigned nr_bvecs)
+{
+	struct eio_readfill_io *rio = NULL;
+	struct kcached_job *job, *next;
+	struct eio_bio *iebio;
+	unsigned i, n, left;
+	int err;
+
+	list_for_each_entry(job, run, list) {
+		SECTOR_STATS(dmc, ssd_readfills, job->ebio->eb_size);
+		SECTOR_STATS(dmc, ssd_writes, job->ebio->eb_size);
+		EIO_STATS_INC(dmc, readfill);
+		EIO_STATS_INC(dmc, writecache);
+	}
+
+	if (!list_is_singular(run))
+		rio = kmalloc(sizeof(*rio) + nr_bvecs * sizeof(struct bio_vec),
+			      GFP_NOIO);
+	if (rio == NULL) {
+		/* A single block, or no memory to merge: a write per block */
+		list_for_each_entry_safe(job, next, run, list) {
+			list_del(&job->list);
+			iebio = job->ebio;
+			EIO_STATS_INC(dmc, readfill_ssd_writes);
+			err = eio_io_async_bvec(dmc, &job->job_io_regions.cache,
+						WRITE, iebio->eb_bv,
+						iebio->eb_nbvec,
+						eio_io_callback, job, 0);
+			if (err) {
+				eio_readfill_abort(dmc, iebio, err);
+				eio_free_cache_job(job);
+			}
+		}
+		return;
+	}
+
+	n = 0;
+	list_for_each_entry(job, run, list) {
+		iebio = job->ebio;
+		left = to_bytes(job->job_io_regions.cache.count);
+		for (i = 0; i < iebio->eb_nbvec && left; i++, n++) {
+			rio->bvecs[n] = iebio->eb_bv[i];
+			if (rio->bvecs[n].bv_len > left)
+				rio->bvecs[n].bv_len = left;
+			left -= rio->bvecs[n].bv_len;
+		}
+		EIO_ASSERT(left == 0);
+	}
+	EIO_ASSERT(n <= nr_bvecs);
+	INIT_LIST_HEAD(&rio->jobs);
+	list_splice_init(run, &rio->jobs);
+
+	EIO_STATS_INC(dmc, readfill_ssd_writes);
+	err = eio_io_async_bvec(dmc, where, WRITE, rio->bvecs, n,
+				eio_readfill_io_callback, rio, 0);
+	if (err) {
+		list_for_each_entry_safe(job, next, &rio->jobs, list) {
+			eio_readfill_abort(dmc, job->ebio, err);
 			eio_free_cache_job(job);
 		}
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		kfree(rio);
 	}
-	dmc->readfill_in_prog = 0;
-out:
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-	atomic64_inc(&dmc->eio_stats.ssd_readfill_unplugs);
+}
+
+/* Write the blocks to fill, sorted in cache sector order */
+static void eio_readfill_issue(struct cache_c *dmc, struct list_head *fills)
+{
+	struct kcached_job *job;
+	struct eio_io_region where;
+	unsigned nr_bvecs;
+	LIST_HEAD(run);
+
+	while (!list_empty(fills)) {
+		job = list_first_entry(fills, struct kcached_job, list);
+		where = job->job_io_regions.cache;
+		nr_bvecs = job->ebio->eb_nbvec;
+		list_move_tail(&job->list, &run);
+
+		/* Take the blocks adjacent to the run, as far as it may grow */
+		while (!list_empty(fills)) {
+			job = list_first_entry(fills, struct kcached_job, list);
+			if (job->job_io_regions.cache.sector !=
+			    where.sector + where.count ||
+			    where.count + job->job_io_regions.cache.count >
+			    EIO_READFILL_MERGE_SECTORS)
+				break;
+			where.count += job->job_io_regions.cache.count;
+			nr_bvecs += job->ebio->eb_nbvec;
+			list_move_tail(&job->list, &run);
+		}
+
+		eio_readfill_write(dmc, &run, &where, nr_bvecs);
+	}
+}
+
+static void eio_do_readfill(struct work_struct *work)
+{
+	struct eio_readfill_worker *w;
+	struct cache_c *dmc;
+	struct kcached_job *job, *next;
+	unsigned long flags;
+	LIST_HEAD(jobs);
+	LIST_HEAD(fills);
+	int nr_jobs = 0;
+
+	w = container_of(work, struct eio_readfill_worker, work);
+	dmc = w->dmc;
+
+	spin_lock_irqsave(&w->lock, flags);
+	list_splice_init(&w->jobs, &jobs);
+	spin_unlock_irqrestore(&w->lock, flags);
+	if (list_empty(&jobs))
+		return;
+
+	list_for_each_entry_safe(job, next, &jobs, list) {
+		eio_readfill_blocks(dmc, job, &fills);
+		nr_jobs++;
+	}
+	atomic_sub(nr_jobs, &dmc->readfill_depth);
+	EIO_STATS_INC(dmc, readfill_batches);
+	EIO_STATS_INC(dmc, readfill_batch_hist[min(fls(nr_jobs) - 1,
+						   READFILL_BATCH_HIST - 1)]);
+
+	list_sort(NULL, &fills, eio_readfill_cmp);
+	eio_readfill_issue(dmc, &fills);
+
+	EIO_STATS_INC(dmc, ssd_readfill_unplugs);
 	eio_unplug_cache_device(dmc);
 }
 
+/*
+ * The readfill workers of a cache share an unbound workqueue, so that
+ * the passes of different workers may run concurrently.
+ */
+int eio_readfill_init(struct cache_c *dmc)
+{
+	struct eio_readfill_worker *w;
+	unsigned i, nr;
+
+	atomic_set(&dmc->readfill_depth, 0);
+	dmc->readfill_max_depth = 0;
+	nr = clamp_t(unsigned, readfill_workers, 1, num_possible_cpus());
+
+	dmc->readfill_workers = kcalloc(nr, sizeof(*w), GFP_KERNEL);
+	if (!dmc->readfill_workers)
+		return -ENOMEM;
+	dmc->readfill_q = alloc_workqueue("eio_readfill",
+					  WQ_MEM_RECLAIM | WQ_UNBOUND, nr);
+	if (!dmc->readfill_q)
+		goto free_workers;
+	/* Read-aheads wait for set locks, see eio_do_readahead() */
+	dmc->readahead_q = alloc_workqueue("eio_readahead",
+					   WQ_MEM_RECLAIM | WQ_UNBOUND, nr);
+	if (!dmc->readahead_q)
+		goto destroy_readfill_q;
+
+	for (i = 0; i < nr; i++) {
+		w = &dmc->readfill_workers[i];
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->jobs);
+		INIT_WORK(&w->work, eio_do_readfill);
+		w->dmc = dmc;
+	}
+	dmc->nr_readfill_workers = nr;
+	return 0;
+
+destroy_readfill_q:
+	destroy_workqueue(dmc->readfill_q);
+	dmc->readfill_q = NULL;
+free_workers:
+	kfree(dmc->readfill_workers);
+	dmc->readfill_workers = NULL;
+	return -ENOMEM;
+}
+
+/* Called once no more disk reads of the cache may end */
+void eio_readfill_exit(struct cache_c *dmc)
+{
+	if (dmc->readahead_q) {
+		flush_workqueue(dmc->readahead_q);
+		destroy_workqueue(dmc->readahead_q);
+		dmc->readahead_q = NULL;
+	}
+	if (dmc->readfill_q) {
+		flush_workqueue(dmc->readfill_q);
+		destroy_workqueue(dmc->readfill_q);
+		dmc->readfill_q = NULL;
+	}
+	EIO_ASSERT(atomic_read(&dmc->readfill_depth) == 0);
+	kfree(dmc->readfill_workers);
+	dmc->readfill_workers = NULL;
+	dmc->nr_readfill_workers = 0;
+}
+
 /*
  * Map a block from the source device to a block in the cache device.
  */
@@ -1079,35 +1345,35 @@ find_valid_dbn(struct cache_c *dmc, sector_t dbn,
 	       index_t start_index, index_t *index)
 {
 	index_t i;
-	index_t end_index = start_index + dmc->assoc;
 
-	for (i = start_index; i < end_index; i++) {
-		if ((EIO_CACHE_STATE_GET(dmc, i) & VALID)
-		    && EIO_DBN_GET(dmc, i) == dbn) {
-			*index = i;
-			if ((EIO_CACHE_STATE_GET(dmc, i) & BLOCK_IO_INPROG) ==
-			    0)
-				eio_policy_reclaim_lru_movetail(dmc, i,
-								dmc->
-								policy_ops);
-			return;
-		}
+	if (dmc->dbn_index)
+		i = eio_dbn_index_find(dmc, start_index, dbn);
+	else
+		i = eio_scan_valid_dbn(dmc, start_index, dbn);
+
+	if (i == -1 || !(EIO_CACHE_STATE_GET(dmc, i) & VALID)) {
+		*index = -1;
+		return;
 	}
-	*index = -1;
+	*index = i;
+	if ((EIO_CACHE_STATE_GET(dmc, i) & BLOCK_IO_INPROG) == 0)
+		eio_policy_reclaim_lru_movetail(dmc, i, dmc->policy_ops);
 }
 
 static index_t find_invalid_dbn(struct cache_c *dmc, index_t start_index)
 {
 	index_t i;
-	index_t end_index = start_index + dmc->assoc;
+	unsigned long bit;
 
 	/* Find INVALID slot that we can reuse */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == INVALID) {
-			eio_policy_reclaim_lru_movetail(dmc, i,
-							dmc->policy_ops);
-			return i;
-		}
+	bit = find_first_bit(EIO_SET_FREE_MAP(dmc,
+				start_index >> dmc->consecutive_shift),
+			     dmc->assoc);
+	if (bit < dmc->assoc) {
+		i = start_index + bit;
+		EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, i) == INVALID);
+		eio_policy_reclaim_lru_movetail(dmc, i, dmc->policy_ops);
+		return i;
 	}
 	return -1;
 }
@@ -1164,181 +1430,260 @@ eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
 	return -1;
 }
 
-/* Do metadata update for a set */
-static void eio_do_mdupdate(struct work_struct *work)
+/* A write throttled on a set may go on */
+static int eio_write_throttle_done(struct cache_c *dmc, index_t set)
 {
-	struct mdupdate_request *mdreq;
-	struct cache_set *set;
-	struct cache_c *dmc;
+	return dmc->cache_sets[set].nr_dirty < dmc->assoc ||
+	       !(dmc->cache_sets[set].flags & SETFLAG_CLEAN_INPROG);
+}
+
+/*
+ * A write of the block at "dbn" would find no room in its set: the set
+ * is full of dirty blocks and the block is not one of them.
+ */
+static int eio_write_stalls(struct cache_c *dmc, sector_t dbn, index_t set)
+{
+	index_t start_index = set * dmc->assoc;
 	unsigned long flags;
 	index_t i;
-	index_t start_index;
-	index_t end_index;
-	index_t min_index;
-	index_t max_index;
-	struct flash_cacheblock *md_blocks;
-	struct eio_bio *ebio;
-	u_int8_t cstate;
-	struct eio_io_region region;
-	unsigned pindex;
-	int error, j;
-	index_t blk_index;
-	int k;
-	void *pg_virt_addr[2] = { NULL };
-	u_int8_t sector_bits[2] = { 0 };
-	int startbit, endbit;
-	int rw_flags = 0;
+	int stalls = 0;
 
-	mdreq = container_of(work, struct mdupdate_request, work);
-	dmc = mdreq->dmc;
-	set = &dmc->cache_sets[mdreq->set];
-
-	mdreq->error = 0;
-	EIO_ASSERT(mdreq->mdblk_bvecs);
+	if (dmc->cache_sets[set].nr_dirty < dmc->assoc)
+		return 0;
 
-	/*
-	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
-	 */
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+	if (dmc->cache_sets[set].nr_dirty >= dmc->assoc) {
+		if (dmc->dbn_index)
+			i = eio_dbn_index_find(dmc, start_index, dbn);
+		else
+			i = eio_scan_valid_dbn(dmc, start_index, dbn);
+		stalls = i == -1 ||
+			 EIO_CACHE_STATE_GET(dmc, i) != ALREADY_DIRTY;
+	}
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+	return stalls;
+}
 
-	EIO_ASSERT(mdreq->mdbvec_count && mdreq->mdbvec_count <= 2);
-	EIO_ASSERT((dmc->assoc == 512) || mdreq->mdbvec_count == 1);
-	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
-		pg_virt_addr[k] = kmap(mdreq->mdblk_bvecs[k].bv_page);
-
-	spin_lock_irqsave(&set->cs_lock, flags);
+/*
+ * eio_write_throttle
+ *
+ * Without it, a write finding its set full of dirty blocks goes to
+ * the source device, at its latency. With "write_throttle_ms" set, the
+ * write first waits up to that long for the sets it would find full,
+ * which are queued for clean ahead of the others. It is done before
+ * the set locks are taken, as the cleaners need them. A write which
+ * still finds no room goes to the source device as before.
+ */
+static void eio_write_throttle(struct cache_c *dmc, struct bio_container *bc,
+			       sector_t snum, unsigned int size)
+{
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, snum);
+	sector_t end = snum + eio_to_sector(size);
+	index_t set, last_set = -1;
+	unsigned long deadline;
+	ktime_t start;
+	long timeout;
+	int timedout = 0;
+	int64_t ms;
+
+	if (!dmc->sysctl_active.write_throttle_ms ||
+	    (dmc->sysctl_active.do_clean & EIO_CLEAN_KEEP))
+		return;
 
-	start_index = mdreq->set * dmc->assoc;
-	end_index = start_index + dmc->assoc;
+	start = ktime_get();
+	deadline = jiffies +
+		   msecs_to_jiffies(dmc->sysctl_active.write_throttle_ms);
 
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-	j = MD_BLOCKS_PER_PAGE;
+	/* Partial blocks go to the source device on a miss anyway */
+	if (dbn < snum)
+		dbn += dmc->block_size;
+	for (; dbn + dmc->block_size <= end; dbn += dmc->block_size) {
+		set = hash_block(dmc, dbn);
+		if (set == last_set || !eio_write_stalls(dmc, dbn, set))
+			continue;
 
-	/* initialize the md blocks to write */
-	for (i = start_index; i < end_index; i++) {
-		cstate = EIO_CACHE_STATE_GET(dmc, i);
-		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
-		if (cstate == ALREADY_DIRTY)
-			md_blocks->cache_state = cpu_to_le64((VALID | DIRTY));
-		else
-			md_blocks->cache_state = cpu_to_le64(INVALID);
-		md_blocks++;
-		j--;
+		bc->bc_throttled = 1;
+		last_set = set;
+		eio_addto_cleanq_urgent(dmc, set);
 
-		if ((j == 0) && (++pindex < mdreq->mdbvec_count)) {
-			md_blocks =
-				(struct flash_cacheblock *)pg_virt_addr[pindex];
-			j = MD_BLOCKS_PER_PAGE;
+		timeout = (long)(deadline - jiffies);
+		if (timeout <= 0 ||
+		    !wait_event_timeout(*EIO_SET_WQ(dmc, set),
+					eio_write_throttle_done(dmc, set),
+					timeout)) {
+			timedout = 1;
+			break;
 		}
-
 	}
 
-	/* Update the md blocks with the pending mdlist */
-	min_index = start_index;
-	max_index = start_index;
+	if (!bc->bc_throttled)
+		return;
+	ms = ktime_to_ms(ktime_sub(ktime_get(), start));
+	EIO_STATS_INC(dmc, write_throttles);
+	EIO_STATS_INC(dmc, write_throttle_hist[min_t(int, (fls64(ms) + 1) / 2,
+						     WRITE_THROTTLE_HIST - 1)]);
+	if (timedout)
+		EIO_STATS_INC(dmc, write_throttle_timeouts);
+}
 
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
+/*
+ * Do metadata update for a set
+ *
+ * This is the commit of a group: it takes every ebio queued on the
+ * set's mdreq since the last commit. Only the metadata sectors holding
+ * those blocks are rebuilt from the in-core metadata and written, one
+ * I/O per run of consecutive sectors.
+ */
+static void eio_do_mdupdate(struct work_struct *work)
+{
+	struct mdupdate_request *mdreq;
+	struct cache_c *dmc;
+	unsigned long flags;
+	index_t i;
+	index_t start_index;
+	struct flash_cacheblock *md_blocks;
+	struct eio_bio *ebio;
+	u_int8_t cstate;
+	struct eio_io_region region;
+	struct bio_vec *bvec;
+	int error, j, n;
+	index_t blk_index;
+	int k;
+	void *pg_virt_addr[2] = { NULL };
+	u_int8_t sector_bits[2] = { 0 };
+	int startbit;
+	int nr_blocks, nr_sectors, nr_runs;
+	int rw_flags = 0;
 
-	ebio = mdreq->pending_mdlist;
-	while (ebio) {
-		EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, ebio->eb_index) ==
-			   DIRTY_INPROG);
+	mdreq = container_of(work, struct mdupdate_request, work);
+	dmc = mdreq->dmc;
 
-		blk_index = ebio->eb_index - start_index;
-		pindex = INDEX_TO_MD_PAGE(blk_index);
-		blk_index = INDEX_TO_MD_PAGE_OFFSET(blk_index);
-		sector_bits[pindex] |= (1 << INDEX_TO_MD_SECTOR(blk_index));
+	mdreq->error = 0;
+	EIO_ASSERT(mdreq->mdblk_bvecs);
 
-		md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-		md_blocks[blk_index].cache_state = (VALID | DIRTY);
+	/*
+	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
+	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
+	 */
 
-		if (min_index > ebio->eb_index)
-			min_index = ebio->eb_index;
+	EIO_ASSERT(mdreq->mdbvec_count && mdreq->mdbvec_count <= 2);
+	EIO_ASSERT((dmc->assoc == 512) || mdreq->mdbvec_count == 1);
+	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
+		pg_virt_addr[k] = kmap(mdreq->mdblk_bvecs[k].bv_page);
 
-		if (max_index < ebio->eb_index)
-			max_index = ebio->eb_index;
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, mdreq->set), flags);
 
-		ebio = ebio->eb_next;
+	start_index = mdreq->set * dmc->assoc;
+
+	/* Find the md sectors holding the blocks of the pending mdlist */
+	nr_blocks = 0;
+	for (ebio = mdreq->pending_mdlist; ebio; ebio = ebio->eb_next) {
+		EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, ebio->eb_index) ==
+			   DIRTY_INPROG);
+
+		blk_index = ebio->eb_index - start_index;
+		sector_bits[INDEX_TO_MD_PAGE(blk_index)] |=
+			1 << INDEX_TO_MD_SECTOR(INDEX_TO_MD_PAGE_OFFSET(blk_index));
+		nr_blocks++;
 	}
 
-	/*
-	 * Below code may be required when selective pages need to be
-	 * submitted for metadata update. Currently avoiding the optimization
-	 * for correctness validation.
-	 */
+	/* initialize the md blocks of those sectors */
+	for (k = 0; k < (int)mdreq->mdbvec_count; k++) {
+		for (j = 0; j < SECTORS_PER_PAGE; j++) {
+			if (!(sector_bits[k] & (1 << j)))
+				continue;
+
+			md_blocks = (struct flash_cacheblock *)pg_virt_addr[k] +
+				    j * MD_BLOCKS_PER_SECTOR;
+			i = start_index + k * MD_BLOCKS_PER_PAGE +
+			    j * MD_BLOCKS_PER_SECTOR;
+			for (n = 0; n < (int)MD_BLOCKS_PER_SECTOR; n++, i++) {
+				cstate = EIO_CACHE_STATE_GET(dmc, i);
+				md_blocks[n].dbn =
+					cpu_to_le64(EIO_DBN_GET(dmc, i));
+				/* Blocks being cleaned are dirty on ssd */
+				if (cstate == ALREADY_DIRTY ||
+				    cstate == CLEAN_INPROG)
+					md_blocks[n].cache_state =
+						cpu_to_le64((VALID | DIRTY));
+				else
+					md_blocks[n].cache_state =
+						cpu_to_le64(INVALID);
+			}
+		}
+	}
 
-	/*
-	   min_cboff = (min_index - start_index) / MD_BLOCKS_PER_CBLOCK(dmc);
-	   max_cboff = (max_index - start_index) / MD_BLOCKS_PER_CBLOCK(dmc);
-	   write_size = ((uint32_t)(max_cboff - min_cboff + 1)) << dmc->block_shift;
-	   EIO_ASSERT(write_size && (write_size <= eio_to_sector(mdreq->md_size)));
-	 */
+	/* Update the md blocks with the pending mdlist */
+	for (ebio = mdreq->pending_mdlist; ebio; ebio = ebio->eb_next) {
+		blk_index = ebio->eb_index - start_index;
+		md_blocks = (struct flash_cacheblock *)
+			    pg_virt_addr[INDEX_TO_MD_PAGE(blk_index)];
+		md_blocks[INDEX_TO_MD_PAGE_OFFSET(blk_index)].cache_state =
+			cpu_to_le64((VALID | DIRTY));
+	}
 
 	/* Move the pending mdlist to inprog list */
 	mdreq->inprog_mdlist = mdreq->pending_mdlist;
 	mdreq->pending_mdlist = NULL;
 
-	spin_unlock_irqrestore(&set->cs_lock, flags);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, mdreq->set), flags);
 
 	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
 		kunmap(mdreq->mdblk_bvecs[k].bv_page);
 
 	/*
-	 * Initiate the I/O to SSD for on-disk md update.
-	 * TBD. Optimize to write only the affected blocks
+	 * Initiate the I/Os to SSD for on-disk md update.
+	 * Set SYNC for making metadata writes as high priority.
 	 */
 
 	region.bdev = dmc->cache_dev->bdev;
-	/*region.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index) +
-	   (min_cboff << dmc->block_shift); */
+	rw_flags = WRITE | REQ_SYNC;
+	nr_sectors = nr_runs = 0;
 
 	atomic_set(&mdreq->holdcount, 1);
-	for (i = 0; i < mdreq->mdbvec_count; i++) {
-		if (!sector_bits[i])
-			continue;
-		startbit = -1;
+	for (k = 0; k < (int)mdreq->mdbvec_count; k++) {
 		j = 0;
-		while (startbit == -1) {
-			if (sector_bits[i] & (1 << j))
-				startbit = j;
-			j++;
-		}
-		endbit = -1;
-		j = 7;
-		while (endbit == -1) {
-			if (sector_bits[i] & (1 << j))
-				endbit = j;
-			j--;
-		}
-		EIO_ASSERT(startbit <= endbit && startbit >= 0 && startbit <= 7 &&
-			   endbit >= 0 && endbit <= 7);
-		EIO_ASSERT(dmc->assoc != 128 || endbit <= 3);
-		region.sector =
-			dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index) +
-			i * SECTORS_PER_PAGE + startbit;
-		region.count = endbit - startbit + 1;
-		mdreq->mdblk_bvecs[i].bv_offset = to_bytes(startbit);
-		mdreq->mdblk_bvecs[i].bv_len = to_bytes(region.count);
-
-		EIO_ASSERT(region.sector <=
-			   (dmc->md_start_sect + INDEX_TO_MD_SECTOR(end_index)));
-		atomic64_inc(&dmc->eio_stats.md_ssd_writes);
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, to_bytes(region.count));
-		atomic_inc(&mdreq->holdcount);
-
-		/*
-		 * Set SYNC for making metadata
-		 * writes as high priority.
-		 */
-		rw_flags = WRITE | REQ_SYNC;
-		error = eio_io_async_bvec(dmc, &region, rw_flags,
-					  &mdreq->mdblk_bvecs[i], 1,
-					  eio_mdupdate_callback, work, 0);
-		if (error && !(mdreq->error))
-			mdreq->error = error;
+		while (j < SECTORS_PER_PAGE) {
+			if (!(sector_bits[k] & (1 << j))) {
+				j++;
+				continue;
+			}
+			startbit = j;
+			while (j < SECTORS_PER_PAGE && (sector_bits[k] & (1 << j)))
+				j++;
+
+			EIO_ASSERT(nr_runs < MDREQ_MAX_RUNS);
+			EIO_ASSERT(dmc->assoc != 128 || j <= 4);
+			bvec = &mdreq->md_run_bvecs[nr_runs++];
+			bvec->bv_page = mdreq->mdblk_bvecs[k].bv_page;
+			bvec->bv_offset = to_bytes(startbit);
+			bvec->bv_len = to_bytes(j - startbit);
+
+			region.sector =
+				dmc->md_start_sect +
+				INDEX_TO_MD_SECTOR(start_index) +
+				k * SECTORS_PER_PAGE + startbit;
+			region.count = j - startbit;
+			nr_sectors += region.count;
+
+			EIO_STATS_INC(dmc, md_ssd_writes);
+			SECTOR_STATS(dmc, ssd_writes, to_bytes(region.count));
+			atomic_inc(&mdreq->holdcount);
+
+			error = eio_io_async_bvec(dmc, &region, rw_flags,
+						  bvec, 1,
+						  eio_mdupdate_callback, work, 0);
+			if (error && !(mdreq->error))
+				mdreq->error = error;
+		}
 	}
+
+	EIO_STATS_INC(dmc, md_commits);
+	EIO_STATS_ADD(dmc, md_commit_blocks, nr_blocks);
+	EIO_STATS_ADD(dmc, md_commit_sectors, nr_sectors);
+	EIO_STATS_INC(dmc, md_commit_hist[min(fls(nr_blocks) - 1,
+					      MD_COMMIT_HIST - 1)]);
+
 	if (atomic_dec_and_test(&mdreq->holdcount)) {
 		INIT_WORK(&mdreq->work, eio_post_mdupdate);
 		queue_work(dmc->mdupdate_q, &mdreq->work);
@@ -1382,7 +1727,7 @@ static void eio_post_mdupdate(struct work_struct *work)
 
 	/* Update in-core cache metadata */
 
-	spin_lock_irqsave(&set->cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set_index), flags);
 
 	/*
 	 * Update dirty inprog blocks.
@@ -1395,12 +1740,12 @@ static void eio_post_mdupdate(struct work_struct *work)
 			   DIRTY_INPROG);
 		if (unlikely(error)) {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_DEC(dmc, cached_blocks);
 		} else {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, ALREADY_DIRTY);
 			set->nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
-			atomic64_inc(&dmc->eio_stats.md_write_dirty);
+			EIO_STATS_INC(dmc, md_write_dirty);
 		}
 		ebio = ebio->eb_next;
 	}
@@ -1423,7 +1768,7 @@ static void eio_post_mdupdate(struct work_struct *work)
 	ebio = mdreq->inprog_mdlist;
 	mdreq->inprog_mdlist = NULL;
 
-	spin_unlock_irqrestore(&set->cs_lock, flags);
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set_index), flags);
 
 	/* End the processed I/Os */
 	while (ebio) {
@@ -1454,14 +1799,49 @@ static void eio_post_mdupdate(struct work_struct *work)
 		 * No more pending mdupdates.
 		 * Free the mdreq.
 		 */
-		if (mdreq->mdblk_bvecs) {
-			eio_free_wb_bvecs(mdreq->mdblk_bvecs,
-					  mdreq->mdbvec_count,
-					  SECTORS_PER_PAGE);
-			kfree(mdreq->mdblk_bvecs);
+		eio_put_mdreq(dmc, mdreq);
+	}
+}
+
+/*
+ * eio_mdupdate_done
+ *
+ * Same as eio_post_mdupdate() for a list of ebios of any sets, whose
+ * metadata update went through the journal.
+ */
+void eio_mdupdate_done(struct cache_c *dmc, struct eio_bio *ebio, int error)
+{
+	struct cache_set *set;
+	unsigned long flags;
+	struct eio_bio *nebio;
+	index_t set_index;
+
+	while (ebio) {
+		nebio = ebio->eb_next;
+		set_index = ebio->eb_cacheset;
+		set = &dmc->cache_sets[set_index];
+
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set_index), flags);
+		EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, ebio->eb_index) ==
+			   DIRTY_INPROG);
+		if (unlikely(error)) {
+			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
+			EIO_STATS_DEC(dmc, cached_blocks);
+		} else {
+			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, ALREADY_DIRTY);
+			set->nr_dirty++;
+			atomic64_inc(&dmc->nr_dirty);
+			EIO_STATS_INC(dmc, md_write_dirty);
 		}
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set_index), flags);
+
+		eb_endio(ebio, error);
+		ebio = nebio;
 
-		kfree(mdreq);
+		if (!error && (!ebio || ebio->eb_cacheset != set_index)) {
+			eio_touch_set_lru(dmc, set_index);
+			eio_comply_dirty_thresholds(dmc, set_index);
+		}
 	}
 }
 
@@ -1476,6 +1856,13 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 	struct mdupdate_request *mdreq;
 	int do_schedule;
 
+	if (dmc->journal) {
+		ebio = bc->bc_mdlist;
+		bc->bc_mdlist = NULL;
+		eio_journal_enq(dmc, ebio);
+		return;
+	}
+
 	ebio = bc->bc_mdlist;
 	set_index = -1;
 	do_schedule = 0;
@@ -1483,7 +1870,8 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 		if (ebio->eb_cacheset != set_index) {
 			set_index = ebio->eb_cacheset;
 			set = &dmc->cache_sets[set_index];
-			spin_lock_irqsave(&set->cs_lock, flags);
+			spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set_index),
+					  flags);
 		}
 		EIO_ASSERT(ebio->eb_cacheset == set_index);
 
@@ -1510,7 +1898,8 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 
 		ebio = bc->bc_mdlist;
 		if (!ebio || ebio->eb_cacheset != set_index) {
-			spin_unlock_irqrestore(&set->cs_lock, flags);
+			spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set_index),
+					       flags);
 			if (do_schedule) {
 				INIT_WORK(&mdreq->work, eio_do_mdupdate);
 				queue_work(dmc->mdupdate_q, &mdreq->work);
@@ -1562,47 +1951,98 @@ void eio_md_write(struct kcached_job *job)
 		eio_enq_mdupdate(bc);
 }
 
+/*
+ * Queue dirty sets for a cache-wide clean in ascending order, from the
+ * set after the last one queued by the previous clean. Sets map to
+ * consecutive regions of the source device when linear, so that the
+ * cleaners write to it in a sweep rather than all over it.
+ */
+static int64_t eio_sweep_dirty_sets(struct cache_c *dmc,
+				    int64_t required_cleans)
+{
+	int64_t enqueued_cleans = 0;
+	index_t set = dmc->clean_sweep;
+	index_t n;
+	unsigned long flags;
+
+	for (n = 0; n < dmc->num_sets && enqueued_cleans <= required_cleans;
+	     n++) {
+		if (dmc->cache_sets[set].nr_dirty) {
+			spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
+			lru_rem(dmc->dirty_set_lru, set);
+			spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
+			enqueued_cleans += dmc->cache_sets[set].nr_dirty;
+			eio_addto_cleanq(dmc, set, 1);
+		}
+		if (++set == dmc->num_sets)
+			set = 0;
+	}
+	dmc->clean_sweep = set;
+	return enqueued_cleans;
+}
+
+/*
+ * eio_queue_dirty_sets
+ *
+ * Queue whole sets for clean, until they hold more than
+ * "required_cleans" dirty blocks. Returns the dirty blocks queued, 0
+ * if another cache-wide clean is being queued.
+ */
+int64_t eio_queue_dirty_sets(struct cache_c *dmc, int64_t required_cleans)
+{
+	int64_t enqueued_cleans = 0;
+	u_int64_t set_time;
+	index_t set_index;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->clean_sl, flags);
+	if (dmc->clean_excess_dirty) {
+		spin_unlock_irqrestore(&dmc->clean_sl, flags);
+		return 0;
+	}
+	dmc->clean_excess_dirty = 1;
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+
+	if (dmc->set_hash == EIO_SET_HASH_LINEAR) {
+		enqueued_cleans = eio_sweep_dirty_sets(dmc, required_cleans);
+		goto out;
+	}
+
+	spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
+	do {
+		lru_rem_head(dmc->dirty_set_lru, &set_index, &set_time);
+		if (set_index == LRU_NULL)
+			break;
+
+		enqueued_cleans += dmc->cache_sets[set_index].nr_dirty;
+		spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
+		eio_addto_cleanq(dmc, set_index, 1);
+		spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
+	} while (enqueued_cleans <= required_cleans);
+	spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
+
+out:
+	spin_lock_irqsave(&dmc->clean_sl, flags);
+	dmc->clean_excess_dirty = 0;
+	spin_unlock_irqrestore(&dmc->clean_sl, flags);
+	return enqueued_cleans;
+}
+
 /* Ensure cache level dirty thresholds compliance. If required, trigger cache-wide clean */
 static void eio_check_dirty_cache_thresholds(struct cache_c *dmc)
 {
 	if (DIRTY_CACHE_THRESHOLD_CROSSED(dmc)) {
 		int64_t required_cleans;
-		int64_t enqueued_cleans;
-		u_int64_t set_time;
-		index_t set_index;
-		unsigned long flags;
 
-		spin_lock_irqsave(&dmc->clean_sl, flags);
-		if (atomic64_read(&dmc->clean_pendings)
-		    || dmc->clean_excess_dirty) {
-			/* Already excess dirty block cleaning is in progress */
-			spin_unlock_irqrestore(&dmc->clean_sl, flags);
+		/* Already excess dirty block cleaning is in progress */
+		if (atomic64_read(&dmc->clean_pendings))
 			return;
-		}
-		dmc->clean_excess_dirty = 1;
-		spin_unlock_irqrestore(&dmc->clean_sl, flags);
 
 		/* Clean needs to be triggered on the cache */
 		required_cleans = atomic64_read(&dmc->nr_dirty) -
 				  (EIO_DIV((dmc->sysctl_active.dirty_low_threshold * dmc->size),
 					   100));
-		enqueued_cleans = 0;
-
-		spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
-		do {
-			lru_rem_head(dmc->dirty_set_lru, &set_index, &set_time);
-			if (set_index == LRU_NULL)
-				break;
-
-			enqueued_cleans += dmc->cache_sets[set_index].nr_dirty;
-			spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
-			eio_addto_cleanq(dmc, set_index, 1);
-			spin_lock_irqsave(&dmc->dirty_set_lru_lock, flags);
-		} while (enqueued_cleans <= required_cleans);
-		spin_unlock_irqrestore(&dmc->dirty_set_lru_lock, flags);
-		spin_lock_irqsave(&dmc->clean_sl, flags);
-		dmc->clean_excess_dirty = 0;
-		spin_unlock_irqrestore(&dmc->clean_sl, flags);
+		eio_queue_dirty_sets(dmc, required_cleans);
 	}
 }
 
@@ -1659,9 +2099,11 @@ eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 		job->action = READCACHE;        /* Fetch data from cache */
 		atomic_inc(&dmc->nr_jobs);
 
-		SECTOR_STATS(dmc->eio_stats.read_hits, ebio->eb_size);
-		SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.readcache);
+		SECTOR_STATS(dmc, read_hits, ebio->eb_size);
+		if (eio_to_sector(ebio->eb_size) < dmc->block_size)
+			SECTOR_STATS(dmc, partial_read_hits, ebio->eb_size);
+		SECTOR_STATS(dmc, ssd_reads, ebio->eb_size);
+		EIO_STATS_INC(dmc, readcache);
 		err =
 			eio_io_async_bvec(dmc, &job->job_io_regions.cache, rw_flags,
 					  ebio->eb_bv, ebio->eb_nbvec,
@@ -1672,7 +2114,7 @@ eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 		unsigned long flags;
 		pr_err("eio_cached_read: IO submission failed, block %llu",
 		       EIO_DBN_GET(dmc, index));
-		spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 				  flags);
 		/*
 		 * For already DIRTY block, invalidation is too costly, skip it.
@@ -1680,10 +2122,10 @@ eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 		 */
 		if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) != ALREADY_DIRTY) {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_DEC(dmc, cached_blocks);
 		}
-		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
-				       cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
+				       flags);
 		eb_endio(ebio, err);
 		ebio = NULL;
 		if (job) {
@@ -1705,6 +2147,7 @@ eio_inval_block_set_range(struct cache_c *dmc, int set, sector_t iosector,
 {
 	int start_index, end_index, i;
 	sector_t endsector = iosector + eio_to_sector(iosize);
+	u_int8_t cstate;
 
 	start_index = dmc->assoc * set;
 	end_index = start_index + dmc->assoc;
@@ -1719,21 +2162,28 @@ eio_inval_block_set_range(struct cache_c *dmc, int set, sector_t iosector,
 
 		if (!(endsector <= start_dbn || iosector >= end_dbn)) {
 
-			if (!
-			    (EIO_CACHE_STATE_GET(dmc, i) &
-			     (BLOCK_IO_INPROG | DIRTY | QUEUED))) {
-				EIO_CACHE_STATE_SET(dmc, i, INVALID);
-				atomic64_dec_if_positive(&dmc->eio_stats.
-							 cached_blocks);
+			/*
+			 * A read hit may start or end on the block meanwhile,
+			 * without cs_lock: try again with the new state.
+			 */
+retry:
+			cstate = EIO_CACHE_STATE_GET(dmc, i);
+			if (!(cstate & (BLOCK_IO_INPROG | DIRTY | QUEUED))) {
+				if (!eio_cache_state_cmpxchg(dmc, i, cstate,
+							     INVALID))
+					goto retry;
+				EIO_STATS_DEC(dmc, cached_blocks);
 				if (multiblk)
 					continue;
 				return 0;
 			}
 
 			/* Skip queued flag for DIRTY(inprog or otherwise) blocks. */
-			if (!(EIO_CACHE_STATE_GET(dmc, i) & (DIRTY | QUEUED)))
-				/* BLOCK_IO_INPROG is set. Set QUEUED flag */
-				EIO_CACHE_STATE_ON(dmc, i, QUEUED);
+			if (!(cstate & (DIRTY | QUEUED)) &&
+			    /* BLOCK_IO_INPROG is set. Set QUEUED flag */
+			    !eio_cache_state_cmpxchg(dmc, i, cstate,
+						     cstate | QUEUED))
+				goto retry;
 
 			if (!multiblk)
 				return 1;
@@ -1792,9 +2242,9 @@ void eio_inval_range(struct cache_c *dmc, sector_t iosector, unsigned iosize)
 		ioinset = (unsigned)to_bytes(snext - snum);
 		if (ioinset > iosize)
 			ioinset = iosize;
-		spin_lock_irqsave(&dmc->cache_sets[bset].cs_lock, flags);
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, bset), flags);
 		eio_inval_block_set_range(dmc, bset, snum, ioinset, 1);
-		spin_unlock_irqrestore(&dmc->cache_sets[bset].cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, bset), flags);
 		snum = snext;
 		iosize -= ioinset;
 	}
@@ -1812,11 +2262,11 @@ int eio_invalidate_cache(struct cache_c *dmc)
 
 	/* invalidate the whole cache */
 	for (i = 0; i < (dmc->size >> dmc->consecutive_shift); i++) {
-		spin_lock_irqsave(&dmc->cache_sets[i].cs_lock, flags);
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, i), flags);
 		/* TBD. Apply proper fix for the cast to disk_dev_size */
 		(void)eio_inval_block_set_range(dmc, (int)i, 0,
 						(unsigned)disk_dev_size, 0);
-		spin_unlock_irqrestore(&dmc->cache_sets[i].cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, i), flags);
 	}                       /* end - for all cachesets (i) */
 
 	return 0;               /* i suspect we may need to return different statuses in the future */
@@ -1855,7 +2305,7 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		return 0;
 	}
 
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset), flags);
 	cstate = EIO_CACHE_STATE_GET(dmc, index);
 	EIO_ASSERT(cstate & (DIRTY | CACHEWRITEINPROG));
 	if (cstate == ALREADY_DIRTY) {
@@ -1879,7 +2329,7 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		/* ensure DISKWRITEINPROG for uncached write on non-DIRTY blocks */
 		EIO_CACHE_STATE_ON(dmc, index, DISKWRITEINPROG);
 
-	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 			       flags);
 
 	job = eio_new_job(dmc, ebio, index);
@@ -1887,8 +2337,8 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		err = -ENOMEM;
 	else {
 		job->action = WRITECACHE;
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
+		SECTOR_STATS(dmc, ssd_writes, ebio->eb_size);
+		EIO_STATS_INC(dmc, writecache);
 		err = eio_io_async_bvec(dmc, &job->job_io_regions.cache, WRITE,
 					ebio->eb_bv, ebio->eb_nbvec,
 					eio_io_callback, job, 0);
@@ -1897,7 +2347,7 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 	if (err) {
 		pr_err("eio_uncached_write: IO submission failed, block %llu",
 		       EIO_DBN_GET(dmc, index));
-		spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 				  flags);
 		if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) == ALREADY_DIRTY)
 			/*
@@ -1910,13 +2360,13 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		else {
 			/* Mark the block as INVALID for non-DIRTY block. */
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_DEC(dmc, cached_blocks);
 			/* Set the INVAL flag to ensure block is marked invalid at the end */
 			ebio->eb_iotype |= EB_INVAL;
 			ebio->eb_index = -1;
 		}
-		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
-				       cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
+				       flags);
 		if (job) {
 			job->ebio = NULL;
 			eio_free_cache_job(job);
@@ -1951,14 +2401,14 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 	 * TBD
 	 * Possibly don't need the spinlock-unlock here
 	 */
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset), flags);
 	cstate = EIO_CACHE_STATE_GET(dmc, index);
 	if (!(cstate & DIRTY)) {
 		EIO_ASSERT(cstate & CACHEWRITEINPROG);
 		/* make sure the block is marked DIRTY inprogress */
 		EIO_CACHE_STATE_SET(dmc, index, DIRTY_INPROG);
 	}
-	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 			       flags);
 
 	job = eio_new_job(dmc, ebio, index);
@@ -1967,8 +2417,8 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 	else {
 		job->action = WRITECACHE;
 
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
+		SECTOR_STATS(dmc, ssd_writes, ebio->eb_size);
+		EIO_STATS_INC(dmc, writecache);
 		EIO_ASSERT((rw_flags & 1) == WRITE);
 		err =
 			eio_io_async_bvec(dmc, &job->job_io_regions.cache, rw_flags,
@@ -1980,18 +2430,18 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, int rw_flags)
 	if (err) {
 		pr_err("eio_cached_write: IO submission failed, block %llu",
 		       EIO_DBN_GET(dmc, index));
-		spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 				  flags);
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
 		if (cstate == DIRTY_INPROG) {
 			/* A DIRTY(inprog) block should be invalidated on error */
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			EIO_STATS_DEC(dmc, cached_blocks);
 		} else
 			/* An already DIRTY block don't have an option but just return error. */
 			EIO_ASSERT(cstate == ALREADY_DIRTY);
-		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
-				       cs_lock, flags);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
+				       flags);
 		eb_endio(ebio, err);
 		ebio = NULL;
 		if (job) {
@@ -2040,10 +2490,7 @@ static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
 			ios -= len;
 			bvecindex++;
 		}
-		ebio =
-			kmalloc(sizeof(struct eio_bio) +
-				numbvecs * sizeof(struct bio_vec), GFP_NOWAIT);
-
+		ebio = eio_alloc_ebio(bc, numbvecs);
 		if (!ebio)
 			return ERR_PTR(-ENOMEM);
 
@@ -2086,8 +2533,7 @@ static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
 		EIO_ASSERT(rbvindex == numbvecs);
 		ebio->eb_bv = ebio->eb_rbv;
 	} else {
-		ebio = kmalloc(sizeof(struct eio_bio), GFP_NOWAIT);
-
+		ebio = eio_alloc_ebio(bc, 0);
 		if (!ebio)
 			return ERR_PTR(-ENOMEM);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
@@ -2181,19 +2627,19 @@ eio_disk_io(struct cache_c *dmc, struct bio *bio,
 	if (ebio->eb_dir == READ) {
 		job->action = READDISK;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
-		SECTOR_STATS(dmc->eio_stats.disk_reads, bio->bi_iter.bi_size);
+		SECTOR_STATS(dmc, disk_reads, bio->bi_iter.bi_size);
 #else 
-		SECTOR_STATS(dmc->eio_stats.disk_reads, bio->bi_size);
+		SECTOR_STATS(dmc, disk_reads, bio->bi_size);
 #endif 
-		atomic64_inc(&dmc->eio_stats.readdisk);
+		EIO_STATS_INC(dmc, readdisk);
 	} else {
 		job->action = WRITEDISK;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
-		SECTOR_STATS(dmc->eio_stats.disk_writes, bio->bi_iter.bi_size);
+		SECTOR_STATS(dmc, disk_writes, bio->bi_iter.bi_size);
 #else 
-		SECTOR_STATS(dmc->eio_stats.disk_writes, bio->bi_size);
+		SECTOR_STATS(dmc, disk_writes, bio->bi_size);
 #endif 
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		EIO_STATS_INC(dmc, writedisk);
 	}
 
 	/*
@@ -2280,7 +2726,7 @@ insert_set_seq(struct set_seq **seq_list, index_t first_set, index_t last_set)
 		first_set = cur_seq->last_set + 1;
 	}
 
-	new_seq = kmalloc(sizeof(struct set_seq), GFP_NOWAIT);
+	new_seq = mempool_alloc(_seq_pool, GFP_NOWAIT);
 	if (new_seq == NULL)
 		return -ENOMEM;
 	new_seq->first_set = first_set;
@@ -2296,6 +2742,39 @@ insert_set_seq(struct set_seq **seq_list, index_t first_set, index_t last_set)
 	return 0;
 }
 
+/* Read lock the sets of the set span, in ascending order */
+/*
+ * The set span is sorted, and so are the lock table entries of its
+ * sets: an entry shared by several sets of the span is taken once.
+ */
+static void eio_lock_setspan(struct cache_c *dmc, struct bio_container *bc)
+{
+	struct set_seq *cur_seq;
+	index_t i, last = -1;
+
+	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
+		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++) {
+			if ((i >> dmc->set_locks_shift) == last)
+				continue;
+			last = i >> dmc->set_locks_shift;
+			down_read(EIO_SET_RW_LOCK(dmc, i));
+		}
+}
+
+static void eio_unlock_setspan(struct cache_c *dmc, struct bio_container *bc)
+{
+	struct set_seq *cur_seq;
+	index_t i, last = -1;
+
+	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
+		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++) {
+			if ((i >> dmc->set_locks_shift) == last)
+				continue;
+			last = i >> dmc->set_locks_shift;
+			up_read(EIO_SET_RW_LOCK(dmc, i));
+		}
+}
+
 /* Acquire read/shared lock for the sets covering the entire I/O range */
 static int eio_acquire_set_locks(struct cache_c *dmc, struct bio_container *bc)
 {
@@ -2306,7 +2785,6 @@ static int eio_acquire_set_locks(struct cache_c *dmc, struct bio_container *bc)
 	index_t cur_set;
 	index_t first_set;
 	index_t last_set;
-	index_t i;
 	struct set_seq *cur_seq;
 	struct set_seq *next_seq;
 	int error;
@@ -2376,9 +2854,7 @@ static int eio_acquire_set_locks(struct cache_c *dmc, struct bio_container *bc)
 	}
 
 	/* Acquire read locks on the sets in the set span */
-	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
-		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++)
-			down_read(&dmc->cache_sets[i].rw_lock);
+	eio_lock_setspan(dmc, bc);
 
 	return 0;
 
@@ -2388,124 +2864,274 @@ err_out:
 	if (bc->bc_setspan != &bc->bc_singlesspan) {
 		for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = next_seq) {
 			next_seq = cur_seq->next;
-			kfree(cur_seq);
+			mempool_free(cur_seq, _seq_pool);
 		}
 	}
 	return error;
 }
 
 /*
- * Allocate mdreq and md_blocks for each set.
+ * The set of a block of the I/O which is being cleaned, if any, else -1.
+ * Its set lock must be held.
  */
-static int eio_alloc_mdreqs(struct cache_c *dmc, struct bio_container *bc)
+static index_t eio_clean_set_of(struct cache_c *dmc, struct eio_bio *ebegin)
 {
-	index_t i;
-	struct mdupdate_request *mdreq;
-	int nr_bvecs, ret;
-	struct set_seq *cur_seq;
-
-	bc->mdreqs = NULL;
-
-	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next) {
-		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++) {
-			mdreq = kzalloc(sizeof(*mdreq), GFP_NOWAIT);
-			if (mdreq) {
-				mdreq->md_size =
-					dmc->assoc *
-					sizeof(struct flash_cacheblock);
-				nr_bvecs =
-					IO_BVEC_COUNT(mdreq->md_size,
-						      SECTORS_PER_PAGE);
-
-				mdreq->mdblk_bvecs =
-					(struct bio_vec *)
-					kmalloc(sizeof(struct bio_vec) * nr_bvecs,
-						GFP_KERNEL);
-				if (mdreq->mdblk_bvecs) {
-
-					ret =
-						eio_alloc_wb_bvecs(mdreq->
-								   mdblk_bvecs,
-								   nr_bvecs,
-								   SECTORS_PER_PAGE);
-					if (ret) {
-						pr_err
-							("eio_alloc_mdreqs: failed to allocated pages\n");
-						kfree(mdreq->mdblk_bvecs);
-						mdreq->mdblk_bvecs = NULL;
-					}
-					mdreq->mdbvec_count = nr_bvecs;
-				}
-			}
+	struct eio_bio *ebio;
+	unsigned long flags;
+	sector_t dbn;
+	index_t set, start_index, i;
+	int busy;
+
+	for (ebio = ebegin; ebio; ebio = ebio->eb_next) {
+		dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+		set = hash_block(dmc, dbn);
+		if (!(dmc->cache_sets[set].flags & SETFLAG_CLEANING))
+			continue;
 
-			if (unlikely
-				    ((mdreq == NULL) || (mdreq->mdblk_bvecs == NULL))) {
-				struct mdupdate_request *nmdreq;
-
-				mdreq = bc->mdreqs;
-				while (mdreq) {
-					nmdreq = mdreq->next;
-					if (mdreq->mdblk_bvecs) {
-						eio_free_wb_bvecs(mdreq->
-								  mdblk_bvecs,
-								  mdreq->
-								  mdbvec_count,
-								  SECTORS_PER_PAGE);
-						kfree(mdreq->mdblk_bvecs);
-					}
-					kfree(mdreq);
-					mdreq = nmdreq;
-				}
-				bc->mdreqs = NULL;
-				return -ENOMEM;
-			} else {
-				mdreq->next = bc->mdreqs;
-				bc->mdreqs = mdreq;
-			}
-		}
+		start_index = set * dmc->assoc;
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+		if (dmc->dbn_index)
+			i = eio_dbn_index_find(dmc, start_index, dbn);
+		else
+			i = eio_scan_valid_dbn(dmc, start_index, dbn);
+		busy = i != -1 && EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG;
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+		if (busy)
+			return set;
 	}
+	return -1;
+}
 
-	return 0;
-
+/*
+ * eio_wait_block_cleans
+ *
+ * A cleaner holds the set lock for write only while it picks the blocks
+ * to clean, and while it commits their metadata without a journal; app
+ * I/O to the other blocks of the set goes on while the blocks are read
+ * from the ssd and written to the hdd. An I/O to one of the blocks
+ * being cleaned waits for the clean of the set to end, with its set
+ * locks released, as the cleaner takes the set lock again to commit.
+ */
+static void eio_wait_block_cleans(struct cache_c *dmc, struct bio_container *bc,
+				  struct eio_bio *ebegin)
+{
+	index_t set;
+
+	while ((set = eio_clean_set_of(dmc, ebegin)) != -1) {
+		EIO_STATS_INC(dmc, clean_waits);
+		eio_unlock_setspan(dmc, bc);
+		wait_event(*EIO_SET_WQ(dmc, set),
+			   !(dmc->cache_sets[set].flags & SETFLAG_CLEANING));
+		eio_lock_setspan(dmc, bc);
+	}
 }
 
 /*
- * Release:
- * 1. the set locks covering the entire I/O range
- * 2. any previously allocated memory for md update
+ * Metadata update requests of a write-back cache come from a pool of
+ * "mdreq_pool" requests per cache, allocated along with their metadata
+ * pages when the write-back resources are set up. A set holds at most
+ * one mdreq at a time, so the pool bounds the number of sets with a
+ * metadata update in flight. A write waits when the pool runs short;
+ * one which spans more sets than the pool holds allocates its mdreqs.
  */
-static int
-eio_release_io_resources(struct cache_c *dmc, struct bio_container *bc)
+static unsigned int mdreq_pool = 256;
+module_param(mdreq_pool, uint, 0444);
+MODULE_PARM_DESC(mdreq_pool,
+		 "Metadata update requests preallocated per write-back cache");
+
+static struct mdupdate_request *eio_new_mdreq(struct cache_c *dmc)
 {
-	index_t i;
 	struct mdupdate_request *mdreq;
-	struct mdupdate_request *nmdreq;
-	struct set_seq *cur_seq;
-	struct set_seq *next_seq;
+	int nr_bvecs;
+
+	mdreq = kzalloc(sizeof(*mdreq), GFP_NOIO);
+	if (!mdreq)
+		return NULL;
+
+	mdreq->md_size = dmc->assoc * sizeof(struct flash_cacheblock);
+	nr_bvecs = IO_BVEC_COUNT(mdreq->md_size, SECTORS_PER_PAGE);
+	mdreq->mdblk_bvecs = kmalloc(sizeof(struct bio_vec) * nr_bvecs,
+				     GFP_NOIO);
+	if (!mdreq->mdblk_bvecs)
+		goto free_mdreq;
+
+	if (eio_alloc_wb_bvecs(mdreq->mdblk_bvecs, nr_bvecs,
+			       SECTORS_PER_PAGE)) {
+		pr_err("eio_new_mdreq: failed to allocated pages\n");
+		goto free_bvecs;
+	}
+	mdreq->mdbvec_count = nr_bvecs;
+	return mdreq;
+
+free_bvecs:
+	kfree(mdreq->mdblk_bvecs);
+free_mdreq:
+	kfree(mdreq);
+	return NULL;
+}
 
-	/* Release read locks on the sets in the set span */
-	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
-		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++)
-			up_read(&dmc->cache_sets[i].rw_lock);
+static void eio_destroy_mdreq(struct mdupdate_request *mdreq)
+{
 
-	/* Free the seqs in the set span, unless it is single span */
-	if (bc->bc_setspan != &bc->bc_singlesspan) {
-		for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = next_seq) {
-			next_seq = cur_seq->next;
-			kfree(cur_seq);
-		}
-	}
+	eio_free_wb_bvecs(mdreq->mdblk_bvecs, mdreq->mdbvec_count,
+			  SECTORS_PER_PAGE);
+	kfree(mdreq->mdblk_bvecs);
+	kfree(mdreq);
+}
+
+/* Give back an mdreq to the pool, or free it if it is not pooled */
+static void eio_put_mdreq(struct cache_c *dmc, struct mdupdate_request *mdreq)
+{
+	unsigned long flags;
+
+	if (!mdreq->pooled) {
+		eio_destroy_mdreq(mdreq);
+		return;
+	}
+
+	EIO_ASSERT(!mdreq->pending_mdlist && !mdreq->inprog_mdlist);
+	spin_lock_irqsave(&dmc->mdreq_pool_lock, flags);
+	mdreq->next = dmc->mdreq_pool;
+	dmc->mdreq_pool = mdreq;
+	dmc->mdreq_pool_free++;
+	spin_unlock_irqrestore(&dmc->mdreq_pool_lock, flags);
+
+	if (waitqueue_active(&dmc->mdreq_pool_wait))
+		wake_up(&dmc->mdreq_pool_wait);
+}
+
+int eio_mdreq_pool_init(struct cache_c *dmc)
+{
+	struct mdupdate_request *mdreq;
+	u_int64_t num_sets = dmc->size >> dmc->consecutive_shift;
+	unsigned i;
+
+	spin_lock_init(&dmc->mdreq_pool_lock);
+	init_waitqueue_head(&dmc->mdreq_pool_wait);
+	dmc->mdreq_pool = NULL;
+	dmc->mdreq_pool_free = 0;
+	dmc->mdreq_pool_size = max_t(unsigned, mdreq_pool, 1);
+	if (dmc->mdreq_pool_size > num_sets)
+		dmc->mdreq_pool_size = (unsigned)num_sets;
+
+	for (i = 0; i < dmc->mdreq_pool_size; i++) {
+		mdreq = eio_new_mdreq(dmc);
+		if (!mdreq) {
+			pr_err("mdreq_pool_init: Failed to allocate %u mdreqs",
+			       dmc->mdreq_pool_size);
+			dmc->mdreq_pool_size = dmc->mdreq_pool_free;
+			eio_mdreq_pool_exit(dmc);
+			return -ENOMEM;
+		}
+		mdreq->pooled = 1;
+		mdreq->next = dmc->mdreq_pool;
+		dmc->mdreq_pool = mdreq;
+		dmc->mdreq_pool_free++;
+	}
+
+	return 0;
+}
+
+/* Called once all the metadata updates are done */
+void eio_mdreq_pool_exit(struct cache_c *dmc)
+{
+	struct mdupdate_request *mdreq;
+
+	EIO_ASSERT(dmc->mdreq_pool_free == dmc->mdreq_pool_size);
+	while (dmc->mdreq_pool) {
+		mdreq = dmc->mdreq_pool;
+		dmc->mdreq_pool = mdreq->next;
+		eio_destroy_mdreq(mdreq);
+	}
+	dmc->mdreq_pool_free = dmc->mdreq_pool_size = 0;
+}
+
+/*
+ * Allocate mdreq and md_blocks for each set.
+ */
+static int eio_alloc_mdreqs(struct cache_c *dmc, struct bio_container *bc)
+{
+	index_t i;
+	struct mdupdate_request *mdreq;
+	struct set_seq *cur_seq;
+	unsigned nr_sets = 0;
+	unsigned long flags;
+
+	bc->mdreqs = NULL;
+
+	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
+		nr_sets += cur_seq->last_set - cur_seq->first_set + 1;
+
+	if (likely(nr_sets <= dmc->mdreq_pool_size)) {
+		/* Take them all at once, two writes holding part of the pool would deadlock */
+		spin_lock_irqsave(&dmc->mdreq_pool_lock, flags);
+		while (dmc->mdreq_pool_free < nr_sets) {
+			spin_unlock_irqrestore(&dmc->mdreq_pool_lock, flags);
+			EIO_STATS_INC(dmc, mdreq_waits);
+			wait_event(dmc->mdreq_pool_wait,
+				   dmc->mdreq_pool_free >= nr_sets);
+			spin_lock_irqsave(&dmc->mdreq_pool_lock, flags);
+		}
+		dmc->mdreq_pool_free -= nr_sets;
+		while (nr_sets--) {
+			mdreq = dmc->mdreq_pool;
+			dmc->mdreq_pool = mdreq->next;
+			mdreq->next = bc->mdreqs;
+			bc->mdreqs = mdreq;
+		}
+		spin_unlock_irqrestore(&dmc->mdreq_pool_lock, flags);
+		return 0;
+	}
+
+	for (i = 0; i < nr_sets; i++) {
+		mdreq = eio_new_mdreq(dmc);
+		if (unlikely(mdreq == NULL)) {
+			struct mdupdate_request *nmdreq;
+
+			mdreq = bc->mdreqs;
+			while (mdreq) {
+				nmdreq = mdreq->next;
+				eio_destroy_mdreq(mdreq);
+				mdreq = nmdreq;
+			}
+			bc->mdreqs = NULL;
+			return -ENOMEM;
+		}
+		mdreq->next = bc->mdreqs;
+		bc->mdreqs = mdreq;
+	}
+
+	return 0;
+}
+
+/*
+ * Release:
+ * 1. the set locks covering the entire I/O range
+ * 2. any previously allocated memory for md update
+ */
+static int
+eio_release_io_resources(struct cache_c *dmc, struct bio_container *bc)
+{
+	struct mdupdate_request *mdreq;
+	struct mdupdate_request *nmdreq;
+	struct set_seq *cur_seq;
+	struct set_seq *next_seq;
+
+	/* Release read locks on the sets in the set span */
+	eio_unlock_setspan(dmc, bc);
+
+	/* Free the seqs in the set span, unless it is single span */
+	if (bc->bc_setspan != &bc->bc_singlesspan) {
+		for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = next_seq) {
+			next_seq = cur_seq->next;
+			mempool_free(cur_seq, _seq_pool);
+		}
+	}
 
 	mdreq = bc->mdreqs;
 	while (mdreq) {
 		nmdreq = mdreq->next;
-		if (mdreq->mdblk_bvecs) {
-			eio_free_wb_bvecs(mdreq->mdblk_bvecs,
-					  mdreq->mdbvec_count,
-					  SECTORS_PER_PAGE);
-			kfree(mdreq->mdblk_bvecs);
-		}
-		kfree(mdreq);
+		eio_put_mdreq(dmc, mdreq);
 		mdreq = nmdreq;
 	}
 	bc->mdreqs = NULL;
@@ -2532,6 +3158,7 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	unsigned int residual_biovec;
 	unsigned int force_uncached = 0;
 	int data_dir = bio_data_dir(bio);
+	struct eio_io_region ra;
 
 	/*bio list*/
 	struct eio_bio *ebegin = NULL;
@@ -2574,22 +3201,22 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	}
 
 	if (sectors < SIZE_HIST)
-		atomic64_inc(&dmc->size_hist[sectors]);
+		this_cpu_inc(dmc->pcpu_stats->size_hist[sectors]);
 
 	if (data_dir == READ) {
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
-		SECTOR_STATS(dmc->eio_stats.reads, bio->bi_iter.bi_size);
+		SECTOR_STATS(dmc, reads, bio->bi_iter.bi_size);
 #else 
-		SECTOR_STATS(dmc->eio_stats.reads, bio->bi_size);
+		SECTOR_STATS(dmc, reads, bio->bi_size);
 #endif 
-		atomic64_inc(&dmc->eio_stats.readcount);
+		EIO_STATS_INC(dmc, readcount);
 	} else {
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
-		SECTOR_STATS(dmc->eio_stats.writes, bio->bi_iter.bi_size);
+		SECTOR_STATS(dmc, writes, bio->bi_iter.bi_size);
 #else 
-		SECTOR_STATS(dmc->eio_stats.writes, bio->bi_size);
+		SECTOR_STATS(dmc, writes, bio->bi_size);
 #endif 
-		atomic64_inc(&dmc->eio_stats.writecount);
+		EIO_STATS_INC(dmc, writecount);
 	}
 
 	/*
@@ -2616,9 +3243,9 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 #else
 		if (to_sector(bio->bi_size) != dmc->block_size)
 #endif
-			atomic64_inc(&dmc->eio_stats.uncached_map_size);
+			EIO_STATS_INC(dmc, uncached_map_size);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_map_uncacheable);
+			EIO_STATS_INC(dmc, uncached_map_uncacheable);
 		force_uncached = 1;
 	}
 
@@ -2635,13 +3262,13 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		return DM_MAPIO_SUBMITTED;
 	}
 
-	/* Create a bio container */
+	/*
+	 * Create a bio container. It is held only until this bio
+	 * completes, so waiting for one to come back to the pool is safe.
+	 */
 
-	bc = kzalloc(sizeof(struct bio_container), GFP_NOWAIT);
-	if (!bc) {
-		bio_endio(bio, -ENOMEM);
-		return DM_MAPIO_SUBMITTED;
-	}
+	bc = mempool_alloc(_bc_pool, GFP_NOIO);
+	memset(bc, 0, offsetof(struct bio_container, bc_ebio));
 	bc->bc_iotime = jiffies;
 	bc->bc_bio = bio;
 	bc->bc_dmc = dmc;
@@ -2660,23 +3287,42 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 #endif 
 	residual_biovec = 0;
 
+	/*
+	 * Past "sequential_cutoff_kb" of a stream, reads fill no blocks and
+	 * writes to a write-through or read-only cache go uncached.
+	 */
+	if (eio_seq_detect(dmc, snum, sectors,
+			   data_dir == READ ? &ra : NULL) && !force_uncached) {
+		if (data_dir == READ) {
+			bc->bc_seq_bypass = 1;
+			EIO_STATS_INC(dmc, seq_bypass_reads);
+		} else if (dmc->mode != CACHE_MODE_WB) {
+			force_uncached = 1;
+			EIO_STATS_INC(dmc, seq_bypass_writes);
+		}
+	}
+
 	if (dmc->mode == CACHE_MODE_WB) {
 		int ret;
+
+		if (data_dir == WRITE && !force_uncached)
+			eio_write_throttle(dmc, bc, snum, totalio);
+
 		/*
-		 * For writeback, the app I/O and the clean I/Os
-		 * need to be exclusive for a cache set. Acquire shared
-		 * lock on the cache set for app I/Os and exclusive
-		 * lock on the cache set for clean I/Os.
+		 * For writeback, the app I/O and the cleaners need to be
+		 * exclusive for a cache set while the blocks to clean are
+		 * picked and committed. Acquire shared lock on the cache
+		 * set for app I/Os, see eio_wait_block_cleans().
 		 */
 		ret = eio_acquire_set_locks(dmc, bc);
 		if (ret) {
 			bio_endio(bio, ret);
-			kfree(bc);
+			mempool_free(bc, _bc_pool);
 			return DM_MAPIO_SUBMITTED;
 		}
 	}
 
-	atomic64_inc(&dmc->nr_ios);
+	this_cpu_inc(dmc->pcpu_stats->nr_ios);
 
 	/*
 	 * Prepare for I/O processing.
@@ -2732,17 +3378,22 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	 *      Error handling would be done as part of
 	 *      the processing of the ebios internally.
 	 */
+	if (dmc->mode == CACHE_MODE_WB)
+		eio_wait_block_cleans(dmc, bc, ebegin);
+
 	if (force_uncached) {
 		EIO_ASSERT(dmc->mode != CACHE_MODE_WB);
 		if (data_dir == READ)
-			atomic64_inc(&dmc->eio_stats.uncached_reads);
+			EIO_STATS_INC(dmc, uncached_reads);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_writes);
+			EIO_STATS_INC(dmc, uncached_writes);
 		eio_disk_io(dmc, bio, ebegin, bc, 1);
 	} else if (data_dir == READ) {
 
 		/* read io processing */
 		eio_read(dmc, bc, ebegin);
+		if (ra.count)
+			eio_readahead(dmc, &ra);
 	} else
 		/* write io processing */
 		eio_write(dmc, bc, ebegin);
@@ -2755,6 +3406,138 @@ out:
 	return DM_MAPIO_SUBMITTED;
 }
 
+/*
+ * Give a block a new dbn. Lookups without cs_lock which run meanwhile
+ * retry, see eio_read_peek_fast().
+ */
+static void eio_set_block_dbn(struct cache_c *dmc, index_t index, sector_t dbn)
+{
+	seqcount_t *seq = EIO_SET_DBN_SEQ(dmc, index >> dmc->consecutive_shift);
+
+	write_seqcount_begin(seq);
+	EIO_DBN_SET(dmc, index, dbn);
+	write_seqcount_end(seq);
+
+	if (unlikely(dmc->readahead_map) &&
+	    test_and_clear_bit(index, dmc->readahead_map))
+		EIO_STATS_INC(dmc, readahead_wasted);
+}
+
+/* Count the first read of a block filled by a read-ahead */
+static inline void eio_readahead_hit(struct cache_c *dmc, index_t index)
+{
+
+	if (unlikely(dmc->readahead_map) &&
+	    test_bit(index, dmc->readahead_map) &&
+	    test_and_clear_bit(index, dmc->readahead_map))
+		EIO_STATS_INC(dmc, readahead_hits);
+}
+
+/*
+ * eio_read_peek_fast
+ *
+ * The lookup of a read, without cs_lock. The block carrying the dbn of
+ * the ebio is looked up under the dbn_seq of its set, and the lookup
+ * retried if a block of the set changed dbn meanwhile.
+ *
+ * On a hit, the metadata word of the block is compared and swapped
+ * from VALID with the dbn to VALID | CACHEREADINPROG, so that the block
+ * is known to still hold that dbn, and is not recycled until the read
+ * is over. An already DIRTY block is read as it is. The LRU is only
+ * touched if cs_lock is free.
+ *
+ * A miss, or a hit on a block with I/O in progress, goes to the source
+ * device without cs_lock too, unless eio_read_peek() may claim a block
+ * for a readfill: only block sized, non sequential reads of a writable
+ * cache do.
+ *
+ * Returns 1 on a hit, -1 on a miss, 0 if eio_read_peek() has to look
+ * under cs_lock.
+ */
+static int eio_read_peek_fast(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	struct eio_set_lock *sl = eio_set_lock(dmc, ebio->eb_cacheset);
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	index_t start_index = dmc->assoc * ebio->eb_cacheset;
+	u_int32_t shift = EIO_MD_STATE_SHIFT(dmc);
+	u_int64_t dbn_mask = ((u_int64_t)1 << shift) - 1;
+	u_int64_t key, word;
+	unsigned long flags;
+	unsigned seq;
+	index_t index;
+	u_int8_t cstate;
+
+	key = EIO_MD8(dmc) ? (u_int64_t)dbn : eio_shrink_dbn(dmc, dbn);
+	do {
+		seq = read_seqcount_begin(&sl->dbn_seq);
+		if (dmc->dbn_index)
+			index = eio_dbn_index_find(dmc, start_index, dbn);
+		else
+			index = eio_scan_valid_dbn(dmc, start_index, dbn);
+		word = index == -1 ? 0 : eio_md_word(dmc, index);
+	} while (read_seqcount_retry(&sl->dbn_seq, seq));
+
+	cstate = (u_int8_t)(word >> shift);
+	if (index == -1 || (word & dbn_mask) != key || !(cstate & VALID)) {
+		/* Miss */
+		if (eio_to_sector(ebio->eb_size) == dmc->block_size &&
+		    !dmc->cache_rdonly && !ebio->eb_bc->bc_seq_bypass)
+			return 0;
+		goto miss;
+	}
+
+	if (cstate == ALREADY_DIRTY) {
+		ebio->eb_iotype = EB_MAIN_IO;
+		ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+	} else if (cstate & (BLOCK_IO_INPROG | QUEUED))
+		/* eio_read_peek() would not wait for the I/O either */
+		goto miss;
+	else if (cstate != VALID ||
+		 eio_md_word_cmpxchg(dmc, index, word,
+				     word | ((u_int64_t)CACHEREADINPROG <<
+					     shift)) != word)
+		return 0;
+
+	ebio->eb_index = index;
+	SECTOR_STATS(dmc, lockless_read_hits, ebio->eb_size);
+	eio_readahead_hit(dmc, index);
+
+	if (spin_trylock_irqsave(&sl->cs_lock, flags)) {
+		eio_policy_reclaim_lru_movetail(dmc, index, dmc->policy_ops);
+		spin_unlock_irqrestore(&sl->cs_lock, flags);
+	}
+	return 1;
+
+miss:
+	ebio->eb_index = -1;
+	EIO_STATS_INC(dmc, lockless_read_misses);
+	return -1;
+}
+
+/*
+ * With "readfill_admit" set, a block read from the source device is
+ * only written to the cache on its second miss in a while, see
+ * eio_ghost_admit(). The blocks of a sequential read are not written
+ * at all. Called with cs_lock.
+ */
+static int eio_readfill_admit(struct cache_c *dmc, struct eio_bio *ebio)
+{
+
+	if (ebio->eb_bc->bc_seq_bypass)
+		return 0;
+	if (dmc->sysctl_active.readfill_admit == READFILL_ADMIT_ALL ||
+	    ACCESS_ONCE(dmc->ghost) == NULL)
+		return 1;
+
+	if (eio_ghost_admit(dmc, ebio->eb_cacheset,
+			    EIO_ROUND_SECTOR(dmc, ebio->eb_sector))) {
+		EIO_STATS_INC(dmc, readfill_admitted);
+		return 1;
+	}
+	EIO_STATS_INC(dmc, readfill_rejected);
+	return 0;
+}
+
 /*
  * Checks the cache block state, for deciding cached/uncached read.
  * Also reserves/allocates the cache block, wherever necessary.
@@ -2771,13 +3554,13 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	unsigned long flags;
 	u_int8_t cstate;
 
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset), flags);
 
 	res = eio_lookup(dmc, ebio, &index);
 	ebio->eb_index = -1;
 
 	if (res < 0) {
-		atomic64_inc(&dmc->eio_stats.noroom);
+		EIO_STATS_INC(dmc, noroom);
 		goto out;
 	}
 
@@ -2812,10 +3595,14 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 				 */
 				ebio->eb_bc->bc_dir =
 					UNCACHED_READ_AND_READFILL;
-			} else
-				EIO_CACHE_STATE_ON(dmc, index, CACHEREADINPROG);
+			} else if (!eio_cache_state_cmpxchg(dmc, index, cstate,
+							    cstate |
+							    CACHEREADINPROG))
+				/* A read hit without cs_lock got there first */
+				goto out;
 			retval = 1;
 			ebio->eb_index = index;
+			eio_readahead_hit(dmc, index);
 			goto out;
 		}
 
@@ -2830,9 +3617,13 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		EIO_ASSERT(!(cstate & DIRTY));
 		if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
 			/*We can recycle and then READFILL only if iosize is block size*/
-			atomic64_inc(&dmc->eio_stats.rd_replace);
-			EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-			EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+			if (!eio_readfill_admit(dmc, ebio) ||
+			    !eio_cache_state_cmpxchg(dmc, index, cstate,
+						     VALID | DISKREADINPROG))
+				goto out;
+			EIO_STATS_INC(dmc, rd_replace);
+			eio_set_block_dbn(dmc, index,
+					  (sector_t)ebio->eb_sector);
 			ebio->eb_index = index;
 			ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
 		}
@@ -2847,18 +3638,19 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	 * Found an invalid block to be used.
 	 * Can recycle only if iosize is block size
 	 */
-	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
+	if (eio_to_sector(ebio->eb_size) == dmc->block_size &&
+	    eio_readfill_admit(dmc, ebio)) {
 		EIO_ASSERT(cstate & INVALID);
 		EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-		atomic64_inc(&dmc->eio_stats.cached_blocks);
-		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+		EIO_STATS_INC(dmc, cached_blocks);
+		eio_set_block_dbn(dmc, index, (sector_t)ebio->eb_sector);
 		ebio->eb_index = index;
 		ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
 	}
 
 out:
 
-	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 			       flags);
 
 	/*
@@ -2888,7 +3680,7 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	u_int8_t cstate;
 	unsigned long flags;
 
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset), flags);
 
 	res = eio_lookup(dmc, ebio, &index);
 	ebio->eb_index = -1;
@@ -2896,7 +3688,7 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 
 	if (res < 0) {
 		/* cache block not found and new block couldn't be allocated */
-		atomic64_inc(&dmc->eio_stats.noroom);
+		EIO_STATS_INC(dmc, noroom);
 		ebio->eb_iotype |= EB_INVAL;
 		goto out;
 	}
@@ -2916,11 +3708,16 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		 * All except an already DIRTY block should have an INPROG flag.
 		 * If it is a cached write, a DIRTY flag would be added later.
 		 */
-		SECTOR_STATS(dmc->eio_stats.write_hits, ebio->eb_size);
-		if (cstate != ALREADY_DIRTY)
-			EIO_CACHE_STATE_ON(dmc, index, CACHEWRITEINPROG);
-		else
-			atomic64_inc(&dmc->eio_stats.dirty_write_hits);
+		if (cstate != ALREADY_DIRTY &&
+		    !eio_cache_state_cmpxchg(dmc, index, cstate,
+					     cstate | CACHEWRITEINPROG)) {
+			/* A read hit without cs_lock got there first */
+			ebio->eb_iotype |= EB_INVAL;
+			goto out;
+		}
+		SECTOR_STATS(dmc, write_hits, ebio->eb_size);
+		if (cstate == ALREADY_DIRTY)
+			EIO_STATS_INC(dmc, dirty_write_hits);
 		ebio->eb_index = index;
 		/*
 		 * A VALID block should get upgraded to DIRTY, only when we
@@ -2946,12 +3743,16 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	 */
 	EIO_ASSERT(!(EIO_CACHE_STATE_GET(dmc, index) & DIRTY));
 	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
+		if (!eio_cache_state_cmpxchg(dmc, index, cstate,
+					     VALID | CACHEWRITEINPROG)) {
+			ebio->eb_iotype |= EB_INVAL;
+			goto out;
+		}
 		if (res == VALID)
-			atomic64_inc(&dmc->eio_stats.wr_replace);
+			EIO_STATS_INC(dmc, wr_replace);
 		else
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
-		EIO_CACHE_STATE_SET(dmc, index, VALID | CACHEWRITEINPROG);
-		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+			EIO_STATS_INC(dmc, cached_blocks);
+		eio_set_block_dbn(dmc, index, (sector_t)ebio->eb_sector);
 		ebio->eb_index = index;
 		retval = 1;
 	} else {
@@ -2968,7 +3769,7 @@ out:
 	    (cstate != ALREADY_DIRTY))
 		ebio->eb_bc->bc_mdwait++;
 
-	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
 			       flags);
 
 	/*
@@ -2994,8 +3795,18 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 	ebio = ebegin;
 	while (ebio) {
 		enext = ebio->eb_next;
-		if (eio_read_peek(dmc, ebio) == 0)
+		if (eio_to_sector(ebio->eb_size) < dmc->block_size)
+			SECTOR_STATS(dmc, partial_reads, ebio->eb_size);
+		switch (eio_read_peek_fast(dmc, ebio)) {
+		case 1:
+			break;
+		case 0:
+			if (eio_read_peek(dmc, ebio))
+				break;
+			/* fall through */
+		default:
 			ucread = 1;
+		}
 		ebio = enext;
 	}
 
@@ -3005,8 +3816,9 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 		 * Start HDD I/O. Once that is finished
 		 * readfill or dirty block re-read would start
 		 */
-		atomic64_inc(&dmc->eio_stats.uncached_reads);
-		eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
+		EIO_STATS_INC(dmc, uncached_reads);
+		if (!eio_read_expand(dmc, bc, ebegin))
+			eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
 	} else {
 		/* Cached read. Serve the read from SSD */
 
@@ -3034,85 +3846,448 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 	}
 }
 
-/* Top level write function called from eio_map */
-static void
-eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
+/*
+ * Read-ahead. With "readahead_blocks" set, a read which extends a
+ * sequential stream queues the read of the blocks following it, see
+ * eio_seq_detect(), so that the next reads of the stream hit. The
+ * read-ahead runs from "readahead_q": it claims the free or reclaimable
+ * blocks of the window as a read miss would, reads the window from the
+ * source device in one I/O and leaves the blocks to the readfill
+ * workers. Blocks already cached or busy are read but not filled.
+ *
+ * A read-ahead holds an nr_ios count from the time it is queued, so the
+ * cache is not torn down under it.
+ */
+struct eio_readahead {
+	struct work_struct work;
+	struct cache_c *dmc;
+	sector_t sector;
+	sector_t count;
+};
+
+/*
+ * Claims the block of a read-ahead ebio for a readfill, as a read miss
+ * does in eio_read_peek(), but regardless of "readfill_admit": the
+ * block is expected to be read soon. Returns 1 if the block was
+ * claimed, 0 if it is cached already, busy, or its set has no room.
+ */
+static int eio_readahead_peek(struct cache_c *dmc, struct eio_bio *ebio)
 {
-	int ucwrite = 0;
-	int error = 0;
-	struct eio_bio *ebio;
-	struct eio_bio *enext;
+	index_t index;
+	int res;
+	int retval = 0;
+	unsigned long flags;
+	u_int8_t cstate;
 
-	if ((dmc->mode != CACHE_MODE_WB) ||
-	    (dmc->sysctl_active.do_clean & EIO_CLEAN_KEEP))
-		ucwrite = 1;
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset), flags);
 
-	ebio = ebegin;
-	while (ebio) {
-		enext = ebio->eb_next;
-		if (eio_write_peek(dmc, ebio) == 0)
-			ucwrite = 1;
-		ebio = enext;
-	}
+	res = eio_lookup(dmc, ebio, &index);
+	ebio->eb_index = -1;
+	if (res < 0 || unlikely(dmc->cache_rdonly))
+		goto out;
 
-	if (ucwrite) {
-		/*
-		 * Uncached write.
-		 * Start both SSD and HDD writes
-		 */
-		atomic64_inc(&dmc->eio_stats.uncached_writes);
-		bc->bc_mdwait = 0;
-		bc->bc_dir = UNCACHED_WRITE;
-		ebio = ebegin;
-		while (ebio) {
-			enext = ebio->eb_next;
-			eio_uncached_write(dmc, ebio);
-			ebio = enext;
-		}
+	cstate = EIO_CACHE_STATE_GET(dmc, index);
+	if (cstate & (BLOCK_IO_INPROG | QUEUED))
+		goto out;
 
-		eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
+	if (res == VALID) {
+		if (EIO_DBN_GET(dmc, index) == ebio->eb_sector)
+			goto out;
+		EIO_ASSERT(!(cstate & DIRTY));
+		if (!eio_cache_state_cmpxchg(dmc, index, cstate,
+					     VALID | DISKREADINPROG))
+			goto out;
+		EIO_STATS_INC(dmc, rd_replace);
 	} else {
-		/* Cached write. Start writes to SSD blocks */
-
-		int rw_flags;
-		rw_flags = 0;
+		EIO_ASSERT(cstate & INVALID);
+		EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
+		EIO_STATS_INC(dmc, cached_blocks);
+	}
+	eio_set_block_dbn(dmc, index, ebio->eb_sector);
+	set_bit(index, dmc->readahead_map);
+	ebio->eb_index = index;
+	ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+	retval = 1;
 
-		bc->bc_dir = CACHED_WRITE;
-		if (bc->bc_mdwait) {
+out:
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, ebio->eb_cacheset),
+			       flags);
+	return retval;
+}
 
-			/*
-			 * mdreqs are required only if the write would cause a metadata
-			 * update.
-			 */
+static void eio_readahead_endio(struct bio *bio, int error)
+{
+	int i;
 
-			error = eio_alloc_mdreqs(dmc, bc);
-		}
+	for (i = 0; i < bio->bi_vcnt; i++)
+		__free_page(bio->bi_io_vec[i].bv_page);
+	bio_put(bio);
+}
 
-		/*
-		 * Pass all orig bio flags except UNPLUG.
-		 * UNPLUG in the end if flagged.
-		 */
-		ebio = ebegin;
-		VERIFY_BIO_FLAGS(ebio);
+/*
+ * A bio of its own pages for the read-ahead of "count" sectors at
+ * "sector", cut to the whole blocks the pages and the source device
+ * allow.
+ */
+static struct bio *eio_readahead_bio(struct cache_c *dmc, sector_t sector,
+				     sector_t count)
+{
+	unsigned int size = to_bytes(count);
+	unsigned int len;
+	struct page *page;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(size, PAGE_SIZE));
+	if (!bio)
+		return NULL;
+	bio->bi_bdev = dmc->disk_dev->bdev;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	bio->bi_iter.bi_sector = sector;
+#else 
+	bio->bi_sector = sector;
+#endif 
+	bio->bi_end_io = eio_readahead_endio;
 
-		while (ebio) {
-			enext = ebio->eb_next;
-			ebio->eb_iotype = EB_MAIN_IO;
+	while (size) {
+		len = min_t(unsigned int, size, PAGE_SIZE);
+		page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!page)
+			break;
+		if (bio_add_page(bio, page, len, 0) != len) {
+			__free_page(page);
+			break;
+		}
+		size -= len;
+	}
 
-			if (!error) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	bio->bi_iter.bi_size -= bio->bi_iter.bi_size %
+				to_bytes(dmc->block_size);
+	size = bio->bi_iter.bi_size;
+#else 
+	bio->bi_size -= bio->bi_size % to_bytes(dmc->block_size);
+	size = bio->bi_size;
+#endif 
+	if (size == 0) {
+		eio_readahead_endio(bio, 0);
+		return NULL;
+	}
+	return bio;
+}
 
-				eio_cached_write(dmc, ebio, WRITE | rw_flags);
+static void eio_do_readahead(struct work_struct *work)
+{
+	struct eio_readahead *ra;
+	struct cache_c *dmc;
+	struct bio_container *bc;
+	struct bio *bio = NULL;
+	struct eio_bio *ebio;
+	struct eio_bio *ebegin = NULL;
+	struct eio_bio *eend = NULL;
+	struct eio_bio *enext;
+	unsigned int residual_biovec = 0;
+	unsigned int biosize;
+	unsigned int iosize;
+	sector_t snum, end;
+	int claimed = 0;
+
+	ra = container_of(work, struct eio_readahead, work);
+	dmc = ra->dmc;
+	end = eio_to_sector(eio_get_device_size(dmc->disk_dev));
+	end = min(EIO_ROUND_SECTOR(dmc, end), ra->sector + ra->count);
+	if (ra->sector < end && !CACHE_FAILED_IS_SET(dmc) &&
+	    !CACHE_DEGRADED_IS_SET(dmc))
+		bio = eio_readahead_bio(dmc, ra->sector, end - ra->sector);
+	kfree(ra);
+	if (!bio)
+		goto out;
 
-			} else {
+	bc = mempool_alloc(_bc_pool, GFP_NOIO);
+	memset(bc, 0, offsetof(struct bio_container, bc_ebio));
+	bc->bc_iotime = jiffies;
+	bc->bc_bio = bio;
+	bc->bc_dmc = dmc;
+	spin_lock_init(&bc->bc_lock);
+	atomic_set(&bc->bc_holdcount, 1);
+	bc->bc_bio_private = 1;
+
+	/* As an application read, see eio_map() */
+	if (dmc->mode == CACHE_MODE_WB && eio_acquire_set_locks(dmc, bc)) {
+		mempool_free(bc, _bc_pool);
+		eio_readahead_endio(bio, 0);
+		goto out;
+	}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	snum = bio->bi_iter.bi_sector;
+	biosize = bio->bi_iter.bi_size;
+#else 
+	snum = bio->bi_sector;
+	biosize = bio->bi_size;
+#endif 
+	while (biosize) {
+		iosize = eio_get_iosize(dmc, snum, biosize);
+		ebio = eio_new_ebio(dmc, bio, &residual_biovec, snum,
+				    iosize, bc, EB_SUBORDINATE_IO);
+		if (IS_ERR(ebio))
+			/* Read the rest without filling it */
+			break;
+		if (ebegin)
+			eend->eb_next = ebio;
+		else
+			ebegin = ebio;
+		eend = ebio;
+		biosize -= iosize;
+		snum += eio_to_sector(iosize);
+	}
+
+	if (dmc->mode == CACHE_MODE_WB && ebegin)
+		eio_wait_block_cleans(dmc, bc, ebegin);
+	for (ebio = ebegin; ebio; ebio = ebio->eb_next)
+		claimed += eio_readahead_peek(dmc, ebio);
+
+	if (claimed) {
+		EIO_STATS_INC(dmc, readahead_ios);
+		EIO_STATS_ADD(dmc, readahead_blocks, claimed);
+		eio_disk_io(dmc, bio, ebegin, bc, 0);
+	} else {
+		for (ebio = ebegin; ebio; ebio = enext) {
+			enext = ebio->eb_next;
+			eb_endio(ebio, 0);
+		}
+	}
+	bc_put(bc, 0);
+	return;
+
+out:
+	this_cpu_dec(dmc->pcpu_stats->nr_ios);
+}
+
+/* Queue the read-ahead of the "where" window of a stream */
+static void eio_readahead(struct cache_c *dmc, struct eio_io_region *where)
+{
+	struct eio_readahead *ra;
+
+	if (unlikely(dmc->cache_rdonly))
+		return;
+	ra = kmalloc(sizeof(*ra), GFP_NOWAIT | __GFP_NOWARN);
+	if (!ra)
+		return;
+
+	INIT_WORK(&ra->work, eio_do_readahead);
+	ra->dmc = dmc;
+	ra->sector = where->sector;
+	ra->count = where->count;
+	this_cpu_inc(dmc->pcpu_stats->nr_ios);
+	queue_work(dmc->readahead_q, &ra->work);
+}
+
+/*
+ * Partial read misses. A read of part of a block, or across part of
+ * two, misses the cache for good: a block is only filled by the read
+ * of all of it. With "expand_partial_reads" set, the miss of a read
+ * within one block is read from the source device as the whole block,
+ * into pages of the cache's own, see eio_readahead_bio(). The sectors
+ * asked for are copied to the application bio, which is ended as soon
+ * as the read is done, and the block is filled as for a block sized
+ * miss, "readfill_admit" included.
+ *
+ * Returns 1 if the read was taken over, 0 if the caller is to read the
+ * bio from the source device as usual.
+ */
+static int eio_read_expand(struct cache_c *dmc, struct bio_container *bc,
+			   struct eio_bio *ebio)
+{
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	unsigned int residual_biovec = 0;
+	struct eio_bio *febio;
+	struct bio *fill;
+	unsigned long flags;
+
+	if (!dmc->sysctl_active.expand_partial_reads || ebio->eb_next ||
+	    ebio->eb_index != -1 ||
+	    eio_to_sector(ebio->eb_size) == dmc->block_size ||
+	    unlikely(dmc->cache_rdonly) || bc->bc_seq_bypass)
+		return 0;
+
+	fill = eio_readahead_bio(dmc, dbn, dmc->block_size);
+	if (!fill)
+		return 0;
+	febio = eio_new_ebio(dmc, fill, &residual_biovec, dbn,
+			     to_bytes(dmc->block_size), bc, EB_SUBORDINATE_IO);
+	if (IS_ERR(febio)) {
+		bio_endio(fill, 0);
+		return 0;
+	}
+
+	if (eio_read_peek(dmc, febio)) {
+		/* Cached meanwhile, let the read go to the source device */
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, febio->eb_cacheset),
+				  flags);
+		if (EIO_CACHE_STATE_GET(dmc, febio->eb_index) != ALREADY_DIRTY)
+			EIO_CACHE_STATE_OFF(dmc, febio->eb_index,
+					    CACHEREADINPROG);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc,
+						       febio->eb_cacheset),
+				       flags);
+		febio->eb_index = -1;
+	}
+	if (febio->eb_index == -1) {
+		bc->bc_dir = UNCACHED_READ;
+		febio->eb_iotype = EB_SUBORDINATE_IO;
+		eb_endio(febio, 0);
+		bio_endio(fill, 0);
+		return 0;
+	}
+
+	EIO_STATS_INC(dmc, expanded_reads);
+	bc->bc_fill_bio = fill;
+	/* The application bio is read from the fill, see below */
+	eb_endio(ebio, 0);
+	eio_disk_io(dmc, fill, febio, bc, 0);
+	return 1;
+}
+
+/* Copy the sectors of "bio" out of "fill", the block they lie in */
+static void eio_read_expand_copy(struct bio *bio, struct bio *fill)
+{
+	struct bio_vec *dst, *src;
+	unsigned int offset, remaining, done, len;
+	char *d, *s;
+	int i;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	offset = to_bytes(bio->bi_iter.bi_sector - fill->bi_iter.bi_sector);
+	remaining = bio->bi_iter.bi_size;
+#else 
+	offset = to_bytes(bio->bi_sector - fill->bi_sector);
+	remaining = bio->bi_size;
+#endif 
+	for (i = 0; remaining; i++) {
+		dst = &bio->bi_io_vec[i];
+		for (done = 0; done < dst->bv_len && remaining; done += len) {
+			src = &fill->bi_io_vec[offset >> PAGE_SHIFT];
+			len = min_t(unsigned int, dst->bv_len - done, remaining);
+			len = min_t(unsigned int, len,
+				    PAGE_SIZE - (offset & ~PAGE_MASK));
+			d = kmap(dst->bv_page);
+			s = kmap(src->bv_page);
+			memcpy(d + dst->bv_offset + done,
+			       s + (offset & ~PAGE_MASK), len);
+			kunmap(src->bv_page);
+			kunmap(dst->bv_page);
+			flush_dcache_page(dst->bv_page);
+			offset += len;
+			remaining -= len;
+		}
+	}
+}
+
+/*
+ * The whole block read of a partial miss is done: end the application
+ * bio, the bio container lives on with the fill until the block is
+ * written to the cache.
+ */
+static void eio_read_expand_done(struct cache_c *dmc,
+				 struct bio_container *bc)
+{
+	struct bio *bio = bc->bc_bio;
+
+	eio_read_expand_copy(bio, bc->bc_fill_bio);
+	bc->bc_bio = bc->bc_fill_bio;
+	bc->bc_fill_bio = NULL;
+	bc->bc_bio_private = 1;
+	EIO_STATS_ADD(dmc, rdtime_ms,
+		      (long)jiffies_to_msecs(jiffies - bc->bc_iotime));
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	bio->bi_iter.bi_size = 0;
+#else 
+	bio->bi_size = 0;
+#endif 
+	bio_endio(bio, 0);
+}
+
+/* Top level write function called from eio_map */
+static void
+eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
+{
+	int ucwrite = 0;
+	int error = 0;
+	struct eio_bio *ebio;
+	struct eio_bio *enext;
+
+	if ((dmc->mode != CACHE_MODE_WB) ||
+	    (dmc->sysctl_active.do_clean & EIO_CLEAN_KEEP))
+		ucwrite = 1;
+
+	ebio = ebegin;
+	while (ebio) {
+		enext = ebio->eb_next;
+		if (eio_write_peek(dmc, ebio) == 0)
+			ucwrite = 1;
+		ebio = enext;
+	}
+
+	if (ucwrite) {
+		/*
+		 * Uncached write.
+		 * Start both SSD and HDD writes
+		 */
+		EIO_STATS_INC(dmc, uncached_writes);
+		if (bc->bc_throttled)
+			EIO_STATS_INC(dmc, write_throttle_uncached);
+		bc->bc_mdwait = 0;
+		bc->bc_dir = UNCACHED_WRITE;
+		ebio = ebegin;
+		while (ebio) {
+			enext = ebio->eb_next;
+			eio_uncached_write(dmc, ebio);
+			ebio = enext;
+		}
+
+		eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
+	} else {
+		/* Cached write. Start writes to SSD blocks */
+
+		int rw_flags;
+		rw_flags = 0;
+
+		bc->bc_dir = CACHED_WRITE;
+		if (bc->bc_mdwait && !dmc->journal) {
+
+			/*
+			 * mdreqs are required only if the write would cause a metadata
+			 * update, and the journal has no need of them.
+			 */
+
+			error = eio_alloc_mdreqs(dmc, bc);
+		}
+
+		/*
+		 * Pass all orig bio flags except UNPLUG.
+		 * UNPLUG in the end if flagged.
+		 */
+		ebio = ebegin;
+		VERIFY_BIO_FLAGS(ebio);
+
+		while (ebio) {
+			enext = ebio->eb_next;
+			ebio->eb_iotype = EB_MAIN_IO;
+
+			if (!error) {
+
+				eio_cached_write(dmc, ebio, WRITE | rw_flags);
+
+			} else {
 				unsigned long flags;
 				u_int8_t cstate;
 
 				pr_err
 					("eio_write: IO submission failed, block %llu",
 					EIO_DBN_GET(dmc, ebio->eb_index));
-				spin_lock_irqsave(&dmc->
-						  cache_sets[ebio->eb_cacheset].
-						  cs_lock, flags);
+				spin_lock_irqsave(EIO_SET_CS_LOCK(dmc,
+						  ebio->eb_cacheset), flags);
 				cstate =
 					EIO_CACHE_STATE_GET(dmc, ebio->eb_index);
 				if (cstate != ALREADY_DIRTY) {
@@ -3123,14 +4298,11 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 
 					EIO_CACHE_STATE_SET(dmc, ebio->eb_index,
 							    INVALID);
-					atomic64_dec_if_positive(&dmc->
-								 eio_stats.
-								 cached_blocks);
+					EIO_STATS_DEC(dmc, cached_blocks);
 				}
-				spin_unlock_irqrestore(&dmc->
-						       cache_sets[ebio->
-								  eb_cacheset].
-						       cs_lock, flags);
+				spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc,
+						       ebio->eb_cacheset),
+						       flags);
 				eb_endio(ebio, error);
 			}
 			ebio = enext;
@@ -3139,23 +4311,17 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 }
 
 /*
- * Synchronous clean of all the cache sets. Callers of this function needs
- * to handle the situation that clean operation was aborted midway.
+ * Claim the sets of a force clean from clean_index on, in ascending
+ * order. Cleaner 0 and the others sweep together, see eio_clean_all().
  */
-
-void eio_clean_all(struct cache_c *dmc)
+static void eio_clean_sweep(struct cache_c *dmc, struct eio_clean_pipe *pipe)
 {
-	unsigned long flags = 0;
+	s32 index;
 
-	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
-	for (atomic_set(&dmc->clean_index, 0);
-	     (atomic_read(&dmc->clean_index) <
-	      (s32)(dmc->size >> dmc->consecutive_shift))
-	     && (dmc->sysctl_active.do_clean & EIO_CLEAN_START)
-	     && (atomic64_read(&dmc->nr_dirty) > 0)
-	     && (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG)
-		 && !dmc->sysctl_active.fast_remove);
-	     atomic_inc(&dmc->clean_index)) {
+	while ((dmc->sysctl_active.do_clean & EIO_CLEAN_START)
+	       && (atomic64_read(&dmc->nr_dirty) > 0)
+	       && (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG)
+		   && !dmc->sysctl_active.fast_remove)) {
 
 		if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
 			pr_err("clean_all: CACHE \"%s\" is in FAILED state.",
@@ -3163,9 +4329,40 @@ void eio_clean_all(struct cache_c *dmc)
 			break;
 		}
 
-		eio_clean_set(dmc, (index_t)(atomic_read(&dmc->clean_index)),
-				/* whole */ 1, /* force */ 1);
+		do {
+			index = atomic_read(&dmc->clean_index);
+			if (index >= (s32)dmc->num_sets)
+				return;
+		} while (atomic_cmpxchg(&dmc->clean_index, index, index + 1) !=
+			 index);
+
+		eio_clean_pipe_add(pipe, (index_t)index, /* whole */ 1,
+				   /* force */ 1);
 	}
+}
+
+/*
+ * Synchronous clean of all the cache sets. Callers of this function needs
+ * to handle the situation that clean operation was aborted midway.
+ * The other cleaner threads sweep the sets along, in ascending order,
+ * so that the source device is written from start to end.
+ */
+
+void eio_clean_all(struct cache_c *dmc)
+{
+	struct eio_clean_pipe pipe;
+	unsigned long flags = 0;
+
+	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
+	eio_clean_pipe_init(&pipe, dmc);
+	atomic_set(&dmc->clean_index, 0);
+	wake_up_all(&dmc->clean_wq);
+
+	eio_clean_sweep(dmc, &pipe);
+	eio_clean_pipe_drain(&pipe);
+
+	/* wait for the sets the other cleaners took */
+	wait_event(dmc->clean_wq, !atomic_read(&dmc->clean_sweepers));
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	dmc->sysctl_active.do_clean &= ~EIO_CLEAN_START;
@@ -3178,10 +4375,13 @@ void eio_clean_all(struct cache_c *dmc)
  */
 void eio_clean_for_reboot(struct cache_c *dmc)
 {
+	struct eio_clean_pipe pipe;
 	index_t i;
 
+	eio_clean_pipe_init(&pipe, dmc);
 	for (i = 0; i < (index_t)(dmc->size >> dmc->consecutive_shift); i++)
-		eio_clean_set(dmc, i, /* whole */ 1, /* force */ 1);
+		eio_clean_pipe_add(&pipe, i, /* whole */ 1, /* force */ 1);
+	eio_clean_pipe_drain(&pipe);
 }
 
 /*
@@ -3194,7 +4394,7 @@ void eio_clean_for_reboot(struct cache_c *dmc)
 static void
 eio_get_setblks_to_clean(struct cache_c *dmc, index_t set, int *ncleans)
 {
-	int i = 0;
+	unsigned long i;
 	int max_clean;
 	index_t start_index;
 	int nr_writes = 0;
@@ -3214,15 +4414,16 @@ eio_get_setblks_to_clean(struct cache_c *dmc, index_t set, int *ncleans)
 	 * taken a write lock on the cache set, when we reach here
 	 */
 	if (dmc->policy_ops == NULL) {
-		/* Scan sequentially in the set and pick blocks to clean */
-		while ((i < (int)dmc->assoc) && (nr_writes < max_clean)) {
+		/* Walk the dirty blocks of the set and pick blocks to clean */
+		for_each_set_bit(i, EIO_SET_DIRTY_MAP(dmc, set), dmc->assoc) {
+			if (nr_writes >= max_clean)
+				break;
 			if ((EIO_CACHE_STATE_GET(dmc, start_index + i) &
 			     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 				EIO_CACHE_STATE_ON(dmc, start_index + i,
 						   DISKWRITEINPROG);
 				nr_writes++;
 			}
-			i++;
 		}
 	} else
 		nr_writes =
@@ -3231,14 +4432,34 @@ eio_get_setblks_to_clean(struct cache_c *dmc, index_t set, int *ncleans)
 	*ncleans = nr_writes;
 }
 
-/* Callback function, when synchronous I/O completes */
-static void eio_sync_io_callback(int error, void *context)
+static int eio_clean_io_tryget(struct cache_c *dmc)
 {
-	struct sync_io_context *sioc = (struct sync_io_context *)context;
+	int n;
 
-	if (error)
-		sioc->sio_error = error;
-	up_read(&sioc->sio_lock);
+	do {
+		n = atomic_read(&dmc->clean_ios);
+		if (n >= (int)dmc->sysctl_active.max_clean_ios)
+			return 0;
+	} while (atomic_cmpxchg(&dmc->clean_ios, n, n + 1) != n);
+	return 1;
+}
+
+/*
+ * Clean I/Os of all the cleaner threads share "max_clean_ios" slots,
+ * so that many concurrent set cleans don't flood the source device.
+ */
+static void eio_clean_io_get(struct cache_c *dmc)
+{
+	if (!eio_clean_io_tryget(dmc))
+		wait_event(dmc->clean_io_wq, eio_clean_io_tryget(dmc));
+}
+
+static void eio_clean_io_put(struct cache_c *dmc)
+{
+	atomic_dec(&dmc->clean_ios);
+	smp_mb__after_atomic();
+	if (waitqueue_active(&dmc->clean_io_wq))
+		wake_up(&dmc->clean_io_wq);
 }
 
 /*
@@ -3279,130 +4500,138 @@ struct bio_vec *setup_bio_vecs(struct bio_vec *bvec, index_t block_index,
 	return data;
 }
 
-/* Cleans a given cache set */
-static void
-eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
+/* The I/Os of the current stage of a set clean are over */
+static void eio_clean_stage_put(struct eio_clean_buf *buf)
 {
-	struct eio_io_region where;
-	int error;
-	index_t i;
-	index_t j;
-	index_t start_index;
-	index_t end_index;
-	struct sync_io_context sioc;
-	int ncleans = 0;
-	int alloc_size;
-	struct flash_cacheblock *md_blocks = NULL;
+	struct eio_clean_pipe *pipe = buf->pipe;
 	unsigned long flags;
 
-	int pindex, k;
-	index_t blkindex;
-	struct bio_vec *bvecs;
-	unsigned nr_bvecs = 0, total;
-	void *pg_virt_addr[2] = { NULL };
+	if (!atomic_dec_and_test(&buf->nr_ios))
+		return;
 
-	/* Cache is failed mode, do nothing. */
-	if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
-		pr_debug("clean_set: CACHE \"%s\" is in FAILED state.",
-			 dmc->cache_name);
-		goto err_out1;
-	}
+	/*
+	 * Wake up under the lock: the pipe is on the stack of its
+	 * cleaner, which may be gone as soon as it has the clean back.
+	 */
+	spin_lock_irqsave(&pipe->lock, flags);
+	list_add_tail(&buf->list, &pipe->done);
+	wake_up(&pipe->wait);
+	spin_unlock_irqrestore(&pipe->lock, flags);
+}
 
-	/* Nothing to clean, if there are no dirty blocks */
-	if (dmc->cache_sets[set].nr_dirty == 0)
-		goto err_out1;
+static void eio_clean_stage_callback(int error, void *context)
+{
+	struct eio_clean_buf *buf = (struct eio_clean_buf *)context;
 
-	/* If this is not the suitable time to clean, postpone it */
-	if ((!force) && AUTOCLEAN_THRESHOLD_CROSSED(dmc)) {
-		eio_touch_set_lru(dmc, set);
-		goto err_out1;
-	}
+	if (error)
+		buf->error = error;
+	eio_clean_stage_put(buf);
+}
 
-	/*
-	 * 1. Take exclusive lock on the cache set
-	 * 2. Verify that there are dirty blocks to clean
-	 * 3. Identify the cache blocks to clean
-	 * 4. Read the cache blocks data from ssd
-	 * 5. Write the cache blocks data to hdd
-	 * 6. Update on-disk cache metadata
-	 * 7. Update in-core cache metadata
-	 */
+/*
+ * Callback of the clean data I/Os, see eio_clean_io_get(). The hdd
+ * writes are timed from the start of the stage, for the writeback
+ * rate controller.
+ */
+static void eio_clean_io_callback(int error, void *context)
+{
+	struct eio_clean_buf *buf = (struct eio_clean_buf *)context;
+	struct cache_c *dmc = buf->pipe->dmc;
 
-	start_index = set * dmc->assoc;
-	end_index = start_index + dmc->assoc;
+	if (buf->stage == CLEAN_STAGE_WRITE && !error) {
+		atomic64_add(ktime_us_delta(ktime_get(), buf->stage_start),
+			     &dmc->wb_rate.lat_sum_us);
+		atomic64_inc(&dmc->wb_rate.lat_count);
+	}
+	eio_clean_io_put(dmc);
+	eio_clean_stage_callback(error, context);
+}
 
-	/* 1. exclusive lock. Let the ongoing writes to finish. Pause new writes */
-	down_write(&dmc->cache_sets[set].rw_lock);
+/* Issue a data I/O of the current stage of a set clean */
+static void eio_clean_io(struct eio_clean_buf *buf, struct eio_io_region *where,
+			 int rw, struct bio_vec *bvecs, unsigned nr_bvecs,
+			 int hddio)
+{
+	struct cache_c *dmc = buf->pipe->dmc;
+	int error;
 
-	/* 2. Return if there are no dirty blocks to clean */
-	if (dmc->cache_sets[set].nr_dirty == 0)
-		goto err_out2;
+	eio_clean_io_get(dmc);
+	atomic_inc(&buf->nr_ios);
+	error = eio_io_async_bvec(dmc, where, rw, bvecs, nr_bvecs,
+				  eio_clean_io_callback, buf, hddio);
+	if (error)
+		eio_clean_io_callback(error, buf);
+}
 
-	/* 3. identify and mark cache blocks to clean */
-	if (!whole)
-		eio_get_setblks_to_clean(dmc, set, &ncleans);
-	else {
-		for (i = start_index; i < end_index; i++) {
-			if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY) {
-				EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
-				ncleans++;
-			}
-		}
+/* Reset the clean flags of a set, cleaned or not */
+static void eio_clean_set_done(struct cache_c *dmc, index_t set, int force)
+{
+	unsigned long flags;
+
+	if (!force) {
+		spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+		dmc->cache_sets[set].flags &=
+			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE |
+			  SETFLAG_CLEAN_URGENT);
+		spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
 	}
 
-	/* If nothing to clean, return */
-	if (!ncleans)
-		goto err_out2;
+	/* Writers waiting for room in the set may go on */
+	wake_up_all(EIO_SET_WQ(dmc, set));
 
-	/*
-	 * From this point onwards, make sure to reset
-	 * the clean inflag on cache blocks before returning
-	 */
+	if (dmc->cache_sets[set].nr_dirty)
+		/*
+		 * Lru touch the set, so that it can be picked
+		 * up for whole set clean by clean thread later
+		 */
+		eio_touch_set_lru(dmc, set);
+}
 
-	/* 4. read cache set data */
+/* 4. read cache set data */
+static void eio_clean_read(struct eio_clean_buf *buf)
+{
+	struct cache_c *dmc = buf->pipe->dmc;
+	struct eio_io_region where;
+	index_t start_index = buf->set * dmc->assoc;
+	index_t end_index = start_index + dmc->assoc;
+	unsigned long *dirty_map = EIO_SET_DIRTY_MAP(dmc, buf->set);
+	unsigned long bit;
+	struct bio_vec *bvecs;
+	unsigned nr_bvecs = 0;
+	index_t i;
+	index_t j;
 
-	init_rwsem(&sioc.sio_lock);
-	sioc.sio_error = 0;
+	buf->stage = CLEAN_STAGE_READ;
+	atomic_set(&buf->nr_ios, 1);
 
-	for (i = start_index; i < end_index; i++) {
+	for (bit = find_first_bit(dirty_map, dmc->assoc); bit < dmc->assoc;
+	     bit = find_next_bit(dirty_map, dmc->assoc, bit + 1)) {
+		i = start_index + bit;
 		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
 
 			for (j = i; ((j < end_index) &&
 				(EIO_CACHE_STATE_GET(dmc, j) == CLEAN_INPROG));
 				j++);
 
-			blkindex = (i - start_index);
-			total = (j - i);
+			where.bdev = dmc->cache_dev->bdev;
+			where.sector =
+				(i << dmc->block_shift) + dmc->md_sectors;
+			where.count = (j - i) * dmc->block_size;
 
 			/*
 			 * Get the correct index and number of bvecs
-			 * setup from dmc->clean_dbvecs before issuing i/o.
+			 * setup from buf->dbvecs before issuing i/o.
 			 */
-			bvecs =
-				setup_bio_vecs(dmc->clean_dbvecs, blkindex,
-					       dmc->block_size, total, &nr_bvecs);
+			bvecs = setup_bio_vecs(buf->dbvecs, i - start_index,
+					       dmc->block_size, j - i,
+					       &nr_bvecs);
 			EIO_ASSERT(bvecs != NULL);
 			EIO_ASSERT(nr_bvecs > 0);
 
-			where.bdev = dmc->cache_dev->bdev;
-			where.sector =
-				(i << dmc->block_shift) + dmc->md_sectors;
-			where.count = total * dmc->block_size;
-
-			SECTOR_STATS(dmc->eio_stats.ssd_reads,
+			SECTOR_STATS(dmc, ssd_reads,
 				     to_bytes(where.count));
-			down_read(&sioc.sio_lock);
-			error =
-				eio_io_async_bvec(dmc, &where, READ, bvecs,
-						  nr_bvecs, eio_sync_io_callback,
-						  &sioc, 0);
-			if (error) {
-				sioc.sio_error = error;
-				up_read(&sioc.sio_lock);
-			}
-
-			bvecs = NULL;
-			i = j;
+			eio_clean_io(buf, &where, READ, bvecs, nr_bvecs, 0);
+			bit = j - start_index;
 		}
 	}
 	/*
@@ -3412,61 +4641,120 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	 */
 	eio_unplug_cache_device(dmc);
 
-	/* wait for all I/Os to complete and release sync lock */
-	down_write(&sioc.sio_lock);
-	up_write(&sioc.sio_lock);
+	eio_clean_stage_put(buf);
+}
 
-	error = sioc.sio_error;
-	if (error)
-		goto err_out3;
+static int eio_clean_blk_cmp(const void *a, const void *b)
+{
+	const struct eio_clean_blk *x = a;
+	const struct eio_clean_blk *y = b;
+
+	if (x->dbn < y->dbn)
+		return -1;
+	return x->dbn > y->dbn;
+}
+
+/*
+ * 5. write to hdd
+ * The blocks are written in ascending dbn order, those contiguous on
+ * the hdd in one I/O.
+ */
+static void eio_clean_write(struct eio_clean_buf *buf)
+{
+	struct cache_c *dmc = buf->pipe->dmc;
+	struct eio_io_region where;
+	struct eio_clean_blk *blks = buf->blks;
+	index_t start_index = buf->set * dmc->assoc;
+	unsigned long *dirty_map = EIO_SET_DIRTY_MAP(dmc, buf->set);
+	unsigned long bit;
+	struct bio_vec *bvecs, *dbvecs;
+	unsigned nr_bvecs, wpos = 0;
+	int n = 0;
+	int j, k;
+
+	buf->stage = CLEAN_STAGE_WRITE;
+	buf->stage_start = ktime_get();
+	atomic_set(&buf->nr_ios, 1);
+
+	for_each_set_bit(bit, dirty_map, dmc->assoc) {
+		if (EIO_CACHE_STATE_GET(dmc, start_index + bit) ==
+		    CLEAN_INPROG) {
+			blks[n].dbn = EIO_DBN_GET(dmc, start_index + bit);
+			blks[n].index = bit;
+			n++;
+		}
+	}
+	sort(blks, n, sizeof(*blks), eio_clean_blk_cmp, NULL);
 
-	/* 5. write to hdd */
 	/*
 	 * While writing the data to HDD, explicitly enable
 	 * BIO_RW_SYNC flag to hint higher priority for these
 	 * I/Os.
 	 */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
-
-			blkindex = (i - start_index);
-			total = 1;
+	for (k = 0; k < n; k = j) {
+		where.bdev = dmc->disk_dev->bdev;
+		where.sector = blks[k].dbn;
+		where.count = 0;
+		bvecs = &buf->wbvecs[wpos];
+		for (j = k; j < n && blks[j].dbn == where.sector + where.count;
+		     j++) {
+			dbvecs = setup_bio_vecs(buf->dbvecs, blks[j].index,
+						dmc->block_size, 1, &nr_bvecs);
+			memcpy(&buf->wbvecs[wpos], dbvecs,
+			       nr_bvecs * sizeof(struct bio_vec));
+			wpos += nr_bvecs;
+			where.count += dmc->block_size;
+		}
+		EIO_ASSERT(wpos <= (unsigned)buf->dbvec_count);
 
-			bvecs =
-				setup_bio_vecs(dmc->clean_dbvecs, blkindex,
-					       dmc->block_size, total, &nr_bvecs);
-			EIO_ASSERT(bvecs != NULL);
-			EIO_ASSERT(nr_bvecs > 0);
+		SECTOR_STATS(dmc, disk_writes, to_bytes(where.count));
+		eio_clean_io(buf, &where, WRITE | REQ_SYNC, bvecs,
+			     &buf->wbvecs[wpos] - bvecs, 1);
+	}
 
-			where.bdev = dmc->disk_dev->bdev;
-			where.sector = EIO_DBN_GET(dmc, i);
-			where.count = dmc->block_size;
+	eio_clean_stage_put(buf);
+}
 
-			SECTOR_STATS(dmc->eio_stats.disk_writes,
-				     to_bytes(where.count));
-			down_read(&sioc.sio_lock);
-			error = eio_io_async_bvec(dmc, &where, WRITE | REQ_SYNC,
-						  bvecs, nr_bvecs,
-						  eio_sync_io_callback, &sioc,
-						  1);
-
-			if (error) {
-				sioc.sio_error = error;
-				up_read(&sioc.sio_lock);
-			}
-			bvecs = NULL;
-		}
-	}
+/* 6. update on-disk cache metadata */
+static void eio_clean_commit(struct eio_clean_buf *buf)
+{
+	struct cache_c *dmc = buf->pipe->dmc;
+	struct eio_io_region where;
+	struct eio_io_request req;
+	struct flash_cacheblock *md_blocks = NULL;
+	void *pg_virt_addr[2] = { NULL };
+	index_t start_index = buf->set * dmc->assoc;
+	index_t end_index = start_index + dmc->assoc;
+	index_t i;
+	int alloc_size;
+	int pindex, k;
+	int error;
 
-	/* wait for all I/Os to complete and release sync lock */
-	down_write(&sioc.sio_lock);
-	up_write(&sioc.sio_lock);
+	buf->stage = CLEAN_STAGE_COMMIT;
+	atomic_set(&buf->nr_ios, 2);
 
-	error = sioc.sio_error;
-	if (error)
-		goto err_out3;
+	/*
+	 * With a metadata journal, the clean is a record per block in
+	 * it, and the CLEAN_INPROG blocks are VALID once it is durable.
+	 */
+	if (dmc->journal) {
+		buf->jclean.set = buf->set;
+		buf->jclean.notify = eio_clean_stage_callback;
+		buf->jclean.context = buf;
+		eio_journal_clean(dmc, &buf->jclean);
+		eio_clean_stage_put(buf);
+		return;
+	}
 
-	/* 6. update on-disk cache metadata */
+	/*
+	 * Without one, the metadata of the whole set is rebuilt from the
+	 * in-core metadata. Lock the set until the clean ends, lest the
+	 * metadata update of an app write to another block of the set,
+	 * rebuilt while these blocks were CLEAN_INPROG, lands after it.
+	 */
+	down_write(EIO_SET_RW_LOCK(dmc, buf->set));
+	buf->locked = 1;
+	buf->pipe->nr_locked++;
 
 	/* TBD. Do we have to consider sector alignment here ? */
 
@@ -3475,9 +4763,9 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
 	 */
 
-	EIO_ASSERT(dmc->mdpage_count <= 2);
-	for (k = 0; k < dmc->mdpage_count; k++)
-		pg_virt_addr[k] = kmap(dmc->clean_mdpages[k]);
+	EIO_ASSERT(buf->mdpage_count <= 2);
+	for (k = 0; k < buf->mdpage_count; k++)
+		pg_virt_addr[k] = kmap(buf->mdpages[k]);
 
 	alloc_size = dmc->assoc * sizeof(struct flash_cacheblock);
 	pindex = 0;
@@ -3506,29 +4794,53 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 		}
 	}
 
-	for (k = 0; k < dmc->mdpage_count; k++)
-		kunmap(dmc->clean_mdpages[k]);
+	for (k = 0; k < buf->mdpage_count; k++)
+		kunmap(buf->mdpages[k]);
 
 	where.bdev = dmc->cache_dev->bdev;
 	where.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index);
 	where.count = eio_to_sector(alloc_size);
-	error =
-		eio_io_sync_pages(dmc, &where, WRITE, dmc->clean_mdpages,
-				  dmc->mdpage_count);
 
+	memset((char *)&req, 0, sizeof(req));
+	req.mtype = EIO_PAGES;
+	req.dptr.plist = buf->mdpages;
+	req.num_bvecs = buf->mdpage_count;
+	req.notify = eio_clean_stage_callback;
+	req.context = buf;
+	req.hddio = 0;
+
+	if (unlikely(CACHE_DEGRADED_IS_SET(dmc)))
+		error = -ENODEV;
+	else
+		error = eio_do_io(dmc, &where, WRITE | REQ_SYNC, &req);
 	if (error)
-		goto err_out3;
+		eio_clean_stage_callback(error, buf);
 
-err_out3:
+	eio_clean_stage_put(buf);
+}
 
-	/*
-	 * 7. update in-core cache metadata for clean_inprog blocks.
-	 * If there was an error, set them back to ALREADY_DIRTY
-	 * If no error, set them to VALID
-	 */
-	for (i = start_index; i < end_index; i++) {
+/*
+ * 7. update in-core cache metadata for clean_inprog blocks.
+ * If there was an error, set them back to ALREADY_DIRTY
+ * If no error, set them to VALID
+ */
+static void eio_clean_end(struct eio_clean_buf *buf)
+{
+	struct eio_clean_pipe *pipe = buf->pipe;
+	struct cache_c *dmc = pipe->dmc;
+	index_t set = buf->set;
+	int force = buf->force;
+	index_t start_index = set * dmc->assoc;
+	unsigned long bit;
+	unsigned long flags;
+	index_t i;
+
+	/* App I/O to the other blocks of the set may be going on */
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+	for_each_set_bit(bit, EIO_SET_DIRTY_MAP(dmc, set), dmc->assoc) {
+		i = start_index + bit;
 		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
-			if (error)
+			if (buf->error)
 				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
 			else {
 				EIO_CACHE_STATE_SET(dmc, i, VALID);
@@ -3538,30 +4850,222 @@ err_out3:
 			}
 		}
 	}
+	dmc->cache_sets[set].flags &= ~SETFLAG_CLEANING;
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
 
-err_out2:
+	if (buf->locked) {
+		up_write(EIO_SET_RW_LOCK(dmc, set));
+		pipe->nr_locked--;
+	}
+	eio_put_clean_buf(dmc, buf);
+	pipe->nr_cleans--;
 
-	up_write(&dmc->cache_sets[set].rw_lock);
+	eio_clean_set_done(dmc, set, force);
+}
 
-err_out1:
+static void eio_clean_pipe_init(struct eio_clean_pipe *pipe,
+				struct cache_c *dmc)
+{
+	pipe->dmc = dmc;
+	spin_lock_init(&pipe->lock);
+	INIT_LIST_HEAD(&pipe->done);
+	INIT_LIST_HEAD(&pipe->commit);
+	init_waitqueue_head(&pipe->wait);
+	pipe->nr_cleans = 0;
+	pipe->nr_locked = 0;
+}
 
-	/* Reset clean flags on the set */
+/*
+ * eio_clean_pipe_run
+ *
+ * Move the set cleans at the end of a stage on to the next one,
+ * first waiting for one if "wait". The sets done with their hdd
+ * writes have their metadata written together, so that the journal,
+ * if any, commits them in one write. Without a journal, a commit locks
+ * its set: the sets are committed one at a time, so that the cleaner
+ * never waits for a set lock while holding another.
+ */
+static void eio_clean_pipe_run(struct eio_clean_pipe *pipe, int wait)
+{
+	struct eio_clean_buf *buf, *nbuf;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	EIO_ASSERT(!wait || pipe->nr_cleans);
+	if (wait)
+		wait_event(pipe->wait, !list_empty(&pipe->done));
+
+	spin_lock_irqsave(&pipe->lock, flags);
+	list_splice_init(&pipe->done, &done);
+	spin_unlock_irqrestore(&pipe->lock, flags);
+
+	list_for_each_entry_safe(buf, nbuf, &done, list) {
+		list_del(&buf->list);
+		if (buf->error || buf->stage == CLEAN_STAGE_COMMIT)
+			eio_clean_end(buf);
+		else if (buf->stage == CLEAN_STAGE_READ)
+			eio_clean_write(buf);
+		else
+			list_add_tail(&buf->list, &pipe->commit);
+	}
 
-	if (!force) {
-		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
-		dmc->cache_sets[set].flags &=
-			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE);
-		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	if (list_empty(&pipe->commit) || pipe->nr_locked)
+		return;
+	list_for_each_entry_safe(buf, nbuf, &pipe->commit, list) {
+		list_del(&buf->list);
+		eio_clean_commit(buf);
+		if (pipe->nr_locked)
+			break;
 	}
+	eio_unplug_cache_device(pipe->dmc);
+}
 
-	if (dmc->cache_sets[set].nr_dirty)
-		/*
-		 * Lru touch the set, so that it can be picked
-		 * up for whole set clean by clean thread later
-		 */
+static void eio_clean_pipe_drain(struct eio_clean_pipe *pipe)
+{
+	while (pipe->nr_cleans)
+		eio_clean_pipe_run(pipe, 1);
+}
+
+/*
+ * eio_clean_pipe_add
+ *
+ * Clean a given cache set, once the pipe has room for it:
+ * 1. Take exclusive lock on the cache set
+ * 2. Verify that there are dirty blocks to clean
+ * 3. Identify the cache blocks to clean, and release the lock
+ * 4. Read the cache blocks data from ssd
+ * 5. Write the cache blocks data to hdd
+ * 6. Update on-disk cache metadata
+ * 7. Update in-core cache metadata
+ * It returns once the reads are issued, eio_clean_pipe_run() takes
+ * the clean through the other steps.
+ */
+static void
+eio_clean_pipe_add(struct eio_clean_pipe *pipe, index_t set, int whole,
+		   int force)
+{
+	struct cache_c *dmc = pipe->dmc;
+	struct eio_clean_buf *buf;
+	index_t start_index;
+	unsigned long *dirty_map;
+	unsigned long bit;
+	unsigned long flags;
+	index_t i;
+	int ncleans = 0;
+
+	/* Cache is failed mode, do nothing. */
+	if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
+		pr_debug("clean_set: CACHE \"%s\" is in FAILED state.",
+			 dmc->cache_name);
+		goto out;
+	}
+
+	/* Nothing to clean, if there are no dirty blocks */
+	if (dmc->cache_sets[set].nr_dirty == 0)
+		goto out;
+
+	/*
+	 * If this is not the suitable time to clean, postpone it. The
+	 * writeback rate controller, if on, paces the cleans instead,
+	 * and writers waiting for the set cannot wait for a quiet time.
+	 */
+	if ((!force) && !dmc->sysctl_active.writeback_percent &&
+	    !(dmc->cache_sets[set].flags & SETFLAG_CLEAN_URGENT) &&
+	    AUTOCLEAN_THRESHOLD_CROSSED(dmc)) {
 		eio_touch_set_lru(dmc, set);
+		goto out;
+	}
+
+	while (pipe->nr_cleans >= CLEAN_PIPELINE_DEPTH)
+		eio_clean_pipe_run(pipe, 1);
+
+	/*
+	 * Other cleaners may have all the buffers, those of this pipe
+	 * come back as it runs.
+	 */
+	while ((buf = eio_tryget_clean_buf(dmc)) == NULL && pipe->nr_cleans)
+		eio_clean_pipe_run(pipe, 1);
+	if (buf == NULL)
+		buf = eio_get_clean_buf(dmc);
+
+	/*
+	 * 1. exclusive lock. Let the ongoing I/Os to the set finish. Pause
+	 * new ones while the blocks to clean are picked. With the set of
+	 * a commit locked by the pipe, only try it: an I/O spanning this
+	 * set and that one may hold this one and wait for ours, or the
+	 * two may share a lock table entry.
+	 */
+relock:
+	if (!pipe->nr_locked)
+		down_write(EIO_SET_RW_LOCK(dmc, set));
+	else if (!down_write_trylock(EIO_SET_RW_LOCK(dmc, set))) {
+		eio_clean_pipe_drain(pipe);
+		down_write(EIO_SET_RW_LOCK(dmc, set));
+	}
+
+	/* 2. Return if there are no dirty blocks to clean */
+	if (dmc->cache_sets[set].nr_dirty == 0)
+		goto out_unlock;
 
+	/*
+	 * Another clean of the set is in flight. A forced clean waits for
+	 * it to end, and cleans the blocks left dirty.
+	 */
+	if (dmc->cache_sets[set].flags & SETFLAG_CLEANING) {
+		up_write(EIO_SET_RW_LOCK(dmc, set));
+		if (!force)
+			goto out_put;
+		eio_clean_pipe_drain(pipe);
+		wait_event(*EIO_SET_WQ(dmc, set),
+			   !(dmc->cache_sets[set].flags & SETFLAG_CLEANING));
+		goto relock;
+	}
+
+	/* 3. identify and mark cache blocks to clean */
+	start_index = set * dmc->assoc;
+	dirty_map = EIO_SET_DIRTY_MAP(dmc, set);
+	if (!whole)
+		eio_get_setblks_to_clean(dmc, set, &ncleans);
+	else {
+		for_each_set_bit(bit, dirty_map, dmc->assoc) {
+			i = start_index + bit;
+			if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY) {
+				EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
+				ncleans++;
+			}
+		}
+	}
+
+	/* If nothing to clean, return */
+	if (!ncleans)
+		goto out_unlock;
+
+	/*
+	 * From this point onwards, eio_clean_end() resets
+	 * the clean inflag on cache blocks. App I/O to the
+	 * blocks waits for it, see eio_wait_block_cleans().
+	 */
+	spin_lock_irqsave(EIO_SET_CS_LOCK(dmc, set), flags);
+	dmc->cache_sets[set].flags |= SETFLAG_CLEANING;
+	spin_unlock_irqrestore(EIO_SET_CS_LOCK(dmc, set), flags);
+	up_write(EIO_SET_RW_LOCK(dmc, set));
+
+	buf->pipe = pipe;
+	buf->set = set;
+	buf->force = force;
+	buf->error = 0;
+	buf->locked = 0;
+	pipe->nr_cleans++;
+	eio_clean_read(buf);
 	return;
+
+out_unlock:
+	up_write(EIO_SET_RW_LOCK(dmc, set));
+out_put:
+	eio_put_clean_buf(dmc, buf);
+
+out:
+	eio_clean_set_done(dmc, set, force);
 }
 
 /*
@@ -26,11 +26,109 @@
 #define SECTORS_PER_SET_SHIFT   (dmc->consecutive_shift + dmc->block_shift)
 #define SECTORS_PER_SET_MASK    (SECTORS_PER_SET - 1)
 
+/*
+ * Set index functions.
+ *
+ * A dbn is split into the offset within its region (SECTORS_PER_SET
+ * sectors), "num_sets_bits" bits of region number which pick the set,
+ * and the msb above them which the shrunken dbn keeps. The linear
+ * function uses the region bits as they are, so regions a multiple of
+ * (num_sets_mask + 1) apart, as well as large power of two strides,
+ * crowd into a few sets. The xor-fold function xors a hash of the msb
+ * into the region bits; the multiplicative one also scrambles the
+ * region bits with an xorshift-multiply-xorshift. Either way, for a
+ * given msb, the region bits are permuted: a region still maps to a
+ * single set and eio_expand_dbn() recovers the dbn from the set, the
+ * wrapped bit and the msb.
+ */
+static int set_hash = EIO_SET_HASH_LINEAR;
+module_param(set_hash, int, 0644);
+MODULE_PARM_DESC(set_hash,
+		 "Set index function of new caches: 0 linear, 1 xor-fold, 2 multiplicative");
+
+/* 2^64 / golden ratio, and its inverse modulo 2^64 */
+#define EIO_SET_HASH_MULT_K     0x9E3779B97F4A7C15ULL
+#define EIO_SET_HASH_MULT_INV   0xF1DE83E19937733DULL
+
+/* Spread the msb over all the set bits, zero stays zero */
+static inline u_int64_t eio_set_hash_fold(struct cache_c *dmc, u_int64_t msb)
+{
+
+	return (msb * EIO_SET_HASH_MULT_K) >> (64 - dmc->num_sets_bits);
+}
+
+static inline u_int64_t eio_set_hash_unxorshift(struct cache_c *dmc,
+						u_int64_t y, u_int32_t shift)
+{
+	u_int64_t x = y;
+	u_int32_t i;
+
+	for (i = shift; i < dmc->num_sets_bits; i += shift)
+		x = y ^ (x >> shift);
+
+	return x;
+}
+
+static inline u_int64_t eio_set_hash(struct cache_c *dmc, u_int64_t mid_i,
+				     u_int64_t msb)
+{
+	u_int32_t shift = (dmc->num_sets_bits + 1) >> 1;
+	u_int64_t x;
+
+	switch (dmc->set_hash) {
+	case EIO_SET_HASH_XOR:
+		return mid_i ^ eio_set_hash_fold(dmc, msb);
+	case EIO_SET_HASH_MULT:
+		x = mid_i ^ eio_set_hash_fold(dmc, msb);
+		x ^= x >> shift;
+		x = (x * EIO_SET_HASH_MULT_K) & dmc->num_sets_mask;
+		return x ^ (x >> shift);
+	default:
+		return mid_i;
+	}
+}
+
+static inline u_int64_t eio_set_unhash(struct cache_c *dmc, u_int64_t mid_i,
+				       u_int64_t msb)
+{
+	u_int32_t shift = (dmc->num_sets_bits + 1) >> 1;
+	u_int64_t x;
+
+	switch (dmc->set_hash) {
+	case EIO_SET_HASH_XOR:
+		return mid_i ^ eio_set_hash_fold(dmc, msb);
+	case EIO_SET_HASH_MULT:
+		x = eio_set_hash_unxorshift(dmc, mid_i, shift);
+		x = (x * EIO_SET_HASH_MULT_INV) & dmc->num_sets_mask;
+		x = eio_set_hash_unxorshift(dmc, x, shift);
+		return x ^ eio_set_hash_fold(dmc, msb);
+	default:
+		return mid_i;
+	}
+}
+
+/*
+ * eio_set_hash_default
+ *
+ * Set index function for a cache being created.
+ */
+u_int32_t eio_set_hash_default(void)
+{
+
+	if (set_hash < EIO_SET_HASH_LINEAR || set_hash > EIO_SET_HASH_LAST) {
+		pr_info("Invalid set_hash %d, using linear set index",
+			set_hash);
+		return EIO_SET_HASH_LINEAR;
+	}
+	return (u_int32_t)set_hash;
+}
+
 #define EIO_DBN_TO_SET(dmc, dbn, set_number, wrapped)   do {		\
 		u_int64_t value;						\
 		u_int64_t mid_i;						\
 		value = (dbn) >> SECTORS_PER_SET_SHIFT;				\
-		mid_i = (value) & (dmc)->num_sets_mask;				\
+		mid_i = eio_set_hash((dmc), (value) & (dmc)->num_sets_mask,	\
+				     (value) >> (dmc)->num_sets_bits);		\
 		if (mid_i >= (dmc)->num_sets) {					\
 			(wrapped) = 1;						\
 			(set_number) = mid_i - (dmc)->num_sets;			\
@@ -40,6 +138,427 @@
 		}								\
 } while (0)
 
+/*
+ * Per-set dbn index.
+ *
+ * Each set owns (1 << dmc->dbn_index_bits) entries, twice its
+ * associativity, used as a linear probing hash table.  An entry holds
+ * the offset of a block within its set plus one; zero marks an empty
+ * entry.  Keys are not stored but read back from the in-core metadata
+ * (the shrunken dbn for md4, the dbn for md8), so the table costs 2
+ * bytes per entry.  An entry always points at a block whose metadata
+ * matches the entry's key, which lets a delete shift the following
+ * entries back instead of leaving a tombstone.
+ *
+ * The index of a set is protected by the same cs_lock as the metadata,
+ * but for the lookups of eio_dbn_index_find().
+ */
+static int dbn_index = 1;
+module_param(dbn_index, int, 0444);
+MODULE_PARM_DESC(dbn_index, "Keep a per-set dbn index for cache lookups");
+
+#define EIO_DBN_INDEX_SET(dmc, index)	\
+	((dmc)->dbn_index + (((index) >> (dmc)->consecutive_shift) << (dmc)->dbn_index_bits))
+
+static inline u_int64_t eio_dbn_index_key(struct cache_c *dmc, index_t index)
+{
+	if (EIO_MD8(dmc))
+		return dmc->cache_md8[index].md8_u.u_i_md8 & EIO_MD8_DBN_MASK;
+
+	return dmc->cache[index].md4_u.u_i_md4 & EIO_MD4_DBN_MASK;
+}
+
+static void eio_dbn_index_insert(struct cache_c *dmc, index_t index)
+{
+	u_int16_t *tbl = EIO_DBN_INDEX_SET(dmc, index);
+	index_t start_index = index & ~((index_t)dmc->assoc - 1);
+	u_int32_t mask = (1 << dmc->dbn_index_bits) - 1;
+	u_int64_t key = eio_dbn_index_key(dmc, index);
+	u_int32_t h;
+
+	/*
+	 * A stale block may still carry the same dbn, in which case its
+	 * entry is taken over by the new block.
+	 */
+	for (h = hash_64(key, dmc->dbn_index_bits); tbl[h];
+	     h = (h + 1) & mask)
+		if (eio_dbn_index_key(dmc, start_index + tbl[h] - 1) == key)
+			break;
+	tbl[h] = (u_int16_t)(index - start_index + 1);
+}
+
+static void eio_dbn_index_remove(struct cache_c *dmc, index_t index)
+{
+	u_int16_t *tbl = EIO_DBN_INDEX_SET(dmc, index);
+	index_t start_index = index & ~((index_t)dmc->assoc - 1);
+	u_int32_t mask = (1 << dmc->dbn_index_bits) - 1;
+	u_int16_t slot = (u_int16_t)(index - start_index + 1);
+	u_int32_t h, i, k;
+
+	for (h = hash_64(eio_dbn_index_key(dmc, index), dmc->dbn_index_bits);
+	     tbl[h] != slot; h = (h + 1) & mask)
+		if (tbl[h] == 0)
+			/* block isn't indexed */
+			return;
+
+	/* Shift back the entries that probed past the hole */
+	for (i = (h + 1) & mask; tbl[i]; i = (i + 1) & mask) {
+		k = hash_64(eio_dbn_index_key(dmc, start_index + tbl[i] - 1),
+			    dmc->dbn_index_bits);
+		if (((i - k) & mask) >= ((i - h) & mask)) {
+			tbl[h] = tbl[i];
+			h = i;
+		}
+	}
+	tbl[h] = 0;
+}
+
+/*
+ * eio_dbn_index_find
+ *
+ * Returns the block of the set at "start_index" which carries "dbn",
+ * or -1. The caller still has to check the block state. Without
+ * cs_lock, the block may be missed while the entries move, or may no
+ * longer carry "dbn" by the time the caller looks at it.
+ */
+index_t eio_dbn_index_find(struct cache_c *dmc, index_t start_index,
+			   sector_t dbn)
+{
+	u_int16_t *tbl = EIO_DBN_INDEX_SET(dmc, start_index);
+	u_int32_t mask = (1 << dmc->dbn_index_bits) - 1;
+	u_int64_t key;
+	u_int32_t h;
+	u_int16_t slot;
+
+	key = EIO_MD8(dmc) ? (u_int64_t)dbn : eio_shrink_dbn(dmc, dbn);
+	for (h = hash_64(key, dmc->dbn_index_bits);
+	     (slot = ACCESS_ONCE(tbl[h])) != 0; h = (h + 1) & mask)
+		if (eio_dbn_index_key(dmc, start_index + slot - 1) == key)
+			return start_index + slot - 1;
+
+	return -1;
+}
+
+/*
+ * eio_scan_valid_dbn
+ *
+ * Returns the VALID block of the set at "start_index" which carries
+ * "dbn", or -1. The target is shrunk once and compared against the raw
+ * metadata words, with the VALID bit folded into the compare, so no
+ * block has its dbn expanded.
+ */
+index_t eio_scan_valid_dbn(struct cache_c *dmc, index_t start_index,
+			   sector_t dbn)
+{
+
+	if (EIO_MD8(dmc))
+		return eio_scan_md(dmc, start_index, dmc->assoc, 0, 0,
+				   EIO_MD8_DBN_VALID_MASK,
+				   (u_int64_t)dbn | EIO_MD8_VALID);
+
+	return eio_scan_md(dmc, start_index, dmc->assoc,
+			   EIO_MD4_DBN_VALID_MASK,
+			   eio_shrink_dbn(dmc, dbn) | EIO_MD4_VALID, 0, 0);
+}
+
+/*
+ * eio_dbn_index_size
+ *
+ * Memory needed by the dbn index, 0 if it is disabled.
+ */
+size_t eio_dbn_index_size(struct cache_c *dmc)
+{
+
+	if (!dbn_index)
+		return 0;
+	return ((size_t)dmc->num_sets << (dmc->consecutive_shift + 1)) *
+	       sizeof(u_int16_t);
+}
+
+/*
+ * eio_dbn_index_build
+ *
+ * (Re)build the dbn index from the in-core metadata. Called with no
+ * I/O in flight on the cache.
+ */
+void eio_dbn_index_build(struct cache_c *dmc)
+{
+	index_t i;
+
+	if (dmc->dbn_index == NULL)
+		return;
+
+	memset(dmc->dbn_index, 0, eio_dbn_index_size(dmc));
+	for (i = 0; i < (index_t)dmc->size; i++)
+		if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
+			eio_dbn_index_insert(dmc, i);
+}
+
+/*
+ * eio_dbn_index_alloc
+ */
+int eio_dbn_index_alloc(struct cache_c *dmc)
+{
+	size_t size = eio_dbn_index_size(dmc);
+
+	if (size == 0)
+		return 0;
+
+	dmc->dbn_index_bits = dmc->consecutive_shift + 1;
+	dmc->dbn_index = vmalloc(size);
+	if (dmc->dbn_index == NULL)
+		return -ENOMEM;
+	eio_dbn_index_build(dmc);
+
+	return 0;
+}
+
+/*
+ * eio_dbn_index_free
+ */
+void eio_dbn_index_free(struct cache_c *dmc)
+{
+
+	vfree(dmc->dbn_index);
+	dmc->dbn_index = NULL;
+}
+
+/*
+ * Ghost tags of the readfill admission filter, see eio_ghost_admit().
+ *
+ * Each set owns (1 << dmc->ghost_bits) entries, a quarter of its
+ * associativity. An entry holds a 16 bit tag of a block which missed
+ * the cache lately and was kept out of it, zero marks an empty entry.
+ * A block hashes to one entry of its set, and is forgotten when another
+ * miss hashes there, so the misses of a set are remembered for about a
+ * quarter of the set's worth of misses later. The table costs half a
+ * byte per cache block, and is only allocated once "readfill_admit" is
+ * first set on the cache.
+ *
+ * The tags of a set are protected by its cs_lock.
+ */
+static inline u_int32_t eio_ghost_bits(struct cache_c *dmc)
+{
+
+	return dmc->consecutive_shift > 2 ? dmc->consecutive_shift - 2 : 0;
+}
+
+/*
+ * eio_ghost_admit
+ *
+ * Returns 1 if "dbn" missed the cache lately, and forgets it. Otherwise
+ * remembers it and returns 0.
+ */
+int eio_ghost_admit(struct cache_c *dmc, index_t set, sector_t dbn)
+{
+	u_int16_t *entry;
+	u_int32_t h;
+	u_int16_t tag;
+
+	h = hash_64((u_int64_t)dbn >> dmc->block_shift, 32);
+	tag = (u_int16_t)h ? (u_int16_t)h : 1;
+	entry = dmc->ghost + ((u_int64_t)set << dmc->ghost_bits) +
+		((h >> 16) & ((1 << dmc->ghost_bits) - 1));
+	if (*entry == tag) {
+		*entry = 0;
+		return 1;
+	}
+	*entry = tag;
+	return 0;
+}
+
+/*
+ * eio_ghost_alloc
+ *
+ * Called from the "readfill_admit" sysctl, which may run concurrently
+ * on the same cache: the table is only published once.
+ */
+int eio_ghost_alloc(struct cache_c *dmc)
+{
+	u_int32_t bits = eio_ghost_bits(dmc);
+	size_t size = ((size_t)dmc->num_sets << bits) * sizeof(u_int16_t);
+	unsigned long flags;
+	u_int16_t *ghost;
+
+	if (dmc->ghost)
+		return 0;
+	ghost = vmalloc(size);
+	if (ghost == NULL)
+		return -ENOMEM;
+	memset(ghost, 0, size);
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (dmc->ghost == NULL) {
+		dmc->ghost_bits = bits;
+		smp_wmb();
+		dmc->ghost = ghost;
+		ghost = NULL;
+	}
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	vfree(ghost);
+
+	return 0;
+}
+
+/*
+ * eio_ghost_free
+ */
+void eio_ghost_free(struct cache_c *dmc)
+{
+
+	vfree(dmc->ghost);
+	dmc->ghost = NULL;
+}
+
+/*
+ * Read-ahead map, one bit per cache block, set while a block filled by
+ * a read-ahead has not been read yet, see eio_readahead_hit(). It is
+ * only allocated once "readahead_blocks" is first set on the cache.
+ */
+static inline size_t eio_readahead_map_size(struct cache_c *dmc)
+{
+
+	return BITS_TO_LONGS(dmc->size) * sizeof(unsigned long);
+}
+
+/*
+ * eio_readahead_map_alloc
+ *
+ * Called from the "readahead_blocks" sysctl, published once as the
+ * ghost tags are.
+ */
+int eio_readahead_map_alloc(struct cache_c *dmc)
+{
+	size_t size = eio_readahead_map_size(dmc);
+	unsigned long flags;
+	unsigned long *map;
+
+	if (dmc->readahead_map)
+		return 0;
+	map = vmalloc(size);
+	if (map == NULL)
+		return -ENOMEM;
+	memset(map, 0, size);
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (dmc->readahead_map == NULL) {
+		smp_wmb();
+		dmc->readahead_map = map;
+		map = NULL;
+	}
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	vfree(map);
+
+	return 0;
+}
+
+/*
+ * eio_readahead_map_free
+ */
+void eio_readahead_map_free(struct cache_c *dmc)
+{
+
+	vfree(dmc->readahead_map);
+	dmc->readahead_map = NULL;
+}
+
+/*
+ * Set lock table, see eio_set_lock().
+ *
+ * With "set_locks" at 0, each set has its own entry. Otherwise caches
+ * set up afterwards get a table of at most that many entries, each covering a
+ * power of two run of sets and padded to a cacheline, so that entries
+ * taken on different CPUs do not share one.
+ */
+static unsigned int set_locks;
+module_param(set_locks, uint, 0644);
+MODULE_PARM_DESC(set_locks,
+		 "Lock table entries of caches set up afterwards; 0 for one per set");
+
+/*
+ * eio_set_locks_size
+ *
+ * Lays out the lock table of the cache, returns its size.
+ */
+size_t eio_set_locks_size(struct cache_c *dmc)
+{
+
+	dmc->set_locks_shift = 0;
+	if (set_locks)
+		while (((dmc->num_sets - 1) >> dmc->set_locks_shift) >=
+		       set_locks)
+			dmc->set_locks_shift++;
+	dmc->nr_set_locks = ((dmc->num_sets - 1) >> dmc->set_locks_shift) + 1;
+	if (set_locks)
+		dmc->set_lock_size = L1_CACHE_ALIGN(sizeof(struct eio_set_lock));
+	else
+		dmc->set_lock_size = sizeof(struct eio_set_lock);
+
+	return (size_t)dmc->nr_set_locks * dmc->set_lock_size;
+}
+
+/*
+ * eio_set_locks_alloc
+ */
+int eio_set_locks_alloc(struct cache_c *dmc)
+{
+	struct eio_set_lock *sl;
+	u_int32_t i;
+
+	dmc->set_locks = vmalloc(eio_set_locks_size(dmc));
+	if (dmc->set_locks == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < dmc->nr_set_locks; i++) {
+		sl = eio_set_lock(dmc, (index_t)i << dmc->set_locks_shift);
+		spin_lock_init(&sl->cs_lock);
+		init_rwsem(&sl->rw_lock);
+		seqcount_init(&sl->dbn_seq);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_set_locks_free
+ */
+void eio_set_locks_free(struct cache_c *dmc)
+{
+
+	vfree(dmc->set_locks);
+	dmc->set_locks = NULL;
+}
+
+/*
+ * eio_mem_size
+ *
+ * Memory taken by the in-core metadata of the cache and by its per-set
+ * and per-block structures.
+ */
+size_t eio_mem_size(struct cache_c *dmc)
+{
+	size_t size;
+
+	size = (size_t)dmc->size * (EIO_MD8(dmc) ?
+				    sizeof(struct cacheblock_md8) :
+				    sizeof(struct cacheblock));
+	size += (size_t)dmc->num_sets * (sizeof(struct cache_set) +
+					 2 * dmc->set_bitmap_longs *
+					 sizeof(unsigned long));
+	size += (size_t)dmc->nr_set_locks * dmc->set_lock_size;
+	if (dmc->dbn_index)
+		size += eio_dbn_index_size(dmc);
+	if (dmc->ghost)
+		size += ((size_t)dmc->num_sets << dmc->ghost_bits) *
+			sizeof(u_int16_t);
+	if (dmc->readahead_map)
+		size += eio_readahead_map_size(dmc);
+	if (dmc->policy_ops)
+		size += dmc->policy_ops->sp_mem_size;
+
+	return size;
+}
+
 /*
  * eio_mem_init
  */
@@ -170,15 +689,11 @@ sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index)
 	lsb = dbn_24 & SECTORS_PER_SET_MASK;
 	msb = dbn_24 >> (SECTORS_PER_SET_SHIFT + 1);    /* 1 for wrapped */
 	/* had we wrapped? */
-	if ((dbn_24 & SECTORS_PER_SET) != 0) {
-		dbn_40 = msb << (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
-		dbn_40 |= (set_number + dmc->num_sets) << SECTORS_PER_SET_SHIFT;
-		dbn_40 |= lsb;
-	} else {
-		dbn_40 = msb << (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
-		dbn_40 |= set_number << SECTORS_PER_SET_SHIFT;
-		dbn_40 |= lsb;
-	}
+	if ((dbn_24 & SECTORS_PER_SET) != 0)
+		set_number += dmc->num_sets;
+	dbn_40 = msb << (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
+	dbn_40 |= eio_set_unhash(dmc, set_number, msb) << SECTORS_PER_SET_SHIFT;
+	dbn_40 |= lsb;
 	EIO_ASSERT(unlikely(dbn_40 < EIO_MAX_SECTOR));
 
 	return (sector_t)dbn_40;
@@ -191,10 +706,14 @@ EXPORT_SYMBOL(eio_expand_dbn);
 void eio_invalidate_md(struct cache_c *dmc, u_int64_t index)
 {
 
+	if (dmc->dbn_index)
+		eio_dbn_index_remove(dmc, index);
 	if (EIO_MD8(dmc))
 		dmc->cache_md8[index].md8_u.u_i_md8 = EIO_MD8_INVALID;
 	else
 		dmc->cache[index].md4_u.u_i_md4 = EIO_MD4_INVALID;
+	if (dmc->set_bitmaps)
+		eio_set_bitmaps_update(dmc, index, INVALID);
 }
 
 /*
@@ -205,10 +724,16 @@ void eio_md4_dbn_set(struct cache_c *dmc, u_int64_t index, u_int32_t dbn_24)
 
 	EIO_ASSERT((dbn_24 & ~EIO_MD4_DBN_MASK) == 0);
 
+	if (dmc->dbn_index)
+		eio_dbn_index_remove(dmc, index);
+
 	/* retain "cache_state" */
 	dmc->cache[index].md4_u.u_i_md4 &= ~EIO_MD4_DBN_MASK;
 	dmc->cache[index].md4_u.u_i_md4 |= dbn_24;
 
+	if (dmc->dbn_index)
+		eio_dbn_index_insert(dmc, index);
+
 	/* XXX excessive debugging */
 	if (dmc->index_zero < (u_int64_t)dmc->assoc &&  /* sector 0 cached */
 	    index == dmc->index_zero &&                 /* we're accessing sector 0 */
@@ -224,10 +749,16 @@ void eio_md8_dbn_set(struct cache_c *dmc, u_int64_t index, sector_t dbn)
 
 	EIO_ASSERT((dbn & ~EIO_MD8_DBN_MASK) == 0);
 
+	if (dmc->dbn_index)
+		eio_dbn_index_remove(dmc, index);
+
 	/* retain "cache_state" */
 	dmc->cache_md8[index].md8_u.u_i_md8 &= ~EIO_MD8_DBN_MASK;
 	dmc->cache_md8[index].md8_u.u_i_md8 |= dbn;
 
+	if (dmc->dbn_index)
+		eio_dbn_index_insert(dmc, index);
+
 	/* XXX excessive debugging */
 	if (dmc->index_zero < (u_int64_t)dmc->assoc &&  /* sector 0 cached */
 	    index == dmc->index_zero &&                 /* we're accessing sector 0 */
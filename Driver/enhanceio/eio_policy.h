@@ -77,6 +77,7 @@ struct eio_policy {
 				    index_t start_index, index_t *index);
 	int (*sp_clean_set)(struct eio_policy *, index_t set, int);
 	struct cache_c *sp_dmc;
+	size_t sp_mem_size;             /* memory of the per-set and per-block data */
 };
 
 /*
@@ -63,7 +63,6 @@ eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
 		     size_t *length, loff_t *ppos)
 {
 	struct cache_c *dmc = (struct cache_c *)table->extra1;
-	long long cached_blocks;
 	unsigned long flags = 0;
 
 	/* fetch the new tunable value or post the existing value */
@@ -111,11 +110,7 @@ eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
 			 * are inadequate to fully protect this
 			 */
 
-			cached_blocks =
-				atomic64_read(&dmc->eio_stats.cached_blocks);
-			memset(&dmc->eio_stats, 0, sizeof(struct eio_stats));
-			atomic64_set(&dmc->eio_stats.cached_blocks,
-				     cached_blocks);
+			eio_stats_zero(dmc, 1);
 		}
 	}
 
@@ -170,6 +165,200 @@ eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer
 	return 0;
 }
 
+/*
+ * eio_readfill_admit_sysctl
+ * - sets the eio sysctl readfill_admit value
+ */
+static int
+eio_readfill_admit_sysctl(struct ctl_table *table, int write,
+			  void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.readfill_admit =
+			dmc->sysctl_active.readfill_admit;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.readfill_admit !=
+		     READFILL_ADMIT_ALL) &&
+		    (dmc->sysctl_pending.readfill_admit !=
+		     READFILL_ADMIT_SECOND)) {
+			pr_err
+				("0 or 1 are the only valid values for readfill_admit");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.readfill_admit ==
+		    dmc->sysctl_active.readfill_admit)
+			/* same value. Nothing more to do */
+			return 0;
+
+		if (dmc->sysctl_pending.readfill_admit ==
+		    READFILL_ADMIT_SECOND && eio_ghost_alloc(dmc)) {
+			pr_err("readfill_admit: Failed to allocate the tags");
+			return -ENOMEM;
+		}
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.readfill_admit =
+			dmc->sysctl_pending.readfill_admit;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_sequential_cutoff_kb_sysctl
+ * - sets the eio sysctl sequential_cutoff_kb value
+ */
+static int
+eio_sequential_cutoff_kb_sysctl(struct ctl_table *table, int write,
+				void __user *buffer, size_t *length,
+				loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.sequential_cutoff_kb =
+			dmc->sysctl_active.sequential_cutoff_kb;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if (dmc->sysctl_pending.sequential_cutoff_kb >
+		    SEQ_CUTOFF_KB_MAX) {
+			pr_err("sequential_cutoff_kb valid range is 0 to %d",
+			       SEQ_CUTOFF_KB_MAX);
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.sequential_cutoff_kb =
+			dmc->sysctl_pending.sequential_cutoff_kb;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_readahead_blocks_sysctl
+ * - sets the eio sysctl readahead_blocks value
+ */
+static int
+eio_readahead_blocks_sysctl(struct ctl_table *table, int write,
+			    void __user *buffer, size_t *length,
+			    loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.readahead_blocks =
+			dmc->sysctl_active.readahead_blocks;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if (dmc->sysctl_pending.readahead_blocks >
+		    READAHEAD_BLOCKS_MAX) {
+			pr_err("readahead_blocks valid range is 0 to %d",
+			       READAHEAD_BLOCKS_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.readahead_blocks &&
+		    eio_readahead_map_alloc(dmc)) {
+			pr_err("readahead_blocks: Failed to allocate the map");
+			return -ENOMEM;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.readahead_blocks =
+			dmc->sysctl_pending.readahead_blocks;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_expand_partial_reads_sysctl
+ * - sets the eio sysctl expand_partial_reads value
+ */
+static int
+eio_expand_partial_reads_sysctl(struct ctl_table *table, int write,
+				void __user *buffer, size_t *length,
+				loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.expand_partial_reads =
+			dmc->sysctl_active.expand_partial_reads;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.expand_partial_reads != 0) &&
+		    (dmc->sysctl_pending.expand_partial_reads != 1)) {
+			pr_err
+				("0 or 1 are the only valid values for expand_partial_reads");
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.expand_partial_reads =
+			dmc->sysctl_pending.expand_partial_reads;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
 /*
  * eio_clean_sysctl
  */
@@ -232,17 +421,15 @@ eio_clean_sysctl(struct ctl_table *table, int write, void __user *buffer,
 						       flags);
 
 				/*
-				 * Wake up the clean thread.
-				 * Sync thread will do the clean and once complete
+				 * Wake up the clean threads.
+				 * Clean thread 0 will do the clean and once complete
 				 * will reset the clean_start flag.
 				 * The clean_keep flag will remain set(unless reset
 				 * by user) and will prevent new I/Os from making
 				 * the blocks dirty.
 				 */
 
-				spin_lock_irqsave(&dmc->clean_sl, flags);
-				EIO_SET_EVENT_AND_UNLOCK(&dmc->clean_event,
-							 &dmc->clean_sl, flags);
+				wake_up_all(&dmc->clean_wq);
 			} else
 				spin_unlock_irqrestore(&dmc->cache_spin_lock,
 						       flags);
@@ -766,6 +953,259 @@ eio_time_based_clean_interval_sysctl(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * eio_clean_threads_sysctl
+ */
+static int
+eio_clean_threads_sysctl(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.clean_threads =
+			dmc->sysctl_active.clean_threads;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("clean_threads is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.clean_threads < 1) ||
+		    (dmc->sysctl_pending.clean_threads > CLEAN_THREADS_MAX)) {
+			pr_err("clean_threads valid range is 1 to %d",
+			       CLEAN_THREADS_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.clean_threads ==
+		    dmc->sysctl_active.clean_threads)
+			/* new is same as old value */
+			return 0;
+
+		/* start or stop cleaner threads */
+		return eio_set_clean_threads(dmc,
+					     dmc->sysctl_pending.clean_threads);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_max_clean_ios_sysctl
+ */
+static int
+eio_max_clean_ios_sysctl(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.max_clean_ios =
+			dmc->sysctl_active.max_clean_ios;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("max_clean_ios is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.max_clean_ios < 1) ||
+		    (dmc->sysctl_pending.max_clean_ios > MAX_CLEAN_IOS_MAX)) {
+			pr_err("max_clean_ios valid range is 1 to %d",
+			       MAX_CLEAN_IOS_MAX);
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.max_clean_ios =
+			dmc->sysctl_pending.max_clean_ios;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* let the clean I/Os waiting for a slot recheck */
+		wake_up_all(&dmc->clean_io_wq);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_writeback_percent_sysctl
+ */
+static int
+eio_writeback_percent_sysctl(struct ctl_table *table, int write,
+			     void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+	uint32_t old_percent;
+
+	/* fetch the new tunable value or post existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.writeback_percent =
+			dmc->sysctl_active.writeback_percent;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("writeback_percent is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.writeback_percent > 100) {
+			pr_err("writeback_percent valid range is 0 to 100");
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_percent = dmc->sysctl_active.writeback_percent;
+		dmc->sysctl_active.writeback_percent =
+			dmc->sysctl_pending.writeback_percent;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* start or stop the writeback rate controller */
+		if (dmc->sysctl_active.writeback_percent == 0)
+			eio_wb_rate_stop(dmc);
+		else if (old_percent == 0)
+			eio_wb_rate_start(dmc);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_writeback_latency_ms_sysctl
+ */
+static int
+eio_writeback_latency_ms_sysctl(struct ctl_table *table, int write,
+				void __user *buffer, size_t *length,
+				loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.writeback_latency_ms =
+			dmc->sysctl_active.writeback_latency_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("writeback_latency_ms is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.writeback_latency_ms >
+		    WB_LATENCY_MS_MAX) {
+			pr_err("writeback_latency_ms valid range is 0 to %d",
+			       WB_LATENCY_MS_MAX);
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.writeback_latency_ms =
+			dmc->sysctl_pending.writeback_latency_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_write_throttle_ms_sysctl
+ */
+static int
+eio_write_throttle_ms_sysctl(struct ctl_table *table, int write,
+			     void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.write_throttle_ms =
+			dmc->sysctl_active.write_throttle_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("write_throttle_ms is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.write_throttle_ms >
+		    WRITE_THROTTLE_MS_MAX) {
+			pr_err("write_throttle_ms valid range is 0 to %d",
+			       WRITE_THROTTLE_MS_MAX);
+			return -EINVAL;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.write_throttle_ms =
+			dmc->sysctl_pending.write_throttle_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
 static void eio_sysctl_register_writeback(struct cache_c *dmc);
 static void eio_sysctl_unregister_writeback(struct cache_c *dmc);
 static void eio_sysctl_register_invalidate(struct cache_c *dmc);
@@ -1042,7 +1482,7 @@ static struct sysctl_table_dir {
 	},
 };
 
-#define NUM_COMMON_SYSCTLS      3
+#define NUM_COMMON_SYSCTLS      7
 
 static struct sysctl_table_common {
 	struct ctl_table_header *sysctl_header;
@@ -1067,6 +1507,26 @@ static struct sysctl_table_common {
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
 			.proc_handler	= &eio_control_sysctl,
+		}, {            /* 4 */
+			.procname	= "readfill_admit",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_readfill_admit_sysctl,
+		}, {            /* 5 */
+			.procname	= "sequential_cutoff_kb",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_sequential_cutoff_kb_sysctl,
+		}, {            /* 6 */
+			.procname	= "readahead_blocks",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_readahead_blocks_sysctl,
+		}, {            /* 7 */
+			.procname	= "expand_partial_reads",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_expand_partial_reads_sysctl,
 		},
 	}, .dev	= {
 		{
@@ -1092,7 +1552,7 @@ static struct sysctl_table_common {
 	},
 };
 
-#define NUM_WRITEBACK_SYSCTLS   7
+#define NUM_WRITEBACK_SYSCTLS   12
 
 static struct sysctl_table_writeback {
 	struct ctl_table_header *sysctl_header;
@@ -1141,6 +1601,36 @@ static struct sysctl_table_writeback {
 			.mode		= 0644,
 			.proc_handler	= &eio_dirty_set_low_threshold_sysctl,
 		}
+		, {             /* 8 */
+			.procname	= "clean_threads",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_clean_threads_sysctl,
+		}
+		, {             /* 9 */
+			.procname	= "max_clean_ios",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_max_clean_ios_sysctl,
+		}
+		, {             /* 10 */
+			.procname	= "writeback_percent",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_writeback_percent_sysctl,
+		}
+		, {             /* 11 */
+			.procname	= "writeback_latency_ms",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_writeback_latency_ms_sysctl,
+		}
+		, {             /* 12 */
+			.procname	= "write_throttle_ms",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_write_throttle_ms_sysctl,
+		}
 		,
 	}
 	, .dev = {
@@ -1413,10 +1903,28 @@ static void *eio_find_sysctl_data(struct cache_c *dmc, struct ctl_table *vars)
 		return (void *)&dmc->sysctl_pending.dirty_set_low_threshold;
 	if (strcmp(vars->procname, "autoclean_threshold") == 0)
 		return (void *)&dmc->sysctl_pending.autoclean_threshold;
+	if (strcmp(vars->procname, "clean_threads") == 0)
+		return (void *)&dmc->sysctl_pending.clean_threads;
+	if (strcmp(vars->procname, "max_clean_ios") == 0)
+		return (void *)&dmc->sysctl_pending.max_clean_ios;
+	if (strcmp(vars->procname, "writeback_percent") == 0)
+		return (void *)&dmc->sysctl_pending.writeback_percent;
+	if (strcmp(vars->procname, "writeback_latency_ms") == 0)
+		return (void *)&dmc->sysctl_pending.writeback_latency_ms;
+	if (strcmp(vars->procname, "write_throttle_ms") == 0)
+		return (void *)&dmc->sysctl_pending.write_throttle_ms;
 	if (strcmp(vars->procname, "zero_stats") == 0)
 		return (void *)&dmc->sysctl_pending.zerostats;
 	if (strcmp(vars->procname, "mem_limit_pct") == 0)
 		return (void *)&dmc->sysctl_pending.mem_limit_pct;
+	if (strcmp(vars->procname, "readfill_admit") == 0)
+		return (void *)&dmc->sysctl_pending.readfill_admit;
+	if (strcmp(vars->procname, "sequential_cutoff_kb") == 0)
+		return (void *)&dmc->sysctl_pending.sequential_cutoff_kb;
+	if (strcmp(vars->procname, "readahead_blocks") == 0)
+		return (void *)&dmc->sysctl_pending.readahead_blocks;
+	if (strcmp(vars->procname, "expand_partial_reads") == 0)
+		return (void *)&dmc->sysctl_pending.expand_partial_reads;
 	if (strcmp(vars->procname, "control") == 0)
 		return (void *)&dmc->sysctl_pending.control;
 	if (strcmp(vars->procname, "invalidate") == 0)
@@ -1682,69 +2190,133 @@ static void eio_sysctl_unregister_invalidate(struct cache_c *dmc)
 static int eio_stats_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
-	struct eio_stats *stats = &dmc->eio_stats;
+	struct eio_stats stats;
 	unsigned read_hit_pct, write_hit_pct, dirty_write_hit_pct;
+	unsigned partial_read_hit_pct;
+
+	eio_stats_sum(dmc, &stats);
 
-	if (atomic64_read(&stats->reads) > 0)
-		read_hit_pct = EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->read_hits),
-				atomic64_read(&stats->reads));
+	if (stats.reads > 0)
+		read_hit_pct = EIO_CALCULATE_PERCENTAGE(stats.read_hits,
+							stats.reads);
 	else
 		read_hit_pct = 0;
 
-	if (atomic64_read(&stats->writes) > 0) {
-		write_hit_pct =
-		EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->write_hits),
-				atomic64_read(&stats->writes));
+	if (stats.partial_reads > 0)
+		partial_read_hit_pct =
+			EIO_CALCULATE_PERCENTAGE(stats.partial_read_hits,
+						 stats.partial_reads);
+	else
+		partial_read_hit_pct = 0;
+
+	if (stats.writes > 0) {
+		write_hit_pct = EIO_CALCULATE_PERCENTAGE(stats.write_hits,
+							 stats.writes);
 		dirty_write_hit_pct =
-			EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->dirty_write_hits),
-				atomic64_read(&stats->writes));
+			EIO_CALCULATE_PERCENTAGE(stats.dirty_write_hits,
+						 stats.writes);
 	} else {
 		write_hit_pct = 0;
 		dirty_write_hit_pct = 0;
 	}
 
 	seq_printf(seq, "%-26s %12lld\n", "reads",
-		   (int64_t)atomic64_read(&stats->reads));
+		   stats.reads);
 	seq_printf(seq, "%-26s %12lld\n", "writes",
-		   (int64_t)atomic64_read(&stats->writes));
+		   stats.writes);
 
 	seq_printf(seq, "%-26s %12lld\n", "read_hits",
-		   (int64_t)atomic64_read(&stats->read_hits));
+		   stats.read_hits);
 	seq_printf(seq, "%-26s %12u\n", "read_hit_pct", read_hit_pct);
+	seq_printf(seq, "%-26s %12lld\n", "lockless_read_hits",
+		   stats.lockless_read_hits);
+	seq_printf(seq, "%-26s %12lld\n", "lockless_read_misses",
+		   stats.lockless_read_misses);
+	seq_printf(seq, "%-26s %12lld\n", "partial_reads",
+		   stats.partial_reads);
+	seq_printf(seq, "%-26s %12lld\n", "partial_read_hits",
+		   stats.partial_read_hits);
+	seq_printf(seq, "%-26s %12u\n", "partial_read_hit_pct",
+		   partial_read_hit_pct);
+	seq_printf(seq, "%-26s %12lld\n", "expanded_reads",
+		   stats.expanded_reads);
 
 	seq_printf(seq, "%-26s %12lld\n", "write_hits",
-		   (int64_t)atomic64_read(&stats->write_hits));
+		   stats.write_hits);
 	seq_printf(seq, "%-26s %12u\n", "write_hit_pct", write_hit_pct);
 
 	seq_printf(seq, "%-26s %12lld\n", "dirty_write_hits",
-		   (int64_t)atomic64_read(&stats->dirty_write_hits));
+		   stats.dirty_write_hits);
 	seq_printf(seq, "%-26s %12u\n", "dirty_write_hit_pct",
 		   dirty_write_hit_pct);
 
-	if ((int64_t)(atomic64_read(&stats->cached_blocks)) < 0)
-		atomic64_set(&stats->cached_blocks, 0);
 	seq_printf(seq, "%-26s %12lld\n", "cached_blocks",
-		   (int64_t)atomic64_read(&stats->cached_blocks));
+		   stats.cached_blocks);
 
 	seq_printf(seq, "%-26s %12lld\n", "rd_replace",
-		   (int64_t)atomic64_read(&stats->rd_replace));
+		   stats.rd_replace);
 	seq_printf(seq, "%-26s %12lld\n", "wr_replace",
-		   (int64_t)atomic64_read(&stats->wr_replace));
+		   stats.wr_replace);
 
 	seq_printf(seq, "%-26s %12lld\n", "noroom",
-		   (int64_t)atomic64_read(&stats->noroom));
+		   stats.noroom);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttles",
+		   stats.write_throttles);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_timeouts",
+		   stats.write_throttle_timeouts);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_uncached",
+		   stats.write_throttle_uncached);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_0ms",
+		   stats.write_throttle_hist[0]);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_1-3ms",
+		   stats.write_throttle_hist[1]);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_4-15ms",
+		   stats.write_throttle_hist[2]);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_16-63ms",
+		   stats.write_throttle_hist[3]);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_64-255ms",
+		   stats.write_throttle_hist[4]);
+	seq_printf(seq, "%-26s %12lld\n", "write_throttle_256ms+",
+		   stats.write_throttle_hist[5]);
 
 	seq_printf(seq, "%-26s %12lld\n", "cleanings",
-		   (int64_t)atomic64_read(&stats->cleanings));
+		   stats.cleanings);
+	seq_printf(seq, "%-26s %12lld\n", "clean_waits",
+		   stats.clean_waits);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_dirty",
-		   (int64_t)atomic64_read(&stats->md_write_dirty));
+		   stats.md_write_dirty);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_clean",
-		   (int64_t)atomic64_read(&stats->md_write_clean));
+		   stats.md_write_clean);
 	seq_printf(seq, "%-26s %12lld\n", "md_ssd_writes",
-		   (int64_t)atomic64_read(&stats->md_ssd_writes));
+		   stats.md_ssd_writes);
+	seq_printf(seq, "%-26s %12lld\n", "mdreq_waits",
+		   stats.mdreq_waits);
+	seq_printf(seq, "%-26s %12lld\n", "md_commits",
+		   stats.md_commits);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_blocks",
+		   stats.md_commit_blocks);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_sectors",
+		   stats.md_commit_sectors);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_1",
+		   stats.md_commit_hist[0]);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_2-3",
+		   stats.md_commit_hist[1]);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_4-7",
+		   stats.md_commit_hist[2]);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_8-15",
+		   stats.md_commit_hist[3]);
+	seq_printf(seq, "%-26s %12lld\n", "md_commit_16+",
+		   stats.md_commit_hist[4]);
+	seq_printf(seq, "%-26s %12lld\n", "journal_commits",
+		   stats.journal_commits);
+	seq_printf(seq, "%-26s %12lld\n", "journal_records",
+		   stats.journal_records);
+	seq_printf(seq, "%-26s %12lld\n", "journal_sectors",
+		   stats.journal_sectors);
+	seq_printf(seq, "%-26s %12lld\n", "journal_checkpoints",
+		   stats.journal_checkpoints);
+	seq_printf(seq, "%-26s %12lld\n", "journal_ckpt_sectors",
+		   stats.journal_ckpt_sectors);
 	seq_printf(seq, "%-26s %12d\n", "do_clean",
 		   dmc->sysctl_active.do_clean);
 	seq_printf(seq, "%-26s %12lld\n", "nr_blocks", dmc->size);
@@ -1753,52 +2325,105 @@ static int eio_stats_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "%-26s %12u\n", "nr_sets", (uint32_t)dmc->num_sets);
 	seq_printf(seq, "%-26s %12d\n", "clean_index",
 		   (uint32_t)atomic_read(&dmc->clean_index));
+	seq_printf(seq, "%-26s %12lld\n", "wb_rate", dmc->wb_rate.rate);
+	seq_printf(seq, "%-26s %12lld\n", "wb_rate_target",
+		   dmc->wb_rate.target);
+	seq_printf(seq, "%-26s %12lld\n", "wb_rate_p",
+		   dmc->wb_rate.proportional);
+	seq_printf(seq, "%-26s %12lld\n", "wb_rate_i",
+		   dmc->wb_rate.integral_term);
+	seq_printf(seq, "%-26s %12lld\n", "wb_rate_d",
+		   dmc->wb_rate.derivative);
+	seq_printf(seq, "%-26s %12llu\n", "wb_rate_latency_us",
+		   dmc->wb_rate.latency_us);
+	seq_printf(seq, "%-26s %12llu\n", "wb_rate_queued",
+		   dmc->wb_rate.queued);
 
 	seq_printf(seq, "%-26s %12lld\n", "uncached_reads",
-		   (int64_t)atomic64_read(&stats->uncached_reads));
+		   stats.uncached_reads);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_writes",
-		   (int64_t)atomic64_read(&stats->uncached_writes));
+		   stats.uncached_writes);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_size",
-		   (int64_t)atomic64_read(&stats->uncached_map_size));
+		   stats.uncached_map_size);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_uncacheable",
-		   (int64_t)atomic64_read(&stats->uncached_map_uncacheable));
+		   stats.uncached_map_uncacheable);
+	seq_printf(seq, "%-26s %12lld\n", "seq_hits",
+		   stats.seq_hits);
+	seq_printf(seq, "%-26s %12lld\n", "seq_streams",
+		   stats.seq_streams);
+	seq_printf(seq, "%-26s %12lld\n", "seq_bypass_reads",
+		   stats.seq_bypass_reads);
+	seq_printf(seq, "%-26s %12lld\n", "seq_bypass_writes",
+		   stats.seq_bypass_writes);
+	seq_printf(seq, "%-26s %12lld\n", "readahead_ios",
+		   stats.readahead_ios);
+	seq_printf(seq, "%-26s %12lld\n", "readahead_blocks",
+		   stats.readahead_blocks);
+	seq_printf(seq, "%-26s %12lld\n", "readahead_hits",
+		   stats.readahead_hits);
+	seq_printf(seq, "%-26s %12lld\n", "readahead_wasted",
+		   stats.readahead_wasted);
 
 	seq_printf(seq, "%-26s %12lld\n", "disk_reads",
-		   (int64_t)atomic64_read(&stats->disk_reads));
+		   stats.disk_reads);
 	seq_printf(seq, "%-26s %12lld\n", "disk_writes",
-		   (int64_t)atomic64_read(&stats->disk_writes));
+		   stats.disk_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_reads",
-		   (int64_t)atomic64_read(&stats->ssd_reads));
+		   stats.ssd_reads);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_writes",
-		   (int64_t)atomic64_read(&stats->ssd_writes));
+		   stats.ssd_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfills",
-		   (int64_t)atomic64_read(&stats->ssd_readfills));
+		   stats.ssd_readfills);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_unplugs",
-		   (int64_t)atomic64_read(&stats->ssd_readfill_unplugs));
+		   stats.ssd_readfill_unplugs);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_ssd_writes",
+		   stats.readfill_ssd_writes);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batches",
+		   stats.readfill_batches);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_1",
+		   stats.readfill_batch_hist[0]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_2-3",
+		   stats.readfill_batch_hist[1]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_4-7",
+		   stats.readfill_batch_hist[2]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_8-15",
+		   stats.readfill_batch_hist[3]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_16-31",
+		   stats.readfill_batch_hist[4]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_batch_32+",
+		   stats.readfill_batch_hist[5]);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_admitted",
+		   stats.readfill_admitted);
+	seq_printf(seq, "%-26s %12lld\n", "readfill_rejected",
+		   stats.readfill_rejected);
+	seq_printf(seq, "%-26s %12d\n", "readfill_depth",
+		   atomic_read(&dmc->readfill_depth));
+	seq_printf(seq, "%-26s %12d\n", "readfill_max_depth",
+		   dmc->readfill_max_depth);
 
 	seq_printf(seq, "%-26s %12lld\n", "readdisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   stats.readdisk);
 	seq_printf(seq, "%-26s %12lld\n", "writedisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   stats.writedisk);
 	seq_printf(seq, "%-26s %12lld\n", "readcache",
-		   (int64_t)atomic64_read(&stats->readcache));
+		   stats.readcache);
 	seq_printf(seq, "%-26s %12lld\n", "readfill",
-		   (int64_t)atomic64_read(&stats->readfill));
+		   stats.readfill);
 	seq_printf(seq, "%-26s %12lld\n", "writecache",
-		   (int64_t)atomic64_read(&stats->writecache));
+		   stats.writecache);
 
 	seq_printf(seq, "%-26s %12lld\n", "readcount",
-		   (int64_t)atomic64_read(&stats->readcount));
+		   stats.readcount);
 	seq_printf(seq, "%-26s %12lld\n", "writecount",
-		   (int64_t)atomic64_read(&stats->writecount));
+		   stats.writecount);
 	seq_printf(seq, "%-26s %12lld\n", "kb_reads",
-		   (int64_t)atomic64_read(&stats->reads) / 2);
+		   stats.reads / 2);
 	seq_printf(seq, "%-26s %12lld\n", "kb_writes",
-		   (int64_t)atomic64_read(&stats->writes) / 2);
+		   stats.writes / 2);
 	seq_printf(seq, "%-26s %12lld\n", "rdtime_ms",
-		   (int64_t)atomic64_read(&stats->rdtime_ms));
+		   stats.rdtime_ms);
 	seq_printf(seq, "%-26s %12lld\n", "wrtime_ms",
-		   (int64_t)atomic64_read(&stats->wrtime_ms));
+		   stats.wrtime_ms);
 	return 0;
 }
 
@@ -1849,21 +2474,23 @@ static int eio_errors_open(struct inode *inode, struct file *file)
 static int eio_iosize_hist_show(struct seq_file *seq, void *v)
 {
 	int i;
+	int64_t count;
 	struct cache_c *dmc = seq->private;
 
 	for (i = 1; i <= SIZE_HIST - 1; i++) {
-		if (atomic64_read(&dmc->size_hist[i]) == 0)
+		count = eio_size_hist_sum(dmc, i);
+		if (count == 0)
 			continue;
 
 		if (i == 1)
 			seq_printf(seq, "%u   %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 		else if (i < 20)
 			seq_printf(seq, "%u  %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 		else
 			seq_printf(seq, "%u %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 	}
 
 	return 0;
@@ -1888,6 +2515,7 @@ static int eio_version_show(struct seq_file *seq, void *v)
 	memset(buf, 0, sizeof(buf));
 	eio_version_query(sizeof(buf), buf);
 	seq_printf(seq, "%s\n", buf);
+	seq_printf(seq, "Set scan: %s\n", eio_scan_name());
 
 	return 0;
 }
@@ -1917,9 +2545,18 @@ static int eio_config_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "mode       %10u\n", dmc->mode);
 	seq_printf(seq, "eviction   %10u\n", dmc->req_policy);
 	seq_printf(seq, "num_sets   %10u\n", dmc->num_sets);
+	seq_printf(seq, "set_hash   %10u\n", dmc->set_hash);
 	seq_printf(seq, "num_blocks %10lu\n", (long unsigned int)dmc->size);
 	seq_printf(seq, "metadata        %s\n",
 		   CACHE_MD8_IS_SET(dmc) ? "large" : "small");
+	seq_printf(seq, "set_scan   %10s\n", eio_scan_name());
+	seq_printf(seq, "dbn_index  %10lu\n", (long unsigned int)
+		   (dmc->dbn_index ? eio_dbn_index_size(dmc) : 0));
+	seq_printf(seq, "set_locks  %10u\n", dmc->nr_set_locks);
+	seq_printf(seq, "memory     %10lu\n",
+		   (long unsigned int)eio_mem_size(dmc));
+	seq_printf(seq, "md_journal %10lu\n",
+		   (long unsigned int)dmc->journal_sectors);
 	seq_printf(seq, "state        %s\n",
 		   CACHE_DEGRADED_IS_SET(dmc) ? "degraded"
 		   : (CACHE_FAILED_IS_SET(dmc) ? "failed" : "normal"));
@@ -77,7 +77,7 @@ void
 eio_rand_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 			  index_t *index)
 {
-	int i = 0;
+	index_t first;
 	index_t idx;
 
 	struct cache_c *dmc = p_ops->sp_dmc;
@@ -87,13 +87,20 @@ eio_rand_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 	 * We're just being cautious here.
 	 */
 	start_index = (start_index / dmc->assoc) * dmc->assoc;
-	for (i = 0; i < (int)dmc->assoc; i++) {
-		idx = dmc->random++ % dmc->assoc;
-		if (EIO_CACHE_STATE_GET(dmc, start_index + idx) == VALID) {
-			*index = start_index + idx;
-			return;
-		}
+
+	/* Look for a VALID block from the "random" slot on, wrapping around */
+	first = dmc->random % dmc->assoc;
+	idx = eio_scan_state(dmc, start_index + first, dmc->assoc - first,
+			     VALID);
+	if (idx == -1 && first > 0)
+		idx = eio_scan_state(dmc, start_index, first, VALID);
+	if (idx == -1) {
+		dmc->random += dmc->assoc;
+		return;
 	}
+	idx -= start_index;
+	dmc->random += ((idx - first) & (dmc->assoc - 1)) + 1;
+	*index = start_index + idx;
 }
 
 /*
@@ -101,7 +108,8 @@ eio_rand_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
  */
 int eio_rand_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 {
-	int i = 0, nr_writes = 0;
+	unsigned long i;
+	int nr_writes = 0;
 	index_t start_index;
 
 	struct cache_c *dmc;
@@ -110,15 +118,16 @@ int eio_rand_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 
 	start_index = set * dmc->assoc;
 
-	/* Scan sequentially in the set and pick blocks to clean */
-	while ((i < (int)dmc->assoc) && (nr_writes < to_clean)) {
+	/* Walk the dirty blocks of the set and pick blocks to clean */
+	for_each_set_bit(i, EIO_SET_DIRTY_MAP(dmc, set), dmc->assoc) {
+		if (nr_writes >= to_clean)
+			break;
 		if ((EIO_CACHE_STATE_GET(dmc, start_index + i) &
 		     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 			EIO_CACHE_STATE_ON(dmc, start_index + i,
 					   DISKWRITEINPROG);
 			nr_writes++;
 		}
-		i++;
 	}
 
 	return nr_writes;
@@ -155,6 +164,7 @@ struct eio_policy *eio_rand_instance_init(void)
 	new_instance->sp_find_reclaim_dbn = eio_rand_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_rand_clean_set;
 	new_instance->sp_dmc = NULL;
+	new_instance->sp_mem_size = 0;
 
 	try_module_get(THIS_MODULE);
 
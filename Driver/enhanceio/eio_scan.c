@@ -0,0 +1,339 @@
+/*
+ *  eio_scan.c
+ *
+ *  Set scan kernels. Find the first in-core metadata entry of a range
+ *  which, masked, equals a given value. This is the inner loop of the
+ *  dbn lookup and of the replacement policies looking for a VALID block.
+ *
+ *  The variant is chosen once at module load: AVX2 or SSE2 on x86-64
+ *  when the CPU has it, a plain C loop otherwise. The vector kernels run
+ *  between kernel_fpu_begin()/kernel_fpu_end() and fall back to the C
+ *  loop for short ranges or when the FPU can't be used in the current
+ *  context.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eio.h"
+
+#ifdef CONFIG_X86_64
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#include <asm/cpufeature.h>
+#endif                          /* CONFIG_X86_64 */
+
+/*
+ * Below this many entries saving the FPU state costs more than
+ * the scan itself.
+ */
+#define EIO_SCAN_SIMD_MIN       64
+
+struct eio_scan_ops {
+	const char *name;
+	long (*md4)(const u_int32_t *md, u_int32_t n, u_int32_t mask,
+		    u_int32_t want);
+	long (*md8)(const u_int64_t *md, u_int32_t n, u_int64_t mask,
+		    u_int64_t want);
+};
+
+static long
+eio_scan_md4_scalar(const u_int32_t *md, u_int32_t n, u_int32_t mask,
+		    u_int32_t want)
+{
+	u_int32_t i;
+
+	for (i = 0; i < n; i++)
+		if ((md[i] & mask) == want)
+			return i;
+	return -1;
+}
+
+static long
+eio_scan_md8_scalar(const u_int64_t *md, u_int32_t n, u_int64_t mask,
+		    u_int64_t want)
+{
+	u_int32_t i;
+
+	for (i = 0; i < n; i++)
+		if ((md[i] & mask) == want)
+			return i;
+	return -1;
+}
+
+static const struct eio_scan_ops eio_scan_scalar = {
+	.name	= "scalar",
+	.md4	= eio_scan_md4_scalar,
+	.md8	= eio_scan_md8_scalar,
+};
+
+#ifdef CONFIG_X86_64
+
+/*
+ * SSE2: 8 md4 or 4 md8 entries per iteration, in two xmm registers.
+ * There is no 64-bit compare in SSE2, an md8 entry matches when both
+ * of its 32-bit halves do.
+ */
+static long
+eio_scan_md4_sse2(const u_int32_t *md, u_int32_t n, u_int32_t mask,
+		  u_int32_t want)
+{
+	u_int32_t i, lo, hi;
+	long ret = -1;
+
+	if (n < EIO_SCAN_SIMD_MIN || !irq_fpu_usable())
+		return eio_scan_md4_scalar(md, n, mask, want);
+
+	kernel_fpu_begin();
+	asm volatile("movd %0, %%xmm0\n\t"
+		     "pshufd $0, %%xmm0, %%xmm0\n\t"
+		     "movd %1, %%xmm1\n\t"
+		     "pshufd $0, %%xmm1, %%xmm1"
+		     : : "r" (mask), "r" (want));
+	for (i = 0; i + 8 <= n; i += 8) {
+		asm volatile("movdqu %2, %%xmm2\n\t"
+			     "movdqu %3, %%xmm3\n\t"
+			     "pand %%xmm0, %%xmm2\n\t"
+			     "pand %%xmm0, %%xmm3\n\t"
+			     "pcmpeqd %%xmm1, %%xmm2\n\t"
+			     "pcmpeqd %%xmm1, %%xmm3\n\t"
+			     "movmskps %%xmm2, %0\n\t"
+			     "movmskps %%xmm3, %1"
+			     : "=r" (lo), "=r" (hi)
+			     : "m" (*(const u_int32_t (*)[4])&md[i]),
+			       "m" (*(const u_int32_t (*)[4])&md[i + 4]));
+		if (lo | hi) {
+			ret = i + __ffs(lo | (hi << 4));
+			break;
+		}
+	}
+	kernel_fpu_end();
+
+	if (ret == -1 && i < n) {
+		ret = eio_scan_md4_scalar(md + i, n - i, mask, want);
+		if (ret != -1)
+			ret += i;
+	}
+	return ret;
+}
+
+static long
+eio_scan_md8_sse2(const u_int64_t *md, u_int32_t n, u_int64_t mask,
+		  u_int64_t want)
+{
+	u_int32_t i, lo, hi;
+	long ret = -1;
+
+	if (n < EIO_SCAN_SIMD_MIN || !irq_fpu_usable())
+		return eio_scan_md8_scalar(md, n, mask, want);
+
+	kernel_fpu_begin();
+	asm volatile("movq %0, %%xmm0\n\t"
+		     "punpcklqdq %%xmm0, %%xmm0\n\t"
+		     "movq %1, %%xmm1\n\t"
+		     "punpcklqdq %%xmm1, %%xmm1"
+		     : : "r" (mask), "r" (want));
+	for (i = 0; i + 4 <= n; i += 4) {
+		asm volatile("movdqu %2, %%xmm2\n\t"
+			     "movdqu %3, %%xmm3\n\t"
+			     "pand %%xmm0, %%xmm2\n\t"
+			     "pand %%xmm0, %%xmm3\n\t"
+			     "pcmpeqd %%xmm1, %%xmm2\n\t"
+			     "pcmpeqd %%xmm1, %%xmm3\n\t"
+			     "movmskps %%xmm2, %0\n\t"
+			     "movmskps %%xmm3, %1"
+			     : "=r" (lo), "=r" (hi)
+			     : "m" (*(const u_int64_t (*)[2])&md[i]),
+			       "m" (*(const u_int64_t (*)[2])&md[i + 2]));
+		/* bit 2k set when both halves of entry k are equal */
+		lo = lo | (hi << 4);
+		lo &= lo >> 1;
+		lo &= 0x55;
+		if (lo) {
+			ret = i + (__ffs(lo) >> 1);
+			break;
+		}
+	}
+	kernel_fpu_end();
+
+	if (ret == -1 && i < n) {
+		ret = eio_scan_md8_scalar(md + i, n - i, mask, want);
+		if (ret != -1)
+			ret += i;
+	}
+	return ret;
+}
+
+static const struct eio_scan_ops eio_scan_sse2 = {
+	.name	= "sse2",
+	.md4	= eio_scan_md4_sse2,
+	.md8	= eio_scan_md8_sse2,
+};
+
+/*
+ * AVX2: 16 md4 or 8 md8 entries per iteration, in two ymm registers.
+ */
+static long
+eio_scan_md4_avx2(const u_int32_t *md, u_int32_t n, u_int32_t mask,
+		  u_int32_t want)
+{
+	u_int32_t i, lo, hi;
+	long ret = -1;
+
+	if (n < EIO_SCAN_SIMD_MIN || !irq_fpu_usable())
+		return eio_scan_md4_scalar(md, n, mask, want);
+
+	kernel_fpu_begin();
+	asm volatile("vpbroadcastd %0, %%ymm0\n\t"
+		     "vpbroadcastd %1, %%ymm1"
+		     : : "m" (mask), "m" (want));
+	for (i = 0; i + 16 <= n; i += 16) {
+		asm volatile("vpand %2, %%ymm0, %%ymm2\n\t"
+			     "vpand %3, %%ymm0, %%ymm3\n\t"
+			     "vpcmpeqd %%ymm1, %%ymm2, %%ymm2\n\t"
+			     "vpcmpeqd %%ymm1, %%ymm3, %%ymm3\n\t"
+			     "vmovmskps %%ymm2, %0\n\t"
+			     "vmovmskps %%ymm3, %1"
+			     : "=r" (lo), "=r" (hi)
+			     : "m" (*(const u_int32_t (*)[8])&md[i]),
+			       "m" (*(const u_int32_t (*)[8])&md[i + 8]));
+		if (lo | hi) {
+			ret = i + __ffs(lo | (hi << 8));
+			break;
+		}
+	}
+	asm volatile("vzeroupper");
+	kernel_fpu_end();
+
+	if (ret == -1 && i < n) {
+		ret = eio_scan_md4_scalar(md + i, n - i, mask, want);
+		if (ret != -1)
+			ret += i;
+	}
+	return ret;
+}
+
+static long
+eio_scan_md8_avx2(const u_int64_t *md, u_int32_t n, u_int64_t mask,
+		  u_int64_t want)
+{
+	u_int32_t i, lo, hi;
+	long ret = -1;
+
+	if (n < EIO_SCAN_SIMD_MIN || !irq_fpu_usable())
+		return eio_scan_md8_scalar(md, n, mask, want);
+
+	kernel_fpu_begin();
+	asm volatile("vpbroadcastq %0, %%ymm0\n\t"
+		     "vpbroadcastq %1, %%ymm1"
+		     : : "m" (mask), "m" (want));
+	for (i = 0; i + 8 <= n; i += 8) {
+		asm volatile("vpand %2, %%ymm0, %%ymm2\n\t"
+			     "vpand %3, %%ymm0, %%ymm3\n\t"
+			     "vpcmpeqq %%ymm1, %%ymm2, %%ymm2\n\t"
+			     "vpcmpeqq %%ymm1, %%ymm3, %%ymm3\n\t"
+			     "vmovmskpd %%ymm2, %0\n\t"
+			     "vmovmskpd %%ymm3, %1"
+			     : "=r" (lo), "=r" (hi)
+			     : "m" (*(const u_int64_t (*)[4])&md[i]),
+			       "m" (*(const u_int64_t (*)[4])&md[i + 4]));
+		if (lo | hi) {
+			ret = i + __ffs(lo | (hi << 4));
+			break;
+		}
+	}
+	asm volatile("vzeroupper");
+	kernel_fpu_end();
+
+	if (ret == -1 && i < n) {
+		ret = eio_scan_md8_scalar(md + i, n - i, mask, want);
+		if (ret != -1)
+			ret += i;
+	}
+	return ret;
+}
+
+static const struct eio_scan_ops eio_scan_avx2 = {
+	.name	= "avx2",
+	.md4	= eio_scan_md4_avx2,
+	.md8	= eio_scan_md8_avx2,
+};
+
+#endif                          /* CONFIG_X86_64 */
+
+static const struct eio_scan_ops *eio_scan = &eio_scan_scalar;
+
+/*
+ * eio_scan_init -- called from "eio_init()"
+ */
+void eio_scan_init(void)
+{
+
+#ifdef CONFIG_X86_64
+	if (boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_AVX))
+		eio_scan = &eio_scan_avx2;
+	else if (boot_cpu_has(X86_FEATURE_XMM2))
+		eio_scan = &eio_scan_sse2;
+#endif                          /* CONFIG_X86_64 */
+	pr_info("Using %s set scan", eio_scan->name);
+}
+
+const char *eio_scan_name(void)
+{
+
+	return eio_scan->name;
+}
+
+/*
+ * eio_scan_md
+ *
+ * Returns the first block in [index, index + count) whose metadata,
+ * masked with the md4 or md8 mask, equals the md4 or md8 value, or -1.
+ */
+index_t
+eio_scan_md(struct cache_c *dmc, index_t index, u_int32_t count,
+	    u_int32_t mask4, u_int32_t want4, u_int64_t mask8, u_int64_t want8)
+{
+	long i;
+
+	if (EIO_MD8(dmc))
+		i = eio_scan->md8(&dmc->cache_md8[index].md8_u.u_i_md8, count,
+				  mask8, want8);
+	else
+		i = eio_scan->md4(&dmc->cache[index].md4_u.u_i_md4, count,
+				  mask4, want4);
+
+	return (i == -1) ? -1 : index + i;
+}
+EXPORT_SYMBOL(eio_scan_md);
+
+/*
+ * eio_scan_state
+ *
+ * Returns the first block in [index, index + count) in exactly
+ * "cache_state", or -1.
+ */
+index_t
+eio_scan_state(struct cache_c *dmc, index_t index, u_int32_t count,
+	       u_int8_t cache_state)
+{
+
+	return eio_scan_md(dmc, index, count,
+			   ~EIO_MD4_DBN_MASK,
+			   (u_int32_t)cache_state << EIO_MD4_DBN_BITS,
+			   ~EIO_MD8_DBN_MASK,
+			   (u_int64_t)cache_state << EIO_MD8_DBN_BITS);
+}
+EXPORT_SYMBOL(eio_scan_state);
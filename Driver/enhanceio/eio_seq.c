@@ -0,0 +1,127 @@
+/*
+ *  eio_seq.c
+ *
+ *  Sequential stream detection of a cache. Large sequential I/O is
+ *  served well by the source device: caching it only evicts the blocks
+ *  read at random and costs readfill writes on the SSD.
+ *
+ *  The cache keeps the tails of the last EIO_SEQ_STREAMS streams, each
+ *  known by the sector following its last bio. A bio starting there
+ *  extends the stream, any other bio starts a new stream in place of
+ *  the least recently extended one. Once a stream reaches
+ *  "sequential_cutoff_kb", its bios bypass the cache:
+ *
+ *	- a read is still served from the SSD where it hits, but no block
+ *	  is filled where it misses,
+ *	- a write to a write-through or read-only cache goes to the source
+ *	  device alone and invalidates the blocks it covers.
+ *
+ *  The writes to a write-back cache are cached as usual, as the blocks
+ *  they cover may be dirty.
+ *
+ *  With "readahead_blocks" set, a read which extends a stream short of
+ *  the cutoff also gets a read-ahead window: the blocks following the
+ *  stream, up to "readahead_blocks" of them and no further than the end
+ *  of the set region they start in, which have not been read ahead for
+ *  the stream yet. See eio_readahead() for how they are read.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eio.h"
+
+void eio_seq_init(struct cache_c *dmc)
+{
+	struct eio_seq_detect *sd = &dmc->seq_detect;
+
+	spin_lock_init(&sd->lock);
+	sd->clock = 0;
+	memset(sd->streams, 0, sizeof(sd->streams));
+}
+
+/*
+ * The read-ahead window of a stream, in "ra". A stream is read ahead
+ * again once it has read half of the blocks read ahead for it, so that
+ * the read-aheads stay large. The blocks of a set region all go to the
+ * same set, see hash_block(), so the window is read into one set.
+ */
+static void eio_seq_readahead(struct cache_c *dmc, struct eio_seq_stream *s,
+			      u_int32_t blocks, struct eio_io_region *ra)
+{
+	sector_t start, end, region_end;
+
+	start = EIO_ROUND_SECTOR(dmc, s->next + dmc->block_size - 1);
+	if (s->ra_next > start + (sector_t)(blocks / 2) * dmc->block_size)
+		return;
+	region_end = EIO_ROUND_SET_SECTOR(dmc, start) +
+		     (sector_t)dmc->block_size * dmc->assoc;
+	end = min(start + (sector_t)blocks * dmc->block_size, region_end);
+	if (start < s->ra_next)
+		start = s->ra_next;
+	if (start >= end)
+		return;
+
+	s->ra_next = end;
+	ra->sector = start;
+	ra->count = end - start;
+}
+
+/*
+ * Account a bio of "sectors" at "sector" to its stream. Returns 1 if
+ * the stream has reached "sequential_cutoff_kb", 0 otherwise or if the
+ * detection is off. For a read, "ra" is set to the read-ahead window
+ * of the stream, of zero count if there is none.
+ */
+int eio_seq_detect(struct cache_c *dmc, sector_t sector, sector_t sectors,
+		   struct eio_io_region *ra)
+{
+	struct eio_seq_detect *sd = &dmc->seq_detect;
+	struct eio_seq_stream *s, *lru;
+	u_int64_t cutoff;
+	u_int32_t blocks;
+	unsigned long flags;
+	int i, bypass;
+
+	if (ra)
+		ra->count = 0;
+	cutoff = (u_int64_t)dmc->sysctl_active.sequential_cutoff_kb * 2;
+	blocks = ra ? dmc->sysctl_active.readahead_blocks : 0;
+	if (cutoff == 0 && blocks == 0)
+		return 0;
+
+	spin_lock_irqsave(&sd->lock, flags);
+	lru = &sd->streams[0];
+	for (i = 0; i < EIO_SEQ_STREAMS; i++) {
+		s = &sd->streams[i];
+		if (s->sectors && s->next == sector)
+			break;
+		if (s->used < lru->used)
+			lru = s;
+	}
+	if (i == EIO_SEQ_STREAMS) {
+		s = lru;
+		s->sectors = 0;
+		s->ra_next = 0;
+		EIO_STATS_INC(dmc, seq_streams);
+	} else
+		EIO_STATS_INC(dmc, seq_hits);
+	s->sectors += sectors;
+	s->next = sector + sectors;
+	s->used = ++sd->clock;
+	bypass = cutoff && s->sectors >= cutoff;
+	if (blocks && !bypass && i < EIO_SEQ_STREAMS)
+		eio_seq_readahead(dmc, s, blocks, ra);
+	spin_unlock_irqrestore(&sd->lock, flags);
+
+	return bypass;
+}
@@ -317,7 +317,7 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 			dmc->cache_flags &= ~CACHE_FLAGS_DEGRADED;
 		dmc->cache_flags |= CACHE_FLAGS_FAILED;
 		dmc->eio_errors.no_source_dev = 1;
-		atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+		eio_stats_clear_cached(dmc);
 		pr_info("suspend_caching: Source Device Removed."
 			"Cache \"%s\" is in Failed mode.\n", dmc->cache_name);
 		break;
@@ -345,7 +345,7 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 				return;
 			}
 			dmc->cache_flags |= CACHE_FLAGS_DEGRADED;
-			atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+			eio_stats_clear_cached(dmc);
 			pr_info("suspend caching: Cache \"%s\" \
 				is in Degraded mode.\n", dmc->cache_name);
 		}
@@ -442,3 +442,110 @@ void eio_resume_caching(struct cache_c *dmc, char *dev)
 	pr_info(" resume_caching:cache %s is restored to ACTIVE mode.\n",
 		dmc->cache_name);
 }
+
+/*
+ * eio_stats_sum
+ *
+ * Adds up the per CPU stats of a cache. A block may be counted out
+ * on another CPU, or after a reset, so only the sum of "cached_blocks"
+ * is meaningful and it is clamped to zero.
+ */
+void eio_stats_sum(struct cache_c *dmc, struct eio_stats *stats)
+{
+	int64_t *sum = (int64_t *)stats;
+	int64_t *val;
+	unsigned int i;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		val = (int64_t *)&per_cpu_ptr(dmc->pcpu_stats, cpu)->stats;
+		for (i = 0; i < sizeof(*stats) / sizeof(int64_t); i++)
+			sum[i] += val[i];
+	}
+	if (stats->cached_blocks < 0)
+		stats->cached_blocks = 0;
+}
+
+/*
+ * eio_stats_zero
+ *
+ * Resets the stats, optionally keeping the number of cached blocks.
+ * Updates racing on other CPUs may be lost.
+ */
+void eio_stats_zero(struct cache_c *dmc, int keep_cached)
+{
+	struct eio_stats *stats;
+	int64_t cached_blocks = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = &per_cpu_ptr(dmc->pcpu_stats, cpu)->stats;
+		cached_blocks += stats->cached_blocks;
+		memset(stats, 0, sizeof(*stats));
+	}
+	if (keep_cached && cached_blocks > 0)
+		per_cpu_ptr(dmc->pcpu_stats, cpumask_first(cpu_possible_mask))->
+			stats.cached_blocks = cached_blocks;
+}
+
+/*
+ * eio_stats_clear_cached
+ */
+void eio_stats_clear_cached(struct cache_c *dmc)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(dmc->pcpu_stats, cpu)->stats.cached_blocks = 0;
+}
+
+/*
+ * eio_size_hist_sum
+ */
+int64_t eio_size_hist_sum(struct cache_c *dmc, int i)
+{
+	int64_t sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(dmc->pcpu_stats, cpu)->size_hist[i];
+
+	return sum;
+}
+
+/*
+ * eio_nr_ios
+ *
+ * Number of I/Os in flight. An I/O may complete on another CPU than
+ * it was mapped on: the sum is exact only once no new I/O can come in,
+ * which is how the drain loops use it.
+ */
+int64_t eio_nr_ios(struct cache_c *dmc)
+{
+	int64_t sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(dmc->pcpu_stats, cpu)->nr_ios;
+
+	return sum;
+}
+
+/*
+ * eio_nr_ios_est
+ *
+ * "nr_ios" refreshed at most once per jiffy, for the autoclean
+ * heuristic which runs on every write.
+ */
+int64_t eio_nr_ios_est(struct cache_c *dmc)
+{
+	unsigned long now = jiffies;
+
+	if (dmc->nr_ios_stamp != now) {
+		dmc->nr_ios_est = eio_nr_ios(dmc);
+		dmc->nr_ios_stamp = now;
+	}
+
+	return dmc->nr_ios_est;
+}
@@ -29,6 +29,7 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/srcu.h>
 #include "eio.h"
 #include "eio_ttc.h"
 
@@ -41,8 +42,21 @@
 #endif
 
 
+/*
+ * eio_ttc_lock serializes the updates of eio_ttc_list and the control
+ * paths. The I/O submission path walks eio_ttc_list under eio_ttc_srcu
+ * only, so it doesn't write to any shared cache line. A cache stays
+ * alive as long as it has I/Os in flight ("nr_ios"): eio_ttc_deactivate()
+ * waits for the submitters to leave the list and then for "nr_ios" to
+ * drain out.
+ */
 static struct rw_semaphore eio_ttc_lock[EIO_HASHTBL_SIZE];
 static struct list_head eio_ttc_list[EIO_HASHTBL_SIZE];
+static struct srcu_struct eio_ttc_srcu;
+
+/* Submitters waiting for a cache to be unblocked */
+static DECLARE_WAIT_QUEUE_HEAD(eio_ttc_wait);
+static atomic_t eio_ttc_unblocks = ATOMIC_INIT(0);
 
 int eio_reboot_notified;
 
@@ -148,6 +162,29 @@ struct cache_c *eio_cache_lookup(char *name)
 	return NULL;
 }
 
+/*
+ * eio_ttc_block
+ *
+ * Holds off new application I/O on a cache. On return, every submitter
+ * has either seen the cache blocked or has its I/O counted in "nr_ios".
+ */
+static void eio_ttc_block(struct cache_c *dmc)
+{
+	atomic_inc(&dmc->ttc_block);
+	synchronize_srcu(&eio_ttc_srcu);
+}
+
+/*
+ * eio_ttc_unblock
+ */
+static void eio_ttc_unblock(struct cache_c *dmc)
+{
+	atomic_dec(&dmc->ttc_block);
+	smp_mb__after_atomic();
+	atomic_inc(&eio_ttc_unblocks);
+	wake_up_all(&eio_ttc_wait);
+}
+
 int eio_ttc_activate(struct cache_c *dmc)
 {
 	struct block_device *bdev;
@@ -201,22 +238,25 @@ int eio_ttc_activate(struct cache_c *dmc)
 	}
 
 	/*
-	 * Save original make_request_fn. Switch make_request_fn only once.
+	 * Save original make_request_fn. Switch make_request_fn only once,
+	 * after the cache is on the list so that the new make_request_fn
+	 * finds it. I/O on the cache waits until the barrier is issued.
 	 */
 
+	atomic_inc(&dmc->ttc_block);
 	if (origmfn) {
 		dmc->origmfn = origmfn;
 		dmc->dev_info = EIO_DEV_PARTITION;
 		EIO_ASSERT(wholedisk == 0);
+		list_add_tail_rcu(&dmc->cachelist, &eio_ttc_list[index]);
 	} else {
 		dmc->origmfn = rq->make_request_fn;
-		rq->make_request_fn = eio_make_request_fn;
 		dmc->dev_info =
 			(wholedisk) ? EIO_DEV_WHOLE_DISK : EIO_DEV_PARTITION;
+		list_add_tail_rcu(&dmc->cachelist, &eio_ttc_list[index]);
+		rq->make_request_fn = eio_make_request_fn;
 	}
 
-	list_add_tail(&dmc->cachelist, &eio_ttc_list[index]);
-
 	/*
 	 * Sleep for sometime, to allow previous I/Os to hit
 	 * Issue a barrier I/O on Source device.
@@ -227,6 +267,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 	eio_issue_empty_barrier_flush(dmc->disk_dev->bdev, NULL,
 				      EIO_HDD_DEVICE, dmc->origmfn, rw_flags);
 	up_write(&eio_ttc_lock[index]);
+	eio_ttc_unblock(dmc);
 
 out:
 	if (error == -EINVAL) {
@@ -305,17 +346,21 @@ deactivate:
 		if ((dmc->dev_info == EIO_DEV_WHOLE_DISK) || (found_partitions == 0))
 			rq->make_request_fn = dmc->origmfn;
 
-	list_del_init(&dmc->cachelist);
+	list_del_rcu(&dmc->cachelist);
 	up_write(&eio_ttc_lock[index]);
 
+	/* wait for the submitters which may have found the cache */
+	synchronize_srcu(&eio_ttc_srcu);
+	INIT_LIST_HEAD(&dmc->cachelist);
+
 	/* wait for nr_ios to drain-out */
-	while (atomic64_read(&dmc->nr_ios) != 0)
+	while (eio_nr_ios(dmc) != 0)
 		schedule_timeout(msecs_to_jiffies(100));
 
 	return ret;
 }
 
-void eio_ttc_init(void)
+int eio_ttc_init(void)
 {
 	int i;
 
@@ -323,6 +368,12 @@ void eio_ttc_init(void)
 		init_rwsem(&eio_ttc_lock[i]);
 		INIT_LIST_HEAD(&eio_ttc_list[i]);
 	}
+	return init_srcu_struct(&eio_ttc_srcu);
+}
+
+void eio_ttc_exit(void)
+{
+	cleanup_srcu_struct(&eio_ttc_srcu);
 }
 
 /*
@@ -350,6 +401,8 @@ static void eio_make_request_fn(struct request_queue *q, struct bio *bio)
 	int ret;
 	int overlap;
 	int index;
+	int srcu_idx;
+	int unblocks;
 	make_request_fn *origmfn;
 	struct cache_c *dmc, *dmc1;
 	struct block_device *bdev;
@@ -363,9 +416,11 @@ re_lookup:
 
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 
-	down_read(&eio_ttc_lock[index]);
+	srcu_idx = srcu_read_lock(&eio_ttc_srcu);
+	unblocks = atomic_read(&eio_ttc_unblocks);
+	smp_rmb();
 
-	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
+	list_for_each_entry_rcu(dmc1, &eio_ttc_list[index], cachelist) {
 		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
 			continue;
 
@@ -426,7 +481,7 @@ re_lookup:
 	}
 
 	if (unlikely(overlap)) {
-		up_read(&eio_ttc_lock[index]);
+		srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
 
 		if (bio_rw_flagged(bio, REQ_DISCARD)) {
 			pr_err
@@ -436,6 +491,14 @@ re_lookup:
 		} else
 			ret = eio_overlap_split_bio(q, bio);
 	} else if (dmc) {       /* found cached partition or device */
+		if (unlikely(atomic_read(&dmc->ttc_block))) {
+			/* cache is being activated, edited or shut down */
+			srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
+			wait_event(eio_ttc_wait,
+				   atomic_read(&eio_ttc_unblocks) != unblocks);
+			goto re_lookup;
+		}
+
 		/*
 		 * Start sector of cached partition may or may not be
 		 * aligned with cache blocksize.
@@ -463,7 +526,7 @@ re_lookup:
 	}
 
 	if (!overlap)
-		up_read(&eio_ttc_lock[index]);
+		srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
 
 	if (overlap || dmc)
 		return;
@@ -983,15 +1046,17 @@ static int eio_finish_nrdirty(struct cache_c *dmc)
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
 	down_write(&eio_ttc_lock[index]);
+	eio_ttc_block(dmc);
 
 	/* Wait for the in-flight I/Os to drain out */
-	while (atomic64_read(&dmc->nr_ios) != 0) {
+	while (eio_nr_ios(dmc) != 0) {
 		pr_debug("finish_nrdirty: Draining I/O inflight\n");
 		schedule_timeout(msecs_to_jiffies(1));
 	}
 	EIO_ASSERT(!(dmc->sysctl_active.do_clean & EIO_CLEAN_START));
 
 	dmc->sysctl_active.do_clean |= EIO_CLEAN_KEEP | EIO_CLEAN_START;
+	eio_ttc_unblock(dmc);
 	up_write(&eio_ttc_lock[index]);
 
 	/*
@@ -1115,21 +1180,23 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
 	down_write(&eio_ttc_lock[index]);
+	eio_ttc_block(dmc);
 
 	/* Wait for the in-flight I/Os to drain out */
-	while (atomic64_read(&dmc->nr_ios) != 0) {
+	while (eio_nr_ios(dmc) != 0) {
 		pr_debug("cache_edit: Draining I/O inflight\n");
 		schedule_timeout(msecs_to_jiffies(1));
 	}
 
 	pr_debug("cache_edit: Blocking application I/O\n");
 
-	EIO_ASSERT(atomic64_read(&dmc->nr_ios) == 0);
+	EIO_ASSERT(eio_nr_ios(dmc) == 0);
 
 	/* policy change */
 	if ((policy != 0) && (policy != dmc->req_policy)) {
 		error = eio_policy_switch(dmc, policy);
 		if (error) {
+			eio_ttc_unblock(dmc);
 			up_write(&eio_ttc_lock[index]);
 			goto out;
 		}
@@ -1139,6 +1206,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	if ((mode != 0) && (mode != dmc->mode)) {
 		error = eio_mode_switch(dmc, mode);
 		if (error) {
+			eio_ttc_unblock(dmc);
 			up_write(&eio_ttc_lock[index]);
 			goto out;
 		}
@@ -1151,12 +1219,15 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 		/* XXX: In case of error put the cache in degraded mode. */
 		pr_err("eio_cache_edit: superblock update failed(error %d)",
 		       error);
+		eio_ttc_unblock(dmc);
+		up_write(&eio_ttc_lock[index]);
 		goto out;
 	}
 
 	eio_procfs_dtr(dmc);
 	eio_procfs_ctr(dmc);
 
+	eio_ttc_unblock(dmc);
 	up_write(&eio_ttc_lock[index]);
 
 out:
@@ -1172,9 +1243,9 @@ out:
 
 	/* Restart async-task for "WB" cache. */
 	if ((dmc->mode == CACHE_MODE_WB) && (restart_async_task == 1)) {
-		pr_debug("cache_edit: Restarting the clean_thread.\n");
-		EIO_ASSERT(dmc->clean_thread == NULL);
-		ret = eio_start_clean_thread(dmc);
+		pr_debug("cache_edit: Restarting the clean threads.\n");
+		EIO_ASSERT(dmc->nr_cleaners == 0);
+		ret = eio_start_clean_threads(dmc);
 		if (ret) {
 			error = ret;
 			pr_err
@@ -1189,6 +1260,7 @@ out:
 					      * 60 * HZ);
 			dmc->is_clean_aged_sets_sched = 1;
 		}
+		eio_wb_rate_start(dmc);
 	}
 	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
 	dmc->cache_flags &= ~CACHE_FLAGS_MOD_INPROG;
@@ -1535,12 +1607,13 @@ int eio_reboot_handling(void)
 				continue;
 			}
 
-			while (atomic64_read(&dmc->nr_ios) != 0) {
+			eio_ttc_block(dmc);
+			while (eio_nr_ios(dmc) != 0) {
 				pr_debug("rdonly: Draining I/O inflight\n");
 				schedule_timeout(msecs_to_jiffies(10));
 			}
 
-			EIO_ASSERT(atomic64_read(&dmc->nr_ios) == 0);
+			EIO_ASSERT(eio_nr_ios(dmc) == 0);
 			EIO_ASSERT(dmc->cache_rdonly == 0);
 
 			/*
@@ -1571,6 +1644,7 @@ int eio_reboot_handling(void)
 				 * Cache got deleted. Free the dmc.
 				 */
 
+				eio_ttc_unblock(dmc);
 				tempdmc = dmc;
 				continue;
 			}
@@ -1583,6 +1657,7 @@ int eio_reboot_handling(void)
 			dmc->cache_rdonly = 1;
 			pr_info("Cache \"%s\" marked read only\n",
 				dmc->cache_name);
+			eio_ttc_unblock(dmc);
 			up_write(&eio_ttc_lock[i]);
 
 			if (dmc->cold_boot && atomic64_read(&dmc->nr_dirty) &&
@@ -114,7 +114,8 @@ extern void eio_ttc_put_device(struct eio_bdev **);
 extern struct cache_c *eio_cache_lookup(char *);
 extern int eio_ttc_activate(struct cache_c *);
 extern int eio_ttc_deactivate(struct cache_c *, int);
-extern void eio_ttc_init(void);
+extern int eio_ttc_init(void);
+extern void eio_ttc_exit(void);
 
 extern int eio_cache_create(struct cache_rec_short *);
 extern int eio_cache_delete(char *, int);
@@ -132,7 +133,7 @@ extern void eio_free_wb_resources(struct cache_c *);
 extern int eio_cache_edit(char *, u_int32_t, u_int32_t);
 
 extern void eio_stop_async_tasks(struct cache_c *dmc);
-extern int eio_start_clean_thread(struct cache_c *dmc);
+extern int eio_start_clean_threads(struct cache_c *dmc);
 
 extern int eio_policy_init(struct cache_c *);
 extern void eio_policy_free(struct cache_c *);
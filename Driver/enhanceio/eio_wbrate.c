@@ -0,0 +1,172 @@
+/*
+ *  eio_wbrate.c
+ *
+ *  Writeback rate controller of a write-back cache. Without it, dirty
+ *  sets are cleaned when the dirty thresholds are crossed, and only
+ *  while the source device is idle enough for "autoclean_threshold":
+ *  under a steady load nothing is cleaned until the high threshold is
+ *  hit, and then a large part of the cache is cleaned at once.
+ *
+ *  With "writeback_percent" set, a delayed work runs every
+ *  EIO_WB_RATE_PERIOD_MS and sets the rate, in blocks per second, at
+ *  which dirty sets are queued for clean from the error between the
+ *  dirty blocks and that percentage of the cache:
+ *
+ *	rate = error / P + integral of error / I + growth of dirty / D
+ *
+ *  The rate is cut in the ratio of "writeback_latency_ms" to the mean
+ *  latency of the clean writes on the source device when the latter is
+ *  higher, so that cleaning backs off when the source device is busy.
+ *  Whole sets are queued as the rate allows and the cleaners write them
+ *  regardless of "autoclean_threshold".
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/math64.h>
+#include "eio.h"
+#include "eio_ttc.h"
+
+#define EIO_WB_RATE_PERIOD_MS   100
+#define EIO_WB_RATE_P_INVERSE   40      /* error / 40 blocks per second */
+#define EIO_WB_RATE_I_INVERSE   10000   /* error seconds / 10000 */
+#define EIO_WB_RATE_D_INVERSE   4       /* growth per second / 4 */
+#define EIO_WB_RATE_MIN         8       /* blocks per second over target */
+
+static void eio_wb_rate_update(struct cache_c *dmc)
+{
+	struct eio_wb_rate *wbr = &dmc->wb_rate;
+	int64_t dirty, error, rate, max_rate;
+	u_int64_t count, target_us;
+
+	dirty = atomic64_read(&dmc->nr_dirty);
+	max_rate = (int64_t)dmc->size;
+	wbr->target = EIO_DIV(dmc->sysctl_active.writeback_percent * dmc->size,
+			      100);
+	error = dirty - wbr->target;
+
+	wbr->proportional = div_s64(error, EIO_WB_RATE_P_INVERSE);
+	wbr->derivative = div_s64((dirty - wbr->last_dirty) * MSEC_PER_SEC,
+				  EIO_WB_RATE_PERIOD_MS * EIO_WB_RATE_D_INVERSE);
+	wbr->last_dirty = dirty;
+
+	/*
+	 * Do not integrate while the rate is clamped and the error would
+	 * push it further, lest the integral builds up while the cache
+	 * cannot be cleaned any faster or slower.
+	 */
+	if (!(error > 0 && wbr->rate >= max_rate) &&
+	    !(error < 0 && wbr->rate <= 0))
+		wbr->integral += div_s64(error * EIO_WB_RATE_PERIOD_MS,
+					 MSEC_PER_SEC);
+	wbr->integral_term = div_s64(wbr->integral, EIO_WB_RATE_I_INVERSE);
+
+	rate = wbr->proportional + wbr->integral_term + wbr->derivative;
+	if (error > 0 && rate < EIO_WB_RATE_MIN)
+		rate = EIO_WB_RATE_MIN;
+	if (rate < 0)
+		rate = 0;
+	if (rate > max_rate)
+		rate = max_rate;
+
+	/* Latency feedback from the clean writes of the period */
+	count = atomic64_xchg(&wbr->lat_count, 0);
+	if (count)
+		wbr->latency_us =
+			div64_u64(atomic64_xchg(&wbr->lat_sum_us, 0), count);
+	target_us = (u_int64_t)dmc->sysctl_active.writeback_latency_ms *
+		    USEC_PER_MSEC;
+	if (target_us && wbr->latency_us > target_us && rate > EIO_WB_RATE_MIN)
+		rate = max_t(int64_t, EIO_WB_RATE_MIN,
+			     div64_u64(rate * target_us, wbr->latency_us));
+	wbr->rate = rate;
+}
+
+static void eio_wb_rate_work(struct work_struct *work)
+{
+	struct cache_c *dmc;
+	struct eio_wb_rate *wbr;
+	int64_t quantum;
+
+	dmc = container_of(work, struct cache_c, wb_rate.work.work);
+	wbr = &dmc->wb_rate;
+
+	if (dmc->sysctl_active.writeback_percent == 0 ||
+	    dmc->sysctl_active.fast_remove)
+		return;
+
+	if (unlikely(CACHE_FAILED_IS_SET(dmc)))
+		goto resched;
+
+	eio_wb_rate_update(dmc);
+
+	/*
+	 * Sets are queued whole, so the budget may go negative: the blocks
+	 * queued past it are paid back over the next periods. Leave one
+	 * second of budget at most, so that a burst of dirty blocks after a
+	 * quiet time is not cleaned at once.
+	 */
+	quantum = div_s64(wbr->rate * EIO_WB_RATE_PERIOD_MS, MSEC_PER_SEC);
+	wbr->budget = min(wbr->budget + quantum, max_t(int64_t, wbr->rate, 1));
+
+	/* Queue no more sets than the clean pipes of the cleaners hold */
+	if (wbr->budget > 0 && atomic64_read(&dmc->nr_dirty) > wbr->target &&
+	    atomic64_read(&dmc->clean_pendings) <
+	    (int64_t)(dmc->nr_cleaners * CLEAN_PIPELINE_DEPTH)) {
+		int64_t queued;
+
+		queued = eio_queue_dirty_sets(dmc, wbr->budget - 1);
+		wbr->budget -= queued;
+		wbr->queued += queued;
+	}
+
+resched:
+	schedule_delayed_work(&wbr->work,
+			      msecs_to_jiffies(EIO_WB_RATE_PERIOD_MS));
+}
+
+void eio_wb_rate_init(struct cache_c *dmc)
+{
+	struct eio_wb_rate *wbr = &dmc->wb_rate;
+
+	INIT_DELAYED_WORK(&wbr->work, eio_wb_rate_work);
+	atomic64_set(&wbr->lat_sum_us, 0);
+	atomic64_set(&wbr->lat_count, 0);
+	wbr->last_dirty = atomic64_read(&dmc->nr_dirty);
+	wbr->integral = 0;
+	wbr->budget = 0;
+	wbr->target = 0;
+	wbr->proportional = 0;
+	wbr->integral_term = 0;
+	wbr->derivative = 0;
+	wbr->rate = 0;
+	wbr->latency_us = 0;
+	wbr->queued = 0;
+}
+
+/* Start the controller if "writeback_percent" is set */
+void eio_wb_rate_start(struct cache_c *dmc)
+{
+	if (dmc->sysctl_active.writeback_percent == 0)
+		return;
+	dmc->wb_rate.last_dirty = atomic64_read(&dmc->nr_dirty);
+	dmc->wb_rate.integral = 0;
+	dmc->wb_rate.budget = 0;
+	schedule_delayed_work(&dmc->wb_rate.work,
+			      msecs_to_jiffies(EIO_WB_RATE_PERIOD_MS));
+}
+
+void eio_wb_rate_stop(struct cache_c *dmc)
+{
+	cancel_delayed_work_sync(&dmc->wb_rate.work);
+}
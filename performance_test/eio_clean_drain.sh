@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Time to drain the dirty data of a write-back cache to a slow source
+# device, for a growing number of cleaner threads. The SSD is a brd ram
+# disk and the source a dm-delay device over a loop device, which adds a
+# fixed latency to every I/O as a busy HDD array would. Each round fills
+# the cache with dirty blocks, then starts a full clean and waits for
+# nr_dirty to drop to zero.
+#
+# Run it as root with the enhanceio modules loaded.
+
+# Device Variables
+brd_size_kb="4194304"
+loop_file="/root/eio_perf/clean_drain_source.img"
+loop_size="16G"
+delay_ms="5"
+cache_device="/dev/ram0"
+source_name="eio_slow"
+source_device="/dev/mapper/${source_name}"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wb"
+cache_block_size="4096"
+cache_name="drain1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="3G"
+iodepth="32"
+threads_list="1 2 4 8 16"
+max_clean_ios="256"
+
+output_path="/root/eio_perf/clean_drain/${delay_ms}ms_delay_${file_size}_dirty"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+truncate -s ${loop_size} ${loop_file} || exit 1
+loop_device=`losetup -f --show ${loop_file}` || exit 1
+sectors=`blockdev --getsz ${loop_device}`
+echo "0 ${sectors} delay ${loop_device} 0 ${delay_ms}" | dmsetup create ${source_name} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+# Keep the dirty blocks until the clean of each round
+sysctl -w dev.enhanceio.${cache_name}.dirty_high_threshold=90
+sysctl -w dev.enhanceio.${cache_name}.dirty_set_high_threshold=100
+sysctl -w dev.enhanceio.${cache_name}.time_based_clean_interval=0
+sysctl -w dev.enhanceio.${cache_name}.max_clean_ios=${max_clean_ios}
+
+nr_dirty() {
+	awk '$1 == "nr_dirty" { print $2 }' /proc/enhanceio/${cache_name}/stats
+}
+
+# Run the test
+printf "%8s %12s %12s %12s\n" "threads" "dirty" "seconds" "MB/s" | tee ${output_path}/summary.txt
+for threads in ${threads_list}; do
+	sysctl -w dev.enhanceio.${cache_name}.clean_threads=${threads} > /dev/null || break
+
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randwrite --iodepth=${iodepth} --filename=${source_device} --name=Dirty_${threads} --output=${output_path}/Dirty_${threads}.txt
+	dirty=`nr_dirty`
+
+	start=`date +%s.%N`
+	sysctl -w dev.enhanceio.${cache_name}.do_clean=1 > /dev/null
+	while [ "`nr_dirty`" -gt 0 ]; do
+		sleep 1
+	done
+	end=`date +%s.%N`
+
+	seconds=`echo "${end} - ${start}" | bc`
+	mbps=`echo "scale=1; ${dirty} * ${cache_block_size} / 1048576 / ${seconds}" | bc`
+	printf "%8s %12s %12.1f %12s\n" ${threads} ${dirty} ${seconds} ${mbps} | tee -a ${output_path}/summary.txt
+done
+
+cp /proc/enhanceio/${cache_name}/stats ${output_path}/stats.txt
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+dmsetup remove ${source_name}
+losetup -d ${loop_device}
+rm -f ${loop_file}
+rmmod brd
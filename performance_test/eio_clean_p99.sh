@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Latency percentiles of a random read/write load on a write-back cache,
+# with and without heavy cleaning going on. The "idle" round keeps the
+# dirty blocks; the "cleaning" round sets "writeback_percent" to 1, so
+# that the cleaners clean the sets the load keeps dirtying all along.
+# The SSD is a brd ram disk and the source a dm-delay device over a
+# loop device, so a set clean lasts at least as long as its hdd writes.
+# fio reports the p99 latencies, the cache stats the I/Os which waited
+# for the clean of their block.
+#
+# Run it as root with the enhanceio modules loaded.
+
+# Device Variables
+brd_size_kb="1048576"
+loop_file="/root/eio_perf/clean_p99_source.img"
+loop_size="16G"
+delay_ms="5"
+cache_device="/dev/ram0"
+source_name="eio_slow"
+source_device="/dev/mapper/${source_name}"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wb"
+cache_block_size="4096"
+cache_name="cleanp99"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="512M"
+iodepth="16"
+numjobs="4"
+runtime="60"
+rwmixread="70"
+
+output_path="/root/eio_perf/clean_p99/${delay_ms}ms_delay_${file_size}"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+truncate -s ${loop_size} ${loop_file} || exit 1
+loop_device=`losetup -f --show ${loop_file}` || exit 1
+sectors=`blockdev --getsz ${loop_device}`
+echo "0 ${sectors} delay ${loop_device} 0 ${delay_ms}" | dmsetup create ${source_name} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+sysctl -w dev.enhanceio.${cache_name}.dirty_high_threshold=100
+sysctl -w dev.enhanceio.${cache_name}.dirty_set_high_threshold=100
+sysctl -w dev.enhanceio.${cache_name}.time_based_clean_interval=0
+sysctl -w dev.enhanceio.${cache_name}.autoclean_threshold=0
+
+# Warm the cache up with the working set
+fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=write --iodepth=${iodepth} --filename=${source_device} --name=Warmup --output=${output_path}/Warmup.txt
+
+# Run the test
+for round in idle cleaning; do
+	if [ ${round} = cleaning ]; then
+		sysctl -w dev.enhanceio.${cache_name}.writeback_percent=1 > /dev/null || break
+	fi
+	sysctl -w dev.enhanceio.${cache_name}.zero_stats=1 > /dev/null
+
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rwmixread} --iodepth=${iodepth} --numjobs=${numjobs} --group_reporting --time_based --runtime=${runtime} --percentile_list=50:90:99:99.9 --filename=${source_device} --name=Clean_${round} --output=${output_path}/Clean_${round}.txt
+	grep -E "^(cleanings|clean_waits|nr_dirty)" /proc/enhanceio/${cache_name}/stats > ${output_path}/Clean_${round}_stats.txt
+done
+
+sysctl -w dev.enhanceio.${cache_name}.writeback_percent=0 > /dev/null
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+dmsetup remove ${source_name}
+losetup -d ${loop_device}
+rm -f ${loop_file}
+rmmod brd
@@ -0,0 +1,198 @@
+/*
+ * eio_lookup_bench.c
+ *
+ * User space microbenchmark of the EnhanceIO set lookup with 4-byte
+ * metadata. It compares the original find_valid_dbn() loop, which
+ * expands the dbn of every block of the set, with the fast path which
+ * shrinks the target dbn once and compares raw metadata words.
+ *
+ * The shrink/expand code mirrors eio_mem.c for the default geometry
+ * (512 blocks per set, 4K blocks).
+ *
+ * Build and run:
+ *	gcc -O2 -o eio_lookup_bench eio_lookup_bench.c
+ *	./eio_lookup_bench [num_sets] [lookups]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define INVALID                 0x01
+#define VALID                   0x02
+
+#define EIO_MD4_DBN_BITS        (32 - 8)
+#define EIO_MD4_DBN_MASK        ((1 << EIO_MD4_DBN_BITS) - 1)
+#define EIO_MD4_VALID           (VALID << EIO_MD4_DBN_BITS)
+#define EIO_MD4_DBN_VALID_MASK  (EIO_MD4_DBN_MASK | EIO_MD4_VALID)
+
+static uint32_t assoc = 512;
+static uint32_t block_shift = 3;
+static uint32_t consecutive_shift = 9;
+static uint32_t num_sets;
+static uint32_t num_sets_bits;
+static uint64_t num_sets_mask;
+static uint32_t *cache;
+
+#define SECTORS_PER_SET         ((uint64_t)assoc << block_shift)
+#define SECTORS_PER_SET_SHIFT   (consecutive_shift + block_shift)
+#define SECTORS_PER_SET_MASK    (SECTORS_PER_SET - 1)
+
+static uint64_t dbn_to_set(uint64_t dbn, uint64_t *wrapped)
+{
+	uint64_t mid_i = (dbn >> SECTORS_PER_SET_SHIFT) & num_sets_mask;
+
+	*wrapped = mid_i >= num_sets;
+	return *wrapped ? mid_i - num_sets : mid_i;
+}
+
+static uint32_t shrink_dbn(uint64_t dbn)
+{
+	uint64_t wrapped, msb;
+
+	if (dbn == 0)
+		return 0;
+	dbn_to_set(dbn, &wrapped);
+	msb = dbn >> (num_sets_bits + SECTORS_PER_SET_SHIFT);
+	return (uint32_t)((dbn & SECTORS_PER_SET_MASK) |
+			  (wrapped << SECTORS_PER_SET_SHIFT) |
+			  (msb << (SECTORS_PER_SET_SHIFT + 1)));
+}
+
+static uint64_t expand_dbn(uint64_t index)
+{
+	uint32_t dbn_24 = cache[index] & EIO_MD4_DBN_MASK;
+	uint64_t set_number = index / assoc;
+	uint64_t lsb, msb, dbn;
+
+	if (dbn_24 == 0 && (cache[index] >> EIO_MD4_DBN_BITS) == INVALID)
+		return 0;
+	lsb = dbn_24 & SECTORS_PER_SET_MASK;
+	msb = dbn_24 >> (SECTORS_PER_SET_SHIFT + 1);
+	dbn = msb << (num_sets_bits + SECTORS_PER_SET_SHIFT);
+	if (dbn_24 & SECTORS_PER_SET)
+		dbn |= (set_number + num_sets) << SECTORS_PER_SET_SHIFT;
+	else
+		dbn |= set_number << SECTORS_PER_SET_SHIFT;
+	return dbn | lsb;
+}
+
+static long lookup_expand(uint64_t dbn, uint64_t start)
+{
+	uint64_t i;
+
+	for (i = start; i < start + assoc; i++)
+		if (((cache[i] >> EIO_MD4_DBN_BITS) & VALID) &&
+		    expand_dbn(i) == dbn)
+			return (long)i;
+	return -1;
+}
+
+static long lookup_shrunk(uint64_t dbn, uint64_t start)
+{
+	uint32_t want = shrink_dbn(dbn) | EIO_MD4_VALID;
+	uint32_t *md = cache + start;
+	uint32_t i;
+
+	for (i = 0; i < assoc; i++)
+		if ((md[i] & EIO_MD4_DBN_VALID_MASK) == want)
+			return (long)(start + i);
+	return -1;
+}
+
+/* A random dbn, block aligned, that lands in "set" */
+static uint64_t random_dbn(uint64_t set)
+{
+	uint64_t msb = (uint64_t)rand() & 0x3f;
+	uint64_t region = set + ((rand() & 1) ? num_sets : 0);
+	uint64_t lsb = ((uint64_t)rand() % assoc) << block_shift;
+
+	if (region > num_sets_mask)
+		region = set;
+	return (msb << (num_sets_bits + SECTORS_PER_SET_SHIFT)) |
+	       (region << SECTORS_PER_SET_SHIFT) | lsb;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t nr_lookups = 2000000, n, set, i;
+	uint64_t *dbns, *sets;
+	long found_a = 0, found_b = 0, r;
+	double t0, t_expand, t_shrunk;
+
+	num_sets = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	if (argc > 2)
+		nr_lookups = strtoull(argv[2], NULL, 0);
+
+	for (num_sets_bits = 0; num_sets >> num_sets_bits; num_sets_bits++)
+		;
+	num_sets_mask = UINT64_MAX >> (64 - num_sets_bits);
+
+	cache = malloc((size_t)num_sets * assoc * sizeof(*cache));
+	dbns = malloc(nr_lookups * sizeof(*dbns));
+	sets = malloc(nr_lookups * sizeof(*sets));
+	if (!cache || !dbns || !sets) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* Fill every set with VALID blocks, leaving 1/8 INVALID */
+	for (i = 0; i < (uint64_t)num_sets * assoc; i++) {
+		if ((rand() & 7) == 0)
+			cache[i] = INVALID << EIO_MD4_DBN_BITS;
+		else
+			cache[i] = shrink_dbn(random_dbn(i / assoc)) |
+				   EIO_MD4_VALID;
+	}
+
+	/* Half hits on cached blocks, half (likely) misses */
+	for (n = 0; n < nr_lookups; n++) {
+		set = (uint64_t)rand() % num_sets;
+		sets[n] = set * assoc;
+		if (n & 1) {
+			dbns[n] = random_dbn(set);
+		} else {
+			i = sets[n] + (uint64_t)rand() % assoc;
+			dbns[n] = (cache[i] >> EIO_MD4_DBN_BITS) == VALID ?
+				  expand_dbn(i) : random_dbn(set);
+		}
+	}
+
+	t0 = now_ns();
+	for (n = 0; n < nr_lookups; n++) {
+		r = lookup_expand(dbns[n], sets[n]);
+		found_a += r != -1;
+	}
+	t_expand = now_ns() - t0;
+
+	t0 = now_ns();
+	for (n = 0; n < nr_lookups; n++) {
+		r = lookup_shrunk(dbns[n], sets[n]);
+		found_b += r != -1;
+	}
+	t_shrunk = now_ns() - t0;
+
+	printf("sets %u, assoc %u, lookups %llu, hits %ld/%ld\n",
+	       num_sets, assoc, (unsigned long long)nr_lookups,
+	       found_a, found_b);
+	printf("expand each block : %8.1f ns/lookup\n", t_expand / nr_lookups);
+	printf("shrink target once: %8.1f ns/lookup\n", t_shrunk / nr_lookups);
+
+	free(sets);
+	free(dbns);
+	free(cache);
+	return found_a != found_b;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Read IOPS and partial block hit ratio of random 512 byte and 2K reads
+# on a 4K block cache, with "expand_partial_reads" off and on. The
+# source is a null_blk device with a completion delay, so that its reads
+# cost about as much as those of a disk, and the SSD a brd ram disk. The
+# reads follow a zipf distribution, so that a part of the blocks is read
+# again. The hit ratio is the "partial_read_hit_pct" line of the stats.
+
+# Device Variables
+null_blk_size_gb="16"
+null_blk_completion_nsec="200000"
+brd_size_kb="4194304"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="partial1"
+
+# FIO Variables
+file_size="8G"
+iodepth="16"
+numjobs="4"
+runtime="60"
+zipf_theta="1.2"
+blocksize_list="512 2K"
+expand_list="0 1"
+
+cpus=`nproc`
+output_path="/root/eio_perf/partial_reads/${cache_mode}_zipf${zipf_theta}_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} irqmode=2 completion_nsec=${null_blk_completion_nsec} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+printf "%10s %8s %10s %10s %14s\n" "blocksize" "expand" "IOPS" "hit_pct" "expanded" | tee ${output_path}/summary.txt
+for fio_blocksize in ${blocksize_list}; do
+	for expand in ${expand_list}; do
+		# Create a cache
+		eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break 2
+		sysctl -w dev.enhanceio.${cache_name}.expand_partial_reads=${expand} > /dev/null || break 2
+
+		# Run the test
+		name=Partial_${fio_blocksize}_${expand}
+		fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randread --random_distribution=zipf:${zipf_theta} --iodepth=${iodepth} --numjobs=${numjobs} --group_reporting --time_based --runtime=${runtime} --filename=${source_device} --name=${name} --output-format=json --output=${output_path}/${name}.json
+		iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/${name}.json`
+		stats=/proc/enhanceio/${cache_name}/stats
+		hit_pct=`awk '$1 == "partial_read_hit_pct" {print $2}' ${stats}`
+		expanded=`awk '$1 == "expanded_reads" {print $2}' ${stats}`
+		printf "%10s %8s %10s %10s %14s\n" ${fio_blocksize} ${expand} ${iops} ${hit_pct} ${expanded} | tee -a ${output_path}/summary.txt
+		grep -E "^(partial_|expanded_)" ${stats} > ${output_path}/${name}_stats.txt
+
+		# Delete the cache
+		eio_cli delete -c ${cache_name}
+	done
+done
+
+rmmod brd
+rmmod null_blk
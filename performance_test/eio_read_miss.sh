@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# IOPS of random reads of less than a cache block, which miss the cache
+# and go to the source device without a readfill, for a growing number
+# of fio jobs. The source is a null_blk device and the SSD a brd ram
+# disk, so the numbers show the cost of the lookup of a read miss. The
+# "lockless_read_misses" line of the stats shows the misses which were
+# found without the set spinlock.
+#
+# Run it once with each enhanceio build and compare the IOPS columns.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="4194304"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="miss1"
+
+# FIO Variables
+fio_blocksize="512"
+file_size="8G"
+iodepth="32"
+runtime="30"
+jobs_list="1 2 4 8 16 32 64"
+
+cpus=`nproc`
+output_path="/root/eio_perf/read_miss/${cache_mode}_${fio_blocksize}_IO_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+# Fill the cache with other blocks, so that the lookups scan full sets
+fio --direct=1 --filesize=${file_size} --offset=${file_size} --blocksize=4K --ioengine=libaio --rw=read --iodepth=${iodepth} --filename=${source_device} --name=Fill --output=${output_path}/Fill.txt
+
+# Run the test
+printf "%8s %12s\n" "numjobs" "IOPS" | tee ${output_path}/summary.txt
+for numjob in ${jobs_list}; do
+	if [ ${numjob} -gt ${cpus} ]; then
+		break
+	fi
+	sysctl -w dev.enhanceio.${cache_name}.zero_stats=1 > /dev/null
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randread --iodepth=${iodepth} --numjobs=${numjob} --group_reporting --time_based --runtime=${runtime} --filename=${source_device} --name=Miss_${numjob} --output-format=json --output=${output_path}/Miss_${numjob}.json
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/Miss_${numjob}.json`
+	printf "%8s %12s\n" ${numjob} ${iops} | tee -a ${output_path}/summary.txt
+	grep -E "^(reads|read_hits|lockless_read_misses|uncached_reads)" /proc/enhanceio/${cache_name}/stats > ${output_path}/Miss_${numjob}_stats.txt
+done
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+rmmod brd
+rmmod null_blk
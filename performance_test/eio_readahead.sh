@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Read IOPS and hit ratio of 4K sequential readers, as a virtual machine
+# booting from its image, for a growing "readahead_blocks". The source
+# is a null_blk device with a completion delay, so that its reads cost
+# about as much as those of a disk, and the SSD a brd ram disk. Each
+# reader reads its own area of the source device once, so that every
+# hit comes from a read-ahead. The hit ratio is that of all the reads,
+# from the "reads" and "read_hits" lines of the stats.
+
+# Device Variables
+null_blk_size_gb="16"
+null_blk_completion_nsec="200000"
+brd_size_kb="4194304"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="ra1"
+
+# FIO Variables
+fio_blocksize="4K"
+area_size="1G"
+iodepth="1"
+numjobs="4"
+readahead_list="0 8 32 64"
+
+cpus=`nproc`
+output_path="/root/eio_perf/readahead/${cache_mode}_${fio_blocksize}_IO_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} irqmode=2 completion_nsec=${null_blk_completion_nsec} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+printf "%10s %10s %10s %14s %14s %14s\n" "readahead" "IOPS" "hit_pct" "ra_blocks" "ra_hits" "ra_wasted" | tee ${output_path}/summary.txt
+for readahead in ${readahead_list}; do
+	# Create a cache
+	eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break
+	sysctl -w dev.enhanceio.${cache_name}.readahead_blocks=${readahead} > /dev/null || break
+
+	# Run the test
+	fio --direct=1 --size=${area_size} --offset_increment=${area_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=read --iodepth=${iodepth} --numjobs=${numjobs} --group_reporting --filename=${source_device} --name=Readahead_${readahead} --output-format=json --output=${output_path}/Readahead_${readahead}.json
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/Readahead_${readahead}.json`
+	stats=/proc/enhanceio/${cache_name}/stats
+	hit_pct=`awk '$1 == "reads" {r = $2} $1 == "read_hits" {h = $2} END {printf "%.1f", r ? 100 * h / r : 0}' ${stats}`
+	blocks=`awk '$1 == "readahead_blocks" {print $2}' ${stats}`
+	hits=`awk '$1 == "readahead_hits" {print $2}' ${stats}`
+	wasted=`awk '$1 == "readahead_wasted" {print $2}' ${stats}`
+	printf "%10s %10s %10s %14s %14s %14s\n" ${readahead} ${iops} ${hit_pct} ${blocks} ${hits} ${wasted} | tee -a ${output_path}/summary.txt
+	grep -E "^(seq_|readahead_)" ${stats} > ${output_path}/Readahead_${readahead}_stats.txt
+
+	# Delete the cache
+	eio_cli delete -c ${cache_name}
+done
+
+rmmod brd
+rmmod null_blk
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# IOPS of random reads which miss the cache and are written to the SSD
+# by the readfill workers, for each number of workers and read size. The
+# source is a null_blk device and the SSD a brd ram disk, so the numbers
+# show the cost of the readfills. The "readfill" and "readfill_ssd_writes"
+# lines of the stats give the blocks filled per SSD write, and the
+# "readfill_batch_*" lines the reads taken per pass of a worker.
+#
+# "readfill_workers" is read when a cache is created, and is read only,
+# so the enhanceio modules are reloaded for each number of workers.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="8388608"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="fill1"
+
+# FIO Variables
+file_size="8G"
+iodepth="32"
+numjobs="16"
+runtime="30"
+blocksize_list="4K 64K"
+workers_list="1 2 4 8"
+
+cpus=`nproc`
+output_path="/root/eio_perf/readfill/${cache_mode}_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+printf "%8s %10s %12s %12s %12s\n" "workers" "blocksize" "IOPS" "readfill" "ssd_writes" | tee ${output_path}/summary.txt
+for workers in ${workers_list}; do
+	rmmod enhanceio_${cache_policy} enhanceio 2> /dev/null
+	modprobe enhanceio readfill_workers=${workers} || break
+	modprobe enhanceio_${cache_policy} || break
+
+	for bs in ${blocksize_list}; do
+		# Create a cache, empty so that every read misses
+		eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break
+
+		# Run the test
+		fio --direct=1 --filesize=${file_size} --blocksize=${bs} --ioengine=libaio --rw=randread --iodepth=${iodepth} --numjobs=${numjobs} --group_reporting --time_based --runtime=${runtime} --filename=${source_device} --name=Fill_${workers}_${bs} --output-format=json --output=${output_path}/Fill_${workers}_${bs}.json
+		iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/Fill_${workers}_${bs}.json`
+		stats=/proc/enhanceio/${cache_name}/stats
+		readfill=`awk '$1 == "readfill" {print $2}' ${stats}`
+		writes=`awk '$1 == "readfill_ssd_writes" {print $2}' ${stats}`
+		printf "%8s %10s %12s %12s %12s\n" ${workers} ${bs} ${iops} ${readfill} ${writes} | tee -a ${output_path}/summary.txt
+		grep -E "^(readfill|ssd_readfill)" ${stats} > ${output_path}/Fill_${workers}_${bs}_stats.txt
+
+		# Delete the cache
+		eio_cli delete -c ${cache_name}
+	done
+done
+
+rmmod brd
+rmmod null_blk
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Read hit ratio and SSD writes of a zipf read load on a hot region,
+# next to a one pass sequential scan of the rest of the source device,
+# with each "readfill_admit" value. The SSD is a brd ram disk smaller
+# than the scan, so that with every miss written to the cache the scan
+# evicts the hot blocks. The hit ratio is that of all the reads, from
+# the "reads" and "read_hits" lines of the stats.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="1048576"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="admit1"
+
+# FIO Variables
+fio_blocksize="4K"
+hot_size="512M"
+scan_offset="1G"
+scan_size="8G"
+iodepth="16"
+runtime="60"
+zipf_theta="1.2"
+admit_list="0 1"
+
+cpus=`nproc`
+output_path="/root/eio_perf/readfill_admit/${cache_mode}_zipf${zipf_theta}_${fio_blocksize}_IO_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+printf "%8s %12s %10s %14s %12s %12s\n" "admit" "hot_IOPS" "hit_pct" "ssd_writes" "admitted" "rejected" | tee ${output_path}/summary.txt
+for admit in ${admit_list}; do
+	# Create a cache
+	eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break
+	sysctl -w dev.enhanceio.${cache_name}.readfill_admit=${admit} > /dev/null || break
+
+	# Run the test
+	fio --direct=1 --blocksize=${fio_blocksize} --ioengine=libaio --iodepth=${iodepth} --time_based --runtime=${runtime} --filename=${source_device} --output-format=json --output=${output_path}/Admit_${admit}.json \
+		--name=hot --offset=0 --size=${hot_size} --rw=randread --random_distribution=zipf:${zipf_theta} \
+		--name=scan --offset=${scan_offset} --size=${scan_size} --rw=read
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/Admit_${admit}.json`
+	stats=/proc/enhanceio/${cache_name}/stats
+	hit_pct=`awk '$1 == "reads" {r = $2} $1 == "read_hits" {h = $2} END {printf "%.1f", r ? 100 * h / r : 0}' ${stats}`
+	writes=`awk '$1 == "ssd_writes" {print $2}' ${stats}`
+	admitted=`awk '$1 == "readfill_admitted" {print $2}' ${stats}`
+	rejected=`awk '$1 == "readfill_rejected" {print $2}' ${stats}`
+	printf "%8s %12s %10s %14s %12s %12s\n" ${admit} ${iops} ${hit_pct} ${writes} ${admitted} ${rejected} | tee -a ${output_path}/summary.txt
+
+	# Delete the cache
+	eio_cli delete -c ${cache_name}
+done
+
+rmmod brd
+rmmod null_blk
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# IOPS scaling of a cache over RAM backed devices, with a growing number
+# of fio jobs. The source is a null_blk device and the SSD a brd ram disk,
+# so the numbers show the CPU cost of the caching engine itself (locks,
+# shared counters) rather than the devices.
+#
+# Run it once with each enhanceio build and compare the IOPS columns.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="4194304"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="scale1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="2G"
+iodepth="32"
+runtime="30"
+jobs_list="1 2 4 8 16 32 64"
+rread="100"
+rwrite="0"
+
+cpus=`nproc`
+output_path="/root/eio_perf/scaling/${cache_mode}_${rread}_read_${rwrite}_write_${fio_blocksize}_IO_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+# Warm up the cache, the working set fits in the SSD
+echo "Warm_Up_${fio_blocksize}"
+fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=read --iodepth=${iodepth} --filename=${source_device} --name=WarmUp --output=${output_path}/WarmUp.txt
+fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=read --iodepth=${iodepth} --filename=${source_device} --name=WarmUp2 --output=${output_path}/WarmUp2.txt
+
+# Run the test
+printf "%8s %12s\n" "numjobs" "IOPS" | tee ${output_path}/summary.txt
+for numjob in ${jobs_list}; do
+	if [ ${numjob} -gt ${cpus} ]; then
+		break
+	fi
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --rwmixwrite=${rwrite} --iodepth=${iodepth} --numjobs=${numjob} --group_reporting --time_based --runtime=${runtime} --filename=${source_device} --name=Scaling_${numjob} --output-format=json --output=${output_path}/Scaling_${numjob}.json
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops'] + j['write']['iops']))" ${output_path}/Scaling_${numjob}.json`
+	printf "%8s %12s\n" ${numjob} ${iops} | tee -a ${output_path}/summary.txt
+done
+
+cp /proc/enhanceio/${cache_name}/stats ${output_path}/stats.txt
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+rmmod brd
+rmmod null_blk
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Read hit ratio and SSD writes of a zipf read load on a hot region,
+# next to a sequential scan of the rest of the source device, for a
+# growing "sequential_cutoff_kb". The SSD is a brd ram disk smaller
+# than the scan, so that with sequential I/O cached the scan evicts the
+# hot blocks. The hit ratio is that of all the reads, from the "reads"
+# and "read_hits" lines of the stats.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="1048576"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="seq1"
+
+# FIO Variables
+hot_blocksize="4K"
+scan_blocksize="128K"
+hot_size="512M"
+scan_offset="1G"
+scan_size="8G"
+iodepth="16"
+runtime="60"
+zipf_theta="1.2"
+cutoff_list="0 512 4096"
+
+cpus=`nproc`
+output_path="/root/eio_perf/seq_cutoff/${cache_mode}_zipf${zipf_theta}_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+printf "%10s %12s %10s %14s %14s\n" "cutoff_kb" "hot_IOPS" "hit_pct" "ssd_writes" "bypass_reads" | tee ${output_path}/summary.txt
+for cutoff in ${cutoff_list}; do
+	# Create a cache
+	eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break
+	sysctl -w dev.enhanceio.${cache_name}.sequential_cutoff_kb=${cutoff} > /dev/null || break
+
+	# Run the test
+	fio --direct=1 --ioengine=libaio --iodepth=${iodepth} --time_based --runtime=${runtime} --filename=${source_device} --output-format=json --output=${output_path}/Cutoff_${cutoff}.json \
+		--name=hot --offset=0 --size=${hot_size} --blocksize=${hot_blocksize} --rw=randread --random_distribution=zipf:${zipf_theta} \
+		--name=scan --offset=${scan_offset} --size=${scan_size} --blocksize=${scan_blocksize} --rw=read
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops']))" ${output_path}/Cutoff_${cutoff}.json`
+	stats=/proc/enhanceio/${cache_name}/stats
+	hit_pct=`awk '$1 == "reads" {r = $2} $1 == "read_hits" {h = $2} END {printf "%.1f", r ? 100 * h / r : 0}' ${stats}`
+	writes=`awk '$1 == "ssd_writes" {print $2}' ${stats}`
+	bypass=`awk '$1 == "seq_bypass_reads" {print $2}' ${stats}`
+	printf "%10s %12s %10s %14s %14s\n" ${cutoff} ${iops} ${hit_pct} ${writes} ${bypass} | tee -a ${output_path}/summary.txt
+	grep -E "^seq_" ${stats} > ${output_path}/Cutoff_${cutoff}_stats.txt
+
+	# Delete the cache
+	eio_cli delete -c ${cache_name}
+done
+
+rmmod brd
+rmmod null_blk
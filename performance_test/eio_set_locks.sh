@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# RAM used by a cache and IOPS of random 4K reads and writes on it, for
+# each size of the set lock table. With "set_locks" at 0 each cache set
+# has its own locks, otherwise the sets share a table of that many
+# entries. The source is a null_blk device and the SSD a brd ram disk,
+# so that contention on the shared locks shows in the IOPS. The RAM is
+# the "memory" line of the cache config.
+#
+# The enhanceio module has to be loaded already.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="8388608"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wb"
+cache_block_size="4096"
+cache_name="locks1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="8G"
+iodepth="32"
+numjobs="16"
+runtime="30"
+set_locks_list="0 65536 4096 1024 256"
+
+cpus=`nproc`
+output_path="/root/eio_perf/set_locks/${cache_mode}_${fio_blocksize}_IO_${cpus}_cpus"
+param="/sys/module/enhanceio/parameters/set_locks"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+saved=`cat ${param}` || exit 1
+printf "%10s %10s %14s %12s\n" "set_locks" "entries" "memory" "IOPS" | tee ${output_path}/summary.txt
+for set_locks in ${set_locks_list}; do
+	echo ${set_locks} > ${param}
+
+	# Create a cache
+	eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || break
+	entries=`awk '$1 == "set_locks" {print $2}' /proc/enhanceio/${cache_name}/config`
+	memory=`awk '$1 == "memory" {print $2}' /proc/enhanceio/${cache_name}/config`
+
+	# Run the test
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=70 --iodepth=${iodepth} --numjobs=${numjobs} --group_reporting --time_based --runtime=${runtime} --filename=${source_device} --name=Locks_${set_locks} --output-format=json --output=${output_path}/Locks_${set_locks}.json
+	iops=`python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops'] + j['write']['iops']))" ${output_path}/Locks_${set_locks}.json`
+	printf "%10s %10s %14s %12s\n" ${set_locks} ${entries} ${memory} ${iops} | tee -a ${output_path}/summary.txt
+
+	# Delete the cache
+	eio_cli delete -c ${cache_name}
+done
+echo ${saved} > ${param}
+
+rmmod brd
+rmmod null_blk
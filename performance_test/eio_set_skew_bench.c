@@ -0,0 +1,258 @@
+/*
+ * eio_set_skew_bench.c
+ *
+ * User space simulation of EnhanceIO cache set occupancy under the
+ * linear, xor-fold and multiplicative set index functions (the
+ * "set_hash" module parameter). For each workload a hot working set of
+ * about half the cache size is laid out on the source volume, every
+ * hot block is mapped to its set, and the blocks beyond the set size
+ * are counted as not cacheable. The source volume must be at least
+ * (num_sets_mask + 1) regions (256 GB for 100000 sets).
+ *
+ * It also checks that eio_shrink_dbn()/eio_expand_dbn() round trip
+ * under each function. The set mapping code mirrors eio_mem.c for the
+ * default geometry (512 blocks per set, 4K blocks).
+ *
+ * Build and run:
+ *	gcc -O2 -o eio_set_skew_bench eio_set_skew_bench.c
+ *	./eio_set_skew_bench [num_sets] [source_size_GB]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define EIO_SET_HASH_LINEAR     0
+#define EIO_SET_HASH_XOR        1
+#define EIO_SET_HASH_MULT       2
+#define EIO_SET_HASH_LAST       EIO_SET_HASH_MULT
+
+#define EIO_SET_HASH_MULT_K     0x9E3779B97F4A7C15ULL
+#define EIO_SET_HASH_MULT_INV   0xF1DE83E19937733DULL
+
+static const char *hash_names[] = { "linear", "xor-fold", "mult" };
+
+static uint32_t assoc = 512;
+static uint32_t block_shift = 3;
+static uint32_t consecutive_shift = 9;
+static uint32_t num_sets;
+static uint32_t num_sets_bits;
+static uint64_t num_sets_mask;
+static uint32_t set_hash;
+static uint64_t src_sectors;
+
+#define SECTORS_PER_SET         ((uint64_t)assoc << block_shift)
+#define SECTORS_PER_SET_SHIFT   (consecutive_shift + block_shift)
+#define SECTORS_PER_SET_MASK    (SECTORS_PER_SET - 1)
+
+static uint64_t hash_fold(uint64_t msb)
+{
+	return (msb * EIO_SET_HASH_MULT_K) >> (64 - num_sets_bits);
+}
+
+static uint64_t unxorshift(uint64_t y, uint32_t shift)
+{
+	uint64_t x = y;
+	uint32_t i;
+
+	for (i = shift; i < num_sets_bits; i += shift)
+		x = y ^ (x >> shift);
+	return x;
+}
+
+static uint64_t hash(uint64_t mid_i, uint64_t msb)
+{
+	uint32_t shift = (num_sets_bits + 1) >> 1;
+	uint64_t x;
+
+	switch (set_hash) {
+	case EIO_SET_HASH_XOR:
+		return mid_i ^ hash_fold(msb);
+	case EIO_SET_HASH_MULT:
+		x = mid_i ^ hash_fold(msb);
+		x ^= x >> shift;
+		x = (x * EIO_SET_HASH_MULT_K) & num_sets_mask;
+		return x ^ (x >> shift);
+	default:
+		return mid_i;
+	}
+}
+
+static uint64_t unhash(uint64_t mid_i, uint64_t msb)
+{
+	uint32_t shift = (num_sets_bits + 1) >> 1;
+	uint64_t x;
+
+	switch (set_hash) {
+	case EIO_SET_HASH_XOR:
+		return mid_i ^ hash_fold(msb);
+	case EIO_SET_HASH_MULT:
+		x = unxorshift(mid_i, shift);
+		x = (x * EIO_SET_HASH_MULT_INV) & num_sets_mask;
+		x = unxorshift(x, shift);
+		return x ^ hash_fold(msb);
+	default:
+		return mid_i;
+	}
+}
+
+static uint64_t dbn_to_set(uint64_t dbn, uint64_t *wrapped)
+{
+	uint64_t value = dbn >> SECTORS_PER_SET_SHIFT;
+	uint64_t mid_i = hash(value & num_sets_mask, value >> num_sets_bits);
+
+	*wrapped = mid_i >= num_sets;
+	return *wrapped ? mid_i - num_sets : mid_i;
+}
+
+static uint32_t shrink_dbn(uint64_t dbn)
+{
+	uint64_t wrapped, msb;
+
+	if (dbn == 0)
+		return 0;
+	dbn_to_set(dbn, &wrapped);
+	msb = dbn >> (num_sets_bits + SECTORS_PER_SET_SHIFT);
+	return (uint32_t)((dbn & SECTORS_PER_SET_MASK) |
+			  (wrapped << SECTORS_PER_SET_SHIFT) |
+			  (msb << (SECTORS_PER_SET_SHIFT + 1)));
+}
+
+static uint64_t expand_dbn(uint32_t dbn_24, uint64_t set_number)
+{
+	uint64_t lsb = dbn_24 & SECTORS_PER_SET_MASK;
+	uint64_t msb = dbn_24 >> (SECTORS_PER_SET_SHIFT + 1);
+
+	if (dbn_24 & SECTORS_PER_SET)
+		set_number += num_sets;
+	return (msb << (num_sets_bits + SECTORS_PER_SET_SHIFT)) |
+	       (unhash(set_number, msb) << SECTORS_PER_SET_SHIFT) | lsb;
+}
+
+static int check_roundtrip(void)
+{
+	uint64_t dbn, set, wrapped, n;
+
+	for (n = 0; n < 1000000; n++) {
+		dbn = (((uint64_t)rand() << 31) ^ rand()) % src_sectors;
+		dbn &= ~(((uint64_t)1 << block_shift) - 1);
+		set = dbn_to_set(dbn, &wrapped);
+		if (set >= num_sets ||
+		    (dbn && expand_dbn(shrink_dbn(dbn), set) != dbn)) {
+			fprintf(stderr, "%s: dbn %llu does not round trip\n",
+				hash_names[set_hash], (unsigned long long)dbn);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Workloads: the hot working set is "nr_extents" extents of
+ * "extent" sectors each, "stride" sectors apart.
+ */
+struct workload {
+	const char *name;
+	uint64_t nr_extents;
+	uint64_t extent;
+	uint64_t stride;
+};
+
+static void run(const struct workload *w, uint32_t *occ)
+{
+	uint64_t e, s, set, wrapped, hot = 0, cached = 0, used = 0, max = 0;
+
+	memset(occ, 0, num_sets * sizeof(*occ));
+	for (e = 0; e < w->nr_extents; e++) {
+		uint64_t start = (e * w->stride) % src_sectors;
+
+		for (s = 0; s < w->extent; s += (uint64_t)1 << block_shift) {
+			set = dbn_to_set(start + s, &wrapped);
+			occ[set]++;
+			hot++;
+		}
+	}
+	for (set = 0; set < num_sets; set++) {
+		if (!occ[set])
+			continue;
+		used++;
+		cached += occ[set] < assoc ? occ[set] : assoc;
+		if (occ[set] > max)
+			max = occ[set];
+	}
+	printf("  %-9s sets used %7llu  max/set %6llu  cacheable %6.2f%%\n",
+	       hash_names[set_hash], (unsigned long long)used,
+	       (unsigned long long)max, 100.0 * cached / hot);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t src_gb = 4096, hot, region;
+	struct workload w[4];
+	uint32_t *occ;
+	int i, ret = 0;
+
+	num_sets = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	if (argc > 2)
+		src_gb = strtoull(argv[2], NULL, 0);
+
+	for (num_sets_bits = 0; num_sets >> num_sets_bits; num_sets_bits++)
+		;
+	num_sets_mask = UINT64_MAX >> (64 - num_sets_bits);
+	src_sectors = src_gb << 21;
+	region = SECTORS_PER_SET;
+	hot = (uint64_t)num_sets * region / 2;
+
+	occ = malloc(num_sets * sizeof(*occ));
+	if (!occ) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* One sequential hot file */
+	w[0].name = "one sequential extent";
+	w[0].nr_extents = 1;
+	w[0].extent = hot;
+	w[0].stride = 0;
+
+	/* Hot extents at aligned offsets, as partitions or LVs */
+	w[1].name = "extents (num_sets_mask + 1) regions apart";
+	w[1].stride = (num_sets_mask + 1) * region;
+	w[1].nr_extents = src_sectors / w[1].stride;
+	w[1].extent = hot / w[1].nr_extents;
+
+	/* A hot region out of every 64, as a striped table */
+	w[2].name = "1 region in 64 hot";
+	w[2].stride = 64 * region;
+	w[2].nr_extents = src_sectors / w[2].stride;
+	if (w[2].nr_extents > hot / region)
+		w[2].nr_extents = hot / region;
+	w[2].extent = region;
+
+	/* Hot extents at every 1 GB boundary */
+	w[3].name = "extents 1 GB apart";
+	w[3].stride = (uint64_t)1 << 21;
+	w[3].nr_extents = src_sectors / w[3].stride;
+	w[3].extent = hot / w[3].nr_extents;
+
+	printf("sets %u (%u bits), assoc %u, source %llu GB, hot %llu MB\n",
+	       num_sets, num_sets_bits, assoc, (unsigned long long)src_gb,
+	       (unsigned long long)(hot >> 11));
+
+	for (set_hash = 0; set_hash <= EIO_SET_HASH_LAST; set_hash++)
+		ret |= check_roundtrip();
+
+	for (i = 0; i < 4; i++) {
+		printf("%s\n", w[i].name);
+		for (set_hash = 0; set_hash <= EIO_SET_HASH_LAST; set_hash++)
+			run(&w[i], occ);
+	}
+
+	free(occ);
+	return ret;
+}
@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# Dirty blocks and writeback rate of a write-back cache under a steady,
+# rate-limited random write load, with and without the writeback rate
+# controller. The SSD is a brd ram disk and the source a dm-delay device
+# over a loop device. Every second the "nr_dirty" and "wb_rate*" lines of
+# the cache stats are logged, and fio logs the write latency, so that the
+# swings of the threshold based clean can be told from the controller.
+#
+# Run it as root with the enhanceio modules loaded.
+
+# Device Variables
+brd_size_kb="4194304"
+loop_file="/root/eio_perf/wb_rate_source.img"
+loop_size="16G"
+delay_ms="5"
+cache_device="/dev/ram0"
+source_name="eio_slow"
+source_device="/dev/mapper/${source_name}"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wb"
+cache_block_size="4096"
+cache_name="wbrate1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="12G"
+iodepth="16"
+rate_iops="2000"
+runtime="300"
+percent_list="0 10 30"
+
+output_path="/root/eio_perf/wb_rate/${delay_ms}ms_delay_${rate_iops}iops"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+truncate -s ${loop_size} ${loop_file} || exit 1
+loop_device=`losetup -f --show ${loop_file}` || exit 1
+sectors=`blockdev --getsz ${loop_device}`
+echo "0 ${sectors} delay ${loop_device} 0 ${delay_ms}" | dmsetup create ${source_name} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+stat_lines() {
+	awk '$1 == "nr_dirty" || $1 ~ /^wb_rate/ { printf "%s=%s ", $1, $2 }' /proc/enhanceio/${cache_name}/stats
+}
+
+# Run the test
+for percent in ${percent_list}; do
+	sysctl -w dev.enhanceio.${cache_name}.writeback_percent=${percent} > /dev/null || break
+
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randwrite --iodepth=${iodepth} --rate_iops=${rate_iops} --time_based --runtime=${runtime} --filename=${source_device} --name=WbRate_${percent} --write_lat_log=${output_path}/WbRate_${percent} --log_avg_msec=1000 --output=${output_path}/WbRate_${percent}.txt &
+	fio_pid=$!
+	while kill -0 ${fio_pid} 2> /dev/null; do
+		echo "`date +%s` `stat_lines`" >> ${output_path}/WbRate_${percent}_stats.txt
+		sleep 1
+	done
+
+	# Start the next round from a clean cache
+	sysctl -w dev.enhanceio.${cache_name}.writeback_percent=0 > /dev/null
+	sysctl -w dev.enhanceio.${cache_name}.do_clean=1 > /dev/null
+	while [ "`awk '$1 == "nr_dirty" { print $2 }' /proc/enhanceio/${cache_name}/stats`" -gt 0 ]; do
+		sleep 1
+	done
+done
+
+cp /proc/enhanceio/${cache_name}/stats ${output_path}/stats.txt
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+dmsetup remove ${source_name}
+losetup -d ${loop_device}
+rm -f ${loop_file}
+rmmod brd
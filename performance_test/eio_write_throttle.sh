@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# Write latency of a hot random write burst on a write-back cache whose
+# sets fill up with dirty blocks, for a growing "write_throttle_ms". With
+# 0, the writes which find their set full go to the slow source device;
+# otherwise they wait for an urgent clean of the set. The SSD is a brd
+# ram disk and the source a dm-delay device over a loop device. fio
+# reports the latency percentiles, the cache stats the writes which
+# waited and for how long.
+#
+# Run it as root with the enhanceio modules loaded.
+
+# Device Variables
+brd_size_kb="1048576"
+loop_file="/root/eio_perf/write_throttle_source.img"
+loop_size="16G"
+delay_ms="5"
+cache_device="/dev/ram0"
+source_name="eio_slow"
+source_device="/dev/mapper/${source_name}"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wb"
+cache_block_size="4096"
+cache_name="throttle1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="2G"
+iodepth="32"
+runtime="60"
+throttle_list="0 20 100 500"
+
+output_path="/root/eio_perf/write_throttle/${delay_ms}ms_delay_${file_size}"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+truncate -s ${loop_size} ${loop_file} || exit 1
+loop_device=`losetup -f --show ${loop_file}` || exit 1
+sectors=`blockdev --getsz ${loop_device}`
+echo "0 ${sectors} delay ${loop_device} 0 ${delay_ms}" | dmsetup create ${source_name} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+# Let the sets fill up with dirty blocks
+sysctl -w dev.enhanceio.${cache_name}.dirty_high_threshold=100
+sysctl -w dev.enhanceio.${cache_name}.dirty_set_high_threshold=100
+sysctl -w dev.enhanceio.${cache_name}.time_based_clean_interval=0
+
+# Run the test
+for throttle in ${throttle_list}; do
+	sysctl -w dev.enhanceio.${cache_name}.write_throttle_ms=${throttle} > /dev/null || break
+	sysctl -w dev.enhanceio.${cache_name}.zero_stats=1 > /dev/null
+
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randwrite --iodepth=${iodepth} --time_based --runtime=${runtime} --percentile_list=50:90:99:99.9 --filename=${source_device} --name=Throttle_${throttle} --output=${output_path}/Throttle_${throttle}.txt
+	grep -E "^(uncached_writes|write_throttle)" /proc/enhanceio/${cache_name}/stats > ${output_path}/Throttle_${throttle}_stats.txt
+
+	# Start the next round from a clean cache
+	sysctl -w dev.enhanceio.${cache_name}.do_clean=1 > /dev/null
+	while [ "`awk '$1 == "nr_dirty" { print $2 }' /proc/enhanceio/${cache_name}/stats`" -gt 0 ]; do
+		sleep 1
+	done
+done
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+dmsetup remove ${source_name}
+losetup -d ${loop_device}
+rm -f ${loop_file}
+rmmod brd
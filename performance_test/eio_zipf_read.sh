@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# IOPS and latency of a read-mostly zipf load on a few hot blocks, for
+# 32 and more fio jobs. The source is a null_blk device and the SSD a
+# brd ram disk, so the numbers show the cost of the read hit path of the
+# caching engine: with many readers on the blocks of the same hot sets,
+# it is their cs_lock that bounds the IOPS. The "lockless_read_hits"
+# line of the stats shows the read hits which went without it.
+#
+# Run it once with each enhanceio build and compare the IOPS columns.
+
+# Device Variables
+null_blk_size_gb="16"
+brd_size_kb="4194304"
+source_device="/dev/nullb0"
+cache_device="/dev/ram0"
+
+# Cache Variables
+cache_policy="lru"
+cache_mode="wt"
+cache_block_size="4096"
+cache_name="zipf1"
+
+# FIO Variables
+fio_blocksize="4K"
+file_size="2G"
+iodepth="16"
+runtime="30"
+jobs_list="32 48 64 96 128"
+rread="95"
+zipf_theta="1.2"
+
+cpus=`nproc`
+output_path="/root/eio_perf/zipf_read/${cache_mode}_zipf${zipf_theta}_${rread}_read_${fio_blocksize}_IO_${cpus}_cpus"
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+# Create the devices
+modprobe null_blk nr_devices=1 gb=${null_blk_size_gb} queue_mode=2 submit_queues=${cpus} || exit 1
+modprobe brd rd_nr=1 rd_size=${brd_size_kb} || exit 1
+
+# Create a cache
+echo "Creating a cache"
+eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name} || exit 1
+
+# Warm up the cache, the working set fits in the SSD
+echo "Warm_Up_${fio_blocksize}"
+fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=read --iodepth=${iodepth} --filename=${source_device} --name=WarmUp --output=${output_path}/WarmUp.txt
+fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=read --iodepth=${iodepth} --filename=${source_device} --name=WarmUp2 --output=${output_path}/WarmUp2.txt
+
+# Run the test
+printf "%8s %12s %12s\n" "numjobs" "IOPS" "p99_read_us" | tee ${output_path}/summary.txt
+for numjob in ${jobs_list}; do
+	sysctl -w dev.enhanceio.${cache_name}.zero_stats=1 > /dev/null
+	fio --direct=1 --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --random_distribution=zipf:${zipf_theta} --iodepth=${iodepth} --numjobs=${numjob} --group_reporting --time_based --runtime=${runtime} --percentile_list=50:99:99.9 --filename=${source_device} --name=Zipf_${numjob} --output-format=json --output=${output_path}/Zipf_${numjob}.json
+	read iops p99 <<< `python3 -c "import json,sys; j=json.load(open(sys.argv[1]))['jobs'][0]; print(int(j['read']['iops'] + j['write']['iops']), int(j['read']['clat_ns']['percentile']['99.000000'] / 1000))" ${output_path}/Zipf_${numjob}.json`
+	printf "%8s %12s %12s\n" ${numjob} ${iops} ${p99} | tee -a ${output_path}/summary.txt
+	grep -E "^(read_hits|lockless_read_hits|uncached_reads)" /proc/enhanceio/${cache_name}/stats > ${output_path}/Zipf_${numjob}_stats.txt
+done
+
+# Delete the cache
+echo "Deleting the cache"
+eio_cli delete -c ${cache_name}
+rmmod brd
+rmmod null_blk